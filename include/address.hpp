@@ -0,0 +1,58 @@
+/**
+ * `Address` names where a server listens and where a client connects: a TCP
+ * host and port, or the path of a Unix domain socket. Processes on the same
+ * host as the server can use the latter to skip the TCP stack entirely.
+ *
+ * `listenOn()` and `connectTo()` hold the socket setup `Server` and `Client`
+ * share for either kind of address.
+*/
+
+#pragma once
+
+#include <string>
+
+struct Address
+{
+    enum Family
+    {
+        TCP,
+        UNIX_SOCKET
+    };
+
+    Family family;
+    // Numeric IPv4 host for `TCP`, filesystem path for `UNIX_SOCKET`.
+    std::string host;
+    int port;
+
+    static inline Address tcp(std::string host, int port)
+    {
+        return {TCP, host, port};
+    }
+
+    static inline Address unixSocket(std::string path)
+    {
+        return {UNIX_SOCKET, path, 0};
+    }
+};
+
+/**
+ * Creates a socket listening on `address` that queues up to `backlog`
+ * connections not accepted yet. A socket file left at a Unix domain socket's
+ * path by an earlier run is replaced.
+ *
+ * With `reusePort` a TCP socket is bound with `SO_REUSEPORT`, so several
+ * sockets can listen on the same port and the kernel spreads new connections
+ * across them.
+ *
+ * @return  The listening socket.
+ *          -1 on socket(), setsockopt(), bind() and listen() errors.
+*/
+int listenOn(const Address &address, int backlog, bool reusePort = false);
+
+/**
+ * Connects a new socket to `address`.
+ *
+ * @return  The connected socket.
+ *          -1 on socket() and connect() errors.
+*/
+int connectTo(const Address &address);
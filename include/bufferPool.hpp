@@ -0,0 +1,156 @@
+/**
+ * `BufferPool` recycles the scratch buffers the network layer needs for every
+ * batch of frames it handles: encoded replies, decompressed payloads and
+ * compressor output. Buffers are kept in power-of-two size classes;
+ * `acquire()` hands out a free buffer of the class that fits and `release()`
+ * takes it back, so a connection in steady state does not allocate them.
+ *
+ * A pool is not thread-safe. Every thread uses its own, returned by
+ * `BufferPool::local()`, so event loops and connection threads never contend
+ * on one. `Arena` lends one connection buffers from its thread's pool for the
+ * duration of a batch.
+ *
+ * Counters for every pool and arena in the process are kept in `PoolStats`.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+/**
+ * Process-wide pool counters.
+*/
+struct PoolStats
+{
+    // `acquire()` calls served from a free list, and those that allocated.
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    // Bytes held in free lists.
+    std::atomic<uint64_t> pooledBytes{0};
+    // Live arenas, one per connection, and the sum of the most bytes each has
+    // held at once.
+    std::atomic<uint64_t> arenas{0};
+    std::atomic<uint64_t> arenaPeakBytes{0};
+
+    /**
+     * Share of `acquire()` calls that did not allocate. 1 if there were none.
+    */
+    inline double hitRate()
+    {
+        uint64_t total = hits + misses;
+        return total > 0 ? (double)hits / total : 1;
+    }
+
+    /**
+     * Average peak scratch memory of a live connection.
+    */
+    inline double bytesPerConnection()
+    {
+        uint64_t live = arenas;
+        return live > 0 ? (double)arenaPeakBytes / live : 0;
+    }
+};
+
+class BufferPool
+{
+public:
+
+    /**
+     * Capacity of the smallest and largest size class. Larger buffers are
+     * allocated and freed as usual.
+    */
+    static const size_t MIN_CLASS_BYTES = 256;
+    static const size_t MAX_CLASS_BYTES = 1 << 20;
+
+    /**
+     * Most bytes a pool keeps in its free lists. Buffers released beyond it
+     * are freed.
+    */
+    static const size_t MAX_POOLED_BYTES = 4 << 20;
+
+    ~BufferPool();
+
+    /**
+     * The calling thread's pool.
+    */
+    static BufferPool &local();
+
+    /**
+     * Counters of every pool in the process.
+    */
+    static PoolStats &getStats();
+
+    /**
+     * Returns an empty buffer that holds at least `capacity` bytes without
+     * reallocating.
+    */
+    std::string acquire(size_t capacity);
+
+    /**
+     * Takes `buffer` back for later `acquire()` calls.
+    */
+    void release(std::string &&buffer);
+
+private:
+
+    static const int CLASSES = 13;
+
+    /**
+     * Index of the smallest class of at least `capacity` bytes. `CLASSES` if
+     * there is none.
+    */
+    static int classFor(size_t capacity);
+
+    std::vector<std::string> freeLists[CLASSES];
+    size_t pooledBytes = 0;
+};
+
+/**
+ * `Arena` is the scratch memory of one connection. Buffers acquired from it
+ * stay valid until `reset()`, which returns all of them to the calling
+ * thread's pool at once; the network layer resets a connection's arena as
+ * soon as the replies to a batch of frames are written. An arena must be
+ * reset by the thread that acquired its buffers.
+*/
+class Arena
+{
+public:
+
+    Arena();
+
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    /**
+     * Returns an empty buffer that holds at least `capacity` bytes without
+     * reallocating, owned by the arena until the next `reset()`.
+    */
+    std::string &acquire(size_t capacity);
+
+    /**
+     * Returns every buffer acquired since the last reset to the pool.
+    */
+    void reset();
+
+    /**
+     * Most bytes the arena has held at once.
+    */
+    inline size_t getPeakBytes()
+    {
+        return peakBytes;
+    }
+
+private:
+
+    // Deque so references handed out stay valid as buffers are added.
+    std::deque<std::string> buffers;
+    size_t bytes;
+    size_t peakBytes;
+};
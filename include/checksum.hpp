@@ -0,0 +1,39 @@
+/**
+ * CRC-32 (IEEE), which the write-ahead log and snapshots use to tell intact
+ * data from data that was cut short or damaged on disk.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * CRC-32 of the `length` bytes at `data`. Passing the CRC of the bytes before
+ * them as `crc` continues it, so data written in pieces can be checked as one.
+*/
+inline uint32_t crc32(const char *data, size_t length, uint32_t crc = 0)
+{
+    static const auto table = []()
+    {
+        std::vector<uint32_t> table(256);
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+            }
+            table[i] = crc;
+        }
+        return table;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
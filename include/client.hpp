@@ -1,23 +1,50 @@
 /**
  * `Client` handles the client-server communication and maintians the current
  * state of a particular client (i.e., logging in and chanigng accounts). This
- * class uses the `Network` class to handle the data link layer and registers
- * callbacks for messages received from the server.
+ * class uses the `Network` class to handle the data link layer and lists the
+ * callbacks for messages received from the server in its `callbacks` table.
+ *
+ * Every request is tagged with a fresh request ID and its caller waits on a
+ * future for the reply carrying that ID. Any number of threads may therefore
+ * issue requests at once, and `sendRequest()` lets a single thread keep many
+ * requests in flight instead of waiting a round trip for each one.
 */
 #pragma once
 
+#include "address.hpp"
 #include "network.hpp"
+#include <atomic>
+#include <functional>
+#include <future>
 #include <mutex>
-#include <condition_variable>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <unordered_set>
 #include <thread>
+#include <vector>
+
+// `SEND` payloads longer than this are streamed in chunks of this size.
+#define CHUNK_LENGTH (64 * 1024)
+// Users per page when the command line client lists accounts.
+#define LIST_PAGE_SIZE 100
 
 class Client
 {
 public:
     Client(std::string host, int port);
 
+    /**
+     * Connects to `address`, which may also be a Unix domain socket.
+    */
+    Client(const Address &address);
+
+    /**
+     * Talks to the server over `socket`, which is already connected, for
+     * example by `Server::connectLoopback()`.
+    */
+    Client(int socket);
+
    ~Client();
 
     /**
@@ -30,22 +57,75 @@ public:
     */
     std::string getAccountList(std::string sub);
 
+    /**
+     * Lists the users containing `sub` in sorted order, `pageSize` at a time.
+     * `onPage` is called on the receive thread with the users of each page,
+     * one per line, as it arrives, so the whole list is never held at once.
+     * With `stream` the server sends every page in reply to one request;
+     * otherwise each page is requested with the cursor of the one before.
+     * Returns an empty string once the last page arrived, the error otherwise.
+    */
+    std::string listAccounts(std::string sub, uint32_t pageSize,
+                             const std::function<void(std::string_view users)> &onPage,
+                             bool stream = false);
+
+    /**
+     * Returns the page of at most `pageSize` users containing `sub` that
+     * follows `cursorInOut`, the cursor of the previous page or empty for the
+     * first one. `cursorInOut` is set to the cursor of the next page, or
+     * emptied after the last one.
+    */
+    std::string getAccountPage(std::string sub, uint32_t pageSize,
+                               std::string &cursorInOut);
+
     /**
      * Deletes the specified account on the server.
     */
     std::string deleteAccount(std::string username);
 
     /**
-     * Sends the message specified in message to a recepient.
+     * Sends the message specified in message to a recepient. Long messages are
+     * streamed in chunks so neither end buffers them in one frame.
     */
     std::string sendMessage(Network::Message message);
 
+    /**
+     * Sends every message in `entries` from `sender` in one request. Returns
+     * the status of each entry in order, `Network::OK` or `Network::ERROR`.
+    */
+    std::vector<Network::OpCode> sendBatch(std::string sender,
+                                           const std::vector<Network::BatchEntry> &entries);
+
     /**
      * Retreives the next message for the currently logged in user. Returns
      * an empty string if there are no messages to receive.
     */
     std::string requestMessages();
 
+    /**
+     * Asks the server to push the current user's messages to this client as
+     * they arrive. They are passed to the handler set with
+     * `setMessageHandler()`. Returns the messages that were already waiting.
+    */
+    std::string subscribe();
+
+    /**
+     * Sets the function called with every pushed message. It runs on the
+     * receive thread.
+    */
+    inline void setMessageHandler(std::function<void(std::string)> handler)
+    {
+        std::unique_lock lock(pendingLock);
+        messageHandler = handler;
+    }
+
+    /**
+     * Sends `message` without waiting for the reply. The future becomes ready
+     * with the reply's result, as returned by the blocking functions above,
+     * once it arrives, or with an error if the connection is lost first.
+    */
+    std::future<std::string> sendRequest(Network::Message message);
+
     /**
      * Closes the client connection and cleans up resources.
     */
@@ -65,9 +145,18 @@ public:
 
     inline std::unordered_set<std::string> getClientUserList()
     {
+        std::unique_lock lock(userListLock);
         return clientUserList;
     };
 
+    /**
+     * Protocol version negotiated with the server.
+    */
+    inline uint32_t getProtocolVersion()
+    {
+        return network.getVersion();
+    }
+
     std::atomic<bool> clientRunning;
 
     ////////// FOR TESTING PURPOSES ONLY. DO NOT USE IN PRODUCTION //////////
@@ -75,34 +164,61 @@ public:
     /**
      * `OK` and `ERROR` handler.
     */
-    Network::Message messageCallback(Network::Message message);
+    Network::Message messageCallback(const Network::MessageView &message);
 
     /**
      * `CREATE` handler.
     */
-    Network::Message handleCreateResponse(Network::Message message);
+    Network::Message handleCreateResponse(const Network::MessageView &message);
 
     /**
      * `DELETE` handler.
     */
-    Network::Message handleDelete(Network::Message message);
+    Network::Message handleDelete(const Network::MessageView &message);
 
     /**
      * `LIST` handler.
     */
-    Network::Message handleList(Network::Message message);
+    Network::Message handleList(const Network::MessageView &message);
+
+    /**
+     * `LIST_PAGE` handler. Passes each page to the handler of its request.
+    */
+    Network::Message handleListPage(const Network::MessageView &message);
 
     /**
      * `REQUEST` handler.
     */
-    Network::Message handleReceive(Network::Message message);
+    Network::Message handleReceive(const Network::MessageView &message);
+
+    /**
+     * `PING` handler. Answers with a `PONG` so the server keeps the idle
+     * connection open.
+    */
+    Network::Message handlePing(const Network::MessageView &message);
+
+    /**
+     * The operations this class handles, dispatched by `Endpoint<Client>`.
+    */
+    static constexpr Network::Route<Client> callbacks[] = {
+        {Network::OK, &Client::messageCallback},
+        {Network::CREATE, &Client::handleCreateResponse},
+        {Network::DELETE, &Client::handleDelete},
+        {Network::LIST, &Client::handleList},
+        {Network::SEND, &Client::handleReceive},
+        {Network::ERROR, &Client::messageCallback},
+        {Network::HELLO, &Client::messageCallback},
+        {Network::UNSUPPORTED_OP, &Client::messageCallback},
+        {Network::PING, &Client::handlePing},
+        {Network::LIST_PAGE, &Client::handleListPage}
+    };
 
 private:
 
     /**
      * Network instance acting as data-link layer.
     */
-    Network network;
+    Endpoint<Client> network;
     
     /**
      * Client socket that is connectedto the server.
@@ -110,18 +226,55 @@ private:
     int clientFd;
 
     /**
-     * Locks operation return values so handlers can communicate with calling
-     * function.
+     * Called with the users and next cursor of every page answering a
+     * `LIST_PAGE` request. Returns whether more pages follow for the request.
+    */
+    using PageHandler = std::function<bool(std::string_view users, std::string_view cursor)>;
+
+    /**
+     * Like the public `sendRequest()`, but every `LIST_PAGE` answering the
+     * request is passed to `onPage`, and the request completes with an empty
+     * string after the last page.
     */
-    std::mutex m;
-    std::condition_variable cv;
+    std::future<std::string> sendRequest(Network::Message message, PageHandler onPage);
 
+    /**
+     * Sends the `LIST_PAGE` query for `sub` and waits for its last page.
+    */
+    std::string requestPages(std::string sub, uint32_t pageSize, std::string cursor,
+                             bool stream, PageHandler onPage);
 
     /**
-     * Message return lock and condition_variable
+     * Fulfills the request waiting for `requestId` with `result`. Replies to
+     * requests nobody waits for are dropped.
     */
-    std::mutex message_m;
-    std::condition_variable message_cv;
+    void completeRequest(uint64_t requestId, std::string result);
+
+    /**
+     * Fails every outstanding request. Called once the connection is lost.
+    */
+    void failPendingRequests();
+
+    /**
+     * Serializes writes to `clientFd` so concurrent requests do not interleave
+     * their frames.
+    */
+    std::mutex sendLock;
+
+    /**
+     * Requests sent but not answered yet, by request ID. `receiving` is false
+     * once the receive thread has exited and nothing will be answered anymore.
+    */
+    std::mutex pendingLock;
+    std::unordered_map<uint64_t, std::promise<std::string>> pendingRequests;
+    std::unordered_map<uint64_t, PageHandler> pageHandlers;
+    bool receiving;
+    std::atomic<uint64_t> nextRequestId;
+
+    /**
+     * Receives pushed messages. Guarded by `pendingLock`.
+    */
+    std::function<void(std::string)> messageHandler;
 
     /**
      * The currently logged in user.
@@ -131,14 +284,9 @@ private:
     /**
      * Internal user list that is received from server.
     */
+    std::mutex userListLock;
     std::unordered_set<std::string> clientUserList;
 
-    /**
-     * Return values from callbacks
-    */
-    std::string opResult;
-    std::string opResultMessages;
-
     /**
      * Network `receiveOperation()` thread.
     */
@@ -0,0 +1,69 @@
+/**
+ * `LzCodec` is the block compressor `Network` uses for large payloads. It is a
+ * byte-oriented LZ77 variant in the style of LZ4: no entropy coding, so both
+ * directions run at memory speed, which is what a chat server can afford on
+ * every large `LIST` or mailbox delivery.
+ *
+ * A block is a sequence of (literals, match) pairs:
+ *
+ * > Token (1 byte): literal count in the high nibble, match length - 4 in the
+ *   low nibble. A nibble of 15 is followed by extra bytes that are added to it,
+ *   each 255 meaning another byte follows.
+ * > Literals
+ * > Match offset back into the output (2 bytes, little-endian)
+ * > Extra match length bytes, as above
+ *
+ * The last pair has no match: the block ends right after its literals.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class LzCodec
+{
+public:
+
+    /**
+     * Appends the compressed form of the `length` bytes at `data` to `out`.
+    */
+    static void compress(const char *data, size_t length, std::string &out);
+
+    /**
+     * Decompresses the `length` byte block at `data`, which must expand to
+     * exactly `originalLength` bytes, into `out`.
+     *
+     * @return  0 on success.
+     *          -1 if the block is malformed.
+    */
+    static int decompress(const char *data, size_t length, size_t originalLength,
+                          std::string &out);
+};
+
+/**
+ * Compression counters, shared by every copy of a `Network` instance.
+*/
+struct CompressionStats
+{
+    // Payload bytes before and after compression, for sent frames.
+    std::atomic<uint64_t> rawBytes{0};
+    std::atomic<uint64_t> compressedBytes{0};
+    // Number of frames sent compressed and received compressed.
+    std::atomic<uint64_t> framesCompressed{0};
+    std::atomic<uint64_t> framesDecompressed{0};
+    // CPU time spent in the codec.
+    std::atomic<uint64_t> compressNanoseconds{0};
+    std::atomic<uint64_t> decompressNanoseconds{0};
+
+    /**
+     * Achieved compression ratio of sent payloads. 1 if nothing was
+     * compressed.
+    */
+    inline double ratio()
+    {
+        return compressedBytes > 0 ? (double)rawBytes / compressedBytes : 1;
+    }
+};
@@ -0,0 +1,67 @@
+/**
+ * `Epoch` frees shared objects that other threads may still be reading
+ * without making the readers take a lock or count references.
+ *
+ * A thread holds an `Epoch::Guard` while it uses an object it found through a
+ * shared structure. Whoever unlinks an object from that structure passes it
+ * to `retire()` instead of freeing it. The process keeps a global epoch, and
+ * every guard publishes the epoch it started in. The epoch only advances once
+ * every thread inside a guard has seen the current one, so once it has
+ * advanced twice past the epoch an object was retired in, no guard that could
+ * have found the object is left and it is freed.
+ *
+ * Entering and leaving a guard touches only the calling thread's own slot, so
+ * readers never contend with each other. `retire()` and `collect()` take a
+ * lock, which suits objects that are retired rarely, such as the mailbox of a
+ * deleted account. Retired objects are freed as soon as the guards allow:
+ * `retire()` frees an object at once if no guard is held, and otherwise the
+ * last guard to leave while objects wait collects them, so nothing waits on
+ * later retirements or on the owner calling `collect()`.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+class Epoch
+{
+public:
+
+    /**
+     * Keeps every object retired from now on alive until it is destroyed.
+     * Guards may nest. Must be destroyed by the thread that created it.
+    */
+    class Guard
+    {
+    public:
+        Guard();
+        ~Guard();
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+
+    /**
+     * Calls `deleter` with `object` once no guard that existed when it was
+     * retired is left. `object` must already be unreachable for new guards.
+    */
+    static void retire(void *object, void (*deleter)(void *object));
+
+    template <typename T>
+    static void retire(T *object)
+    {
+        retire(object, [](void *retired)
+        {
+            delete (T *)retired;
+        });
+    }
+
+    /**
+     * Advances the epoch as far as the guards allow and frees the objects
+     * that became safe to free. Also done by every `retire()`, and by guards
+     * leaving while objects wait.
+     *
+     * @return  Number of retired objects still waiting.
+    */
+    static size_t collect();
+};
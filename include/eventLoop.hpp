@@ -0,0 +1,320 @@
+/**
+ * `EventLoop` multiplexes many client sockets on a single thread. The server
+ * creates a small, fixed number of these (one per core) instead of a thread per
+ * connection.
+ *
+ * Every socket handed to `addConnection()` is owned by the loop from then on.
+ * When data arrives on a socket the loop appends it to that connection's
+ * `FrameDecoder` and hands the decoder, along with the connection's `Arena`, to `Endpoint::dispatchBuffered()`, which
+ * triggers the server's callback for every complete frame. The loop closes the socket
+ * once the peer disconnects or a protocol error occurs.
+ *
+ * Two backends are available. `EPOLL` waits for readiness with edge-triggered
+ * epoll and moves bytes with plain socket syscalls. `URING` keeps a multishot
+ * receive armed on every socket and batches all replies produced in one
+ * iteration into the same `io_uring_enter()` that waits for the next
+ * completions. If io_uring is unavailable the loop falls back to `EPOLL`.
+ *
+ * With an `IdlePolicy` set, every connection has a timer in the loop's
+ * `TimerWheel`, and the loop sleeps no longer than until the next one is due.
+ * Receiving data only records the time; the timer is moved when it fires.
+ *
+ * Sends never block the loop. What a slow peer does not take is queued by the
+ * transport. Once a connection has more than the high-water mark queued, the
+ * loop stops reading its requests and holds back messages pushed to it, until
+ * the queue drained below the low-water mark. Its queue is thus bounded by the
+ * high-water mark plus the replies to one buffer of requests.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "frameDecoder.hpp"
+#include "network.hpp"
+#include "timerWheel.hpp"
+#include "transport.hpp"
+
+// Forward declare Server, whose callbacks handle the frames the loop receives.
+class Server;
+
+/**
+ * Outbound queue counters of one or more event loops.
+*/
+struct OutboundStats
+{
+    // Bytes queued for slow peers right now, and the most a single
+    // connection had queued.
+    uint64_t queuedBytes = 0;
+    uint64_t peakQueuedBytes = 0;
+    // Connections whose requests are not read right now, and how many times
+    // a connection passed the high-water mark.
+    uint64_t pausedConnections = 0;
+    uint64_t pauses = 0;
+    // Pushed messages held back until their connection's queue drained.
+    uint64_t deferredPushes = 0;
+};
+
+class EventLoop
+{
+public:
+
+    enum Backend
+    {
+        EPOLL,
+        URING
+    };
+
+    /**
+     * The loop dispatches through its own copy of `network` so that replies
+     * go out over this loop's transport.
+    */
+    EventLoop(const Endpoint<Server> &network, Backend backend = EPOLL);
+
+    ~EventLoop();
+
+    /**
+     * Starts the loop thread.
+    */
+    void start();
+
+    /**
+     * Wakes the loop thread, waits for it to exit and closes every connection
+     * still owned by the loop.
+    */
+    void stop();
+
+    /**
+     * Hands `socket` over to this loop, which starts watching it on its own
+     * thread. May be called from any thread.
+     *
+     * @return  Errors waking the loop.
+    */
+    int addConnection(int socket);
+
+    /**
+     * Pings and evicts idle connections as `policy` says. Must be set before
+     * `start()`.
+    */
+    inline void setIdlePolicy(const IdlePolicy &policy)
+    {
+        idlePolicy = policy;
+    }
+
+    /**
+     * Sets the outbound queue length at which a connection's reads are
+     * paused, and the one at which they resume. A `highWater` of 0 never
+     * pauses. Must be set before `start()`.
+    */
+    inline void setWaterMarks(size_t highWater, size_t lowWater)
+    {
+        this->highWater = highWater;
+        this->lowWater = std::min(lowWater, highWater);
+    }
+
+    OutboundStats getOutboundStats();
+
+    /**
+     * Stops sending heartbeats to `socket`, a peer that does not answer them,
+     * so it is only evicted once idle for the idle timeout. Must be called on
+     * the loop thread, from a callback handling a frame of `socket`.
+    */
+    void stopPinging(int socket);
+
+    /**
+     * Runs `task` on the loop thread and sends the message it returns to
+     * `socket`, encoded in protocol `version`. Nothing is sent if the task
+     * returns `NO_RETURN` or the socket was closed in the meantime. May be
+     * called from any thread; used to push messages the connection did not
+     * ask for.
+    */
+    void post(int socket, uint32_t version, std::function<Network::Message()> task);
+
+    /**
+     * Sets a function called with every socket the loop closes, just before
+     * it is closed.
+    */
+    inline void setCloseHandler(std::function<void(int socket)> handler)
+    {
+        closeHandler = handler;
+    }
+
+    /**
+     * Total number of syscalls issued by this loop and its transport.
+    */
+    uint64_t getSyscalls();
+
+    /**
+     * Number of connections closed for being idle.
+    */
+    inline uint64_t getEvictions()
+    {
+        return evictions;
+    }
+
+    inline Backend getBackend()
+    {
+        return backend;
+    }
+
+private:
+
+    /**
+     * Thread functions that wait for events and service ready sockets.
+    */
+    void runEpoll();
+    void runUring();
+
+    /**
+     * Reads everything currently available on `socket` and dispatches every
+     * complete frame.
+     *
+     * @return  -1 if the connection should be closed.
+    */
+    int serviceConnection(int socket);
+
+    /**
+     * Starts watching the sockets handed over by `addConnection()`.
+    */
+    void watchPending();
+
+    /**
+     * Removes `socket` from the loop and closes it.
+    */
+    void closeConnection(int socket);
+
+    /**
+     * Fires the idle timers due at `loopTime`.
+    */
+    void expireIdle();
+
+    /**
+     * Applies the idle policy to `socket`, whose timer fired.
+    */
+    void checkIdle(int socket);
+
+    /**
+     * Runs the tasks queued by `post()`.
+    */
+    void runPosted();
+
+    /**
+     * Writes what is queued for `socket` and resumes it once below the
+     * low-water mark.
+     *
+     * @return  -1 if the connection should be closed.
+    */
+    int drainOutbound(int socket);
+
+    /**
+     * The network instance whose callbacks handle received frames.
+    */
+    Endpoint<Server> network;
+
+    Backend backend;
+    std::shared_ptr<Transport> transport;
+    std::shared_ptr<UringTransport> uring;
+
+    /**
+     * epoll instance and the eventfd used to wake the loop on `stop()` and on
+     * new connections.
+    */
+    int epollFd;
+    int wakeFd;
+
+    std::atomic<bool> loopRunning;
+    std::thread loopThread;
+    std::atomic<uint64_t> loopSyscalls;
+
+    /**
+     * Sockets handed over by `addConnection()` that the loop has not started
+     * watching yet.
+    */
+    std::mutex pendingLock;
+    std::vector<int> pendingSockets;
+
+    /**
+     * Tasks queued by `post()`, also guarded by `pendingLock`.
+    */
+    struct PostedTask
+    {
+        int socket;
+        uint32_t version;
+        std::function<Network::Message()> task;
+    };
+    std::vector<PostedTask> postedTasks;
+
+    /**
+     * Runs `posted` and sends its message.
+     *
+     * @return  -1 if the connection should be closed.
+    */
+    int runTask(PostedTask &posted);
+
+    std::function<void(int socket)> closeHandler;
+
+    /**
+     * Per-connection receive buffer and scratch memory. Only touched by the
+     * loop thread.
+    */
+    struct Connection
+    {
+        FrameDecoder decoder;
+        Arena arena;
+        // When the connection last received data and was last pinged.
+        uint64_t lastActive = 0;
+        uint64_t lastPing = 0;
+        bool answersPings = true;
+        // Bytes queued by the transport when last checked, whether reads are
+        // paused, and the pushes held back meanwhile.
+        size_t queued = 0;
+        bool paused = false;
+        std::vector<PostedTask> deferred;
+    };
+    std::unordered_map<int, Connection> connections;
+
+    /**
+     * Records how much is queued for `socket` and pauses it past the
+     * high-water mark.
+    */
+    void updateBackpressure(int socket, Connection &connection);
+
+    /**
+     * Runs the pushes held back for the paused `socket` and services what it
+     * sent in the meantime.
+     *
+     * @return  -1 if the connection should be closed.
+    */
+    int resumeConnection(int socket);
+
+    /**
+     * Water marks, the connections with bytes queued, and the counters
+     * reported by `getOutboundStats()`.
+    */
+    size_t highWater;
+    size_t lowWater;
+    std::unordered_set<int> backlogged;
+    std::atomic<uint64_t> queuedBytes;
+    std::atomic<uint64_t> peakQueuedBytes;
+    std::atomic<uint64_t> pausedConnections;
+    std::atomic<uint64_t> pauses;
+    std::atomic<uint64_t> deferredPushes;
+
+    /**
+     * Idle timer of every connection, the time the current iteration of the
+     * loop started at, and the number of connections evicted.
+    */
+    IdlePolicy idlePolicy;
+    TimerWheel timers;
+    uint64_t loopTime;
+    std::atomic<uint64_t> evictions;
+};
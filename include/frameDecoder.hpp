@@ -0,0 +1,80 @@
+/**
+ * `FrameDecoder` is the per-connection receive buffer that `Network` parses
+ * frames out of. It is a ring buffer: `readFrom()` fills all free space with a
+ * single vectored read, however much the socket has available, and `Network`
+ * consumes every complete frame from the front. A partially received frame
+ * simply stays buffered until the rest of it arrives, so short reads never
+ * desynchronize the stream.
+ *
+ * The buffer grows when it fills up, so frames larger than the initial
+ * capacity are still received whole. Readers dispatch the frames buffered in a
+ * full decoder before reading more, so it only grows to fit a single frame,
+ * whose size `Network` limits.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "transport.hpp"
+
+class FrameDecoder
+{
+public:
+    FrameDecoder(size_t capacity = 16384);
+
+    /**
+     * Number of buffered bytes not yet consumed.
+    */
+    inline size_t size()
+    {
+        return count;
+    }
+
+    /**
+     * Number of bytes the buffer holds before it has to grow.
+    */
+    inline size_t capacity()
+    {
+        return storage.size();
+    }
+
+    /**
+     * Appends bytes that were received elsewhere (for example by an io_uring
+     * completion).
+    */
+    void append(const char *data, size_t length);
+
+    /**
+     * Reads as much as fits from `socket` with one call to `transport`.
+     *
+     * @return  Number of bytes read, 0 on disconnect.
+     *          Socket read() errors.
+    */
+    int readFrom(Transport &transport, int socket);
+
+    /**
+     * Returns a pointer to `length` contiguous buffered bytes starting
+     * `offset` bytes past the front. If the range wraps around the end of the
+     * ring, the buffer is rotated first so that it no longer does.
+    */
+    const char *peek(size_t offset, size_t length);
+
+    /**
+     * Discards `length` bytes from the front.
+    */
+    void consume(size_t length);
+
+private:
+
+    /**
+     * Grows the ring so at least `length` bytes are free.
+    */
+    void reserve(size_t length);
+
+    std::vector<char> storage;
+    // Index of the first buffered byte and number of buffered bytes.
+    size_t head;
+    size_t count;
+};
@@ -0,0 +1,346 @@
+/**
+ * `Mailbox` holds the undelivered messages of one user in a lock-free
+ * multi-producer, single-consumer queue. Any number of senders push at once
+ * without blocking each other or the reader: a push swaps itself in as the
+ * newest node with one atomic exchange and then links the previous newest
+ * node to it. The reader follows the links from the oldest node, so a push
+ * that has swapped but not linked yet hides the messages behind it until it
+ * links. Pushes from one thread are delivered in order.
+ *
+ * Messages are queued as compact records from `RecordSlab` rather than as
+ * `Network::Message`s: the sequence number, the sender's ID in `Usernames`
+ * and the payload, inline unless it is longer than `INLINE_BYTES`. The
+ * receiver is the mailbox's owner and is not stored.
+ *
+ * Under memory pressure a mailbox can be spilled: the messages it holds in
+ * memory are appended to its own spill file and freed, and messages pushed
+ * later queue in memory behind them. Draining or peeking reads the file
+ * back sequentially before the messages in memory, so the order is kept.
+ * Spill files are scratch space rather than durable state; the write-ahead
+ * log covers the messages in them.
+ *
+ * Only one thread drains a mailbox at a time, claimed with a flag rather than
+ * a lock. A drain that finds the mailbox claimed returns at once; the thread
+ * holding it delivers the messages instead, and checks for messages pushed
+ * while it was finishing before it gives the mailbox up. `peek()` claims the
+ * mailbox the same way to read it, and drains wait for it to finish.
+ *
+ * `MailboxDirectory` maps usernames to mailboxes. It is sharded like
+ * `UserRegistry`, but its locks only guard the maps: mailboxes are used after
+ * the shard lock is released, inside an `Epoch::Guard`, and a mailbox erased
+ * with its account is retired through `Epoch` so it outlives every thread
+ * still pushing to or draining it. A `MailboxSource`, such as the snapshot the
+ * server started from, fills each mailbox the first time it is needed.
+ * The directory counts the bytes its mailboxes hold in memory and spills the
+ * least recently drained ones when asked to stay under a budget.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "messageStore.hpp"
+#include "userRegistry.hpp"
+
+class Mailbox
+{
+public:
+
+    /**
+     * `queuedBytes`, if given, is kept up to date with the bytes of messages
+     * the mailbox holds in memory, along with any other mailbox sharing it.
+     * It is shared since a retired mailbox may outlive its directory.
+    */
+    Mailbox(std::shared_ptr<std::atomic<uint64_t>> queuedBytes = nullptr);
+
+    /**
+     * Frees the messages and removes the spill file.
+    */
+    ~Mailbox();
+
+    Mailbox(const Mailbox &) = delete;
+    Mailbox &operator=(const Mailbox &) = delete;
+
+    /**
+     * Adds a message from `sender` carrying `data` at the back. Safe to call
+     * from any number of threads. `sequence` identifies the message in the
+     * write-ahead log, if any. `data` must be shorter than 4 GB.
+     *
+     * @return  0, or -1 if `sender` could not be interned in `Usernames`, in
+     *          which case nothing is queued.
+    */
+    int push(std::string_view sender, std::string_view data, uint64_t sequence = 0);
+
+    /**
+     * Like the `push()` above, for a sender already interned in `Usernames`.
+    */
+    void push(uint32_t sender, std::string_view data, uint64_t sequence = 0);
+
+    /**
+     * Removes messages in order and passes them to `visit`, unless another
+     * thread is draining the mailbox. Stops once the senders and payloads
+     * passed add up to `maxBytes`, leaving the rest queued, so a drain never
+     * takes more than `maxBytes` and one message. The views are only valid
+     * until `visit` returns.
+     *
+     * @return  Number of messages drained.
+    */
+    size_t drain(const std::function<void(uint64_t sequence, std::string_view sender,
+                                          std::string_view data)> &visit,
+                 uint64_t maxBytes = UINT64_MAX);
+
+    /**
+     * Passes every message to `visit` in order without removing it. Waits
+     * for a drain in progress to finish.
+     *
+     * @return  0 on success, -1 if the spill file could not be read.
+    */
+    int peek(const std::function<void(uint64_t sequence, std::string_view sender,
+                                      std::string_view data)> &visit);
+
+    /**
+     * Appends the messages held in memory to the spill file and frees them,
+     * unless the mailbox is being drained or peeked. The file is created at
+     * `path` if the mailbox has none yet.
+     *
+     * @return  Bytes of memory freed, or -1 if the file could not be written,
+     *          in which case the messages stay in memory.
+    */
+    int64_t spill(const std::string &path);
+
+    /**
+     * Bytes of messages held in memory.
+    */
+    inline size_t memoryBytes() const
+    {
+        return bytes.load(std::memory_order_relaxed) & ~DETACHED;
+    }
+
+    /**
+     * Stops counting the mailbox in `queuedBytes`, for a mailbox that was
+     * unlinked but may still be in use. Messages pushed to it afterwards are
+     * not counted either.
+    */
+    void detach();
+
+    /**
+     * When the mailbox was created or last drained, in `steady_clock` ticks.
+    */
+    inline int64_t getLastDrained() const
+    {
+        return lastDrained.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Number of messages pushed and not drained yet.
+    */
+    inline size_t size() const
+    {
+        return count.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    /**
+     * A queued message, followed in its slab by its payload if the payload
+     * is at most `INLINE_BYTES` long, or else by a pointer to it.
+    */
+    struct Record
+    {
+        std::atomic<Record *> next;
+        uint64_t sequence;
+        uint32_t sender;
+        uint32_t length;
+    };
+
+    static const size_t INLINE_BYTES = RecordSlab::MAX_RECORD_BYTES - sizeof(Record);
+
+    // Set in `bytes` once the mailbox is detached.
+    static const size_t DETACHED = (size_t)1 << 63;
+
+    static Record *allocateRecord(uint32_t sender, std::string_view data, uint64_t sequence);
+
+    /**
+     * Frees the payload of `record` if it is not inline.
+    */
+    static void releasePayload(Record *record);
+
+    static void releaseRecord(Record *record);
+
+    static std::string_view dataOf(const Record *record);
+
+    /**
+     * Memory `record` takes, payload included.
+    */
+    static size_t bytesOf(const Record *record);
+
+    /**
+     * Counts memory taken or freed in `bytes`, and in `queuedBytes` unless
+     * the mailbox is detached.
+    */
+    void addBytes(size_t added);
+    void removeBytes(size_t removed);
+
+    /**
+     * Passes the messages in the spill file to `visit`, from `spillOffset`
+     * on, and moves `spillOffset` past each one if `consume` is set. Stops
+     * once `budget` is used up by the senders and payloads passed, which
+     * are taken from it.
+     *
+     * @return  Number of messages read, or -1 if the file could not be read.
+    */
+    int64_t readSpill(const std::function<void(uint64_t sequence, std::string_view sender,
+                                               std::string_view data)> &visit,
+                      bool consume, uint64_t &budget);
+
+    // Newest record, swapped by every push.
+    std::atomic<Record *> head;
+    // Record drained last; its successor is the oldest message. Only touched
+    // by the thread holding `owner`.
+    Record *tail;
+    std::atomic<size_t> count;
+    std::atomic<size_t> bytes;
+    std::shared_ptr<std::atomic<uint64_t>> queuedBytes;
+    std::atomic<int64_t> lastDrained;
+    // Spill file, empty if there is none, and how much of it was drained
+    // already. Only touched by the thread holding `owner`.
+    std::string spillPath;
+    uint64_t spillOffset;
+
+    enum Owner
+    {
+        FREE,
+        DRAINING,
+        PEEKING,
+        SPILLING
+    };
+    std::atomic<int> owner;
+};
+
+/**
+ * Mailboxes that are not in memory yet. `MailboxDirectory` asks for the
+ * messages of a user the first time it needs their mailbox.
+*/
+class MailboxSource
+{
+public:
+
+    virtual ~MailboxSource() = default;
+
+    /**
+     * Whether `user` has messages that were not handed over yet.
+    */
+    virtual bool contains(const std::string &user) = 0;
+
+    /**
+     * Pushes the messages of `user` to `mailbox`, or drops them if it is
+     * nullptr. Only the first call for a user finds any.
+    */
+    virtual void load(const std::string &user, Mailbox *mailbox) = 0;
+};
+
+class MailboxDirectory
+{
+public:
+
+    // Mailboxes holding fewer bytes in memory are spilled last.
+    static const size_t MIN_SPILL_BYTES = 4096;
+
+    MailboxDirectory(size_t shards = UserRegistry::DEFAULT_SHARDS);
+
+    ~MailboxDirectory();
+
+    /**
+     * Fills mailboxes from `source` as they are first used. Must be set
+     * before the directory is shared with other threads.
+    */
+    inline void setSource(MailboxSource *source)
+    {
+        this->source = source;
+    }
+
+    /**
+     * The mailbox of `user`, created on first use. Only valid while the
+     * calling thread holds an `Epoch::Guard`.
+    */
+    Mailbox &get(const std::string &user);
+
+    /**
+     * Like `get()`, but nullptr if `user` has no mailbox.
+    */
+    Mailbox *find(const std::string &user);
+
+    /**
+     * Removes the mailbox of `user`, along with its messages, once no thread
+     * can still be using it.
+     *
+     * @return  Whether `user` had a mailbox.
+    */
+    bool erase(const std::string &user);
+
+    /**
+     * Passes every mailbox in memory to `visit`. Mailboxes cannot be created
+     * or erased in the shard being visited.
+    */
+    void forEach(const std::function<void(const std::string &user, Mailbox &mailbox)> &visit);
+
+    /**
+     * Creates spill files in `directory`. Must be set before `spillColdest()`
+     * is called.
+    */
+    inline void setSpillDirectory(const std::string &directory)
+    {
+        spillDirectory = directory;
+    }
+
+    /**
+     * Spills the least recently drained mailboxes until the mailboxes hold at
+     * most `target` bytes of messages in memory, or none is left to spill.
+     * Small mailboxes are only spilled once every larger one is, to keep
+     * spill files few.
+     *
+     * @return  Bytes of memory freed.
+    */
+    uint64_t spillColdest(uint64_t target);
+
+    /**
+     * Bytes of messages held in memory by all the mailboxes.
+    */
+    inline uint64_t getQueuedBytes() const
+    {
+        return queuedBytes->load(std::memory_order_relaxed);
+    }
+
+
+private:
+
+    struct alignas(64) Shard
+    {
+        std::shared_mutex lock;
+        std::unordered_map<std::string, Mailbox *> mailboxes;
+    };
+
+    Shard &shardOf(const std::string &user);
+
+    /**
+     * The mailbox of `user` in `shard` if it is in memory.
+    */
+    Mailbox *lookup(Shard &shard, const std::string &user);
+
+    size_t mask;
+    std::unique_ptr<Shard[]> shards;
+    MailboxSource *source = nullptr;
+    std::shared_ptr<std::atomic<uint64_t>> queuedBytes =
+        std::make_shared<std::atomic<uint64_t>>(0);
+    std::string spillDirectory;
+    // Numbers the spill files.
+    std::atomic<uint64_t> spillFiles{0};
+};
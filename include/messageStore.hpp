@@ -0,0 +1,83 @@
+/**
+ * Queued messages are kept as compact records rather than as
+ * `Network::Message`s. A record holds the message's sequence number, its
+ * sender as a 32-bit ID, and its payload, inline when it is short. The
+ * receiver is not stored at all, since a mailbox only holds messages for
+ * one user.
+ *
+ * `Usernames` interns the names behind those IDs. Every name is stored once
+ * for the life of the process, however many messages it sends, so IDs stay
+ * valid without reference counting. The table only grows with the number of
+ * distinct names ever seen, which is why the server only takes messages from
+ * registered accounts. Once every ID is taken, new names are refused.
+ *
+ * `RecordSlab` allocates the records. Records are grouped into size classes
+ * 8 bytes apart, and each class is carved out of 64 KB slabs, so a record
+ * costs no allocator header and at most 7 bytes of rounding. Every thread
+ * keeps a cache of free records per class and exchanges them with a shared
+ * list in batches, since records are usually allocated by the thread that
+ * sends a message and freed by the one that delivers it. Slabs are kept for
+ * reuse once their records are freed rather than given back to the system.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+class Usernames
+{
+public:
+
+    /**
+     * Never the ID of a name.
+    */
+    static const uint32_t NO_ID = UINT32_MAX;
+
+    /**
+     * ID of `name`, assigned the first time it is seen, or `NO_ID` if the
+     * name is new and every ID is taken. Safe to call from any number of
+     * threads.
+    */
+    static uint32_t intern(std::string_view name);
+
+    /**
+     * The name with ID `id`. Valid for the life of the process.
+    */
+    static std::string_view nameOf(uint32_t id);
+
+    /**
+     * Number of names interned.
+    */
+    static size_t size();
+};
+
+class RecordSlab
+{
+public:
+
+    /**
+     * Largest record allocated from a slab.
+    */
+    static const size_t MAX_RECORD_BYTES = 256;
+
+    static const size_t SLAB_BYTES = 64 << 10;
+
+    /**
+     * Returns memory for a record of `bytes` bytes, at most
+     * `MAX_RECORD_BYTES`, aligned to 8 bytes. Safe to call from any number
+     * of threads.
+    */
+    static void *allocate(size_t bytes);
+
+    /**
+     * Takes back a record allocated with the same `bytes`, from any thread.
+    */
+    static void release(void *record, size_t bytes);
+
+    /**
+     * Bytes of slabs carved so far, whether their records are in use or not.
+    */
+    static uint64_t getSlabBytes();
+};
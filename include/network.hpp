@@ -3,16 +3,19 @@
  * client and defines the common wire protocol the server and client use to
  * communicate. The following breaks down how a user interacts with this class:
  *
- * 1. Register callbacks with `Network` for each operation (`OpCode`) the user
- *    wants to handle.
- * 2. The user calls the `receiveOperation()` function for a particular
- *    connection. When the `Network` instance receives an operation on the
- *    connection, the callback for that operation is triggered.
+ * 1. The user lists the operations (`OpCode`) it wants to handle, and the member
+ *    function handling each, in a `callbacks` table of `Route`s and receives
+ *    through an `Endpoint` of its own type.
+ * 2. The user calls the `receiveOperation()` function of the `Endpoint` for a
+ *    particular connection, passing that connection's `FrameDecoder`. When the
+ *    `Endpoint` receives an operation on the connection, the callback for that
+ *    operation is triggered.
  * 3. The results of that operation can returned by the user using
  *    `sendMessage()`.
  *
  * Communication over the network and the parsing of operations, metadata, and
- * data are handled by this class as well. Notably, this class does not initate
+ * data are handled by this class as well. The bytes themselves are moved by a
+ * pluggable `Transport` (plain socket syscalls by default, see `transport.hpp`). Notably, this class does not initate
  * connections or handle the closing (unexepected or intentional) of connections.
  * The user of this class must handle possible `SIGPIPE`s and manage the socket
  * file descriptor.
@@ -26,14 +29,60 @@
  * > Sender information data length (8 bytes)
  * > Receiver information data length (8 bytes)
  * > Data length (8 bytes)
+ * > Request ID (8 bytes, version 2 only)
  * ///////// Data /////////
  * > Sender information of length `senderLength` (Could be 0)
  * > Reciever information of length `recieverLength` (Could be 0)
  * > Operation data of length `dataLength`
  *
+ * Versions 1 and 2 send the header as a raw struct in host byte order. Version
+ * 3 packs it instead, which shrinks a typical chat header from 40 bytes to 6:
+ *
+ * //////// Packed header (version 3) ////////
+ * > Protocol version number (1 byte, always 3)
+ * > Operation (low 5 bits) and flags (high 3 bits)
+ * > Request ID (varint)
+ * > Sender information data length (varint)
+ * > Receiver information data length (varint)
+ * > Data length (varint)
+ *
+ * Varints are little-endian base 128: seven bits per byte, least significant
+ * group first, with the high bit set on every byte but the last.
+ *
+ * Packed frames may carry a compressed payload. Each frame's `0x40` flag says
+ * whether its sender accepts compressed replies; a reply is only compressed
+ * if the request set it. The `0x80` flag marks a compressed payload, in which
+ * case the data field holds the payload's original length (varint) followed
+ * by an `LzCodec` block, and `dataLength` counts both. Only payloads of at
+ * least the compression threshold are compressed, so short chat frames never
+ * pay for it.
+ *
+ * The `0x20` flag streams a payload too large for one frame: it is sent as a
+ * series of chunk frames with the same operation, sender, receiver and request
+ * ID, each carrying the next piece of the data, and ended by a chunk with no
+ * data. The handler consumes the pieces as they arrive, so the receiver never
+ * buffers more than one frame. Only operations whose route streams accept
+ * chunks.
+ *
+ * Every frame whose sender, receiver and data add up to more than the limit
+ * set for its operation with `setMaxFrameLength()` is rejected as soon as its
+ * header arrives, before anything is buffered or allocated for it, and so is
+ * a compressed payload that claims to expand past that limit.
+ *
  * Any data received by this class that does not follow the above protocol will
  * be ignored.
  *
+ * The request ID lets a client pipeline requests: it may send several before
+ * the first reply arrives, and every reply carries the ID of the request it
+ * answers, so replies may come back in any order. A reply is always encoded in
+ * the version of the request it answers, which keeps version 1 peers (whose
+ * header ends before the request ID) working; their replies must arrive in
+ * request order.
+ *
+ * A connection starts out in version 2. A peer that wants another version
+ * sends `HELLO` with the highest version it speaks, and the reply carries the
+ * version both ends will use from then on.
+ *
  * ///////////////////////////// Usage Information /////////////////////////////
  *
  * Function information and return values:
@@ -55,29 +104,45 @@
  * When the `receiveOperation()` function is called by either the client or
  * server, the function will block until an `OpCode` is received on the
  * designated socket. Any subsequent data received will be parsed by this class
- * and passed to the registered callback for that operation in a `Message`
- * object. The fields of the `Message` object are only defined for some
+ * and passed to the registered callback for that operation in a `MessageView`
+ * object, whose fields point straight into the receive buffer. The fields of
+ * the `MessageView` object are only defined for some
  * oeprations. For example, in a `LIST` op, only the `data` field is defined and
  * `sender` and `receiver` are empty. Some operations have no fields defined.
  */
 
 #pragma once
 
+#include <array>
 #include <cstdint>
+#include <iterator>
+#include <memory>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <utility>
+#include <vector>
 
-#define VERSION 1
+#include "bufferPool.hpp"
+#include "compression.hpp"
+#include "frameDecoder.hpp"
+#include "transport.hpp"
 
-// Forward declare Client and Server so the Network class can register callbacks.
-class Server;
-class Client;
-class Callback;
+#define VERSION 3
+// Oldest protocol version still accepted.
+#define MIN_VERSION 1
+// Version every peer speaks before negotiating.
+#define DEFAULT_VERSION 2
+// First version with the packed header.
+#define PACKED_VERSION 3
+// Default limit on the sender, receiver and data of a frame.
+#define DEFAULT_MAX_FRAME_LENGTH (64 << 20)
 
 class Network
 {
 public:
 
+    Network();
+
     /**
      * Defines the possible operations defined by this wire protocol. Each
      * operation is annotated with what part of `Message` is defined when
@@ -99,11 +164,47 @@ public:
         SEND, // Contains data, sender, receiver
         LIST,
 
-        // Other
+        // Other. `UNSUPPORTED_OP` answers an operation the peer has no route
+        // for and is never answered itself.
         UNSUPPORTED_OP,
-        NO_RETURN
+        NO_RETURN,
+
+        // Version negotiation. Contains data: the highest version the sender
+        // speaks in the request, the version to use in the reply. Answered by
+        // `Endpoint` itself unless its handler has a route for it.
+        HELLO,
+
+        // Many messages in one frame. Contains data (the entries, see
+        // `encodeBatch()`) and sender. Answered with `OK` whose data holds one
+        // status byte per entry, `OK` or `ERROR`, in entry order.
+        SEND_BATCH,
+
+        // Client -> Server. Contains data: the user whose messages should be
+        // pushed to this connection as they arrive, as unsolicited `SEND`s
+        // with request ID 0. Answered with a `SEND` of the messages already
+        // waiting.
+        SUBSCRIBE,
+
+        // Heartbeat sent to a connection that has been silent for a while.
+        // Answered with a `PONG` by `Endpoint` itself unless its handler has
+        // a route for it; a `PONG` gets no answer.
+        PING,
+        PONG,
+
+        // Client -> Server. Contains data (the query, see `encodeListPage()`).
+        // Answered with `LIST_PAGE`s whose data holds users, one per line, in
+        // sorted order and whose sender holds the opaque cursor of the next
+        // page, empty after the last one. A streamed query is answered with
+        // every page, each in its own frame; otherwise with one page.
+        LIST_PAGE
     };
 
+    /**
+     * Operations fit in the 5 bits the packed header has for them, so this
+     * many slots cover every operation a frame can carry.
+    */
+    static constexpr size_t MAX_OPCODES = 32;
+
     /**
      * Generic Message object that is passed as context to each callback. Not
      * every field of this object is defined for every operation. For some
@@ -116,25 +217,136 @@ public:
         std::string data;
         std::string sender;
         std::string receiver;
+        // Echoed back in the reply. 0 for unsolicited messages.
+        uint64_t requestId;
+        // Connection a received message arrived on and the protocol version
+        // it was encoded in. Not sent.
+        int socket = -1;
+        uint32_t version = 0;
     };
 
+    struct OutputBuffer;
+
     /**
-     * Waits for an operation to be received from `socket`. Triggers the
-     * registered callback for that operation with the appropriate data recieved
-     * from from the connection.
-     *
-     * @return  Socket read() errors.
-     *          Errors returned by the callback.
+     * What callbacks receive: a `Message` whose fields point into the
+     * connection's receive buffer instead of owning copies. The views are only
+     * valid until the callback returns, so a handler that keeps any field must
+     * copy it, for example with `materialize()`.
      */
-    int receiveOperation(int socket);
+    struct MessageView
+    {
+        OpCode operation;
+        std::string_view data;
+        std::string_view sender;
+        std::string_view receiver;
+        uint64_t requestId;
+        int socket = -1;
+        uint32_t version = 0;
+        // The frame is a chunk of a streamed payload; `data` is the next
+        // piece, or empty once the payload is complete.
+        bool chunk = false;
+        // Endpoint the request arrived through and the replies it has queued,
+        // for `sendReply()`. Only set while a callback runs.
+        Network *endpoint = nullptr;
+        OutputBuffer *replies = nullptr;
+        bool acceptsCompressed = false;
+
+        inline Message materialize() const
+        {
+            return {operation, std::string(data), std::string(sender),
+                    std::string(receiver), requestId, socket, version};
+        }
+    };
+
+    /**
+     * Binds `operation` to the member function of `Handler` that handles it.
+     * A handler lists its routes in a `static constexpr` array named
+     * `callbacks`, from which `Endpoint<Handler>` builds its dispatch table at
+     * compile time. `streams` marks callbacks that accept chunks.
+     */
+    template <typename Handler>
+    struct Route
+    {
+        OpCode operation;
+        Message (Handler::*callback)(const MessageView &);
+        bool streams = false;
+    };
+
+    /**
+     * One message of a `SEND_BATCH`.
+     */
+    struct BatchEntry
+    {
+        std::string receiver;
+        std::string data;
+    };
+
+    /**
+     * Query of a `LIST_PAGE`: at most `pageSize` users containing `query`,
+     * following `cursor`, the cursor of the previous page or empty for the
+     * first one. `stream` asks for every remaining page at once.
+     */
+    struct ListPage
+    {
+        std::string query;
+        std::string cursor;
+        uint64_t pageSize = 0;
+        bool stream = false;
+    };
+
+    /**
+     * Frames queued for one connection. Every frame is encoded into `bytes`,
+     * except payloads of at least the zero-copy threshold, which are kept aside
+     * in `largePayloads` together with the offset in `bytes` they belong at.
+     * `flush()` hands everything to the transport in one vectored send, so
+     * several replies cost a single syscall.
+     */
+    struct OutputBuffer
+    {
+        std::string bytes;
+        std::vector<std::pair<size_t, std::shared_ptr<std::string>>> largePayloads;
+
+        inline bool empty()
+        {
+            return bytes.empty() && largePayloads.empty();
+        }
+    };
 
     /**
      * Send the given `Message` object to the peer on `socket` following the
-     * wire protocol defined by this class.
+     * wire protocol defined by this class. The whole frame is written with a
+     * single vectored send.
+     *
+     * @return  Socket send() errors.
+     */
+    int sendMessage(int socket, const Message &message);
+
+    /**
+     * Sends `message` as chunks carrying at most `chunkLength` bytes of its
+     * data each, followed by the empty chunk that ends it. Versions without
+     * the packed header cannot stream, so the message is sent whole.
      *
      * @return  Socket send() errors.
      */
-    int sendMessage(int socket, Message message);
+    int sendChunked(int socket, const Message &message, size_t chunkLength);
+
+    /**
+     * Encodes `message` into `output` without sending it, using the header of
+     * protocol `version`, or of the version set with `setVersion()` if none
+     * is given. If `compress` is set the payload is compressed when it reaches
+     * the compression threshold and the version supports it.
+     */
+    void queueMessage(OutputBuffer &output, Message message);
+    void queueMessage(OutputBuffer &output, Message message, uint32_t version,
+                      bool compress = false);
+
+    /**
+     * Sends every frame queued in `output` on `socket` in one vectored send and
+     * empties `output`.
+     *
+     * @return  Socket send() errors.
+     */
+    int flush(int socket, OutputBuffer &output);
 
     /**
      * Convenience function to send an error message to the peer.
@@ -144,13 +356,165 @@ public:
     int sendError(int socket, std::string errorMsg);
 
     /**
-     * Save the given function `callback` to be triggered when `operation` is
-     * received by this instance.
+     * Encodes `entries` as the data of a `SEND_BATCH`: for every entry, the
+     * receiver's length (varint), the receiver, the data's length (varint)
+     * and the data.
+     */
+    static void encodeBatch(const std::vector<BatchEntry> &entries, std::string &out);
+
+    /**
+     * Decodes the data of a `SEND_BATCH` into `entriesOut`.
+     *
+     * @return  -1 if `data` is malformed.
+     */
+    static int decodeBatch(std::string_view data, std::vector<BatchEntry> &entriesOut);
+
+    /**
+     * Encodes `page` as the data of a `LIST_PAGE`: the page size (varint), 1
+     * to stream or 0 (varint), then the query and the cursor, each preceded
+     * by its length (varint).
+     */
+    static void encodeListPage(const ListPage &page, std::string &out);
+
+    /**
+     * Decodes the data of a `LIST_PAGE` into `pageOut`.
+     *
+     * @return  -1 if `data` is malformed.
+     */
+    static int decodeListPage(std::string_view data, ListPage &pageOut);
+
+    /**
+     * Sends `reply` to `request` from inside the callback handling it, ahead
+     * of whatever the callback returns, through the endpoint the request
+     * arrived on. Replies queued before it are sent too, so their order is
+     * kept. Lets a callback answer with several frames without holding them
+     * all at once.
+     *
+     * @return  Socket send() errors.
+     *          -1 if `request` is not being handled by a callback.
+     */
+    static int sendReply(const MessageView &request, Message reply);
+
+    /**
+     * Replaces the transport used for all sends and receives. Copies of this
+     * instance share the transport until it is replaced.
+     */
+    inline void setTransport(std::shared_ptr<Transport> newTransport)
+    {
+        transport = newTransport;
+    }
+
+    inline Transport &getTransport()
+    {
+        return *transport;
+    }
+
+    /**
+     * Protocol version used for the messages this instance sends on its own
+     * initiative. Replies always use the version of the request.
+     */
+    inline void setVersion(uint32_t newVersion)
+    {
+        version = newVersion;
+    }
+
+    inline uint32_t getVersion()
+    {
+        return version;
+    }
+
+    /**
+     * Reply payloads of at least `bytes` are compressed for peers that accept
+     * it. 0 disables compression.
+     */
+    inline void setCompressionThreshold(size_t bytes)
+    {
+        compressionThreshold = bytes;
+    }
+
+    /**
+     * Compression counters, shared with every copy of this instance.
+     */
+    inline CompressionStats &getCompressionStats()
+    {
+        return *compressionStats;
+    }
+
+    /**
+     * Frames of `operation`, or of every operation if none is given, whose
+     * sender, receiver and data add up to more than `bytes` are rejected and
+     * the connection closed, before anything is buffered for them.
+     */
+    void setMaxFrameLength(uint64_t bytes);
+    void setMaxFrameLength(OpCode operation, uint64_t bytes);
+
+    /**
+     * Payloads of at least `bytes` are sent with `MSG_ZEROCOPY` where the
+     * transport supports it. 0 disables zero-copy sends.
+     */
+    inline void setZeroCopyThreshold(size_t bytes)
+    {
+        zeroCopyThreshold = bytes;
+    }
+
+protected:
+
+    /**
+     * A frame parsed out of a receive buffer by `nextFrame()`.
+     */
+    struct Frame
+    {
+        MessageView message;
+        // Bytes the frame occupies in the receive buffer.
+        size_t length;
+        // The requester accepts compressed replies.
+        bool acceptsCompressed;
+        // Why the frame could not be parsed.
+        const char *error;
+    };
+
+    /**
+     * Parses the frame at the front of `decoder`, received on `socket`, into
+     * `frame` without consuming it. The fields of `frame.message` point into
+     * the receive buffer, or into a buffer from `arena` for a compressed
+     * payload.
+     *
+     * @return  1 if a complete frame was parsed.
+     *          0 if the frame is incomplete.
+     *          -1 if it is malformed, with `frame.error` set, and the
+     *          version and request ID of `frame.message` set if the header
+     *          could be read, or 0 if not.
+     */
+    int nextFrame(int socket, FrameDecoder &decoder, Arena &arena, Frame &frame);
+
+    /**
+     * Queues `reply`, the result of handling `frame`, in `output`, tagged with
+     * the request's ID and encoded in the request's protocol version. Nothing
+     * is queued for `NO_RETURN`.
      */
-    void registerCallback(OpCode operation, Callback function);
+    void queueReply(const Frame &frame, Message reply, OutputBuffer &output);
+
+    /**
+     * Version-negotiation reply to the `HELLO` request `message`.
+     */
+    static Message answerHello(const MessageView &message);
 
 private:
 
+    /**
+     * Flags in the high bits of the operation byte of packed headers.
+     */
+    enum HeaderFlags : uint8_t
+    {
+        OPERATION_MASK = 0x1f,
+        // The frame is a chunk of a streamed payload.
+        CHUNK = 0x20,
+        // The sender accepts compressed replies.
+        ACCEPTS_COMPRESSED = 0x40,
+        // The payload is compressed.
+        COMPRESSED = 0x80
+    };
+
     /**
      * Header for any data sent between the server and client.
      */
@@ -167,33 +531,291 @@ private:
         // Length of the data following this metadata header
         // (not including the sender/recvier information).
         uint64_t dataLength;
+        // Identifies the request a reply answers. Added in version 2.
+        uint64_t requestId;
     };
 
     /**
-     * Mappings from operations to user callbacks.
+     * Parses the header at the front of `decoder` into `header` and its
+     * `HeaderFlags`. Packed headers are decoded straight from the receive
+     * buffer.
+     *
+     * @return  Length of the header on the wire.
+     *          0 if the header is incomplete.
+     *          -1 if it is malformed or of an unsupported version.
+     */
+    static int decodeHeader(FrameDecoder &decoder, Metadata &header,
+                            uint8_t &flagsOut);
+
+    /**
+     * Encodes the header of `message`, carrying `dataLength` bytes of its
+     * data, for protocol `version` into `out`, which must hold
+     * `MAX_HEADER_LENGTH` bytes. `flags` are only sent in packed headers.
+     *
+     * @return  Length of the encoded header.
+     */
+    static size_t encodeHeader(char *out, uint32_t version, const Message &message,
+                               size_t dataLength, uint8_t flags);
+
+    /**
+     * Replaces `data` with its compressed form if that is smaller.
+     *
+     * @return  Whether `data` was compressed.
+     */
+    bool compressPayload(std::string &data);
+
+    /**
+     * Decompresses the compressed payload `data` into a buffer from `arena`
+     * and points `payloadOut` at it.
+     *
+     * @return  -1 if `data` is malformed or expands past `maxLength`.
+     */
+    int decompressPayload(std::string_view data, uint64_t maxLength, Arena &arena,
+                          std::string_view &payloadOut);
+
+    /**
+     * Backend that moves bytes to and from the kernel.
+     */
+    std::shared_ptr<Transport> transport;
+
+    /**
+     * Largest frame accepted for each operation. Operations past the end of
+     * the table share the limit of `UNSUPPORTED_OP`.
+     */
+    std::array<uint64_t, MAX_OPCODES> maxFrameLengths;
+
+    /**
+     * Minimum payload size sent with `MSG_ZEROCOPY`. 0 if disabled.
+     */
+    size_t zeroCopyThreshold;
+
+    /**
+     * Negotiated protocol version for messages that are not replies.
+     */
+    uint32_t version;
+
+    /**
+     * Minimum reply payload size that is compressed. 0 if disabled.
      */
-    std::unordered_map<OpCode, Callback> registered_callbacks;
+    size_t compressionThreshold;
+    std::shared_ptr<CompressionStats> compressionStats;
 };
 
 /**
- * Common wrapper class for `Server` and `Client` member functions.
+ * `Endpoint` is the `Network` a `Handler` receives through: it triggers the
+ * member functions `Handler` lists in its `callbacks` table. The table is
+ * turned into a dense array indexed by operation at compile time, so each
+ * frame costs one bounds-checked load and a direct call to a function that
+ * is statically bound to its handler.
+ *
+ * Operations `Handler` has no route for are answered by `Endpoint` itself:
+ * `HELLO` with the negotiated version, `PING` with `PONG`, and anything else
+ * but `PONG` and `UNSUPPORTED_OP` with `UNSUPPORTED_OP`. Those two are never
+ * answered, so two peers that both lack a route cannot trade them forever.
 */
-class Callback
+template <typename Handler>
+class Endpoint : public Network
 {
 public:
 
-    Callback(Server* instance, Network::Message (Server::*func)(Network::Message));
+    Endpoint(Handler *handler) : handler(handler)
+    {
+    }
 
-    Callback(Client* instance, Network::Message (Client::*func)(Network::Message));
+    /**
+     * Waits for an operation to be received from `socket`. Triggers the
+     * callback for that operation with the appropriate data recieved from the
+     * connection. Each read pulls in as much as the socket has available into
+     * `decoder`, the connection's receive buffer, and every complete frame it
+     * contains is dispatched in order. Scratch buffers come from `arena`, the
+     * connection's arena, or from a temporary one if none is given.
+     *
+     * @return  Number of frames dispatched.
+     *          Socket read() errors and disconnects.
+     *          Errors returned by the callback.
+    */
+    int receiveOperation(int socket, FrameDecoder &decoder);
+    int receiveOperation(int socket, FrameDecoder &decoder, Arena &arena);
 
-    Network::Message operator()(Network::Message message);
+    /**
+     * Parses every complete frame buffered in `decoder` and triggers the
+     * callback for each one in order. A trailing partial frame is left in
+     * place for the next call. Used directly by event loops, which fill the
+     * decoder from non-blocking sockets themselves. `arena` is reset once the
+     * replies are sent.
+     *
+     * @return  Number of frames dispatched.
+     *          Socket send() errors.
+     *          -1 on an unsupported protocol version.
+    */
+    int dispatchBuffered(int socket, FrameDecoder &decoder);
+    int dispatchBuffered(int socket, FrameDecoder &decoder, Arena &arena);
 
 private:
 
-    bool isClientCallback;
-    Network::Message (Server::*serverCallback)(Network::Message);
-    Network::Message (Client::*clientCallback)(Network::Message);
+    /**
+     * Entry of the dispatch table: calls one callback of `Handler`.
+    */
+    using Thunk = Message (*)(Handler &handler, const MessageView &message);
+
+    template <Message (Handler::*callback)(const MessageView &)>
+    static Message call(Handler &handler, const MessageView &message)
+    {
+        return (handler.*callback)(message);
+    }
 
-    Client* client;
-    Server* server;
+    /**
+     * Builds the dispatch table from `Handler::callbacks`. Operations without
+     * a route are left null.
+    */
+    template <size_t... Index>
+    static constexpr std::array<Thunk, MAX_OPCODES> buildTable(std::index_sequence<Index...>)
+    {
+        std::array<Thunk, MAX_OPCODES> table = {};
+        ((table[Handler::callbacks[Index].operation] =
+              &call<Handler::callbacks[Index].callback>), ...);
+        return table;
+    }
+
+    /**
+     * Bit mask of the operations whose route streams.
+    */
+    template <size_t... Index>
+    static constexpr uint32_t buildStreaming(std::index_sequence<Index...>)
+    {
+        return ((Handler::callbacks[Index].streams
+                     ? 1u << Handler::callbacks[Index].operation : 0u) | ... | 0u);
+    }
+
+    /**
+     * Triggers the callback for `frame` and queues its result in `output`.
+     *
+     * @return  -1 if `frame` is a chunk its operation does not accept.
+    */
+    int dispatch(const Frame &frame, OutputBuffer &output);
+
+    Handler *handler;
 };
+
+template <typename Handler>
+int Endpoint<Handler>::receiveOperation(int socket, FrameDecoder &decoder)
+{
+    Arena arena;
+    return receiveOperation(socket, decoder, arena);
+}
+
+template <typename Handler>
+int Endpoint<Handler>::receiveOperation(int socket, FrameDecoder &decoder,
+                                        Arena &arena)
+{
+    while (true)
+    {
+        // Frames left over from an earlier read are dispatched first.
+        int frames = dispatchBuffered(socket, decoder, arena);
+        if (frames != 0)
+        {
+            return frames;
+        }
+
+        // Read whatever has arrived, however many frames that is.
+        int err = decoder.readFrom(getTransport(), socket);
+        if (err <= 0)
+        {
+            return -1;
+        }
+    }
+}
+
+template <typename Handler>
+int Endpoint<Handler>::dispatchBuffered(int socket, FrameDecoder &decoder)
+{
+    Arena arena;
+    return dispatchBuffered(socket, decoder, arena);
+}
+
+template <typename Handler>
+int Endpoint<Handler>::dispatchBuffered(int socket, FrameDecoder &decoder,
+                                        Arena &arena)
+{
+    int frames = 0;
+    // Replies to every frame in the buffer are encoded into one of the
+    // connection's buffers and sent together once parsing is done.
+    OutputBuffer output;
+    std::string &replies = arena.acquire(decoder.size());
+    output.bytes.swap(replies);
+    Frame frame;
+
+    int err;
+    while ((err = nextFrame(socket, decoder, arena, frame)) > 0)
+    {
+        if (dispatch(frame, output) < 0)
+        {
+            frame.error = "Operation does not accept chunks.";
+            err = -1;
+            break;
+        }
+        decoder.consume(frame.length);
+        frames++;
+    }
+
+    if (err < 0)
+    {
+        // The error answers the rejected frame, in its version when its
+        // header could be read.
+        Message error = {ERROR, frame.error, "", "", frame.message.requestId};
+        if (frame.message.version != 0)
+        {
+            queueMessage(output, error, frame.message.version);
+        }
+        else
+        {
+            queueMessage(output, error);
+        }
+    }
+    int sent = flush(socket, output);
+
+    // The replies are written, so every buffer can go back to the pool.
+    output.bytes.swap(replies);
+    arena.reset();
+    return err < 0 || sent < 0 ? -1 : frames;
+}
+
+template <typename Handler>
+int Endpoint<Handler>::dispatch(const Frame &frame, OutputBuffer &output)
+{
+    static constexpr auto routes = std::make_index_sequence<std::size(Handler::callbacks)>();
+    static constexpr std::array<Thunk, MAX_OPCODES> table = buildTable(routes);
+    static constexpr uint32_t streaming = buildStreaming(routes);
+
+    OpCode operation = frame.message.operation;
+    // Chunks only come with the packed header, whose operations all have a
+    // slot.
+    if (frame.message.chunk && !(streaming & (1u << operation)))
+    {
+        return -1;
+    }
+
+    Thunk callback = operation < MAX_OPCODES ? table[operation] : nullptr;
+    if (callback != nullptr)
+    {
+        MessageView message = frame.message;
+        message.endpoint = this;
+        message.replies = &output;
+        message.acceptsCompressed = frame.acceptsCompressed;
+        queueReply(frame, callback(*handler, message), output);
+    }
+    else if (operation == HELLO)
+    {
+        queueReply(frame, answerHello(frame.message), output);
+    }
+    else if (operation == PING || operation == PONG || operation == UNSUPPORTED_OP)
+    {
+        queueReply(frame, {operation == PING ? PONG : NO_RETURN}, output);
+    }
+    // Otherwise return an unsupported operation message.
+    else
+    {
+        queueReply(frame, {UNSUPPORTED_OP}, output);
+    }
+    return 0;
+}
@@ -4,107 +4,657 @@
  * sends messages to users on demand.
  * 
  * This class uses the `Network` class to handle parsing the wire protocol, and
- * registers each function as a callback for the various operation it chooses
- * to handle.
+ * lists each function as the callback for the various operation it chooses to
+ * handle in its `callbacks` table.
 */
 
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
-#include <queue>
 
+#include "address.hpp"
+#include "epoch.hpp"
+#include "eventLoop.hpp"
+#include "mailbox.hpp"
 #include "network.hpp"
+#include "snapshot.hpp"
+#include "timerWheel.hpp"
+#include "userRegistry.hpp"
+#include "writeAheadLog.hpp"
 
 #define PORT 8080
+// Limit on requests that only carry a username or search string.
+#define MAX_NAME_FRAME_LENGTH 4096
+// Most users in one `LIST_PAGE`.
+#define MAX_LIST_PAGE_SIZE 10000
+// Most bytes of senders and messages handed over in one `SEND`. Messages past
+// it stay queued for the next request or push.
+#define MAX_DELIVERY_BYTES (1 << 20)
+// Most streamed messages one connection may be sending at once. Clients send
+// a message's chunks back to back, so they only ever have one in flight.
+#define MAX_PARTIAL_MESSAGES 4
 
 class Server
 {
 public:
+
+    /**
+     * How client connections are serviced.
+     *
+     * `THREAD_PER_CONNECTION` spawns a detached thread running blocking reads
+     * for every client. `EVENT_LOOP` multiplexes every client over a fixed set
+     * of epoll event-loop threads. `URING_LOOP` does the same with io_uring
+     * event loops that batch sends and receives across connections.
+    */
+    enum Mode
+    {
+        THREAD_PER_CONNECTION,
+        EVENT_LOOP,
+        URING_LOOP
+    };
+
+    /**
+     * Server configuration.
+    */
+    struct Options
+    {
+        // How client connections are serviced.
+        Mode mode = THREAD_PER_CONNECTION;
+        // Number of event loops in the event-loop modes. 0 uses one per core.
+        int loopThreads = 0;
+        // Payloads of at least this many bytes are sent with `MSG_ZEROCOPY`.
+        // 0 disables zero-copy sends.
+        size_t zeroCopyThreshold = 0;
+        // Reply payloads of at least this many bytes are compressed for
+        // clients that accept it. 0 disables compression.
+        size_t compressionThreshold = 4096;
+        // Largest `SEND` and `SEND_BATCH` frame accepted. Other requests only
+        // carry a username and are limited to `MAX_NAME_FRAME_LENGTH`.
+        size_t maxFrameLength = 1 << 20;
+        // Largest message a streamed `SEND` may add up to, counting its
+        // sender and receiver. Also bounds the bytes of every message one
+        // connection is streaming at once.
+        size_t maxMessageLength = 64 << 20;
+        // Connections each listening socket queues before they are accepted.
+        // The kernel caps this at `net.core.somaxconn`.
+        int backlog = 1024;
+        // Acceptor threads run by `serve()`. Over TCP each acceptor listens on
+        // its own `SO_REUSEPORT` socket, a Unix domain socket is shared.
+        int acceptors = 1;
+        // Connections that received nothing for this long are closed. 0 keeps
+        // them open indefinitely.
+        uint64_t idleTimeoutMillis = 0;
+        // Connections that received nothing for this long are sent a `PING`,
+        // which live clients answer. 0 disables heartbeats.
+        uint64_t heartbeatMillis = 0;
+        // In the event-loop modes, a connection stops being read once more
+        // than this many reply bytes wait for the peer to read them, and is
+        // read again once no more than `outboundLowWater` are left. 0 never
+        // pauses connections.
+        size_t outboundHighWater = 1 << 20;
+        size_t outboundLowWater = 256 << 10;
+        // Independently locked shards of the account registry.
+        size_t registryShards = UserRegistry::DEFAULT_SHARDS;
+        // Directory holding the write-ahead log and the latest snapshot.
+        // Accounts and mailboxes are rebuilt from them on start. Empty keeps
+        // state in memory only.
+        std::string dataDirectory;
+        // How durable a change is before its request is answered, and how
+        // long a `BATCHED` group commit waits for more changes to join it.
+        WriteAheadLog::Durability durability = WriteAheadLog::BATCHED;
+        uint64_t commitWindowMicros = 0;
+        // Time between snapshots taken in the background. 0 only takes them
+        // when `snapshot()` is called.
+        uint64_t snapshotIntervalMillis = 0;
+        // Bytes of undelivered messages kept in memory. Past it, the mailboxes
+        // drained least recently are spilled to disk. 0 keeps every message
+        // in memory.
+        uint64_t mailboxBudgetBytes = 0;
+        // Where spilled mailboxes are written. Empty uses `spill` in
+        // `dataDirectory`, or a temporary directory without one.
+        std::string spillDirectory;
+    };
+
+    /**
+     * Connections accepted by one acceptor, and their average rate since the
+     * server started.
+    */
+    struct AcceptorStats
+    {
+        uint64_t accepted;
+        double acceptsPerSecond;
+    };
+
     Server(int port);
 
+    Server(int port, Options options);
+
+    /**
+     * Listens on `address`, which may also be a Unix domain socket.
+    */
+    Server(const Address &address, Options options);
+
+    ~Server();
+
     ///////////////////// Server functions /////////////////////
 
     /**
-     * Accepts a client connection and spawns a thread to handle requests for
-     * that client. This function returns once the connection has been accepted
-     * and the thread has been spawned. The thread will terminate itself once
-     * the client disconnects.
+     * Accepts a client connection and hands it off to be serviced. In
+     * `THREAD_PER_CONNECTION` mode this spawns a thread to handle requests for
+     * that client, which terminates itself once the client disconnects. In
+     * `EVENT_LOOP` mode the connection is assigned round-robin to one of the
+     * event loops in the acceptor's shard. This function returns once the
+     * connection has been handed off.
+     *
+     * The first overload accepts on the first acceptor.
     */
     int acceptClient();
 
+    int acceptClient(size_t acceptor);
+
+    /**
+     * Runs one thread accepting clients per acceptor until `stopServer()` is
+     * called.
+    */
+    void serve();
+
+    /**
+     * Accept counters of every acceptor, to check that the kernel balances
+     * new connections across them.
+    */
+    std::vector<AcceptorStats> getAcceptorStats();
+
+    /**
+     * Connects an in-process client without going through the listening
+     * socket or TCP: the server services one end of a socket pair like an
+     * accepted connection and the other end is returned, ready for
+     * `Client(int socket)`.
+     *
+     * @return  The client's end of the connection.
+     *          -1 on socketpair() errors.
+    */
+    int connectLoopback();
+
     /**
-     * Closes the listening socket and cleans up resources.
+     * Closes the listening sockets, which also wakes the acceptors blocked in
+     * `acceptClient()`, and cleans up resources.
     */
     void stopServer();
 
+    /**
+     * Total number of syscalls issued by the transports moving client data.
+    */
+    uint64_t getSyscalls();
+
+    /**
+     * Number of connections closed for being idle.
+    */
+    uint64_t getIdleEvictions();
+
+    /**
+     * Outbound queue counters summed over the event loops. The peak is the
+     * largest queue any single connection reached.
+    */
+    OutboundStats getOutboundStats();
+
+    /**
+     * Compression counters for replies sent by every connection mode.
+    */
+    inline CompressionStats &getCompressionStats()
+    {
+        return network.getCompressionStats();
+    }
+
+    /**
+     * Writes a snapshot of the accounts and mailboxes to the data directory
+     * while requests keep being served, then removes the log segments it
+     * covers. Only one snapshot is written at a time.
+     *
+     * @return  0 on success, -1 without a data directory or if writing failed.
+    */
+    int snapshot();
+
+    /**
+     * Write-ahead log counters. All zero without a data directory.
+    */
+    WriteAheadLog::Stats getLogStats();
+
+    /**
+     * Bytes of undelivered messages held in memory. Spilled messages are not
+     * counted.
+    */
+    uint64_t getQueuedBytes();
+
+    /**
+     * Scratch buffer pool counters of the whole process.
+    */
+    inline PoolStats &getPoolStats()
+    {
+        return BufferPool::getStats();
+    }
+
     //////////////////// Business functions ////////////////////
 
     /**
      * Creates an account using the data in `info`.
     */
-    Network::Message createAccount(Network::Message info);
+    Network::Message createAccount(const Network::MessageView &info);
+
+    /**
+     * Returns a list of users, in sorted order. This list can be searched by
+     * substring using the `data` field of `requester`.
+    */
+    Network::Message listAccounts(const Network::MessageView &requester);
 
     /**
-     * Returns a list of users. This list can be searched by substring using
-     * the `data` field of `requester`.
+     * Returns the page of users described by the `ListPage` in the `data`
+     * field of `requester`. The cursor encodes the last user of the previous
+     * page, so pages stay in order and never repeat a user while accounts
+     * come and go. Each page walks the registry's ordered index from the
+     * cursor and stops once it is full, so only one page is ever kept in
+     * memory, streamed or not. An event loop streams one page per turn and
+     * holds the rest back while the connection is paused.
     */
-    Network::Message listAccounts(Network::Message requester);
+    Network::Message listPage(const Network::MessageView &requester);
 
     /**
      * Deletes the account specified by `requester`.
     */
-    Network::Message deleteAccount(Network::Message requester);
+    Network::Message deleteAccount(const Network::MessageView &requester);
 
     /**
      * Sends the message specified by `message` to a recepient. If the recepient
-     * is not currently logged in, the message is backlogged and delivered when
-     * they logged in.
+     * is subscribed the message is pushed to their connection right away,
+     * otherwise it is backlogged and delivered when they log in. Messages
+     * for users that do not exist are refused. Streamed messages are
+     * assembled chunk by chunk and sent once complete.
+    */
+    Network::Message sendMessage(const Network::MessageView &message);
+
+    /**
+     * Queues every entry of the `SEND_BATCH` in `batch`. Entries are grouped
+     * by recipient so each mailbox is locked once. Entries for unknown users
+     * are rejected with an `ERROR` status.
+    */
+    Network::Message sendBatch(const Network::MessageView &batch);
+
+    /**
+     * Returns the next messages for the user specified in `requester`, at most
+     * `MAX_DELIVERY_BYTES` of them and one more. The rest stay queued, even
+     * when they were spilled, and are returned by the next request.
+    */
+    Network::Message requestMessages(const Network::MessageView &requester);
+
+    /**
+     * Pushes messages for the user specified in `subscriber` to the connection
+     * the request arrived on from now on, and returns those already waiting.
+     * A backlog too large for one reply follows in pushes.
     */
-    Network::Message sendMessage(Network::Message message);
+    Network::Message subscribe(const Network::MessageView &subscriber);
 
     /**
-     * Returns the next message for the user specified in `requester`.
+     * Handles the `UNSUPPORTED_OP` a client answers a `PING` with when it
+     * predates heartbeats. The connection is not pinged again, so it is only
+     * evicted by the idle timeout rather than kept alive by its answers.
     */
-    Network::Message requestMessages(Network::Message requester);
+    Network::Message refusedOperation(const Network::MessageView &reply);
+
+    /**
+     * The operations this class handles, dispatched by `Endpoint<Server>`.
+    */
+    static constexpr Network::Route<Server> callbacks[] = {
+        {Network::CREATE, &Server::createAccount},
+        {Network::DELETE, &Server::deleteAccount},
+        {Network::SEND, &Server::sendMessage, true},
+        {Network::LIST, &Server::listAccounts},
+        {Network::REQUEST, &Server::requestMessages},
+        {Network::SEND_BATCH, &Server::sendBatch},
+        {Network::SUBSCRIBE, &Server::subscribe},
+        {Network::LIST_PAGE, &Server::listPage},
+        {Network::UNSUPPORTED_OP, &Server::refusedOperation}
+    };
 
 private:
 
     /**
-     * Listening socket.
+     * The address the server listens on, and a listening socket per acceptor.
+     * In the event-loop modes acceptor `i` of `n` owns the loops whose index
+     * is `i` modulo `n`, so acceptors never contend for the same loops.
     */
-    int serverFd;
+    struct Acceptor
+    {
+        size_t index;
+        int socket;
+        std::atomic<uint64_t> accepted{0};
+        // Picks the next loop of this acceptor's shard round-robin.
+        std::atomic<size_t> nextLoop{0};
+    };
+    Address address;
+    std::vector<std::unique_ptr<Acceptor>> acceptors;
+    std::chrono::steady_clock::time_point startTime;
 
     /**
      * Controls how long to run client processing threads.
     */
     std::atomic<bool> serverRunning;
 
+    /**
+     * Connection servicing mode and, in the event-loop modes, the loops that
+     * accepted connections are distributed across.
+    */
+    Mode mode;
+    std::vector<std::unique_ptr<EventLoop>> loops;
+
+
+    /**
+     * Stores the list of user accounts, sharded so that account operations on
+     * different users do not contend.
+    */
+    UserRegistry users;
+
+    /**
+     * The snapshot the server started from. Mailboxes not used since stay in
+     * it until they are.
+    */
+    std::unique_ptr<Snapshot> restored;
+
+    /**
+     * Stores the undelivered messages for each user. Senders and readers only
+     * touch a mailbox inside an `Epoch::Guard`.
+    */
+    MailboxDirectory mailboxes;
+
+    /**
+     * Keeps the messages held in memory near `mailboxBudget` bytes, if it is
+     * not 0. A push past the budget wakes `spillThread`, which spills the
+     * coldest mailboxes to `spillDirectory` until they hold three quarters of
+     * it. Spill files are scratch space, so the directory is emptied on
+     * start.
+    */
+    uint64_t mailboxBudget;
+    std::string spillDirectory;
+    // Whether the directory was made for this server and goes with it.
+    bool temporarySpillDirectory;
+    std::mutex spillLock;
+    std::condition_variable spillWake;
+    std::thread spillThread;
 
     /**
-     * Stores the list of user accounts.
+     * Records every account and mailbox change when `dataDirectory` is set.
+     * Changes hold `changeGate` shared while they are applied and logged, so
+     * a snapshot can cut the log where no change is half done. They are
+     * answered once their record is durable, which is not waited for under
+     * the gate.
     */
-    std::unordered_set<std::string> userList;
-    std::mutex userListLock;
+    std::string dataDirectory;
+    std::unique_ptr<WriteAheadLog> log;
+    std::shared_mutex changeGate;
+    std::mutex snapshotLock;
+    std::condition_variable snapshotWake;
+    std::thread snapshotThread;
 
     /**
-     * Stores the undelivered messages for each user.
+     * Serializes deleting a user with queueing messages for them, so a message
+     * that found the user registered is never queued into a mailbox the
+     * deletion already erased. Users share the locks by hash, and each is
+     * taken inside `changeGate`.
     */
-    std::unordered_map<std::string, std::queue<Network::Message>> messages;
-    std::unordered_map<std::string, std::mutex> messages_lock;
+    static const size_t USER_LOCK_STRIPES = 64;
+    std::mutex userLocks[USER_LOCK_STRIPES];
+    std::mutex &userLock(std::string_view user);
 
     /**
      * The network instance acting as the data-link layer.
     */
-    Network network;
+    Endpoint<Server> network;
+
+    /**
+     * Streamed messages one connection is still sending, by request ID, and
+     * the bytes they hold between them. A refused message is kept as an
+     * `ERROR` with no data until its last chunk arrives, so the rest of it is
+     * dropped.
+    */
+    struct PartialMessages
+    {
+        std::unordered_map<uint64_t, Network::Message> messages;
+        size_t bytes = 0;
+    };
+    std::unordered_map<int, PartialMessages> partialMessages;
+    std::mutex partialMessagesLock;
+    size_t maxMessageLength;
+
+    /**
+     * Connections that receive their users' messages as they arrive.
+     * `subscribers` maps each user to their connection and `subscribedUsers`
+     * maps back. `connectionLoops` records which event loop owns each
+     * connection in the event-loop modes, and a serial that tells the
+     * connection apart from later ones reusing its socket.
+    */
+    struct Subscription
+    {
+        int socket;
+        // Protocol version the subscriber speaks.
+        uint32_t version;
+        // Loop that owns the connection. nullptr in `THREAD_PER_CONNECTION`.
+        EventLoop *loop;
+    };
+    std::unordered_map<std::string, Subscription> subscribers;
+    std::unordered_map<int, std::string> subscribedUsers;
+    struct LoopConnection
+    {
+        EventLoop *loop;
+        uint64_t serial;
+    };
+    std::unordered_map<int, LoopConnection> connectionLoops;
+    uint64_t nextConnectionSerial = 0;
+
+    /**
+     * The event loop owning `socket` and its connection's serial, or nullptr
+     * if no loop does.
+    */
+    EventLoop *owningLoop(int socket, uint64_t &serialOut);
+
+    /**
+     * Whether `socket` still belongs to the connection numbered `serial`.
+    */
+    bool connectionOpen(int socket, uint64_t serial);
+
+    /**
+     * A `LIST_PAGE` stream to a loop connection, resumed from `after` by a
+     * task posted to the loop for every page.
+    */
+    struct PageStream
+    {
+        EventLoop *loop;
+        int socket;
+        uint64_t serial;
+        uint32_t version;
+        uint64_t requestId;
+        std::string query;
+        std::string after;
+        size_t pageSize;
+    };
+
+    /**
+     * Reads up to `pageSize` users containing `query` that follow `after`,
+     * moves `after` to the last of them and sets `cursorOut` to the cursor of
+     * the next page, empty if none follows.
+     *
+     * @return  The page as a newline-separated list.
+    */
+    std::string readPage(std::string_view query, std::string &after, size_t pageSize,
+                         std::string &cursorOut);
+
+    /**
+     * Posts the task sending the next page of `stream`.
+    */
+    void postNextPage(std::shared_ptr<PageStream> stream);
+    std::mutex subscribersLock;
+
+    /**
+     * Rebuilds the accounts and mailboxes from the write-ahead log in
+     * `directory` and keeps the log open for new changes.
+    */
+    void recover(const std::string &directory, const Options &options);
+
+    /**
+     * Appends `record` to the write-ahead log, if there is one, without
+     * waiting for it to be committed.
+     *
+     * @return  The record's sequence number, or 0 without a log.
+    */
+    uint64_t logChange(WriteAheadLog::Record record);
+
+    /**
+     * Answers `request` with `reply` once the record numbered `sequence` is
+     * committed. Connections of an event loop get `reply` posted to them by
+     * the log's flusher, so the loop goes on serving while the batch syncs,
+     * and `NO_RETURN` is returned. Others wait for the commit, as do
+     * version 1 requests, whose replies must keep the order of the requests.
+     * Must be called without `changeGate` held.
+    */
+    Network::Message replyWhenDurable(const Network::MessageView &request, uint64_t sequence,
+                                      Network::Message reply);
+
+    /**
+     * Holds `changeGate` for a change, if there is a log.
+    */
+    std::shared_lock<std::shared_mutex> changing();
+
+    /**
+     * Writes a snapshot with `snapshotLock` held.
+    */
+    int writeSnapshot();
+
+    /**
+     * Thread function that takes a snapshot every `interval` milliseconds.
+    */
+    void snapshotPeriodically(uint64_t interval);
+
+    /**
+     * Creates the spill directory, or empties the one a previous run left.
+    */
+    void openSpillDirectory(const Options &options);
+
+    /**
+     * Wakes `spillThread` if the mailboxes hold more than the budget.
+    */
+    void checkMailboxBudget();
+
+    /**
+     * Thread function that spills mailboxes while they hold more than the
+     * budget.
+    */
+    void spillOverBudget();
+
+    /**
+     * Adds `message` to its receiver's mailbox and pushes it if they are
+     * subscribed.
+    */
+    Network::Message deliver(const Network::MessageView &message);
+
+    /**
+     * Sets `idOut` to the ID of `sender` in `Usernames`, if `sender` is a
+     * registered account and can be interned.
+     *
+     * @return  `OK`, or the `ERROR` to refuse the message with.
+    */
+    Network::Message internSender(std::string_view sender, uint32_t &idOut);
+
+    /**
+     * Appends a chunk of a streamed `SEND` to the message it belongs to, and
+     * delivers the message once its last chunk arrives. A message is refused
+     * with an `ERROR` as soon as its connection has more than
+     * `MAX_PARTIAL_MESSAGES` messages or `maxMessageLength` bytes in flight,
+     * and the rest of its chunks are dropped.
+    */
+    Network::Message receiveChunk(const Network::MessageView &chunk);
+
+    /**
+     * Delivers the waiting messages of `user` if they are subscribed.
+    */
+    void pushMessages(const std::string &user);
+
+    /**
+     * Drains the next `MAX_DELIVERY_BYTES` of the mailbox of `user` into a
+     * `SEND`, and logs their delivery. `moreOut` is set if messages are left.
+    */
+    Network::Message takeMessages(const std::string &user, bool &moreOut);
+
+    /**
+     * Forgets the subscription and partial messages of a connection that is
+     * being closed.
+    */
+    void connectionClosed(int socket);
+
+    /**
+     * Hands the connected `clientSocket` off to be serviced by `acceptor`'s
+     * shard, as described for `acceptClient()`.
+    */
+    int addConnection(int clientSocket, Acceptor &acceptor);
 
     /**
      * Thread function that is spawned to handle each client connection.
     */
     int processClient(int socket);
+
+    /**
+     * Sends the mailbox of the user `socket` is subscribed to, from the
+     * thread servicing `socket` in `THREAD_PER_CONNECTION` mode.
+     *
+     * @return  Socket send() errors.
+    */
+    int deliverPushes(int socket);
+
+    /**
+     * Sends a heartbeat `PING` on `socket`, from the thread servicing it in
+     * `THREAD_PER_CONNECTION` mode, so it never lands inside a reply.
+     *
+     * @return  -1 if the peer stopped reading and should be evicted.
+    */
+    int sendPing(int socket);
+
+    /**
+     * Connections serviced by their own thread in `THREAD_PER_CONNECTION`
+     * mode, with when they last received data and were last pinged. Their
+     * threads block in reads, so `stopServer()` shuts the sockets down to
+     * end them, and `reapIdle()` does the same to idle ones. The timers are
+     * guarded by `threadConnectionsLock` too.
+     *
+     * Every connection gets an eventfd that `pushMessages()` and `reapIdle()`
+     * signal, so pushes and pings are sent by the connection's own thread.
+     * Nothing else writes to the socket, and a peer that stops reading only
+     * ever blocks its own thread.
+    */
+    struct ThreadConnection
+    {
+        std::atomic<uint64_t> lastActive;
+        uint64_t lastPing;
+        bool answersPings = true;
+        std::atomic<bool> pingDue{false};
+        int wakeFd = -1;
+    };
+    std::unordered_map<int, ThreadConnection> threadConnections;
+    std::mutex threadConnectionsLock;
+    IdlePolicy idlePolicy;
+    TimerWheel idleTimers;
+    std::atomic<uint64_t> idleEvictions;
+    std::condition_variable reaperWake;
+    std::thread reaperThread;
+
+    /**
+     * Thread function that pings and evicts idle connections in
+     * `THREAD_PER_CONNECTION` mode.
+    */
+    void reapIdle();
 };
@@ -0,0 +1,212 @@
+/**
+ * `Snapshot` is a point-in-time copy of the accounts and mailboxes, written
+ * so that a restarted server can map it with `mmap()` and use it in place
+ * instead of replaying the whole write-ahead log.
+ *
+ * A snapshot records the sequence number of the last log record it covers.
+ * Changes logged after it may or may not be in the snapshot, since it is
+ * written while the server keeps running; replaying them on top gives the
+ * same state either way.
+ *
+ * The file is laid out as
+ * > Header: sequence number, counts, and the offset of each section
+ * > Users: each name's length (4 bytes) followed by the name
+ * > Mailboxes: the receiver's length (4 bytes) and name, followed by each
+ *   message's sequence number (8 bytes), sender length (4 bytes), data length
+ *   (4 bytes), sender and data
+ * > Mailbox table: an open-addressing hash table from receiver to mailbox
+ * > User index: the offset of every `USER_CHUNK`th user
+ *
+ * Integers are in the machine's byte order. On start only the users are read,
+ * spread over threads by the user index. A mailbox is read when it is first
+ * used, and mailboxes that are never used are never paged in.
+ *
+ * The header, the users, the table and the index carry CRC-32 checksums and
+ * are checked on open, along with every offset and length they hold. Each
+ * mailbox carries its own checksum, checked when it is read; a damaged
+ * mailbox is reported and dropped.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mailbox.hpp"
+
+class Snapshot : public MailboxSource
+{
+public:
+
+    // Users between two entries of the user index.
+    static const uint64_t USER_CHUNK = 4096;
+
+    /**
+     * Streams a snapshot to a temporary file and moves it to its path once it
+     * is complete and synced, so a crash never leaves a partial snapshot.
+     * Users must all be added before the first mailbox.
+    */
+    class Writer
+    {
+    public:
+
+        /**
+         * Starts the snapshot to be stored at `path`, covering the log up to
+         * the record numbered `sequence`.
+        */
+        Writer(const std::string &path, uint64_t sequence);
+
+        /**
+         * Removes the temporary file unless the snapshot was committed.
+        */
+        ~Writer();
+
+        Writer(const Writer &) = delete;
+        Writer &operator=(const Writer &) = delete;
+
+        void addUser(std::string_view user);
+
+        /**
+         * Starts the mailbox of `user`. The messages added next belong to it.
+        */
+        void beginMailbox(std::string_view user);
+
+        void addMessage(uint64_t sequence, std::string_view sender, std::string_view data);
+
+        /**
+         * Writes the mailbox table and user index, syncs the file and moves
+         * it into place.
+         *
+         * @return  0 on success, -1 if any write failed.
+        */
+        int commit();
+
+    private:
+
+        struct Entry
+        {
+            uint64_t hash;
+            uint64_t offset;
+            uint64_t count;
+            uint64_t length;
+            uint64_t checksum;
+        };
+
+        void emit(const void *bytes, size_t length);
+
+        /**
+         * Records the length and checksum of the users, or of the mailbox
+         * being written, and starts the checksum of what follows.
+        */
+        void endSection();
+
+        int flush();
+
+        std::string path;
+        std::string temporaryPath;
+        int fd;
+        bool failed;
+        bool committed;
+        // Bytes not written yet, and the file offset they end at.
+        std::string buffer;
+        uint64_t offset;
+        uint64_t sequence;
+        uint64_t userCount;
+        uint64_t messageCount;
+        std::vector<uint64_t> userIndex;
+        std::vector<Entry> mailboxes;
+        // Where the mailboxes start, 0 until the users end, and the checksum
+        // of the section being written.
+        uint64_t mailboxesOffset;
+        uint32_t running;
+        uint32_t usersChecksum;
+    };
+
+    /**
+     * Maps the snapshot at `path` and checks it.
+     *
+     * @return  nullptr if there is none, or it is cut short or damaged.
+    */
+    static std::unique_ptr<Snapshot> open(const std::string &path);
+
+    ~Snapshot();
+
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    /**
+     * Sequence number of the last log record the snapshot covers.
+    */
+    uint64_t getSequence() const;
+
+    uint64_t getUserCount() const;
+
+    uint64_t getMailboxCount() const;
+
+    uint64_t getMessageCount() const;
+
+    /**
+     * Passes every user to `visit`, from `threads` threads at once.
+    */
+    void forEachUser(int threads, const std::function<void(std::string_view user)> &visit);
+
+    bool contains(const std::string &user) override;
+
+    void load(const std::string &user, Mailbox *mailbox) override;
+
+    /**
+     * Passes the messages of `user` to `visit` in order, unless they were
+     * handed over already. Hands them over either way.
+     *
+     * @return  Whether any were passed.
+    */
+    bool take(std::string_view user,
+              const std::function<void(uint64_t sequence, std::string_view sender,
+                                       std::string_view data)> &visit);
+
+    /**
+     * Adds the mailboxes not handed over yet to `writer`.
+     *
+     * @return  Which mailboxes were added, for `copied()`.
+    */
+    std::vector<bool> copyTo(Writer &writer);
+
+    /**
+     * Whether `copyTo()` added the mailbox of `user`.
+    */
+    bool copied(const std::vector<bool> &added, std::string_view user) const;
+
+private:
+
+    Snapshot() = default;
+
+    /**
+     * Whether the checksums of the mapped file match, and its sections and
+     * the offsets in them stay within it.
+    */
+    bool valid() const;
+
+    /**
+     * Index of the mailbox table slot of `user`, or -1 if it has none.
+    */
+    int64_t slotOf(std::string_view user) const;
+
+    /**
+     * Passes the messages of the mailbox in `slot` to `visit`.
+     *
+     * @return  false, without passing any, if the mailbox is damaged.
+    */
+    bool visitMailbox(int64_t slot,
+                      const std::function<void(uint64_t sequence, std::string_view sender,
+                                               std::string_view data)> &visit) const;
+
+    const char *base = nullptr;
+    size_t length = 0;
+    // Whether each mailbox was handed over.
+    std::unique_ptr<std::atomic<bool>[]> taken;
+};
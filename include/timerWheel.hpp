@@ -0,0 +1,149 @@
+/**
+ * `TimerWheel` keeps one timer per ID, for example per connection, with O(1)
+ * `schedule()` and `cancel()` however many timers are pending.
+ *
+ * Time is cut into ticks of `tickMillis`. The wheel has `WHEEL_LEVELS` levels
+ * of `WHEEL_SLOTS` slots each: a slot of level 0 holds the timers due in one
+ * tick, a slot of level `n` those due in a span of `WHEEL_SLOTS^n` ticks.
+ * Whenever `advance()` enters a new span, the slot of the level above holding
+ * it is cascaded down, so each timer moves at most `WHEEL_LEVELS - 1` times
+ * before it fires. Timers further out than the top level covers wait in its
+ * last slot and are placed again when it cascades.
+ *
+ * Timers fire at most one tick late and never early.
+ *
+ * `IdlePolicy` decides what happens to a connection whose idle timer fired.
+ * Connections only record when they last received something; the timer is
+ * moved lazily when it fires, so traffic never touches the wheel.
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+class TimerWheel
+{
+public:
+
+    /**
+     * Creates a wheel whose first tick starts at `start`.
+    */
+    TimerWheel(uint64_t tickMillis = 10);
+
+    TimerWheel(uint64_t tickMillis, uint64_t start);
+
+    /**
+     * Milliseconds on the monotonic clock, the time base of every wheel.
+    */
+    static uint64_t now();
+
+    /**
+     * Sets the timer for `id` to fire at `deadline`, replacing the one it had.
+     * A deadline already passed fires on the next tick.
+    */
+    void schedule(uint64_t id, uint64_t deadline);
+
+    /**
+     * Removes the timer for `id`, if any.
+    */
+    void cancel(uint64_t id);
+
+    /**
+     * Fires every timer due at `now` by passing its ID to `expired`, which
+     * may schedule and cancel timers itself. A fired timer is removed unless
+     * `expired` schedules it again.
+    */
+    void advance(uint64_t now, const std::function<void(uint64_t id)> &expired);
+
+    /**
+     * Milliseconds from `now` until `advance()` has work to do, for use as a
+     * poll timeout.
+     *
+     * @return  -1 if no timer is pending.
+    */
+    int timeoutMillis(uint64_t now) const;
+
+    inline size_t size() const
+    {
+        return timers.size();
+    }
+
+private:
+
+    static constexpr uint64_t NONE = UINT64_MAX;
+    // Slot of timers taken out of the wheel to be fired.
+    static constexpr uint32_t DETACHED = UINT32_MAX;
+
+    /**
+     * Pending timer, linked into the list of the slot it waits in.
+    */
+    struct Timer
+    {
+        uint64_t tick;
+        uint32_t slot;
+        uint64_t prev;
+        uint64_t next;
+    };
+
+    /**
+     * Links `id` into the slot its tick falls in, relative to `nextTick`.
+    */
+    void place(uint64_t id, Timer &timer);
+
+    void unlink(Timer &timer);
+
+    /**
+     * Detaches the list of `slot` and returns its first ID.
+    */
+    uint64_t takeSlot(uint32_t slot);
+
+    uint64_t tickMillis;
+    // First tick `advance()` has not processed yet.
+    uint64_t nextTick;
+
+    std::array<uint64_t, WHEEL_LEVELS * WHEEL_SLOTS> slots;
+    std::unordered_map<uint64_t, Timer> timers;
+    // IDs being fired by `advance()`, kept to reuse the allocation.
+    std::vector<uint64_t> firing;
+};
+
+/**
+ * Idle connection handling. A connection that received nothing for
+ * `heartbeatMillis` is sent a `PING`, and another one every `heartbeatMillis`
+ * it stays silent. A connection that received nothing for `idleMillis`,
+ * including the `PONG` a live peer answers with, is evicted. 0 disables
+ * either.
+*/
+struct IdlePolicy
+{
+    uint64_t idleMillis = 0;
+    uint64_t heartbeatMillis = 0;
+
+    enum Action
+    {
+        WAIT,
+        PING,
+        EVICT
+    };
+
+    inline bool enabled() const
+    {
+        return idleMillis > 0 || heartbeatMillis > 0;
+    }
+
+    /**
+     * Decides what to do at `now` with a connection that last received data
+     * at `lastActive` and was last pinged at `lastPing`. `deadlineOut` is set
+     * to when to check the connection again, assuming the action is taken.
+    */
+    Action check(uint64_t lastActive, uint64_t lastPing, uint64_t now,
+                 uint64_t &deadlineOut) const;
+};
@@ -0,0 +1,382 @@
+/**
+ * `Transport` is the byte-moving layer underneath `Network`. `Network` decides
+ * what goes on the wire; the transport decides how the bytes reach the kernel.
+ * Two backends are provided:
+ *
+ * 1. `SocketTransport` issues a plain `sendmsg()`/`readv()` syscall for every
+ *    call. It is the default and works with blocking and non-blocking sockets.
+ *    Each send is written whole even if other threads send on the same socket.
+ *    A queueing transport never waits for a non-blocking socket to become
+ *    writable: whatever the socket cannot take is queued until `drain()`.
+ *    Zero-copy sends use `MSG_ZEROCOPY` and keep their payloads alive until
+ *    the kernel reports on the socket's error queue that it is done with them.
+ * 2. `UringTransport` batches work through an io_uring instance. Sends are
+ *    copied into registered buffers and queued; `flush()` submits the sends of
+ *    every connection in a single `io_uring_enter()`. Sockets registered with
+ *    `watch()` get a multishot receive that draws from a provided buffer ring,
+ *    so one submission keeps delivering data until the peer disconnects.
+ *    Completions for every watched connection are reaped in batches by
+ *    `wait()`.
+ *
+ * Each transport counts the syscalls it issues so the backends can be compared
+ * under the same load. A `UringTransport` is not thread safe and must only be
+ * used by the event loop that owns it.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+
+    /**
+     * Sends the `count` buffers in `iov` on `socket`, in order, as one write.
+     * Backends that batch may only queue the data until `flush()`.
+     *
+     * @return  Number of bytes sent or queued.
+     *          Socket send() errors.
+     */
+    virtual int send(int socket, const struct iovec *iov, int count) = 0;
+
+    /**
+     * Like `send()`, but the buffers owned by `hold` may be sent without being
+     * copied. The transport keeps `hold` alive until the kernel no longer needs
+     * it. Backends without zero-copy support simply copy.
+     *
+     * @return  Number of bytes sent or queued.
+     *          Socket send() errors.
+     */
+    virtual int sendZeroCopy(int socket, const struct iovec *iov, int count,
+                             std::vector<std::shared_ptr<std::string>> hold)
+    {
+        return send(socket, iov, count);
+    }
+
+    /**
+     * Waits until data is available on `socket` (unless it is non-blocking)
+     * and reads as much as fits into the `count` buffers of `iov`.
+     *
+     * @return  Number of bytes read, 0 on disconnect.
+     *          Socket read() errors.
+     */
+    virtual int receive(int socket, const struct iovec *iov, int count) = 0;
+
+    /**
+     * Pushes any queued sends to the kernel.
+     *
+     * @return  Submission errors.
+     */
+    virtual int flush()
+    {
+        return 0;
+    }
+
+    /**
+     * Number of bytes sent on `socket` that the kernel has not taken yet.
+     */
+    virtual size_t queued(int socket)
+    {
+        return 0;
+    }
+
+    /**
+     * Writes as many of the bytes queued for `socket` as the socket takes
+     * without blocking.
+     *
+     * @return  Number of bytes still queued.
+     *          Socket send() errors.
+     */
+    virtual int drain(int socket)
+    {
+        return 0;
+    }
+
+    /**
+     * Processes completion notifications the kernel queued on `socket`, such
+     * as finished zero-copy sends.
+     */
+    virtual void reapCompletions(int socket)
+    {
+    }
+
+    /**
+     * Drops any state kept for `socket`. Called before the socket is closed.
+     */
+    virtual void forget(int socket)
+    {
+    }
+
+    /**
+     * Total number of syscalls issued by this transport.
+     */
+    inline uint64_t getSyscalls()
+    {
+        return syscalls;
+    }
+
+protected:
+    std::atomic<uint64_t> syscalls{0};
+};
+
+class SocketTransport : public Transport
+{
+public:
+
+    /**
+     * Without `queueing`, sends on a non-blocking socket wait in poll() for it
+     * to become writable. A queueing transport must only be used by one
+     * thread.
+     */
+    SocketTransport(bool queueing = false);
+
+    int send(int socket, const struct iovec *iov, int count) override;
+
+    int sendZeroCopy(int socket, const struct iovec *iov, int count,
+                     std::vector<std::shared_ptr<std::string>> hold) override;
+
+    int receive(int socket, const struct iovec *iov, int count) override;
+
+    void reapCompletions(int socket) override;
+
+    void forget(int socket) override;
+
+    size_t queued(int socket) override;
+
+    int drain(int socket) override;
+
+private:
+
+    /**
+     * Writes every buffer in `iov` with `sendmsg()`, retrying short writes.
+     * `calls` is incremented for every successful `MSG_ZEROCOPY` send.
+     *
+     * @return  Number of bytes sent.
+     *          Socket send() errors.
+     */
+    int sendAll(int socket, const struct iovec *iov, int count, int flags,
+                uint32_t &calls);
+
+    /**
+     * Per-socket zero-copy bookkeeping. The kernel numbers successful
+     * `MSG_ZEROCOPY` sends from 0 and reports ranges of finished ones.
+     */
+    struct ZeroCopyState
+    {
+        bool enabled = false;
+        bool unsupported = false;
+        uint32_t nextId = 0;
+        uint32_t completed = 0;
+        // Payloads still referenced by the kernel, with the first send id that
+        // no longer covers them.
+        std::deque<std::pair<uint32_t, std::vector<std::shared_ptr<std::string>>>> held;
+    };
+
+    /**
+     * Reads completion notifications from `socket`'s error queue and releases
+     * the payloads they cover.
+     */
+    void reapZeroCopy(int socket, ZeroCopyState &state);
+
+    // Zero-copy sends are only used for large payloads, so one lock guarding
+    // their bookkeeping is not contended.
+    std::mutex zeroCopyLock;
+    std::unordered_map<int, ZeroCopyState> zeroCopy;
+
+    // Serializes sends on the same socket, striped by socket number.
+    static const int SEND_LOCK_STRIPES = 64;
+    std::mutex sendLocks[SEND_LOCK_STRIPES];
+
+    /**
+     * Bytes of each socket waiting for `drain()`, written from `offset` on.
+     * A queueing transport belongs to a single event loop, so only its thread
+     * touches them.
+     */
+    struct Outbound
+    {
+        std::string bytes;
+        size_t offset = 0;
+    };
+    bool queueing;
+    std::unordered_map<int, Outbound> outbound;
+};
+
+class UringTransport : public Transport
+{
+public:
+
+    /**
+     * Callback type for data received on a watched socket. `length` is 0 when
+     * the peer disconnected and negative on a receive error.
+     */
+    using ReceiveHandler = std::function<void(int socket, const char *data, int length)>;
+
+    /**
+     * Sets up the ring, the registered send buffers and the provided receive
+     * buffer ring. Check `isReady()` afterwards; the kernel may not support
+     * io_uring or may forbid it.
+     */
+    UringTransport(unsigned entries = 256);
+
+    ~UringTransport();
+
+    inline bool isReady()
+    {
+        return ringFd >= 0;
+    }
+
+    int send(int socket, const struct iovec *iov, int count) override;
+
+    int receive(int socket, const struct iovec *iov, int count) override;
+
+    int flush() override;
+
+    /**
+     * Arms a multishot receive on `socket`. Received data is reported through
+     * the handler passed to `wait()`.
+     */
+    void watch(int socket);
+
+    /**
+     * Forgets `socket`. Completions still in flight for it are discarded. The
+     * caller remains responsible for closing the socket.
+     */
+    void unwatch(int socket);
+
+    /**
+     * Arms a one-shot poll on `fd` so that `wait()` returns once it becomes
+     * readable. Used for the event loop's wakeup eventfd.
+     */
+    void watchWakeup(int fd);
+
+    /**
+     * Stops receiving on the watched `socket`, so the kernel applies flow
+     * control to the peer, until `resumeReceive()`. Data already in flight is
+     * still delivered.
+     */
+    void pauseReceive(int socket);
+
+    void resumeReceive(int socket);
+
+    size_t queued(int socket) override;
+
+    /**
+     * Submits everything queued and blocks until at least one completion is
+     * available, or `timeoutMillis` passed unless it is negative, then reaps
+     * every available completion. Received data is passed to `onReceive`.
+     *
+     * @return  Number of completions reaped.
+     *          io_uring_enter() errors.
+     */
+    int wait(const ReceiveHandler &onReceive, int timeoutMillis = -1);
+
+private:
+
+    /**
+     * Kinds of requests, encoded in the top byte of each SQE's `user_data`.
+     */
+    enum RequestKind : uint64_t
+    {
+        RECV = 1,
+        WRITE,
+        WAKEUP,
+        SYNC_RECV,
+        TIMEOUT,
+        CANCEL
+    };
+
+    /**
+     * Per-socket state. `generation` changes whenever the socket number is
+     * reused so stale completions can be recognised.
+     */
+    struct Connection
+    {
+        uint32_t generation = 0;
+        bool watched = false;
+        // A multishot receive is armed, and whether it should stay armed.
+        bool receiving = false;
+        bool paused = false;
+        // Bytes waiting for a registered send buffer.
+        std::string pending;
+        // Registered send buffer currently being written, -1 if none.
+        int writeSlot = -1;
+        size_t writeOffset = 0;
+        size_t writeLength = 0;
+    };
+
+    struct io_uring_sqe *getSqe();
+
+    /**
+     * Starts a write for every socket that queued data since the last call.
+     */
+    void submitDirty();
+
+    int enter(unsigned toSubmit, unsigned minComplete);
+
+    void armReceive(int socket);
+
+    void submitWrite(int socket);
+
+    void recycleBuffer(uint16_t bufferId);
+
+    uint64_t encode(RequestKind kind, int socket);
+
+    int ringFd;
+
+    // Submission queue ring.
+    void *sqRing;
+    size_t sqRingSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned sqPending;
+
+    // Completion queue ring.
+    void *cqRing;
+    size_t cqRingSize;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+
+    // Registered send buffers, handed out one per in-flight write.
+    char *sendArena;
+    std::vector<int> freeSendSlots;
+
+    // Provided buffer ring backing the multishot receives.
+    struct io_uring_buf_ring *bufferRing;
+    char *receiveArena;
+    uint16_t bufferRingTail;
+
+    std::unordered_map<int, Connection> connections;
+    std::vector<int> dirtySockets;
+    uint32_t nextGeneration;
+    int wakeupFd;
+    bool wakeupArmed;
+    // Read by the kernel when the `TIMEOUT` request of `wait()` is submitted.
+    struct __kernel_timespec timeout;
+
+    // Handler passed to the most recent `wait()`.
+    ReceiveHandler handler;
+
+    // Result of the last synchronous receive.
+    int syncResult;
+    bool syncDone;
+};
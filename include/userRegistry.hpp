@@ -0,0 +1,159 @@
+/**
+ * `UserRegistry` is the set of account names, split into shards that are
+ * locked independently. A username always lives in the shard its hash picks,
+ * so creating, deleting and looking up different users mostly touch
+ * different locks and scale with the number of cores.
+ *
+ * Each shard is guarded by a reader-writer lock: lookups and scans share it,
+ * only `insert()` and `erase()` take it exclusively. `forEach()` visits the
+ * shards one after another and holds a single shard's lock at a time, so a
+ * scan never stalls writers to the rest of the registry. In exchange it sees
+ * each shard as of the moment it reached it, not one snapshot of the whole
+ * registry.
+ *
+ * Each shard also keeps an inverted trigram index of its users: every run of
+ * three bytes in a name maps to the users containing it, and `insert()` and
+ * `erase()` update it along with the set. A user containing a query contains
+ * every trigram of the query, so `search()` only verifies the users found in
+ * all of the query's posting lists instead of every user. Queries shorter
+ * than a trigram fall back to a scan.
+ *
+ * Shards also keep their users in order, so `listAfter()` can page through
+ * the registry by merging the shards from a name onwards, without sorting
+ * or even visiting the users before it. A filtered page reads a shard's
+ * posting lists instead of walking it when they are short.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class UserRegistry
+{
+public:
+
+    static const size_t DEFAULT_SHARDS = 64;
+
+    /**
+     * `shards` is rounded up to a power of two.
+    */
+    UserRegistry(size_t shards = DEFAULT_SHARDS);
+
+    /**
+     * @return  Whether `user` was added, false if it already existed.
+    */
+    bool insert(const std::string &user);
+
+    /**
+     * @return  Whether `user` was removed, false if it did not exist.
+    */
+    bool erase(const std::string &user);
+
+    bool contains(std::string_view user);
+
+    /**
+     * Calls `visit` with every user, shard by shard, under that shard's shared
+     * lock. `visit` must not modify the registry.
+    */
+    void forEach(const std::function<void(const std::string &user)> &visit);
+
+    /**
+     * Like `forEach()`, but only visits users whose name contains `query`.
+    */
+    void search(std::string_view query,
+                const std::function<void(const std::string &user)> &visit);
+
+    /**
+     * Up to `limit` users containing `query` that sort after `after`, in
+     * order. Each shard is walked from `after` under its own lock, one match
+     * at a time, so only `limit` names and one candidate per shard are held.
+    */
+    std::vector<std::string> listAfter(std::string_view after, std::string_view query,
+                                       size_t limit);
+
+    size_t size();
+
+    inline size_t shardCount() const
+    {
+        return mask + 1;
+    }
+
+private:
+
+    /**
+     * Aligned to a cache line so that shards locked by different cores do
+     * not share one.
+    */
+    struct alignas(64) Shard
+    {
+        std::shared_mutex lock;
+        std::unordered_set<std::string> users;
+        // Users by the trigrams of their name. Names are stored once, in
+        // `users`, whose nodes never move.
+        std::unordered_map<uint32_t, std::unordered_set<const std::string *>> trigrams;
+        // The same names in order.
+        std::set<std::string_view> ordered;
+    };
+
+    // Posting lists of a query's trigrams in one shard, shortest first.
+    using Postings = std::vector<const std::unordered_set<const std::string *> *>;
+
+    /**
+     * Sets `userOut` to the first user of shard `index` containing `query`
+     * that sorts after `after`. Queries of a trigram or more read the
+     * shard's posting lists instead when they are short enough.
+     *
+     * @return  Whether there is one.
+    */
+    bool nextMatch(size_t index, std::string_view after, std::string_view query,
+                   std::string &userOut);
+
+    /**
+     * `nextMatch()` by walking the users of `shard` in order. The caller
+     * holds the shard's lock.
+    */
+    static bool nextInOrder(Shard &shard, std::string_view after, std::string_view query,
+                            std::string &userOut);
+
+    Shard &shardOf(const std::string &user);
+
+    /**
+     * Distinct trigrams of `name`, packed into the low three bytes.
+    */
+    static std::vector<uint32_t> trigramsOf(std::string_view name);
+
+    /**
+     * Sets `postingsOut` to the posting lists of the trigrams of `query` in
+     * `shard`, shortest first.
+     *
+     * @return  false if a trigram has none, so no user can match.
+    */
+    static bool postingsOf(Shard &shard, std::string_view query, Postings &postingsOut);
+
+    /**
+     * Whether `user`, found in the first `first` lists of `postings`, is in
+     * the rest of them and contains `query`.
+    */
+    static bool matches(const Postings &postings, size_t first, const std::string *user,
+                        std::string_view query);
+
+    /**
+     * Visits the users of `shard` containing `query`, which is at least a
+     * trigram long. The caller holds the shard's lock.
+    */
+    static void searchShard(Shard &shard, std::string_view query,
+                            const std::function<void(const std::string &user)> &visit);
+
+    size_t mask;
+    std::unique_ptr<Shard[]> shards;
+};
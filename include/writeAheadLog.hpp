@@ -0,0 +1,221 @@
+/**
+ * `WriteAheadLog` makes account and mailbox changes survive a restart. Every
+ * change is appended to a log as a record before the server acts on it, and a
+ * restarted server replays the records in order to rebuild its state.
+ *
+ * The log is a directory of segment files named after the sequence number of
+ * their first record. `rotate()` starts a new segment, so that the segments
+ * before it can be removed once a snapshot covers them.
+ *
+ * Records are framed as
+ * > Body length (4 bytes)
+ * > CRC-32 of the body (4 bytes)
+ * > Body: sequence number (8 bytes), record type (1 byte), then the fields
+ *
+ * Integers are little-endian. Strings are stored as their length (4 bytes)
+ * followed by their bytes. A crash can leave the last record half written;
+ * replay stops at the first record that is cut short or fails its checksum,
+ * and the segment is truncated there.
+ *
+ * Durability is chosen per log:
+ * > `NONE`: records are written in the background and never synced, so a
+ *   crash of the machine may lose the latest changes.
+ * > `BATCHED`: group commit. Records appended while the previous batch is
+ *   being synced, or within the commit window, are written together and
+ *   made durable by one `fdatasync`. `commit()` waits for that sync, and
+ *   `whenDurable()` has the flusher call back once it is done instead.
+ * > `PER_OPERATION`: every record is written and synced on its own before
+ *   `append()` returns.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class WriteAheadLog
+{
+public:
+
+    enum Durability
+    {
+        NONE,
+        BATCHED,
+        PER_OPERATION
+    };
+
+    enum RecordType : uint8_t
+    {
+        // An account was created. `user` is the new account.
+        CREATE = 1,
+        // An account and its mailbox were deleted.
+        DELETE,
+        // `sender` queued `data` for `user`. The record's sequence number
+        // identifies the message.
+        ENQUEUE,
+        // The messages in `sequences` were delivered to `user`.
+        DEQUEUE
+    };
+
+    /**
+     * A change to log. The fields point into the caller's strings, or into the
+     * log's contents while a record is being replayed.
+    */
+    struct Record
+    {
+        RecordType type;
+        std::string_view user;
+        std::string_view sender = {};
+        std::string_view data = {};
+        std::vector<uint64_t> sequences = {};
+        // Assigned by `append()`. Increases by one with every record.
+        uint64_t sequence = 0;
+    };
+
+    /**
+     * Records appended, syncs issued and bytes written since the log was
+     * opened.
+    */
+    struct Stats
+    {
+        uint64_t records;
+        uint64_t syncs;
+        uint64_t bytes;
+    };
+
+    /**
+     * Opens or creates the log in `directory` and passes every intact record
+     * in it to `replay`, oldest first, before any new record is appended.
+     * `commitWindowMicros` holds a `BATCHED` group open for that long after
+     * its first record to let more join it.
+    */
+    WriteAheadLog(const std::string &directory, Durability durability,
+                  uint64_t commitWindowMicros = 0,
+                  const std::function<void(Record &record)> &replay = nullptr);
+
+    /**
+     * Writes and, unless the durability is `NONE`, syncs the records still
+     * buffered.
+    */
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog &) = delete;
+    WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+    /**
+     * Passes every intact record in the log to `visit` again, oldest first,
+     * reading each segment a chunk at a time. Only valid before the first
+     * `append()`.
+    */
+    void replay(const std::function<void(Record &record)> &visit);
+
+    /**
+     * Adds `record` to the log and sets its sequence number. Records are
+     * logged in the order their appends return.
+     *
+     * @return  The record's sequence number.
+    */
+    uint64_t append(Record &record);
+
+    /**
+     * Waits until the record numbered `sequence`, and every one before it,
+     * is as durable as the log's policy promises. Returns at once for `NONE`
+     * and `PER_OPERATION`.
+    */
+    void commit(uint64_t sequence);
+
+    /**
+     * Like `commit()`, but calls `callback` once the record numbered
+     * `sequence` is durable instead of waiting for it. Callbacks are called
+     * in the order of their records, from the thread that made them durable,
+     * which must not be blocked on for long.
+     *
+     * @return  false without calling `callback` if the record already is as
+     *          durable as it gets, in which case the caller goes on itself.
+    */
+    bool whenDurable(uint64_t sequence, std::function<void()> callback);
+
+    /**
+     * Writes out the records appended so far, syncing them unless the
+     * durability is `NONE`, and starts a new segment for the records that
+     * follow.
+     *
+     * @return  Sequence number of the last record before the new segment.
+    */
+    uint64_t rotate();
+
+    /**
+     * Deletes the segments holding only records numbered up to `sequence`.
+     * The current segment is kept.
+    */
+    void removeSegmentsThrough(uint64_t sequence);
+
+    Stats getStats();
+
+    /**
+     * Encodes `record` as a framed log record.
+    */
+    static void encode(const Record &record, std::string &out);
+
+    /**
+     * Decodes the framed record at the start of `data`. The record's fields
+     * point into `data`.
+     *
+     * @return  Bytes the record took, 0 if `data` ends inside it, or -1 if it
+     *          is corrupt.
+    */
+    static int64_t decode(std::string_view data, Record &recordOut);
+
+private:
+
+    /**
+     * Writes and syncs batches until the log is closed. Only runs for
+     * `NONE` and `BATCHED`.
+    */
+    void flushLoop();
+
+    int writeAll(const std::string &bytes);
+
+    /**
+     * Calls the callbacks of `whenDurable()` whose records are durable now.
+     * Called without `lock` held.
+    */
+    void completeDurable();
+
+    /**
+     * Opens a new segment whose first record is `nextSequence`.
+    */
+    void openSegment();
+
+    std::string directory;
+    // Sequence number of each segment's first record, oldest first. The last
+    // one is open as `fd`.
+    std::vector<uint64_t> segments;
+    int fd;
+    Durability durability;
+    uint64_t commitWindowMicros;
+
+    std::mutex lock;
+    // Signalled when records are appended or the log closes.
+    std::condition_variable appended;
+    // Signalled when a batch is durable.
+    std::condition_variable committed;
+    // Encoded records not handed to the flusher yet.
+    std::string pending;
+    uint64_t nextSequence;
+    // Every record up to this one is durable.
+    uint64_t durableSequence;
+    // Callbacks waiting for their records to become durable.
+    std::vector<std::pair<uint64_t, std::function<void()>>> completions;
+    // Whether the flusher is writing a batch outside the lock.
+    bool flushing;
+    bool closing;
+    Stats stats;
+    std::thread flusher;
+};
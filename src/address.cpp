@@ -0,0 +1,131 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "address.hpp"
+
+/**
+ * Fills `storage` with the socket address for `address`.
+ *
+ * @return  Length of the socket address.
+ *          -1 if `address` cannot be represented.
+*/
+static int toSockaddr(const Address &address, struct sockaddr_storage &storage)
+{
+    memset(&storage, 0, sizeof(storage));
+
+    if (address.family == Address::UNIX_SOCKET)
+    {
+        struct sockaddr_un *local = (struct sockaddr_un *)&storage;
+        if (address.host.size() >= sizeof(local->sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        local->sun_family = AF_UNIX;
+        memcpy(local->sun_path, address.host.c_str(), address.host.size() + 1);
+        return sizeof(struct sockaddr_un);
+    }
+
+    struct sockaddr_in *inet = (struct sockaddr_in *)&storage;
+    inet->sin_family = AF_INET;
+    inet->sin_port = htons(address.port);
+    if (inet_pton(AF_INET, address.host.c_str(), &inet->sin_addr) <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return sizeof(struct sockaddr_in);
+}
+
+int listenOn(const Address &address, int backlog, bool reusePort)
+{
+    struct sockaddr_storage storage;
+    int length = toSockaddr(address, storage);
+    if (length < 0)
+    {
+        perror("address");
+        return -1;
+    }
+
+    int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket()");
+        return -1;
+    }
+
+    if (address.family == Address::TCP)
+    {
+        // Enable SO_REUSEADDR so that we dont get bind() errors if the previous
+        // socket is stuck in TIME_WAIT or hasn't been released by the OS.
+        int enable = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+        {
+            perror("setsockopt()");
+            close(fd);
+            return -1;
+        }
+        if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0)
+        {
+            perror("setsockopt()");
+            close(fd);
+            return -1;
+        }
+    }
+    else
+    {
+        // A socket file outlives the server that bound it.
+        unlink(address.host.c_str());
+    }
+
+    // Bind to the address and mark as a listening socket.
+    if (bind(fd, (struct sockaddr *)&storage, length) < 0)
+    {
+        perror("bind()");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, backlog) < 0)
+    {
+        perror("listen()");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int connectTo(const Address &address)
+{
+    struct sockaddr_storage storage;
+    int length = toSockaddr(address, storage);
+    if (length < 0)
+    {
+        perror("address");
+        return -1;
+    }
+
+    int fd = socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket()");
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&storage, length) < 0)
+    {
+        perror("connect()");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
@@ -0,0 +1,107 @@
+#include "bufferPool.hpp"
+
+BufferPool::~BufferPool()
+{
+    getStats().pooledBytes -= pooledBytes;
+}
+
+BufferPool &BufferPool::local()
+{
+    thread_local BufferPool pool;
+    return pool;
+}
+
+PoolStats &BufferPool::getStats()
+{
+    static PoolStats stats;
+    return stats;
+}
+
+int BufferPool::classFor(size_t capacity)
+{
+    int index = 0;
+    while (index < CLASSES && (MIN_CLASS_BYTES << index) < capacity)
+    {
+        index++;
+    }
+    return index;
+}
+
+std::string BufferPool::acquire(size_t capacity)
+{
+    int index = classFor(capacity);
+    if (index < CLASSES && !freeLists[index].empty())
+    {
+        std::string buffer = std::move(freeLists[index].back());
+        freeLists[index].pop_back();
+        pooledBytes -= buffer.capacity();
+        getStats().pooledBytes -= buffer.capacity();
+        getStats().hits++;
+        return buffer;
+    }
+
+    getStats().misses++;
+    std::string buffer;
+    buffer.reserve(index < CLASSES ? MIN_CLASS_BYTES << index : capacity);
+    return buffer;
+}
+
+void BufferPool::release(std::string &&buffer)
+{
+    // File the buffer under the largest class it can serve.
+    size_t capacity = buffer.capacity();
+    if (capacity < MIN_CLASS_BYTES || capacity > MAX_CLASS_BYTES ||
+        pooledBytes + capacity > MAX_POOLED_BYTES)
+    {
+        return;
+    }
+    int index = classFor(capacity);
+    if ((MIN_CLASS_BYTES << index) > capacity)
+    {
+        index--;
+    }
+
+    buffer.clear();
+    freeLists[index].push_back(std::move(buffer));
+    pooledBytes += capacity;
+    getStats().pooledBytes += capacity;
+}
+
+Arena::Arena() : bytes(0), peakBytes(0)
+{
+    BufferPool::getStats().arenas++;
+}
+
+Arena::~Arena()
+{
+    reset();
+    BufferPool::getStats().arenas--;
+    BufferPool::getStats().arenaPeakBytes -= peakBytes;
+}
+
+std::string &Arena::acquire(size_t capacity)
+{
+    buffers.push_back(BufferPool::local().acquire(capacity));
+    bytes += buffers.back().capacity();
+    if (bytes > peakBytes)
+    {
+        BufferPool::getStats().arenaPeakBytes += bytes - peakBytes;
+        peakBytes = bytes;
+    }
+    return buffers.back();
+}
+
+void Arena::reset()
+{
+    if (buffers.empty())
+    {
+        return;
+    }
+    BufferPool &pool = BufferPool::local();
+    for (std::string &buffer : buffers)
+    {
+        pool.release(std::move(buffer));
+    }
+    buffers.clear();
+    bytes = 0;
+}
@@ -1,5 +1,6 @@
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <sys/socket.h>
@@ -11,50 +12,50 @@
 
 #include "client.hpp"
 
-Client::Client(std::string host, int port)
+Client::Client(std::string host, int port) : Client(Address::tcp(host, port))
 {
-    // Connect to the server.
-    struct sockaddr_in serverAddress;
+}
 
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(port);
-    if (inet_pton(AF_INET, host.c_str(), &serverAddress.sin_addr) <= 0)
-    {
-        perror("inet_pton()");
-        exit(1);
-    }
+Client::Client(const Address &address) : Client(connectTo(address))
+{
+}
 
-    clientFd = socket(AF_INET, SOCK_STREAM, 0);
+Client::Client(int socket) : network(this), clientFd(socket)
+{
     if (clientFd < 0)
     {
-        perror("socket()");
         exit(1);
     }
 
-    if (connect(clientFd, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0)
-    {
-        perror("connect()");
-        exit(1);
-    }
-
-    // Register callbacks
-    network.registerCallback(Network::OK, Callback(this, &Client::messageCallback));
-    network.registerCallback(Network::CREATE, Callback(this, &Client::handleCreateResponse));
-    network.registerCallback(Network::DELETE, Callback(this, &Client::handleDelete));
-    network.registerCallback(Network::LIST, Callback(this, &Client::handleList));
-    network.registerCallback(Network::SEND, Callback(this, &Client::handleReceive));
-    network.registerCallback(Network::ERROR, Callback(this, &Client::messageCallback));
-
     clientRunning = true;
+    receiving = true;
+    nextRequestId = 1;
 
     // Start the receive operation thread.
     opThread = std::thread([this]()
     {
+        FrameDecoder decoder;
+        Arena arena;
         while (clientRunning)
         {
-            network.receiveOperation(clientFd);
+            // The connection is gone, so no reply can arrive anymore.
+            if (network.receiveOperation(clientFd, decoder, arena) < 0)
+            {
+                break;
+            }
         }
+        failPendingRequests();
     });
+
+    // Switch to the newest protocol version the server also speaks. Servers
+    // that predate negotiation answer `UNSUPPORTED_OP` and we stay on the
+    // default version.
+    std::string agreed = sendRequest({Network::HELLO, std::to_string(VERSION)}).get();
+    uint32_t version = strtoul(agreed.c_str(), nullptr, 10);
+    if (version >= MIN_VERSION && version <= VERSION)
+    {
+        network.setVersion(version);
+    }
 }
 
 Client::~Client()
@@ -62,98 +63,287 @@ Client::~Client()
     opThread.join();
 }
 
-Network::Message Client::messageCallback(Network::Message message)
+Network::Message Client::messageCallback(const Network::MessageView &message)
 {
-    opResult = message.data;
-    cv.notify_all();
+    completeRequest(message.requestId, std::string(message.data));
     return {Network::NO_RETURN};
 }
 
-Network::Message Client::handleCreateResponse(Network::Message message)
+Network::Message Client::handleCreateResponse(const Network::MessageView &message)
 {
     currentUser = message.data;
-    opResult = "Created account " + message.data;
-    cv.notify_all();
+    completeRequest(message.requestId, "Created account " + currentUser);
     return {Network::NO_RETURN};
 }
 
-Network::Message Client::handleDelete(Network::Message message)
+Network::Message Client::handleDelete(const Network::MessageView &message)
 {
     currentUser = "";
-    opResult = "Deleted account " + message.data;
-    cv.notify_all();
+    completeRequest(message.requestId, "Deleted account " + std::string(message.data));
+    return {Network::NO_RETURN};
+}
+
+Network::Message Client::handleList(const Network::MessageView &message)
+{
+    {
+        std::unique_lock lock(userListLock);
+        clientUserList.clear();
+        std::string_view remaining = message.data;
+        size_t pos = 0;
+        // Split the newline seperated names into an actual list.
+        while ((pos = remaining.find("\n")) != std::string_view::npos)
+        {
+            std::string_view user = remaining.substr(0, pos);
+            if (user.size() <= 0)
+            {
+                break;
+            }
+            clientUserList.emplace(user);
+            remaining.remove_prefix(pos + 1);
+        }
+    }
+    completeRequest(message.requestId, std::string(message.data));
+    return {Network::NO_RETURN};
+}
+
+Network::Message Client::handleListPage(const Network::MessageView &message)
+{
+    PageHandler handler;
+    {
+        std::unique_lock lock(pendingLock);
+        auto it = pageHandlers.find(message.requestId);
+        if (it != pageHandlers.end())
+        {
+            handler = it->second;
+        }
+    }
+    if (!handler || !handler(message.data, message.sender))
+    {
+        completeRequest(message.requestId, "");
+    }
     return {Network::NO_RETURN};
 }
 
-Network::Message Client::handleList(Network::Message message)
+Network::Message Client::handleReceive(const Network::MessageView &message)
 {
-    opResult = message.data;
-    clientUserList.clear();
-    size_t pos = 0;
-    // Split the newline seperated names into an actual list.
-    while ((pos = message.data.find("\n")) != std::string::npos)
+    // Request ID 0 marks messages pushed to a subscriber.
+    if (message.requestId == 0)
     {
-        std::string user = message.data.substr(0, pos);
-        if (user.size() <= 0)
+        std::function<void(std::string)> handler;
         {
-            break;
+            std::unique_lock lock(pendingLock);
+            handler = messageHandler;
         }
-        clientUserList.insert(user);
-        message.data.erase(0, pos + 1);
+        if (handler && message.data.size() > 0)
+        {
+            handler(std::string(message.data));
+        }
+        return {Network::NO_RETURN};
     }
-    cv.notify_all();
+
+    completeRequest(message.requestId, std::string(message.data));
     return {Network::NO_RETURN};
 }
 
-Network::Message Client::handleReceive(Network::Message message)
+Network::Message Client::handlePing(const Network::MessageView &message)
 {
-    opResultMessages = message.data;
-    message_cv.notify_all();
+    // Sent here rather than returned, so the reply cannot interleave with a
+    // request being sent by another thread.
+    std::unique_lock lock(sendLock);
+    network.sendMessage(clientFd, {Network::PONG});
     return {Network::NO_RETURN};
 }
 
+std::future<std::string> Client::sendRequest(Network::Message message)
+{
+    return sendRequest(std::move(message), nullptr);
+}
+
+std::future<std::string> Client::sendRequest(Network::Message message, PageHandler onPage)
+{
+    std::promise<std::string> promise;
+    std::future<std::string> result = promise.get_future();
+    message.requestId = nextRequestId++;
+
+    {
+        std::unique_lock lock(pendingLock);
+        if (!receiving)
+        {
+            promise.set_value("Connection closed");
+            return result;
+        }
+        pendingRequests.emplace(message.requestId, std::move(promise));
+        if (onPage)
+        {
+            pageHandlers.emplace(message.requestId, std::move(onPage));
+        }
+    }
+
+    int err;
+    {
+        std::unique_lock lock(sendLock);
+        if (message.operation == Network::SEND && message.data.size() > CHUNK_LENGTH)
+        {
+            err = network.sendChunked(clientFd, message, CHUNK_LENGTH);
+        }
+        else
+        {
+            err = network.sendMessage(clientFd, message);
+        }
+    }
+    if (err < 0)
+    {
+        completeRequest(message.requestId, "Failed to send request");
+    }
+    return result;
+}
+
+void Client::completeRequest(uint64_t requestId, std::string result)
+{
+    std::promise<std::string> promise;
+    {
+        std::unique_lock lock(pendingLock);
+        auto it = pendingRequests.find(requestId);
+        if (it == pendingRequests.end())
+        {
+            return;
+        }
+        promise = std::move(it->second);
+        pendingRequests.erase(it);
+        pageHandlers.erase(requestId);
+    }
+    promise.set_value(result);
+}
+
+void Client::failPendingRequests()
+{
+    std::unordered_map<uint64_t, std::promise<std::string>> failed;
+    {
+        std::unique_lock lock(pendingLock);
+        receiving = false;
+        failed.swap(pendingRequests);
+        pageHandlers.clear();
+    }
+    for (auto &[requestId, promise] : failed)
+    {
+        promise.set_value("Connection closed");
+    }
+}
+
 std::string Client::createAccount(std::string username)
 {
-    std::unique_lock lock(m);
-    network.sendMessage(clientFd, {Network::CREATE, username});
-    cv.wait(lock);
-    return opResult;
+    return sendRequest({Network::CREATE, username}).get();
 }
 
 std::string Client::getAccountList(std::string sub)
 {
-    std::unique_lock lock(m);
-    network.sendMessage(clientFd, {Network::LIST, sub});
-    cv.wait(lock);
-    return opResult;
+    return sendRequest({Network::LIST, sub}).get();
+}
+
+std::string Client::listAccounts(std::string sub, uint32_t pageSize,
+                                 const std::function<void(std::string_view users)> &onPage,
+                                 bool stream)
+{
+    if (stream)
+    {
+        return requestPages(sub, pageSize, "", true,
+                            [&onPage](std::string_view users, std::string_view cursor)
+        {
+            onPage(users);
+            return !cursor.empty();
+        });
+    }
+
+    std::string cursor;
+    do
+    {
+        std::string result = requestPages(sub, pageSize, cursor, false,
+                                          [&onPage, &cursor](std::string_view users,
+                                                             std::string_view next)
+        {
+            onPage(users);
+            cursor = next;
+            return false;
+        });
+        if (!result.empty())
+        {
+            return result;
+        }
+    } while (!cursor.empty());
+    return "";
+}
+
+std::string Client::getAccountPage(std::string sub, uint32_t pageSize,
+                                   std::string &cursorInOut)
+{
+    std::string users;
+    std::string next;
+    std::string result = requestPages(sub, pageSize, cursorInOut, false,
+                                      [&users, &next](std::string_view page,
+                                                      std::string_view cursor)
+    {
+        users = page;
+        next = cursor;
+        return false;
+    });
+    if (!result.empty())
+    {
+        return result;
+    }
+    cursorInOut = next;
+    return users;
+}
+
+std::string Client::requestPages(std::string sub, uint32_t pageSize, std::string cursor,
+                                 bool stream, PageHandler onPage)
+{
+    Network::Message request = {Network::LIST_PAGE};
+    Network::encodeListPage({sub, cursor, pageSize, stream}, request.data);
+    return sendRequest(request, std::move(onPage)).get();
 }
 
 std::string Client::deleteAccount(std::string username)
 {
-    std::unique_lock lock(m);
-    network.sendMessage(clientFd, {Network::DELETE, username});
-    cv.wait(lock);
-    return opResult;
+    return sendRequest({Network::DELETE, username}).get();
 }
 
 std::string Client::sendMessage(Network::Message message)
 {
-    std::unique_lock lock(m);
-    network.sendMessage(clientFd, message);
-    cv.wait(lock);
-    return opResult;
+    return sendRequest(message).get();
+}
+
+std::vector<Network::OpCode> Client::sendBatch(std::string sender,
+                                               const std::vector<Network::BatchEntry> &entries)
+{
+    Network::Message batch = {Network::SEND_BATCH, "", sender};
+    Network::encodeBatch(entries, batch.data);
+    std::string status = sendRequest(batch).get();
+
+    // Anything but a status per entry means the whole batch failed.
+    std::vector<Network::OpCode> result(entries.size(), Network::ERROR);
+    if (status.size() == entries.size())
+    {
+        for (size_t i = 0; i < status.size(); i++)
+        {
+            result[i] = (Network::OpCode)status[i];
+        }
+    }
+    return result;
 }
 
 std::string Client::requestMessages()
 {
-    std::unique_lock lock(message_m);
-    network.sendMessage(clientFd, {Network::REQUEST, currentUser});
-    message_cv.wait(lock);
-    return opResultMessages;
+    return sendRequest({Network::REQUEST, currentUser}).get();
+}
+
+std::string Client::subscribe()
+{
+    return sendRequest({Network::SUBSCRIBE, currentUser}).get();
 }
 
 void Client::stopClient()
 {
     clientRunning = false;
+    shutdown(clientFd, SHUT_RDWR);
     close(clientFd);
 }
@@ -1,8 +1,5 @@
-#include <atomic>
-#include <chrono>
 #include <iostream>
 #include <string>
-#include <thread>
 
 #include "client.hpp"
 
@@ -12,30 +9,29 @@
 */
 int main(int argc, char const *argv[])
 {
-	if (argc < 3)
+	if (argc < 2)
 	{
-		std::cerr << "Usage: client [HOST] [PORT]" << std::endl;
+		std::cerr << "Usage: client [HOST] [PORT]\n"
+		          << "       client [SOCKET_PATH]" << std::endl;
 		return -1;
 	}
-	
-	std::string host = argv[1];
-	int port = std::stoi(argv[2]);
 
-    Client client(host, port);
+    // A single argument is the path of the server's Unix domain socket.
+    Address address = argc >= 3 ? Address::tcp(argv[1], std::stoi(argv[2]))
+                                : Address::unixSocket(argv[1]);
 
-    std::thread msg_thread([&client]()
+    Client client(address);
+
+    // The server pushes new mail for the logged in user as it arrives.
+    auto showMail = [](std::string messages)
     {
-        while (client.clientRunning)
+        if (messages.size() <= 0)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(250));
-            std::string messages = client.requestMessages();
-            if (messages.size() <= 0)
-            {
-                continue;
-            }
-            std::cout << "\nYou have received mail :)\n" << messages << std::endl;
+            return;
         }
-    });
+        std::cout << "\nYou have received mail :)\n" << messages << std::endl;
+    };
+    client.setMessageHandler(showMail);
 
     std::string buffer;
     while (client.clientRunning)
@@ -65,6 +61,7 @@ int main(int argc, char const *argv[])
             }
             client.setCurrentUser(arg2);
             std::cout << "Logged in as " << client.getCurrentUser() << std::endl;
+            showMail(client.subscribe());
         }
         else if (arg1 == "create")
         {
@@ -74,6 +71,10 @@ int main(int argc, char const *argv[])
                 continue;
             }
             std::cout << client.createAccount(arg2) << std::endl;
+            if (client.getCurrentUser() == arg2)
+            {
+                showMail(client.subscribe());
+            }
         }
         else if (arg1 == "delete")
         {
@@ -86,14 +87,15 @@ int main(int argc, char const *argv[])
         }
         else if (arg1 == "list")
         {
-            client.getAccountList(arg2);
-
-            std::string list;
-            for (std::string user : client.getClientUserList())
+            // Pages are shown as they arrive.
+            std::string err = client.listAccounts(arg2, LIST_PAGE_SIZE, [](std::string_view users)
+            {
+                std::cout << users << std::flush;
+            }, true);
+            if (!err.empty())
             {
-                list += user + "\n";
+                std::cout << err << std::endl;
             }
-            std::cout << list;
         }
         else if (arg1 == "send")
         {
@@ -124,6 +126,5 @@ int main(int argc, char const *argv[])
         }
     }
 
-    msg_thread.join();
     return 0;
 }
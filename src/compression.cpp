@@ -0,0 +1,175 @@
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "compression.hpp"
+
+// Shortest match worth encoding.
+#define MIN_MATCH 4
+// Farthest a match may reach back.
+#define MAX_OFFSET 65535
+// log2 of the number of match-finder hash slots.
+#define HASH_BITS 14
+
+/**
+ * Appends `value` in the 255-run encoding used for lengths past a nibble.
+*/
+static void putLength(std::string &out, size_t value)
+{
+    while (value >= 255)
+    {
+        out += (char)255;
+        value -= 255;
+    }
+    out += (char)value;
+}
+
+/**
+ * Reads a 255-run length at `in[position]` and adds it to `value`.
+ *
+ * @return  -1 if the input ends first.
+*/
+static int getLength(const unsigned char *in, size_t length, size_t &position,
+                     size_t &value)
+{
+    unsigned char byte;
+    do
+    {
+        if (position >= length)
+        {
+            return -1;
+        }
+        byte = in[position++];
+        value += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/**
+ * Appends one (literals, match) pair. A `matchLength` of 0 ends the block.
+*/
+static void putSequence(std::string &out, const char *literals, size_t literalLength,
+                        size_t offset, size_t matchLength)
+{
+    size_t matchCode = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+    out += (char)((std::min(literalLength, (size_t)15) << 4) |
+                  std::min(matchCode, (size_t)15));
+    if (literalLength >= 15)
+    {
+        putLength(out, literalLength - 15);
+    }
+    out.append(literals, literalLength);
+
+    if (matchLength == 0)
+    {
+        return;
+    }
+    out += (char)(offset & 0xff);
+    out += (char)(offset >> 8);
+    if (matchCode >= 15)
+    {
+        putLength(out, matchCode - 15);
+    }
+}
+
+void LzCodec::compress(const char *data, size_t length, std::string &out)
+{
+    // Most recent position + 1 of every hashed 4-byte sequence, 0 if none.
+    std::vector<uint32_t> table(1 << HASH_BITS, 0);
+    size_t anchor = 0;
+    size_t position = 0;
+
+    while (position + MIN_MATCH <= length)
+    {
+        uint32_t sequence;
+        memcpy(&sequence, data + position, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = position + 1;
+
+        if (candidate == 0 || position - (candidate - 1) > MAX_OFFSET ||
+            memcmp(data + candidate - 1, data + position, MIN_MATCH) != 0)
+        {
+            position++;
+            continue;
+        }
+        candidate--;
+
+        size_t matchLength = MIN_MATCH;
+        while (position + matchLength < length &&
+               data[candidate + matchLength] == data[position + matchLength])
+        {
+            matchLength++;
+        }
+
+        putSequence(out, data + anchor, position - anchor, position - candidate,
+                    matchLength);
+        position += matchLength;
+        anchor = position;
+    }
+
+    putSequence(out, data + anchor, length - anchor, 0, 0);
+}
+
+int LzCodec::decompress(const char *data, size_t length, size_t originalLength,
+                        std::string &out)
+{
+    const unsigned char *in = (const unsigned char *)data;
+    out.resize(originalLength);
+    char *output = out.empty() ? nullptr : &out[0];
+    size_t written = 0;
+    size_t position = 0;
+
+    while (position < length)
+    {
+        unsigned char token = in[position++];
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && getLength(in, length, position, literalLength) < 0)
+        {
+            return -1;
+        }
+        if (literalLength > length - position ||
+            literalLength > originalLength - written)
+        {
+            return -1;
+        }
+        memcpy(output + written, in + position, literalLength);
+        written += literalLength;
+        position += literalLength;
+
+        // The last sequence has no match.
+        if (position == length)
+        {
+            break;
+        }
+
+        if (length - position < 2)
+        {
+            return -1;
+        }
+        size_t offset = in[position] | (in[position + 1] << 8);
+        position += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && getLength(in, length, position, matchLength) < 0)
+        {
+            return -1;
+        }
+        matchLength += MIN_MATCH;
+        if (offset == 0 || offset > written || matchLength > originalLength - written)
+        {
+            return -1;
+        }
+
+        // Byte by byte, since a match may overlap the bytes it produces.
+        const char *from = output + written - offset;
+        for (size_t i = 0; i < matchLength; i++)
+        {
+            output[written + i] = from[i];
+        }
+        written += matchLength;
+    }
+
+    return written == originalLength ? 0 : -1;
+}
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "epoch.hpp"
+
+namespace
+{
+
+// Epoch of a thread outside every guard.
+const uint64_t QUIESCENT = UINT64_MAX;
+
+/**
+ * Slot a thread publishes its epoch in. Slots are never freed; a thread that
+ * exits hands its slot to the next thread that needs one.
+*/
+struct alignas(64) Participant
+{
+    std::atomic<uint64_t> epoch{QUIESCENT};
+    std::atomic<bool> inUse{false};
+    Participant *next = nullptr;
+    // Nesting depth of the owner's guards. Only touched by the owner.
+    unsigned depth = 0;
+};
+
+struct Retired
+{
+    uint64_t epoch;
+    void *object;
+    void (*deleter)(void *object);
+};
+
+std::atomic<uint64_t> globalEpoch{0};
+std::atomic<Participant *> participants{nullptr};
+std::mutex retiredLock;
+std::vector<Retired> retired;
+// Size of `retired`, read by guards without taking the lock.
+std::atomic<size_t> waiting{0};
+
+Participant *acquireParticipant()
+{
+    for (Participant *p = participants.load(); p != nullptr; p = p->next)
+    {
+        bool expected = false;
+        if (!p->inUse.load(std::memory_order_relaxed) &&
+            p->inUse.compare_exchange_strong(expected, true))
+        {
+            return p;
+        }
+    }
+
+    Participant *p = new Participant();
+    p->inUse = true;
+    p->next = participants.load();
+    while (!participants.compare_exchange_weak(p->next, p))
+    {
+    }
+    return p;
+}
+
+/**
+ * The calling thread's slot, taken on first use and given back when the
+ * thread exits.
+*/
+struct LocalParticipant
+{
+    Participant *participant = acquireParticipant();
+
+    ~LocalParticipant()
+    {
+        participant->depth = 0;
+        participant->epoch = QUIESCENT;
+        participant->inUse = false;
+    }
+};
+
+Participant &local()
+{
+    thread_local LocalParticipant slot;
+    return *slot.participant;
+}
+
+/**
+ * Moves the global epoch on if no guard is behind it.
+ *
+ * @return  Whether it moved.
+*/
+bool tryAdvance()
+{
+    uint64_t current = globalEpoch.load();
+    for (Participant *p = participants.load(); p != nullptr; p = p->next)
+    {
+        uint64_t epoch = p->epoch.load();
+        if (epoch != QUIESCENT && epoch != current)
+        {
+            return false;
+        }
+    }
+    return globalEpoch.compare_exchange_strong(current, current + 1);
+}
+
+/**
+ * Does the work of `Epoch::collect()`. Unless `block` is set, returns at once
+ * if another thread is collecting.
+*/
+size_t collectRetired(bool block)
+{
+    std::vector<Retired> freeable;
+    size_t left;
+    {
+        std::unique_lock lock(retiredLock, std::defer_lock);
+        if (block)
+        {
+            lock.lock();
+        }
+        else if (!lock.try_lock())
+        {
+            return waiting.load();
+        }
+        // Objects are freed two epochs after they were retired, so with no
+        // guard in the way they are freed at once.
+        if (tryAdvance())
+        {
+            tryAdvance();
+        }
+        uint64_t epoch = globalEpoch.load();
+        auto keep = std::partition(retired.begin(), retired.end(), [epoch](const Retired &r)
+        {
+            return r.epoch + 2 > epoch;
+        });
+        freeable.assign(keep, retired.end());
+        retired.erase(keep, retired.end());
+        left = retired.size();
+        waiting.store(left);
+    }
+
+    // Deleters run outside the lock in case they retire objects themselves.
+    for (Retired &r : freeable)
+    {
+        r.deleter(r.object);
+    }
+    return left;
+}
+
+}
+
+Epoch::Guard::Guard()
+{
+    Participant &self = local();
+    if (self.depth++ > 0)
+    {
+        return;
+    }
+    // Publish an epoch that was still current after it became visible, so
+    // the epoch cannot advance twice past it unseen.
+    uint64_t epoch;
+    do
+    {
+        epoch = globalEpoch.load();
+        self.epoch.store(epoch);
+    } while (globalEpoch.load() != epoch);
+}
+
+Epoch::Guard::~Guard()
+{
+    Participant &self = local();
+    if (--self.depth == 0)
+    {
+        self.epoch.store(QUIESCENT);
+        // This guard may be the last one holding retired objects back.
+        if (waiting.load(std::memory_order_relaxed) > 0)
+        {
+            collectRetired(false);
+        }
+    }
+}
+
+void Epoch::retire(void *object, void (*deleter)(void *object))
+{
+    {
+        std::unique_lock lock(retiredLock);
+        retired.push_back({globalEpoch.load(), object, deleter});
+        waiting.store(retired.size());
+    }
+    collect();
+}
+
+size_t Epoch::collect()
+{
+    return collectRetired(true);
+}
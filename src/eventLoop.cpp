@@ -0,0 +1,633 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <iterator>
+#include <unordered_set>
+
+#include "eventLoop.hpp"
+#include "server.hpp"
+
+// Maximum number of events handled per epoll_wait() call.
+#define MAX_EVENTS 64
+
+EventLoop::EventLoop(const Endpoint<Server> &network, Backend backend)
+    : network(network), backend(backend), loopSyscalls(0), highWater(0), lowWater(0),
+      queuedBytes(0), peakQueuedBytes(0), pausedConnections(0), pauses(0),
+      deferredPushes(0), loopTime(TimerWheel::now()), evictions(0)
+{
+    if (backend == URING)
+    {
+        uring = std::make_shared<UringTransport>();
+        if (uring->isReady())
+        {
+            transport = uring;
+        }
+        else
+        {
+            perror("io_uring unavailable, falling back to epoll");
+            uring.reset();
+            this->backend = EPOLL;
+        }
+    }
+    if (!transport)
+    {
+        transport = std::make_shared<SocketTransport>(true);
+    }
+    this->network.setTransport(transport);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+    {
+        perror("epoll_create1()");
+        exit(1);
+    }
+
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0)
+    {
+        perror("eventfd()");
+        exit(1);
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wakeFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) < 0)
+    {
+        perror("epoll_ctl()");
+        exit(1);
+    }
+
+    loopRunning = false;
+}
+
+EventLoop::~EventLoop()
+{
+    stop();
+    close(wakeFd);
+    close(epollFd);
+}
+
+void EventLoop::start()
+{
+    loopRunning = true;
+    if (backend == URING)
+    {
+        loopThread = std::thread(&EventLoop::runUring, this);
+    }
+    else
+    {
+        loopThread = std::thread(&EventLoop::runEpoll, this);
+    }
+}
+
+void EventLoop::stop()
+{
+    if (!loopThread.joinable())
+    {
+        return;
+    }
+
+    loopRunning = false;
+    uint64_t one = 1;
+    write(wakeFd, &one, sizeof(one));
+    loopThread.join();
+
+    while (!connections.empty())
+    {
+        closeConnection(connections.begin()->first);
+    }
+    for (int socket : pendingSockets)
+    {
+        if (closeHandler)
+        {
+            closeHandler(socket);
+        }
+        close(socket);
+    }
+    pendingSockets.clear();
+    postedTasks.clear();
+}
+
+int EventLoop::addConnection(int socket)
+{
+    // Connections and the ring may only be touched by the loop thread, so
+    // queue the socket and wake the loop to start watching it.
+    {
+        std::unique_lock lock(pendingLock);
+        pendingSockets.push_back(socket);
+    }
+    uint64_t one = 1;
+    return write(wakeFd, &one, sizeof(one)) < 0 ? -1 : 0;
+}
+
+void EventLoop::watchPending()
+{
+    std::vector<int> sockets;
+    {
+        std::unique_lock lock(pendingLock);
+        sockets.swap(pendingSockets);
+    }
+
+    for (int socket : sockets)
+    {
+        if (backend == URING)
+        {
+            uring->watch(socket);
+        }
+        else
+        {
+            // Edge-triggered: we are only told when new data arrives, or room
+            // for queued replies, so every wakeup must drain the socket until
+            // read() would block.
+            struct epoll_event event = {};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.fd = socket;
+            int flags = fcntl(socket, F_GETFL, 0);
+            if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0 ||
+                epoll_ctl(epollFd, EPOLL_CTL_ADD, socket, &event) < 0)
+            {
+                perror("epoll_ctl()");
+                if (closeHandler)
+                {
+                    closeHandler(socket);
+                }
+                close(socket);
+                continue;
+            }
+        }
+
+        Connection &connection = connections[socket];
+        connection.lastActive = loopTime;
+        connection.lastPing = loopTime;
+        uint64_t deadline;
+        if (idlePolicy.enabled() &&
+            idlePolicy.check(loopTime, loopTime, loopTime, deadline) == IdlePolicy::WAIT &&
+            deadline != UINT64_MAX)
+        {
+            timers.schedule(socket, deadline);
+        }
+    }
+}
+
+void EventLoop::post(int socket, uint32_t version, std::function<Network::Message()> task)
+{
+    {
+        std::unique_lock lock(pendingLock);
+        postedTasks.push_back({socket, version, std::move(task)});
+    }
+    uint64_t one = 1;
+    write(wakeFd, &one, sizeof(one));
+}
+
+uint64_t EventLoop::getSyscalls()
+{
+    return loopSyscalls + transport->getSyscalls();
+}
+
+OutboundStats EventLoop::getOutboundStats()
+{
+    return {queuedBytes, peakQueuedBytes, pausedConnections, pauses, deferredPushes};
+}
+
+void EventLoop::stopPinging(int socket)
+{
+    auto it = connections.find(socket);
+    if (it != connections.end())
+    {
+        it->second.answersPings = false;
+    }
+}
+
+void EventLoop::runEpoll()
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (loopRunning)
+    {
+        int ready = epoll_wait(epollFd, events, MAX_EVENTS,
+                               timers.timeoutMillis(TimerWheel::now()));
+        loopSyscalls++;
+        loopTime = TimerWheel::now();
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait()");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            int socket = events[i].data.fd;
+            if (socket == wakeFd)
+            {
+                uint64_t value;
+                read(wakeFd, &value, sizeof(value));
+                loopSyscalls++;
+                watchPending();
+                runPosted();
+                continue;
+            }
+
+            // Zero-copy completions are reported through the error queue, so
+            // EPOLLERR alone does not mean the connection failed.
+            bool failed = events[i].events & EPOLLHUP;
+            if (events[i].events & EPOLLERR)
+            {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &length);
+                loopSyscalls++;
+                failed = failed || error != 0;
+                transport->reapCompletions(socket);
+            }
+
+            if (events[i].events & EPOLLOUT)
+            {
+                failed = failed || drainOutbound(socket) < 0;
+            }
+            // Room to write alone leaves nothing to read.
+            bool readable = events[i].events & ~EPOLLOUT;
+            if ((readable && serviceConnection(socket) < 0) || failed)
+            {
+                closeConnection(socket);
+            }
+        }
+        expireIdle();
+    }
+}
+
+void EventLoop::runUring()
+{
+    std::unordered_set<int> ready;
+    std::vector<int> closing;
+
+    auto onReceive = [&](int socket, const char *data, int length)
+    {
+        if (length <= 0)
+        {
+            closing.push_back(socket);
+            return;
+        }
+        auto it = connections.find(socket);
+        if (it != connections.end())
+        {
+            it->second.decoder.append(data, length);
+            ready.insert(socket);
+        }
+    };
+
+    uring->watchWakeup(wakeFd);
+    while (loopRunning)
+    {
+        // Submits the replies queued during the previous iteration and waits
+        // for the next batch of completions in a single syscall.
+        if (uring->wait(onReceive, timers.timeoutMillis(TimerWheel::now())) < 0 &&
+            errno != EINTR)
+        {
+            perror("io_uring_enter()");
+            break;
+        }
+        loopTime = TimerWheel::now();
+
+        watchPending();
+        runPosted();
+
+        for (int socket : ready)
+        {
+            auto it = connections.find(socket);
+            if (it == connections.end())
+            {
+                continue;
+            }
+            it->second.lastActive = loopTime;
+            if (it->second.paused)
+            {
+                // Dispatched once the connection resumes.
+                continue;
+            }
+            if (network.dispatchBuffered(socket, it->second.decoder,
+                                         it->second.arena) < 0)
+            {
+                closeConnection(socket);
+                continue;
+            }
+            updateBackpressure(socket, it->second);
+        }
+        for (int socket : closing)
+        {
+            closeConnection(socket);
+        }
+        ready.clear();
+        closing.clear();
+
+        // Completed writes shrink the queues without an event of their own.
+        std::vector<int> queuedSockets(backlogged.begin(), backlogged.end());
+        for (int socket : queuedSockets)
+        {
+            if (drainOutbound(socket) < 0)
+            {
+                closeConnection(socket);
+            }
+        }
+        expireIdle();
+    }
+}
+
+int EventLoop::serviceConnection(int socket)
+{
+    auto it = connections.find(socket);
+    if (it == connections.end())
+    {
+        return 0;
+    }
+    Connection &connection = it->second;
+    connection.lastActive = loopTime;
+    FrameDecoder &decoder = connection.decoder;
+    bool peerClosed = false;
+    if (connection.paused)
+    {
+        // Read once the connection resumes.
+        return 0;
+    }
+
+    // Drain the socket completely before parsing, unless the buffer fills
+    // up first: then the frames it holds are dispatched to make room, so a
+    // peer sending faster than we parse cannot grow it without bound. The
+    // rest stays in the socket if that pauses the connection.
+    while (true)
+    {
+        if (decoder.size() == decoder.capacity())
+        {
+            if (network.dispatchBuffered(socket, decoder, connection.arena) < 0)
+            {
+                return -1;
+            }
+            updateBackpressure(socket, connection);
+            if (connection.paused)
+            {
+                return 0;
+            }
+        }
+        int n = decoder.readFrom(*transport, socket);
+        if (n > 0)
+        {
+            continue;
+        }
+        if (n == 0)
+        {
+            peerClosed = true;
+            break;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        return -1;
+    }
+
+    if (network.dispatchBuffered(socket, decoder, connection.arena) < 0)
+    {
+        return -1;
+    }
+    updateBackpressure(socket, connection);
+
+    return peerClosed ? -1 : 0;
+}
+
+void EventLoop::runPosted()
+{
+    std::vector<PostedTask> tasks;
+    {
+        std::unique_lock lock(pendingLock);
+        tasks.swap(postedTasks);
+    }
+
+    for (PostedTask &posted : tasks)
+    {
+        auto it = connections.find(posted.socket);
+        if (it == connections.end())
+        {
+            continue;
+        }
+        if (it->second.paused)
+        {
+            it->second.deferred.push_back(std::move(posted));
+            deferredPushes++;
+            continue;
+        }
+        if (runTask(posted) < 0)
+        {
+            closeConnection(posted.socket);
+        }
+    }
+}
+
+int EventLoop::runTask(PostedTask &posted)
+{
+    Network::Message message = posted.task();
+    if (message.operation == Network::NO_RETURN)
+    {
+        return 0;
+    }
+    Network::OutputBuffer output;
+    network.queueMessage(output, message, posted.version);
+    if (network.flush(posted.socket, output) < 0)
+    {
+        return -1;
+    }
+    updateBackpressure(posted.socket, connections[posted.socket]);
+    return 0;
+}
+
+int EventLoop::drainOutbound(int socket)
+{
+    auto it = connections.find(socket);
+    if (it == connections.end())
+    {
+        return 0;
+    }
+    if (transport->drain(socket) < 0)
+    {
+        return -1;
+    }
+    updateBackpressure(socket, it->second);
+    if (it->second.paused && it->second.queued <= lowWater)
+    {
+        return resumeConnection(socket);
+    }
+    return 0;
+}
+
+void EventLoop::updateBackpressure(int socket, Connection &connection)
+{
+    size_t queued = transport->queued(socket);
+    if (queued == connection.queued)
+    {
+        return;
+    }
+    queuedBytes += queued;
+    queuedBytes -= connection.queued;
+    connection.queued = queued;
+    if (queued > peakQueuedBytes)
+    {
+        peakQueuedBytes = queued;
+    }
+
+    if (queued == 0)
+    {
+        backlogged.erase(socket);
+        return;
+    }
+    backlogged.insert(socket);
+    if (!connection.paused && highWater > 0 && queued > highWater)
+    {
+        connection.paused = true;
+        pausedConnections++;
+        pauses++;
+        if (backend == URING)
+        {
+            uring->pauseReceive(socket);
+        }
+    }
+}
+
+int EventLoop::resumeConnection(int socket)
+{
+    Connection &connection = connections[socket];
+    connection.paused = false;
+    pausedConnections--;
+    if (backend == URING)
+    {
+        uring->resumeReceive(socket);
+    }
+
+    std::vector<PostedTask> deferred;
+    deferred.swap(connection.deferred);
+    for (size_t i = 0; i < deferred.size(); i++)
+    {
+        if (connection.paused)
+        {
+            // The replayed pushes filled the queue again.
+            connection.deferred.insert(connection.deferred.end(),
+                                       std::make_move_iterator(deferred.begin() + i),
+                                       std::make_move_iterator(deferred.end()));
+            return 0;
+        }
+        if (runTask(deferred[i]) < 0)
+        {
+            return -1;
+        }
+    }
+    if (connection.paused)
+    {
+        return 0;
+    }
+
+    // An `EPOLL` socket is read again; a `URING` one only has to dispatch
+    // what its receive delivered before it was cancelled.
+    if (backend == EPOLL)
+    {
+        return serviceConnection(socket);
+    }
+    if (network.dispatchBuffered(socket, connection.decoder, connection.arena) < 0)
+    {
+        return -1;
+    }
+    updateBackpressure(socket, connection);
+    return 0;
+}
+
+void EventLoop::closeConnection(int socket)
+{
+    auto it = connections.find(socket);
+    if (it == connections.end())
+    {
+        return;
+    }
+    queuedBytes -= it->second.queued;
+    if (it->second.paused)
+    {
+        pausedConnections--;
+    }
+    connections.erase(it);
+    backlogged.erase(socket);
+    timers.cancel(socket);
+    transport->forget(socket);
+    if (closeHandler)
+    {
+        closeHandler(socket);
+    }
+
+    if (backend == URING)
+    {
+        // The armed receive holds a reference to the socket; shutting it down
+        // completes the receive so the socket is really released on close().
+        uring->unwatch(socket);
+        shutdown(socket, SHUT_RDWR);
+    }
+    else
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, nullptr);
+    }
+    close(socket);
+}
+
+void EventLoop::expireIdle()
+{
+    timers.advance(loopTime, [this](uint64_t socket)
+    {
+        checkIdle(socket);
+    });
+}
+
+void EventLoop::checkIdle(int socket)
+{
+    auto it = connections.find(socket);
+    if (it == connections.end())
+    {
+        return;
+    }
+    Connection &connection = it->second;
+
+    IdlePolicy policy = idlePolicy;
+    if (!connection.answersPings)
+    {
+        policy.heartbeatMillis = 0;
+    }
+    uint64_t deadline;
+    IdlePolicy::Action action = policy.check(connection.lastActive, connection.lastPing,
+                                             loopTime, deadline);
+    if (action == IdlePolicy::EVICT)
+    {
+        evictions++;
+        closeConnection(socket);
+        return;
+    }
+    if (action == IdlePolicy::PING)
+    {
+        // The oldest header, so every client version understands it.
+        connection.lastPing = loopTime;
+        Network::OutputBuffer output;
+        network.queueMessage(output, {Network::PING}, MIN_VERSION);
+        if (network.flush(socket, output) < 0)
+        {
+            closeConnection(socket);
+            return;
+        }
+    }
+    if (deadline != UINT64_MAX)
+    {
+        timers.schedule(socket, deadline);
+    }
+}
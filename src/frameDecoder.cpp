@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <string.h>
+
+#include "frameDecoder.hpp"
+
+FrameDecoder::FrameDecoder(size_t capacity)
+    : storage(std::max(capacity, (size_t)1)), head(0), count(0)
+{
+}
+
+void FrameDecoder::append(const char *data, size_t length)
+{
+    reserve(length);
+
+    size_t tail = (head + count) % storage.size();
+    size_t first = std::min(length, storage.size() - tail);
+    memcpy(&storage[tail], data, first);
+    memcpy(&storage[0], data + first, length - first);
+    count += length;
+}
+
+int FrameDecoder::readFrom(Transport &transport, int socket)
+{
+    if (count == storage.size())
+    {
+        reserve(storage.size());
+    }
+
+    // The free space is at most two regions: from the tail to the end of the
+    // ring, then from the start of the ring up to the head.
+    size_t tail = (head + count) % storage.size();
+    struct iovec iov[2];
+    int regions = 1;
+    if (tail >= head)
+    {
+        iov[0] = {&storage[tail], storage.size() - tail};
+        iov[1] = {&storage[0], head};
+        regions = head > 0 ? 2 : 1;
+    }
+    else
+    {
+        iov[0] = {&storage[tail], head - tail};
+    }
+
+    int err = transport.receive(socket, iov, regions);
+    if (err > 0)
+    {
+        count += err;
+    }
+    return err;
+}
+
+const char *FrameDecoder::peek(size_t offset, size_t length)
+{
+    size_t start = (head + offset) % storage.size();
+    if (start + length > storage.size())
+    {
+        // Rare: the range wraps. Rotate the ring so the buffered bytes start at
+        // index 0 and are contiguous.
+        std::rotate(storage.begin(), storage.begin() + head, storage.end());
+        head = 0;
+        start = offset;
+    }
+    return &storage[start];
+}
+
+void FrameDecoder::consume(size_t length)
+{
+    length = std::min(length, count);
+    count -= length;
+    // Restart at the beginning once empty so later frames rarely wrap.
+    head = count == 0 ? 0 : (head + length) % storage.size();
+}
+
+void FrameDecoder::reserve(size_t length)
+{
+    if (storage.size() - count >= length)
+    {
+        return;
+    }
+
+    // Unwrap into a larger buffer.
+    size_t capacity = storage.size();
+    while (capacity - count < length)
+    {
+        capacity *= 2;
+    }
+    std::vector<char> grown(capacity);
+    size_t first = std::min(count, storage.size() - head);
+    memcpy(&grown[0], &storage[head], first);
+    memcpy(&grown[first], &storage[0], count - first);
+    storage.swap(grown);
+    head = 0;
+}
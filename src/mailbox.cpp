@@ -0,0 +1,592 @@
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <mutex>
+#include <new>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "epoch.hpp"
+#include "mailbox.hpp"
+
+// Bytes of spilled messages buffered before they are written, and read at
+// once when they are read back.
+#define SPILL_BUFFER_LENGTH (64 << 10)
+// Sequence number, sender ID and length in front of every spilled message.
+#define SPILL_HEADER_LENGTH 16
+
+static int64_t now()
+{
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+static int writeAll(int fd, const std::string &bytes)
+{
+    size_t written = 0;
+    while (written < bytes.size())
+    {
+        ssize_t n = write(fd, bytes.data() + written, bytes.size() - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+Mailbox::Mailbox(std::shared_ptr<std::atomic<uint64_t>> queuedBytes)
+    : count(0), bytes(0), queuedBytes(std::move(queuedBytes)), lastDrained(now()),
+      spillOffset(0), owner(FREE)
+{
+    // The queue always holds a record whose message was already taken.
+    tail = allocateRecord(0, "", 0);
+    head = tail;
+}
+
+Mailbox::~Mailbox()
+{
+    while (tail != nullptr)
+    {
+        Record *next = tail->next.load(std::memory_order_relaxed);
+        releaseRecord(tail);
+        tail = next;
+    }
+    detach();
+    if (!spillPath.empty())
+    {
+        unlink(spillPath.c_str());
+    }
+}
+
+void Mailbox::detach()
+{
+    size_t held = bytes.fetch_or(DETACHED);
+    if (queuedBytes && !(held & DETACHED))
+    {
+        *queuedBytes -= held;
+    }
+}
+
+void Mailbox::addBytes(size_t added)
+{
+    // Counted in `queuedBytes` first, so a detach in between never takes
+    // away bytes that were not added yet.
+    if (queuedBytes)
+    {
+        *queuedBytes += added;
+    }
+    if ((bytes.fetch_add(added) & DETACHED) && queuedBytes)
+    {
+        *queuedBytes -= added;
+    }
+}
+
+void Mailbox::removeBytes(size_t removed)
+{
+    if (!(bytes.fetch_sub(removed) & DETACHED) && queuedBytes)
+    {
+        *queuedBytes -= removed;
+    }
+}
+
+Mailbox::Record *Mailbox::allocateRecord(uint32_t sender, std::string_view data,
+                                         uint64_t sequence)
+{
+    bool inlined = data.size() <= INLINE_BYTES;
+    Record *record = (Record *)RecordSlab::allocate(
+        sizeof(Record) + (inlined ? data.size() : sizeof(char *)));
+    new (&record->next) std::atomic<Record *>(nullptr);
+    record->sequence = sequence;
+    record->sender = sender;
+    record->length = data.size();
+    char *payload = reinterpret_cast<char *>(record) + sizeof(Record);
+    if (inlined)
+    {
+        memcpy(payload, data.data(), data.size());
+    }
+    else
+    {
+        char *stored = new char[data.size()];
+        memcpy(stored, data.data(), data.size());
+        memcpy(payload, &stored, sizeof(stored));
+    }
+    return record;
+}
+
+void Mailbox::releasePayload(Record *record)
+{
+    if (record->length > INLINE_BYTES)
+    {
+        char *stored;
+        memcpy(&stored, reinterpret_cast<char *>(record) + sizeof(Record), sizeof(stored));
+        delete[] stored;
+        stored = nullptr;
+        memcpy(reinterpret_cast<char *>(record) + sizeof(Record), &stored, sizeof(stored));
+    }
+}
+
+void Mailbox::releaseRecord(Record *record)
+{
+    releasePayload(record);
+    bool inlined = record->length <= INLINE_BYTES;
+    RecordSlab::release(record, sizeof(Record) + (inlined ? record->length : sizeof(char *)));
+}
+
+std::string_view Mailbox::dataOf(const Record *record)
+{
+    const char *payload = reinterpret_cast<const char *>(record) + sizeof(Record);
+    if (record->length <= INLINE_BYTES)
+    {
+        return std::string_view(payload, record->length);
+    }
+    const char *stored;
+    memcpy(&stored, payload, sizeof(stored));
+    return std::string_view(stored, record->length);
+}
+
+size_t Mailbox::bytesOf(const Record *record)
+{
+    if (record->length <= INLINE_BYTES)
+    {
+        return sizeof(Record) + record->length;
+    }
+    return sizeof(Record) + sizeof(char *) + record->length;
+}
+
+int Mailbox::push(std::string_view sender, std::string_view data, uint64_t sequence)
+{
+    uint32_t id = Usernames::intern(sender);
+    if (id == Usernames::NO_ID)
+    {
+        return -1;
+    }
+    push(id, data, sequence);
+    return 0;
+}
+
+void Mailbox::push(uint32_t sender, std::string_view data, uint64_t sequence)
+{
+    Record *record = allocateRecord(sender, data, sequence);
+    addBytes(bytesOf(record));
+    // Counted first, so a drain that sees no messages counted has seen all.
+    count++;
+    Record *previous = head.exchange(record);
+    previous->next.store(record);
+}
+
+size_t Mailbox::drain(const std::function<void(uint64_t sequence, std::string_view sender,
+                                              std::string_view data)> &visit,
+                      uint64_t maxBytes)
+{
+    size_t drained = 0;
+    uint64_t budget = maxBytes;
+    while (true)
+    {
+        int expected = FREE;
+        if (!owner.compare_exchange_strong(expected, DRAINING))
+        {
+            if (expected == DRAINING)
+            {
+                return drained;
+            }
+            // A peek does not deliver what it reads, so wait it out.
+            std::this_thread::yield();
+            continue;
+        }
+
+        lastDrained = now();
+        size_t round = 0;
+        // Spilled messages are older than every message in memory.
+        if (!spillPath.empty())
+        {
+            int64_t spilled = readSpill(visit, true, budget);
+            if (spilled < 0 || budget == 0)
+            {
+                // The rest is delivered by a later drain, still in order.
+                owner.store(FREE);
+                return drained + std::max<int64_t>(spilled, 0);
+            }
+            round += spilled;
+            unlink(spillPath.c_str());
+            spillPath.clear();
+            spillOffset = 0;
+        }
+
+        Record *next;
+        while (budget > 0 && (next = tail->next.load()) != nullptr)
+        {
+            releaseRecord(tail);
+            tail = next;
+            count--;
+            round++;
+            size_t recordBytes = bytesOf(next);
+            std::string_view sender = Usernames::nameOf(next->sender);
+            std::string_view data = dataOf(next);
+            visit(next->sequence, sender, data);
+            budget -= std::min<uint64_t>(budget, sender.size() + data.size());
+            // A long payload is freed once delivered rather than kept until
+            // the record is.
+            releasePayload(next);
+            removeBytes(recordBytes);
+        }
+        owner.store(FREE);
+        drained += round;
+
+        // A push that found the mailbox claimed left its message to us. One
+        // that has not linked its record yet will drain once it has.
+        if (count.load() == 0 || budget == 0)
+        {
+            return drained;
+        }
+        if (round == 0)
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+int Mailbox::peek(const std::function<void(uint64_t sequence, std::string_view sender,
+                                            std::string_view data)> &visit)
+{
+    int expected = FREE;
+    while (!owner.compare_exchange_weak(expected, PEEKING))
+    {
+        expected = FREE;
+        std::this_thread::yield();
+    }
+    uint64_t budget = UINT64_MAX;
+    if (!spillPath.empty() && readSpill(visit, false, budget) < 0)
+    {
+        owner.store(FREE);
+        return -1;
+    }
+    for (Record *record = tail->next.load(); record != nullptr; record = record->next.load())
+    {
+        visit(record->sequence, Usernames::nameOf(record->sender), dataOf(record));
+    }
+    owner.store(FREE);
+    return 0;
+}
+
+int64_t Mailbox::spill(const std::string &path)
+{
+    int expected = FREE;
+    if (!owner.compare_exchange_strong(expected, SPILLING))
+    {
+        return 0;
+    }
+    if (tail->next.load() == nullptr)
+    {
+        owner.store(FREE);
+        return 0;
+    }
+
+    bool created = spillPath.empty();
+    const std::string &file = created ? path : spillPath;
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    off_t start = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+    if (start < 0)
+    {
+        perror("open spill file");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        owner.store(FREE);
+        return -1;
+    }
+
+    // Messages pushed while this runs stay in memory, behind the spilled
+    // ones.
+    Record *last = tail;
+    size_t freed = 0;
+    bool failed = false;
+    std::string buffer;
+    for (Record *record = tail->next.load(); record != nullptr && !failed;
+         record = record->next.load())
+    {
+        char header[SPILL_HEADER_LENGTH];
+        memcpy(header, &record->sequence, 8);
+        memcpy(header + 8, &record->sender, 4);
+        memcpy(header + 12, &record->length, 4);
+        buffer.append(header, sizeof(header));
+        buffer += dataOf(record);
+        freed += bytesOf(record);
+        last = record;
+        if (buffer.size() >= SPILL_BUFFER_LENGTH)
+        {
+            failed = writeAll(fd, buffer) < 0;
+            buffer.clear();
+        }
+    }
+    failed = failed || writeAll(fd, buffer) < 0;
+    if (failed)
+    {
+        perror("write spill file");
+        // Keep the file as it was, so reading it back stays in step.
+        if (ftruncate(fd, start) < 0)
+        {
+            perror("truncate spill file");
+        }
+    }
+    close(fd);
+    if (failed)
+    {
+        if (created)
+        {
+            unlink(path.c_str());
+        }
+        owner.store(FREE);
+        return -1;
+    }
+
+    if (created)
+    {
+        spillPath = path;
+    }
+    while (tail != last)
+    {
+        Record *next = tail->next.load();
+        releaseRecord(tail);
+        tail = next;
+    }
+    releasePayload(last);
+    removeBytes(freed);
+    owner.store(FREE);
+    return freed;
+}
+
+int64_t Mailbox::readSpill(const std::function<void(uint64_t sequence, std::string_view sender,
+                                                   std::string_view data)> &visit,
+                           bool consume, uint64_t &budget)
+{
+    int fd = open(spillPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("open spill file");
+        return -1;
+    }
+
+    // Read in order, a buffer at a time. A message longer than the buffer
+    // grows it until the message fits.
+    int64_t read = 0;
+    std::string buffer;
+    // File offset of the first byte of `buffer`, and of the next message.
+    uint64_t offset = spillOffset;
+    size_t start = 0;
+    ssize_t n = 0;
+    while (budget > 0)
+    {
+        size_t available = buffer.size() - start;
+        size_t needed = SPILL_HEADER_LENGTH;
+        if (available >= SPILL_HEADER_LENGTH)
+        {
+            uint32_t length;
+            memcpy(&length, buffer.data() + start + 12, 4);
+            needed += length;
+        }
+        if (available >= needed)
+        {
+            uint64_t sequence;
+            uint32_t sender;
+            memcpy(&sequence, buffer.data() + start, 8);
+            memcpy(&sender, buffer.data() + start + 8, 4);
+            std::string_view name = Usernames::nameOf(sender);
+            visit(sequence, name,
+                  std::string_view(buffer.data() + start + SPILL_HEADER_LENGTH,
+                                   needed - SPILL_HEADER_LENGTH));
+            budget -= std::min<uint64_t>(budget, name.size() + needed - SPILL_HEADER_LENGTH);
+            start += needed;
+            read++;
+            if (consume)
+            {
+                spillOffset += needed;
+                count--;
+            }
+            continue;
+        }
+
+        // Move the part of the next message already read to the front and
+        // read on behind it.
+        buffer.erase(0, start);
+        offset += start;
+        start = 0;
+        size_t end = buffer.size();
+        buffer.resize(std::max<size_t>(needed, SPILL_BUFFER_LENGTH));
+        n = pread(fd, &buffer[end], buffer.size() - end, offset + end);
+        buffer.resize(end + std::max<ssize_t>(n, 0));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+    }
+    close(fd);
+
+    if (n < 0)
+    {
+        perror("read spill file");
+        return -1;
+    }
+    if (budget > 0 && !buffer.empty())
+    {
+        fprintf(stderr, "Spill file %s ends inside a message\n", spillPath.c_str());
+        return -1;
+    }
+    return read;
+}
+
+uint64_t MailboxDirectory::spillColdest(uint64_t target)
+{
+    Epoch::Guard guard;
+    std::vector<std::pair<int64_t, Mailbox *>> candidates;
+    forEach([&candidates](const std::string &user, Mailbox &mailbox)
+    {
+        if (mailbox.memoryBytes() > 0)
+        {
+            candidates.emplace_back(mailbox.getLastDrained(), &mailbox);
+        }
+    });
+    std::sort(candidates.begin(), candidates.end());
+
+    uint64_t freed = 0;
+    for (size_t minimum : {MIN_SPILL_BYTES, (size_t)1})
+    {
+        for (auto &[lastDrained, mailbox] : candidates)
+        {
+            if (queuedBytes->load() <= target)
+            {
+                return freed;
+            }
+            if (mailbox->memoryBytes() < minimum)
+            {
+                continue;
+            }
+            std::string path = spillDirectory + "/mailbox-" + std::to_string(spillFiles++) +
+                               ".spill";
+            freed += std::max<int64_t>(mailbox->spill(path), 0);
+        }
+    }
+    return freed;
+}
+
+MailboxDirectory::MailboxDirectory(size_t shards)
+{
+    size_t count = 1;
+    while (count < shards)
+    {
+        count <<= 1;
+    }
+    mask = count - 1;
+    this->shards = std::make_unique<Shard[]>(count);
+}
+
+MailboxDirectory::~MailboxDirectory()
+{
+    for (size_t i = 0; i <= mask; i++)
+    {
+        for (auto &[user, mailbox] : shards[i].mailboxes)
+        {
+            delete mailbox;
+        }
+    }
+}
+
+MailboxDirectory::Shard &MailboxDirectory::shardOf(const std::string &user)
+{
+    size_t hash = std::hash<std::string>()(user);
+    return shards[(hash ^ (hash >> 32)) & mask];
+}
+
+Mailbox *MailboxDirectory::lookup(Shard &shard, const std::string &user)
+{
+    std::shared_lock lock(shard.lock);
+    auto it = shard.mailboxes.find(user);
+    return it != shard.mailboxes.end() ? it->second : nullptr;
+}
+
+Mailbox &MailboxDirectory::get(const std::string &user)
+{
+    Shard &shard = shardOf(user);
+    Mailbox *mailbox = lookup(shard, user);
+    if (mailbox != nullptr)
+    {
+        return *mailbox;
+    }
+
+    std::unique_lock lock(shard.lock);
+    Mailbox *&slot = shard.mailboxes[user];
+    if (slot == nullptr)
+    {
+        slot = new Mailbox(queuedBytes);
+        // Under the lock, so no other thread sees the mailbox before it
+        // holds its older messages.
+        if (source != nullptr)
+        {
+            source->load(user, slot);
+        }
+    }
+    return *slot;
+}
+
+Mailbox *MailboxDirectory::find(const std::string &user)
+{
+    Mailbox *mailbox = lookup(shardOf(user), user);
+    if (mailbox == nullptr && source != nullptr && source->contains(user))
+    {
+        mailbox = &get(user);
+    }
+    return mailbox;
+}
+
+bool MailboxDirectory::erase(const std::string &user)
+{
+    Mailbox *mailbox;
+    {
+        Shard &shard = shardOf(user);
+        std::unique_lock lock(shard.lock);
+        bool stored = source != nullptr && source->contains(user);
+        if (source != nullptr)
+        {
+            source->load(user, nullptr);
+        }
+        auto it = shard.mailboxes.find(user);
+        if (it == shard.mailboxes.end())
+        {
+            return stored;
+        }
+        mailbox = it->second;
+        shard.mailboxes.erase(it);
+    }
+    // Its messages are gone as far as the budget is concerned, even while
+    // threads that found it earlier keep it alive.
+    mailbox->detach();
+    Epoch::retire(mailbox);
+    return true;
+}
+
+void MailboxDirectory::forEach(const std::function<void(const std::string &user,
+                                                        Mailbox &mailbox)> &visit)
+{
+    for (size_t i = 0; i <= mask; i++)
+    {
+        std::shared_lock lock(shards[i].lock);
+        for (auto &[user, mailbox] : shards[i].mailboxes)
+        {
+            visit(user, *mailbox);
+        }
+    }
+}
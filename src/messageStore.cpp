@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <string.h>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "messageStore.hpp"
+
+namespace
+{
+
+const size_t NAME_SHARDS = 64;
+// IDs per chunk of the name table. Chunks are allocated as IDs reach them
+// and cover every 32-bit ID between them, `NO_ID` aside.
+const size_t NAMES_PER_CHUNK = 1 << 16;
+const size_t NAME_CHUNKS = 1 << 16;
+// Bytes of name storage allocated at once. Longer names get their own.
+const size_t NAME_BLOCK_BYTES = 64 << 10;
+
+struct alignas(64) NameShard
+{
+    std::shared_mutex lock;
+    std::unordered_map<std::string_view, uint32_t> ids;
+    // Rest of the block names are copied into. Names never move, so the
+    // keys of `ids` and the name table point at them.
+    char *block = nullptr;
+    size_t blockLeft = 0;
+};
+
+NameShard nameShards[NAME_SHARDS];
+std::atomic<uint32_t> nextNameId{0};
+std::atomic<std::string_view *> nameChunks[NAME_CHUNKS];
+
+const size_t CLASS_STEP = 8;
+const size_t RECORD_CLASSES = RecordSlab::MAX_RECORD_BYTES / CLASS_STEP;
+// Free records moved between a thread's cache and the shared lists at once.
+// A thread keeps at most twice as many per class.
+const size_t CACHE_BATCH = 64;
+
+struct FreeRecord
+{
+    FreeRecord *next;
+};
+
+/**
+ * Free records of one class that no thread holds. Batches are lists of free
+ * records; regions are parts of slabs never handed out, left by threads
+ * that exited.
+*/
+struct SharedClass
+{
+    std::mutex lock;
+    std::vector<std::pair<FreeRecord *, size_t>> batches;
+    std::vector<std::pair<char *, char *>> regions;
+};
+
+SharedClass sharedClasses[RECORD_CLASSES];
+std::atomic<uint64_t> slabBytes{0};
+
+size_t classOf(size_t bytes)
+{
+    return (std::max<size_t>(bytes, 1) - 1) / CLASS_STEP;
+}
+
+/**
+ * The calling thread's free records, and the part of its latest slab of each
+ * class not handed out yet. Given back to the shared lists when the thread
+ * exits.
+*/
+struct LocalCache
+{
+    FreeRecord *lists[RECORD_CLASSES] = {};
+    size_t counts[RECORD_CLASSES] = {};
+    char *carved[RECORD_CLASSES] = {};
+    char *carvedEnd[RECORD_CLASSES] = {};
+
+    ~LocalCache()
+    {
+        for (size_t c = 0; c < RECORD_CLASSES; c++)
+        {
+            std::unique_lock guard(sharedClasses[c].lock);
+            if (lists[c] != nullptr)
+            {
+                sharedClasses[c].batches.emplace_back(lists[c], counts[c]);
+            }
+            if (carved[c] != carvedEnd[c])
+            {
+                sharedClasses[c].regions.emplace_back(carved[c], carvedEnd[c]);
+            }
+        }
+    }
+};
+
+LocalCache &localCache()
+{
+    thread_local LocalCache cache;
+    return cache;
+}
+
+}
+
+uint32_t Usernames::intern(std::string_view name)
+{
+    NameShard &shard = nameShards[std::hash<std::string_view>()(name) % NAME_SHARDS];
+    {
+        std::shared_lock lock(shard.lock);
+        auto it = shard.ids.find(name);
+        if (it != shard.ids.end())
+        {
+            return it->second;
+        }
+    }
+
+    std::unique_lock lock(shard.lock);
+    auto it = shard.ids.find(name);
+    if (it != shard.ids.end())
+    {
+        return it->second;
+    }
+
+    // IDs are never reused, so once they run out new names are refused
+    // rather than given IDs that records still point to.
+    uint32_t id = nextNameId.load();
+    do
+    {
+        if (id == NO_ID)
+        {
+            return NO_ID;
+        }
+    } while (!nextNameId.compare_exchange_weak(id, id + 1));
+
+    char *stored;
+    if (name.size() > NAME_BLOCK_BYTES / 4)
+    {
+        stored = new char[name.size()];
+    }
+    else
+    {
+        if (shard.blockLeft < name.size())
+        {
+            shard.block = new char[NAME_BLOCK_BYTES];
+            shard.blockLeft = NAME_BLOCK_BYTES;
+        }
+        stored = shard.block;
+        shard.block += name.size();
+        shard.blockLeft -= name.size();
+    }
+    memcpy(stored, name.data(), name.size());
+    std::string_view copy(stored, name.size());
+
+    std::atomic<std::string_view *> &chunk = nameChunks[id / NAMES_PER_CHUNK];
+    std::string_view *names = chunk.load();
+    if (names == nullptr)
+    {
+        // Another shard may be starting the same chunk.
+        std::string_view *fresh = new std::string_view[NAMES_PER_CHUNK];
+        if (chunk.compare_exchange_strong(names, fresh))
+        {
+            names = fresh;
+        }
+        else
+        {
+            delete[] fresh;
+        }
+    }
+    // Readers get the ID from this thread, after it is stored.
+    names[id % NAMES_PER_CHUNK] = copy;
+    shard.ids.emplace(copy, id);
+    return id;
+}
+
+std::string_view Usernames::nameOf(uint32_t id)
+{
+    return nameChunks[id / NAMES_PER_CHUNK].load(std::memory_order_acquire)[id % NAMES_PER_CHUNK];
+}
+
+size_t Usernames::size()
+{
+    return nextNameId.load();
+}
+
+void *RecordSlab::allocate(size_t bytes)
+{
+    size_t c = classOf(bytes);
+    LocalCache &cache = localCache();
+    size_t recordBytes = (c + 1) * CLASS_STEP;
+    if (cache.lists[c] == nullptr && cache.carved[c] == cache.carvedEnd[c])
+    {
+        // Records freed by other threads are reused before a new slab is
+        // carved.
+        SharedClass &shared = sharedClasses[c];
+        std::unique_lock guard(shared.lock);
+        if (!shared.batches.empty())
+        {
+            std::tie(cache.lists[c], cache.counts[c]) = shared.batches.back();
+            shared.batches.pop_back();
+        }
+        else if (!shared.regions.empty())
+        {
+            std::tie(cache.carved[c], cache.carvedEnd[c]) = shared.regions.back();
+            shared.regions.pop_back();
+        }
+        else
+        {
+            guard.unlock();
+            cache.carved[c] = new char[SLAB_BYTES];
+            cache.carvedEnd[c] = cache.carved[c] + SLAB_BYTES / recordBytes * recordBytes;
+            slabBytes += SLAB_BYTES;
+        }
+    }
+
+    FreeRecord *record = cache.lists[c];
+    if (record != nullptr)
+    {
+        cache.lists[c] = record->next;
+        cache.counts[c]--;
+        return record;
+    }
+    // Carved as needed, so slab pages are only touched once they are used.
+    void *carved = cache.carved[c];
+    cache.carved[c] += recordBytes;
+    return carved;
+}
+
+void RecordSlab::release(void *record, size_t bytes)
+{
+    size_t c = classOf(bytes);
+    LocalCache &cache = localCache();
+    FreeRecord *freed = (FreeRecord *)record;
+    freed->next = cache.lists[c];
+    cache.lists[c] = freed;
+    if (++cache.counts[c] < 2 * CACHE_BATCH)
+    {
+        return;
+    }
+
+    // Hand the older half to the threads that allocate.
+    FreeRecord *last = cache.lists[c];
+    for (size_t i = 1; i < CACHE_BATCH; i++)
+    {
+        last = last->next;
+    }
+    FreeRecord *batch = last->next;
+    last->next = nullptr;
+    cache.counts[c] = CACHE_BATCH;
+    std::unique_lock guard(sharedClasses[c].lock);
+    sharedClasses[c].batches.emplace_back(batch, CACHE_BATCH);
+}
+
+uint64_t RecordSlab::getSlabBytes()
+{
+    return slabBytes.load();
+}
@@ -1,128 +1,442 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
-#include <unistd.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <chrono>
 
 #include "network.hpp"
 
-// MAC and Linux have different names for telling the OS you have more data to
-// send.
-#ifdef __linux__
-    #define MSG_HAVEMORE MSG_MORE
-#endif
+// Longest varint encoding of a 64-bit value.
+#define MAX_VARINT_LENGTH 10
+// Longest header of any version: the packed header's version and operation
+// bytes followed by four varints, which also fits the struct header.
+#define MAX_HEADER_LENGTH (2 + 4 * MAX_VARINT_LENGTH)
 
-int Network::receiveOperation(int socket)
+/**
+ * Appends the varint encoding of `value` at `out`.
+ *
+ * @return  Pointer past the last byte written.
+*/
+static char *putVarint(char *out, uint64_t value)
 {
-    int err;
-    Metadata header;
+    while (value >= 0x80)
+    {
+        *out++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (char)value;
+    return out;
+}
 
-    // Read header from the socet.
-    err = read(socket, &header, sizeof(Metadata));
-    if (err < 0)
+/**
+ * Decodes the varint at the start of the `length` bytes at `in` into `value`.
+ *
+ * @return  Number of bytes consumed.
+ *          0 if the varint continues past `length`.
+ *          -1 if it is longer than any 64-bit value.
+*/
+static int getVarint(const char *in, size_t length, uint64_t &value)
+{
+    value = 0;
+    for (size_t i = 0; i < std::min(length, (size_t)MAX_VARINT_LENGTH); i++)
     {
-        return err;
+        uint8_t byte = in[i];
+        value |= (uint64_t)(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80))
+        {
+            return i + 1;
+        }
     }
-    // Version checking works to both ensure that the network protocols are in
-    // agreement as well make sure that the wire protocol is being followed at
-    // all.
-    if (header.version != VERSION)
+    return length >= MAX_VARINT_LENGTH ? -1 : 0;
+}
+
+Network::Network() : transport(std::make_shared<SocketTransport>()),
+                     zeroCopyThreshold(0), version(DEFAULT_VERSION),
+                     compressionThreshold(0),
+                     compressionStats(std::make_shared<CompressionStats>())
+{
+    maxFrameLengths.fill(DEFAULT_MAX_FRAME_LENGTH);
+}
+
+int Network::nextFrame(int socket, FrameDecoder &decoder, Arena &arena, Frame &frame)
+{
+    if (decoder.size() == 0)
     {
-        sendError(socket, "Incompatible protocol version.");
-        return -1;
+        return 0;
     }
 
-    // Read sender information if available.
-    std::string sender(header.senderLength, 0);
-    err = read(socket, &sender[0], header.senderLength);
-    if (err < 0)
+    // Version checking works to both ensure that the network protocols are
+    // in agreement as well make sure that the wire protocol is being followed
+    // at all.
+    Metadata header;
+    uint8_t flags;
+    int headerLength = decodeHeader(decoder, header, flags);
+    if (headerLength < 0)
     {
-        return err;
+        // Nothing in the header can be trusted, so it is answered in the
+        // endpoint's own version.
+        frame.message.version = 0;
+        frame.message.requestId = 0;
+        frame.error = "Incompatible protocol version.";
+        return -1;
+    }
+    if (headerLength == 0)
+    {
+        return 0;
     }
 
-    // Read receiver information if available.
-    std::string receiver(header.receiverLength, 0);
-    err = read(socket, &receiver[0], header.receiverLength);
-    if (err < 0)
+    // Check the lengths one by one so their sum cannot overflow.
+    uint64_t maxLength = maxFrameLengths[header.operation < MAX_OPCODES
+                                         ? header.operation : UNSUPPORTED_OP];
+    if (header.senderLength > maxLength ||
+        header.receiverLength > maxLength - header.senderLength ||
+        header.dataLength > maxLength - header.senderLength - header.receiverLength)
     {
-        return err;
+        frame.message.version = header.version;
+        frame.message.requestId = header.requestId;
+        frame.error = "Frame too large.";
+        return -1;
     }
 
-    // Read operation data.
-    std::string data(header.dataLength, 0);
-    err = read(socket, &data[0], header.dataLength);
-    if (err < 0)
+    // Leave partial frames in the buffer until the rest arrives.
+    size_t bodyLength = header.senderLength + header.receiverLength +
+                        header.dataLength;
+    if (decoder.size() < headerLength + bodyLength)
     {
-        return err;
+        return 0;
     }
 
-    // Construct Message object
-    Message message = {
+    // The fields are handed to the callback in place; nothing is copied out
+    // of the receive buffer unless a handler keeps it.
+    const char *field = decoder.peek(headerLength, bodyLength);
+    frame.message = {
         header.operation,
-        data,
-        sender,
-        receiver
+        std::string_view(field + header.senderLength + header.receiverLength,
+                         header.dataLength),
+        std::string_view(field, header.senderLength),
+        std::string_view(field + header.senderLength, header.receiverLength),
+        header.requestId,
+        socket,
+        header.version
     };
-    Message output;
+    frame.message.chunk = flags & CHUNK;
+    frame.length = headerLength + bodyLength;
+    frame.acceptsCompressed = flags & ACCEPTS_COMPRESSED;
 
-    // Check that a callback has been registered for the received operation.
-    if (registered_callbacks.find(header.operation) != registered_callbacks.end())
+    if (flags & COMPRESSED)
     {
-        
-        Callback func = registered_callbacks.at(header.operation);
-        output = func(message);
-        if (output.operation != NO_RETURN)
+        if (decompressPayload(frame.message.data, maxLength, arena,
+                              frame.message.data) < 0)
         {
-            err = sendMessage(socket, output);
+            frame.error = "Malformed compressed payload.";
+            return -1;
         }
     }
-    // Otherwise return an unsupported operation message.
-    else
+    return 1;
+}
+
+int Network::decodeHeader(FrameDecoder &decoder, Metadata &header,
+                          uint8_t &flagsOut)
+{
+    header = {};
+    flagsOut = 0;
+
+    if ((uint8_t)*decoder.peek(0, 1) == PACKED_VERSION)
     {
-        Message unsupportedOp = {UNSUPPORTED_OP};
-        err = sendMessage(socket, unsupportedOp);
+        size_t available = std::min(decoder.size(), (size_t)MAX_HEADER_LENGTH);
+        const char *bytes = decoder.peek(0, available);
+        if (available < 2)
+        {
+            return 0;
+        }
+        header.version = PACKED_VERSION;
+        header.operation = (OpCode)(bytes[1] & OPERATION_MASK);
+        flagsOut = bytes[1] & ~OPERATION_MASK;
+
+        size_t offset = 2;
+        uint64_t *fields[] = {
+            &header.requestId,
+            &header.senderLength,
+            &header.receiverLength,
+            &header.dataLength
+        };
+        for (uint64_t *field : fields)
+        {
+            int length = getVarint(bytes + offset, available - offset, *field);
+            if (length <= 0)
+            {
+                return length;
+            }
+            offset += length;
+        }
+        return offset;
     }
 
-    return err;
+    if (decoder.size() < sizeof(uint32_t))
+    {
+        return 0;
+    }
+    uint32_t version;
+    memcpy(&version, decoder.peek(0, sizeof(version)), sizeof(version));
+    if (version < MIN_VERSION || version >= PACKED_VERSION)
+    {
+        return -1;
+    }
+
+    // Version 1 headers are a prefix of version 2 headers; the request ID
+    // they lack stays zero.
+    size_t length = version >= 2 ? sizeof(Metadata) : offsetof(Metadata, requestId);
+    if (decoder.size() < length)
+    {
+        return 0;
+    }
+    memcpy(&header, decoder.peek(0, length), length);
+    return length;
 }
 
-int Network::sendMessage(int socket, Message message)
+size_t Network::encodeHeader(char *out, uint32_t version, const Message &message,
+                             size_t dataLength, uint8_t flags)
 {
-    // Setup protocol header.
+    if (version >= PACKED_VERSION)
+    {
+        char *end = out;
+        *end++ = (char)PACKED_VERSION;
+        *end++ = (char)(message.operation | flags);
+        end = putVarint(end, message.requestId);
+        end = putVarint(end, message.sender.size());
+        end = putVarint(end, message.receiver.size());
+        end = putVarint(end, dataLength);
+        return end - out;
+    }
+
     Metadata header = {
-        VERSION,
+        version,
         message.operation,
         message.sender.size(),
         message.receiver.size(),
-        message.data.size()
+        dataLength,
+        message.requestId
     };
+    size_t length = version >= 2 ? sizeof(Metadata) : offsetof(Metadata, requestId);
+    memcpy(out, &header, length);
+    return length;
+}
+
+Network::Message Network::answerHello(const MessageView &message)
+{
+    uint32_t requested = strtoul(std::string(message.data).c_str(), nullptr, 10);
+    uint32_t agreed = std::max((uint32_t)MIN_VERSION, std::min(requested, (uint32_t)VERSION));
+    return {HELLO, std::to_string(agreed)};
+}
 
-    int err;
-    
-    // Send header.
-    err = send(socket, &header, sizeof(Metadata), MSG_HAVEMORE);
-    if (err < 0)
+void Network::queueReply(const Frame &frame, Message reply, OutputBuffer &output)
+{
+    if (reply.operation == NO_RETURN)
     {
-        return err;
+        return;
     }
-    // Send sender information.
-    char* senderData = message.sender.data();
-    err = send(socket, senderData, message.sender.size(), MSG_HAVEMORE);
-    if (err < 0)
+    reply.requestId = frame.message.requestId;
+    queueMessage(output, std::move(reply), frame.message.version,
+                 frame.acceptsCompressed);
+}
+
+int Network::sendMessage(int socket, const Message &message)
+{
+    if (zeroCopyThreshold > 0 && message.data.size() >= zeroCopyThreshold)
     {
-        return err;
+        // Every buffer of a zero-copy send must outlive the send, including
+        // the header, so queue the frame and let `flush()` hold on to it.
+        OutputBuffer output;
+        queueMessage(output, message);
+        return flush(socket, output);
+    }
+
+    // Setup protocol header.
+    char header[MAX_HEADER_LENGTH];
+    size_t headerLength = encodeHeader(header, version, message, message.data.size(),
+                                       ACCEPTS_COMPRESSED);
+
+    // Send the header, sender, receiver and data in one syscall.
+    struct iovec iov[4] = {
+        {header, headerLength},
+        {(char *)message.sender.data(), message.sender.size()},
+        {(char *)message.receiver.data(), message.receiver.size()},
+        {(char *)message.data.data(), message.data.size()}
+    };
+
+    return transport->send(socket, iov, 4);
+}
+
+int Network::sendChunked(int socket, const Message &message, size_t chunkLength)
+{
+    if (version < PACKED_VERSION || chunkLength == 0)
+    {
+        return sendMessage(socket, message);
+    }
+
+    // Each chunk goes out on its own, so only one chunk's header is ever
+    // buffered. The final, empty chunk ends the payload.
+    size_t offset = 0;
+    int sent = 0;
+    while (true)
+    {
+        size_t length = std::min(chunkLength, message.data.size() - offset);
+        char header[MAX_HEADER_LENGTH];
+        size_t headerLength = encodeHeader(header, version, message, length,
+                                           ACCEPTS_COMPRESSED | CHUNK);
+        struct iovec iov[4] = {
+            {header, headerLength},
+            {(char *)message.sender.data(), message.sender.size()},
+            {(char *)message.receiver.data(), message.receiver.size()},
+            {(char *)message.data.data() + offset, length}
+        };
+        int err = transport->send(socket, iov, 4);
+        if (err < 0)
+        {
+            return err;
+        }
+        sent += err;
+        if (length == 0)
+        {
+            return sent;
+        }
+        offset += length;
+    }
+}
+
+void Network::queueMessage(OutputBuffer &output, Message message)
+{
+    queueMessage(output, message, version);
+}
+
+void Network::queueMessage(OutputBuffer &output, Message message,
+                           uint32_t version, bool compress)
+{
+    uint8_t flags = ACCEPTS_COMPRESSED;
+    if (compress && version >= PACKED_VERSION && compressionThreshold > 0 &&
+        message.data.size() >= compressionThreshold && compressPayload(message.data))
+    {
+        flags |= COMPRESSED;
+    }
+
+    char header[MAX_HEADER_LENGTH];
+    output.bytes.append(header, encodeHeader(header, version, message,
+                                             message.data.size(), flags));
+    output.bytes += message.sender;
+    output.bytes += message.receiver;
+
+    if (zeroCopyThreshold > 0 && message.data.size() >= zeroCopyThreshold)
+    {
+        output.largePayloads.emplace_back(
+            output.bytes.size(),
+            std::make_shared<std::string>(std::move(message.data)));
+    }
+    else
+    {
+        output.bytes += message.data;
     }
-    // Send receiver information.
-    char* receiverData = message.receiver.data();
-    err = send(socket, receiverData, message.receiver.size(), MSG_HAVEMORE);
-    if (err < 0)
+}
+
+int Network::flush(int socket, OutputBuffer &output)
+{
+    if (output.empty())
+    {
+        return 0;
+    }
+
+    if (output.largePayloads.empty())
     {
+        struct iovec iov = {output.bytes.data(), output.bytes.size()};
+        int err = transport->send(socket, &iov, 1);
+        output.bytes.clear();
         return err;
     }
-    // Send the rest of the data.
-    char* data = message.data.data();
-    err = send(socket, data, message.data.size(), 0);
 
+    // The kernel may still reference every buffer of a zero-copy send after
+    // it returns, so the encoded frames are handed over along with the
+    // payloads.
+    auto bytes = std::make_shared<std::string>(std::move(output.bytes));
+    std::vector<std::shared_ptr<std::string>> hold = {bytes};
+
+    // Interleave the encoded frames with the payloads kept aside.
+    std::vector<struct iovec> iov;
+    size_t offset = 0;
+    for (auto &[position, payload] : output.largePayloads)
+    {
+        iov.push_back({&(*bytes)[offset], position - offset});
+        iov.push_back({payload->data(), payload->size()});
+        hold.push_back(payload);
+        offset = position;
+    }
+    iov.push_back({&(*bytes)[offset], bytes->size() - offset});
+
+    int err = transport->sendZeroCopy(socket, iov.data(), iov.size(), hold);
+
+    output.bytes.clear();
+    output.largePayloads.clear();
     return err;
 }
 
+bool Network::compressPayload(std::string &data)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // The original length goes first so the receiver can size its buffer.
+    BufferPool &pool = BufferPool::local();
+    std::string compressed = pool.acquire(data.size());
+    char length[MAX_VARINT_LENGTH];
+    compressed.append(length, putVarint(length, data.size()) - length);
+    LzCodec::compress(data.data(), data.size(), compressed);
+    bool smaller = compressed.size() < data.size();
+
+    compressionStats->rawBytes += data.size();
+    compressionStats->compressedBytes += std::min(compressed.size(), data.size());
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    compressionStats->compressNanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    if (smaller)
+    {
+        compressionStats->framesCompressed++;
+        data.swap(compressed);
+    }
+    // Whichever buffer lost is recycled.
+    pool.release(std::move(compressed));
+    return smaller;
+}
+
+int Network::decompressPayload(std::string_view data, uint64_t maxLength, Arena &arena,
+                               std::string_view &payloadOut)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    uint64_t originalLength;
+    int lengthSize = getVarint(data.data(), data.size(), originalLength);
+    // A block expands at most 255 times, so larger claims are rejected before
+    // anything is allocated for them.
+    if (lengthSize <= 0 || originalLength > maxLength ||
+        originalLength > (data.size() - lengthSize) * 256)
+    {
+        return -1;
+    }
+
+    std::string &payload = arena.acquire(originalLength);
+    if (LzCodec::decompress(data.data() + lengthSize, data.size() - lengthSize,
+                            originalLength, payload) < 0)
+    {
+        return -1;
+    }
+    payloadOut = payload;
+
+    compressionStats->framesDecompressed++;
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    compressionStats->decompressNanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return 0;
+}
+
 int Network::sendError(int socket, std::string errorMsg)
 {
     Message message = {
@@ -133,7 +447,105 @@ int Network::sendError(int socket, std::string errorMsg)
     return sendMessage(socket, message);
 }
 
-void Network::registerCallback(OpCode operation, Callback function)
+void Network::encodeBatch(const std::vector<BatchEntry> &entries, std::string &out)
 {
-    registered_callbacks.insert(std::make_pair(operation, function));
+    char length[MAX_VARINT_LENGTH];
+    for (const BatchEntry &entry : entries)
+    {
+        out.append(length, putVarint(length, entry.receiver.size()) - length);
+        out += entry.receiver;
+        out.append(length, putVarint(length, entry.data.size()) - length);
+        out += entry.data;
+    }
+}
+
+int Network::decodeBatch(std::string_view data, std::vector<BatchEntry> &entriesOut)
+{
+    size_t position = 0;
+    while (position < data.size())
+    {
+        BatchEntry entry;
+        for (std::string *field : {&entry.receiver, &entry.data})
+        {
+            uint64_t length;
+            int lengthSize = getVarint(data.data() + position, data.size() - position,
+                                       length);
+            if (lengthSize <= 0 || length > data.size() - position - lengthSize)
+            {
+                return -1;
+            }
+            position += lengthSize;
+            field->assign(data, position, length);
+            position += length;
+        }
+        entriesOut.push_back(std::move(entry));
+    }
+    return 0;
+}
+
+void Network::encodeListPage(const ListPage &page, std::string &out)
+{
+    char length[MAX_VARINT_LENGTH];
+    out.append(length, putVarint(length, page.pageSize) - length);
+    out.append(length, putVarint(length, page.stream ? 1 : 0) - length);
+    for (const std::string *field : {&page.query, &page.cursor})
+    {
+        out.append(length, putVarint(length, field->size()) - length);
+        out += *field;
+    }
+}
+
+int Network::decodeListPage(std::string_view data, ListPage &pageOut)
+{
+    size_t position = 0;
+    uint64_t stream;
+    for (uint64_t *value : {&pageOut.pageSize, &stream})
+    {
+        int valueSize = getVarint(data.data() + position, data.size() - position, *value);
+        if (valueSize <= 0)
+        {
+            return -1;
+        }
+        position += valueSize;
+    }
+    pageOut.stream = stream != 0;
+
+    for (std::string *field : {&pageOut.query, &pageOut.cursor})
+    {
+        uint64_t length;
+        int lengthSize = getVarint(data.data() + position, data.size() - position, length);
+        if (lengthSize <= 0 || length > data.size() - position - lengthSize)
+        {
+            return -1;
+        }
+        position += lengthSize;
+        field->assign(data, position, length);
+        position += length;
+    }
+    return position == data.size() ? 0 : -1;
+}
+
+int Network::sendReply(const MessageView &request, Message reply)
+{
+    if (request.endpoint == nullptr)
+    {
+        return -1;
+    }
+    reply.requestId = request.requestId;
+    request.endpoint->queueMessage(*request.replies, std::move(reply), request.version,
+                                   request.acceptsCompressed);
+    return request.endpoint->flush(request.socket, *request.replies);
+}
+
+void Network::setMaxFrameLength(uint64_t bytes)
+{
+    maxFrameLengths.fill(bytes);
+}
+
+void Network::setMaxFrameLength(OpCode operation, uint64_t bytes)
+{
+    if (operation < MAX_OPCODES)
+    {
+        maxFrameLengths[operation] = bytes;
+    }
 }
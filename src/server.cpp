@@ -1,170 +1,1318 @@
+#include <algorithm>
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <signal.h>
 #include <unistd.h>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 
 #include "server.hpp"
 
-Server::Server(int port)
-{   
-    // Initialize socket
-    serverFd = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverFd < 0)
+// How often the spill thread checks the budget when no push wakes it.
+#define SPILL_CHECK_MILLIS 100
+
+/**
+ * Removes the spill files in `directory`.
+*/
+static void removeSpillFiles(const std::string &directory)
+{
+    DIR *listing = opendir(directory.c_str());
+    if (listing == nullptr)
     {
-        perror("socket()");
-        exit(1);
+        return;
     }
-    // Enable SO_REUSEADDR so that we dont get bind() errors if the previous
-    // socket is stuck in TIME_WAIT or hasn't been released by the OS.
-    int enable = 1;
-    if (setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+    while (dirent *entry = readdir(listing))
     {
-        perror("setsockopt()");
-        exit(1);
+        std::string name = entry->d_name;
+        if (name.size() > 6 && name.compare(name.size() - 6, 6, ".spill") == 0)
+        {
+            unlink((directory + "/" + name).c_str());
+        }
     }
+    closedir(listing);
+}
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
+/**
+ * The cursor of the page that follows `user`. Clients only ever hand it back,
+ * so its format may change.
+*/
+static std::string encodeCursor(const std::string &user)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string cursor = "u";
+    for (unsigned char c : user)
+    {
+        cursor += digits[c >> 4];
+        cursor += digits[c & 0xf];
+    }
+    return cursor;
+}
 
-    // Bind to port and mark as a listening socket.
-    if (bind(serverFd, (struct sockaddr *)&address, sizeof(address)) < 0)
+/**
+ * Sets `userOut` to the user a cursor from `encodeCursor()` follows, or to the
+ * empty string for the empty cursor of the first page.
+ *
+ * @return  -1 if `cursor` is malformed.
+*/
+static int decodeCursor(std::string_view cursor, std::string &userOut)
+{
+    userOut.clear();
+    if (cursor.empty())
     {
-        perror("bind()");
-        exit(1);
+        return 0;
+    }
+    if (cursor[0] != 'u' || cursor.size() % 2 == 0)
+    {
+        return -1;
+    }
+    auto digit = [](char c)
+    {
+        return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    };
+    for (size_t i = 1; i < cursor.size(); i += 2)
+    {
+        int high = digit(cursor[i]);
+        int low = digit(cursor[i + 1]);
+        if (high < 0 || low < 0)
+        {
+            return -1;
+        }
+        userOut += (char)(high << 4 | low);
     }
+    return 0;
+}
+
+Server::Server(int port) : Server(port, Options())
+{
+}
+
+Server::Server(int port, Options options)
+    : Server(Address::tcp("0.0.0.0", port), options)
+{
+}
 
-    if (listen(serverFd, 3) < 0)
+Server::Server(const Address &address, Options options)
+    : address(address), startTime(std::chrono::steady_clock::now()),
+      mode(options.mode), users(options.registryShards),
+      mailboxBudget(options.mailboxBudgetBytes), temporarySpillDirectory(false),
+      network(this), maxMessageLength(options.maxMessageLength),
+      idlePolicy{options.idleTimeoutMillis, options.heartbeatMillis}, idleEvictions(0)
+{
+    // Unix domain sockets cannot share a path, so their acceptors share one
+    // listening socket instead.
+    int acceptorCount = std::max(1, options.acceptors);
+    bool reusePort = acceptorCount > 1 && address.family == Address::TCP;
+    for (int i = 0; i < acceptorCount; i++)
     {
-        perror("listen()");
-        exit(1);
+        int socket = i == 0 || reusePort
+                         ? listenOn(address, options.backlog, reusePort)
+                         : acceptors[0]->socket;
+        if (socket < 0)
+        {
+            exit(1);
+        }
+        acceptors.push_back(std::make_unique<Acceptor>());
+        acceptors.back()->index = i;
+        acceptors.back()->socket = socket;
     }
 
     // Ignore SIGPIPE on unexpected client disconnects.
     signal(SIGPIPE, SIG_IGN);
 
-    // Register callbacks.
-    network.registerCallback(Network::CREATE, Callback(this, &Server::createAccount));
-    network.registerCallback(Network::DELETE, Callback(this, &Server::deleteAccount));
-    network.registerCallback(Network::SEND, Callback(this, &Server::sendMessage));
-    network.registerCallback(Network::LIST, Callback(this, &Server::listAccounts));
-    network.registerCallback(Network::REQUEST, Callback(this, &Server::requestMessages));
+    // Requests other than messages only carry a name.
+    network.setMaxFrameLength(std::min(options.maxFrameLength,
+                                       (size_t)MAX_NAME_FRAME_LENGTH));
+    network.setMaxFrameLength(Network::SEND, options.maxFrameLength);
+    network.setMaxFrameLength(Network::SEND_BATCH, options.maxFrameLength);
+    // A page query carries a search string and a username.
+    network.setMaxFrameLength(Network::LIST_PAGE,
+                              std::min(options.maxFrameLength,
+                                       (size_t)2 * MAX_NAME_FRAME_LENGTH));
+    network.setZeroCopyThreshold(options.zeroCopyThreshold);
+    network.setCompressionThreshold(options.compressionThreshold);
+
+    if (mailboxBudget > 0)
+    {
+        openSpillDirectory(options);
+    }
+    if (!options.dataDirectory.empty())
+    {
+        recover(options.dataDirectory, options);
+    }
 
     serverRunning = true;
+
+    if (log && options.snapshotIntervalMillis > 0)
+    {
+        snapshotThread = std::thread(&Server::snapshotPeriodically, this,
+                                     options.snapshotIntervalMillis);
+    }
+    if (mailboxBudget > 0)
+    {
+        spillThread = std::thread(&Server::spillOverBudget, this);
+    }
+
+    if (mode != THREAD_PER_CONNECTION)
+    {
+        int loopThreads = options.loopThreads;
+        if (loopThreads <= 0)
+        {
+            loopThreads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        EventLoop::Backend backend = mode == URING_LOOP ? EventLoop::URING
+                                                        : EventLoop::EPOLL;
+        for (int i = 0; i < loopThreads; i++)
+        {
+            loops.push_back(std::make_unique<EventLoop>(network, backend));
+            loops.back()->setCloseHandler([this](int socket)
+            {
+                connectionClosed(socket);
+            });
+            loops.back()->setIdlePolicy(idlePolicy);
+            loops.back()->setWaterMarks(options.outboundHighWater,
+                                        options.outboundLowWater);
+            loops.back()->start();
+        }
+    }
+    else if (idlePolicy.enabled())
+    {
+        reaperThread = std::thread(&Server::reapIdle, this);
+    }
+}
+
+Server::~Server()
+{
+    stopServer();
+    if (reaperThread.joinable())
+    {
+        reaperThread.join();
+    }
+    if (snapshotThread.joinable())
+    {
+        snapshotThread.join();
+    }
+    if (spillThread.joinable())
+    {
+        spillThread.join();
+    }
+    if (temporarySpillDirectory)
+    {
+        // The mailboxes' own files would only be removed after it.
+        removeSpillFiles(spillDirectory);
+        rmdir(spillDirectory.c_str());
+    }
+    for (auto &acceptor : acceptors)
+    {
+        if (acceptor->index == 0 || acceptor->socket != acceptors[0]->socket)
+        {
+            close(acceptor->socket);
+        }
+    }
+    if (address.family == Address::UNIX_SOCKET)
+    {
+        unlink(address.host.c_str());
+    }
 }
 
 void Server::stopServer()
 {
     serverRunning = false;
+
+    for (auto &acceptor : acceptors)
+    {
+        shutdown(acceptor->socket, SHUT_RDWR);
+    }
+
+    // End the blocking reads of thread-per-connection clients.
+    {
+        std::unique_lock lock(threadConnectionsLock);
+        for (auto &[socket, connection] : threadConnections)
+        {
+            shutdown(socket, SHUT_RDWR);
+        }
+    }
+    reaperWake.notify_all();
+    snapshotWake.notify_all();
+    spillWake.notify_all();
+
+    for (auto &loop : loops)
+    {
+        loop->stop();
+    }
+}
+
+uint64_t Server::getIdleEvictions()
+{
+    uint64_t evictions = idleEvictions;
+    for (auto &loop : loops)
+    {
+        evictions += loop->getEvictions();
+    }
+    return evictions;
+}
+
+OutboundStats Server::getOutboundStats()
+{
+    OutboundStats total = {};
+    for (auto &loop : loops)
+    {
+        OutboundStats stats = loop->getOutboundStats();
+        total.queuedBytes += stats.queuedBytes;
+        total.peakQueuedBytes = std::max(total.peakQueuedBytes, stats.peakQueuedBytes);
+        total.pausedConnections += stats.pausedConnections;
+        total.pauses += stats.pauses;
+        total.deferredPushes += stats.deferredPushes;
+    }
+    return total;
+}
+
+WriteAheadLog::Stats Server::getLogStats()
+{
+    return log ? log->getStats() : WriteAheadLog::Stats{};
+}
+
+uint64_t Server::getQueuedBytes()
+{
+    return mailboxes.getQueuedBytes();
 }
 
-Network::Message Server::createAccount(Network::Message info)
+void Server::recover(const std::string &directory, const Options &options)
 {
-    std::unique_lock lock(userListLock);
-    std::string newUser = info.data;
+    if (mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        perror("mkdir data directory");
+        exit(1);
+    }
+    dataDirectory = directory;
+
+    // Accounts are loaded up front. Mailboxes are read from the mapping as
+    // they are used.
+    uint64_t covered = 0;
+    restored = Snapshot::open(directory + "/snapshot");
+    if (restored)
+    {
+        covered = restored->getSequence();
+        restored->forEachUser(std::max(1u, std::thread::hardware_concurrency()),
+                              [this](std::string_view user)
+        {
+            users.insert(std::string(user));
+        });
+        mailboxes.setSource(restored.get());
+    }
+
+    // The first pass applies account changes and notes which messages a
+    // later record delivers or deletes, so the second pass can queue the
+    // others as it reads them rather than holding the log tail in memory.
+    std::unordered_map<std::string, std::unordered_set<uint64_t>> delivered;
+    std::unordered_map<std::string, uint64_t> deletedAt;
+    auto replay = [this, covered, &delivered, &deletedAt](WriteAheadLog::Record &record)
+    {
+        if (record.sequence <= covered)
+        {
+            return;
+        }
+        std::string user(record.user);
+        switch (record.type)
+        {
+        case WriteAheadLog::CREATE:
+            users.insert(user);
+            break;
+        case WriteAheadLog::DELETE:
+            users.erase(user);
+            delivered.erase(user);
+            deletedAt[user] = record.sequence;
+            mailboxes.erase(user);
+            break;
+        case WriteAheadLog::DEQUEUE:
+            // The snapshot may hold these messages too.
+            delivered[user].insert(record.sequences.begin(), record.sequences.end());
+            break;
+        case WriteAheadLog::ENQUEUE:
+            break;
+        }
+    };
+    log = std::make_unique<WriteAheadLog>(directory, options.durability,
+                                          options.commitWindowMicros, replay);
+
+    Epoch::Guard guard;
+    auto queue = [this, &delivered](Mailbox &mailbox, const std::string &user,
+                                    uint64_t sequence, std::string_view sender,
+                                    std::string_view data)
+    {
+        auto gone = delivered.find(user);
+        if (gone != delivered.end() && gone->second.count(sequence) > 0)
+        {
+            return;
+        }
+        if (mailbox.push(sender, data, sequence) < 0)
+        {
+            fprintf(stderr, "No ID left for sender %.*s\n", (int)sender.size(), sender.data());
+        }
+        // The spill thread only starts once the server is up.
+        if (mailboxBudget > 0 && mailboxes.getQueuedBytes() > mailboxBudget)
+        {
+            mailboxes.spillColdest(mailboxBudget - mailboxBudget / 4);
+        }
+    };
+
+    // A mailbox the log tail changed starts with its snapshot messages, less
+    // the delivered ones, so the directory must not load them on its own. A
+    // message logged after the snapshot's cut may be in both; those are
+    // remembered to be skipped in the log.
+    mailboxes.setSource(nullptr);
+    std::unordered_map<std::string, std::unordered_set<uint64_t>> merged;
+    auto merge = [this, covered, &merged, &queue](const std::string &user)
+    {
+        auto mailbox = merged.find(user);
+        if (mailbox != merged.end())
+        {
+            return mailbox;
+        }
+        mailbox = merged.emplace(user, std::unordered_set<uint64_t>()).first;
+        if (restored)
+        {
+            Mailbox &target = mailboxes.get(user);
+            std::unordered_set<uint64_t> &late = mailbox->second;
+            restored->take(user, [&](uint64_t sequence, std::string_view sender,
+                                     std::string_view data)
+            {
+                if (sequence > covered)
+                {
+                    late.insert(sequence);
+                }
+                queue(target, user, sequence, sender, data);
+            });
+        }
+        return mailbox;
+    };
+    log->replay([this, covered, &deletedAt, &merge, &queue](WriteAheadLog::Record &record)
+    {
+        if (record.sequence <= covered || record.type != WriteAheadLog::ENQUEUE)
+        {
+            return;
+        }
+        std::string user(record.user);
+        auto deleted = deletedAt.find(user);
+        if (deleted != deletedAt.end() && record.sequence < deleted->second)
+        {
+            return;
+        }
+        if (merge(user)->second.count(record.sequence) == 0)
+        {
+            queue(mailboxes.get(user), user, record.sequence, record.sender, record.data);
+        }
+    });
+    for (auto &[user, sequences] : delivered)
+    {
+        merge(user);
+    }
+    if (restored)
+    {
+        mailboxes.setSource(restored.get());
+    }
+}
+
+int Server::snapshot()
+{
+    std::unique_lock lock(snapshotLock);
+    return writeSnapshot();
+}
+
+int Server::writeSnapshot()
+{
+    if (!log)
+    {
+        return -1;
+    }
+
+    // Every change logged up to the cut is applied, and every later one is
+    // replayed on top of whatever part of it the snapshot sees.
+    uint64_t sequence;
+    {
+        std::unique_lock gate(changeGate);
+        sequence = log->rotate();
+    }
+
+    Snapshot::Writer writer(dataDirectory + "/snapshot", sequence);
+    users.forEach([&writer](const std::string &user)
+    {
+        writer.addUser(user);
+    });
+    // Mailboxes still in the previous snapshot are copied first. One taken
+    // from it after the copy changed only after the cut.
+    std::vector<bool> copied;
+    if (restored)
+    {
+        copied = restored->copyTo(writer);
+    }
+    bool complete = true;
+    mailboxes.forEach([this, &writer, &copied, &complete](const std::string &user,
+                                                          Mailbox &mailbox)
+    {
+        if (mailbox.size() == 0 || (restored && restored->copied(copied, user)))
+        {
+            return;
+        }
+        writer.beginMailbox(user);
+        bool read = mailbox.peek([&writer](uint64_t sequence, std::string_view sender,
+                                           std::string_view data)
+        {
+            writer.addMessage(sequence, sender, data);
+        }) == 0;
+        complete = complete && read;
+    });
+    if (!complete || writer.commit() < 0)
+    {
+        return -1;
+    }
+
+    log->removeSegmentsThrough(sequence);
+    std::cout << "Snapshot written through log record " << sequence << "\n";
+    return 0;
+}
+
+void Server::snapshotPeriodically(uint64_t interval)
+{
+    std::unique_lock lock(snapshotLock);
+    while (serverRunning)
+    {
+        snapshotWake.wait_for(lock, std::chrono::milliseconds(interval), [this]()
+        {
+            return !serverRunning;
+        });
+        if (serverRunning)
+        {
+            writeSnapshot();
+        }
+    }
+}
+
+void Server::openSpillDirectory(const Options &options)
+{
+    spillDirectory = options.spillDirectory;
+    if (spillDirectory.empty() && !options.dataDirectory.empty())
+    {
+        if (mkdir(options.dataDirectory.c_str(), 0755) < 0 && errno != EEXIST)
+        {
+            perror("mkdir data directory");
+            exit(1);
+        }
+        spillDirectory = options.dataDirectory + "/spill";
+    }
+
+    if (spillDirectory.empty())
+    {
+        char temporary[] = "/tmp/chat-spill-XXXXXX";
+        if (mkdtemp(temporary) == nullptr)
+        {
+            perror("mkdtemp spill directory");
+            exit(1);
+        }
+        spillDirectory = temporary;
+        temporarySpillDirectory = true;
+    }
+    else if (mkdir(spillDirectory.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        perror("mkdir spill directory");
+        exit(1);
+    }
+    // The log holds every message a previous run spilled.
+    removeSpillFiles(spillDirectory);
+    mailboxes.setSpillDirectory(spillDirectory);
+}
+
+void Server::checkMailboxBudget()
+{
+    if (mailboxBudget > 0 && mailboxes.getQueuedBytes() > mailboxBudget)
+    {
+        spillWake.notify_one();
+    }
+}
+
+void Server::spillOverBudget()
+{
+    std::unique_lock lock(spillLock);
+    while (serverRunning)
+    {
+        // Timed, since pushes wake the thread without taking the lock.
+        spillWake.wait_for(lock, std::chrono::milliseconds(SPILL_CHECK_MILLIS), [this]()
+        {
+            return !serverRunning || mailboxes.getQueuedBytes() > mailboxBudget;
+        });
+        if (!serverRunning || mailboxes.getQueuedBytes() <= mailboxBudget)
+        {
+            continue;
+        }
+
+        lock.unlock();
+        // Spilling below the budget leaves room for the next pushes.
+        uint64_t freed = mailboxes.spillColdest(mailboxBudget - mailboxBudget / 4);
+        lock.lock();
+        if (freed == 0)
+        {
+            // Every mailbox is being read; retry once they may not be.
+            spillWake.wait_for(lock, std::chrono::milliseconds(SPILL_CHECK_MILLIS), [this]()
+            {
+                return !serverRunning;
+            });
+        }
+    }
+}
+
+std::shared_lock<std::shared_mutex> Server::changing()
+{
+    std::shared_lock gate(changeGate, std::defer_lock);
+    if (log)
+    {
+        gate.lock();
+    }
+    return gate;
+}
+
+uint64_t Server::logChange(WriteAheadLog::Record record)
+{
+    return log ? log->append(record) : 0;
+}
+
+std::mutex &Server::userLock(std::string_view user)
+{
+    return userLocks[std::hash<std::string_view>()(user) % USER_LOCK_STRIPES];
+}
+
+EventLoop *Server::owningLoop(int socket, uint64_t &serialOut)
+{
+    std::unique_lock lock(subscribersLock);
+    auto owner = connectionLoops.find(socket);
+    if (owner == connectionLoops.end())
+    {
+        return nullptr;
+    }
+    serialOut = owner->second.serial;
+    return owner->second.loop;
+}
+
+bool Server::connectionOpen(int socket, uint64_t serial)
+{
+    std::unique_lock lock(subscribersLock);
+    auto owner = connectionLoops.find(socket);
+    return owner != connectionLoops.end() && owner->second.serial == serial;
+}
+
+Network::Message Server::replyWhenDurable(const Network::MessageView &request, uint64_t sequence,
+                                          Network::Message reply)
+{
+    if (sequence == 0)
+    {
+        return reply;
+    }
+    EventLoop *loop = nullptr;
+    uint64_t serial = 0;
+    if (request.version >= DEFAULT_VERSION)
+    {
+        loop = owningLoop(request.socket, serial);
+    }
+    if (loop == nullptr)
+    {
+        log->commit(sequence);
+        return reply;
+    }
+
+    reply.requestId = request.requestId;
+    int socket = request.socket;
+    uint32_t version = request.version;
+    bool deferred = log->whenDurable(sequence, [this, loop, socket, version, serial, reply]()
+    {
+        loop->post(socket, version, [this, socket, serial, reply]()
+        {
+            // The connection may have closed, and its socket been reused.
+            if (!connectionOpen(socket, serial))
+            {
+                return Network::Message{Network::NO_RETURN};
+            }
+            return reply;
+        });
+    });
+    return deferred ? Network::Message{Network::NO_RETURN} : reply;
+}
+
+uint64_t Server::getSyscalls()
+{
+    uint64_t syscalls = network.getTransport().getSyscalls();
+    for (auto &loop : loops)
+    {
+        syscalls += loop->getSyscalls();
+    }
+    return syscalls;
+}
+
+Network::Message Server::createAccount(const Network::MessageView &info)
+{
+    std::string newUser(info.data);
     if (newUser.size() == 0)
     {
         return {Network::ERROR, "No username provided"};
     }
 
-    if (userList.find(newUser) != userList.end())
+    uint64_t sequence;
     {
-        return {Network::ERROR, "User already exists"};
+        auto gate = changing();
+        if (!users.insert(newUser))
+        {
+            return {Network::ERROR, "User already exists"};
+        }
+        sequence = logChange({WriteAheadLog::CREATE, newUser});
     }
 
     std::cout << "Creating account: " << newUser << "\n";
-    userList.insert(newUser);
 
-    return {Network::CREATE, newUser};
+    return replyWhenDurable(info, sequence, {Network::CREATE, newUser});
 }
 
-Network::Message Server::listAccounts(Network::Message requester)
+Network::Message Server::listAccounts(const Network::MessageView &requester)
 {
-    std::unique_lock lock(userListLock);
+    std::vector<std::string> matches;
+    std::string_view sub = requester.data;
+
+    users.search(sub, [&matches](const std::string &user)
+    {
+        matches.push_back(user);
+    });
+
+    // Shards are scanned in turn, so sort for an order that does not depend
+    // on how names hash.
+    std::sort(matches.begin(), matches.end());
     std::string result;
-    std::string sub = requester.data;
+    for (const std::string &user : matches)
+    {
+        result += user + "\n";
+    }
 
-    for (auto &user : this->userList)
+    std::cout << "Sending account list\n";
+    return {Network::LIST, result};
+}
+
+Network::Message Server::listPage(const Network::MessageView &requester)
+{
+    Network::ListPage page;
+    if (Network::decodeListPage(requester.data, page) < 0)
+    {
+        return {Network::ERROR, "Malformed list request"};
+    }
+    std::string after;
+    if (decodeCursor(page.cursor, after) < 0)
+    {
+        return {Network::ERROR, "Malformed cursor"};
+    }
+    size_t pageSize = std::clamp<uint64_t>(page.pageSize, 1, MAX_LIST_PAGE_SIZE);
+
+    // Streamed pages share the request ID, which version 1 headers lack.
+    std::string cursor;
+    if (!page.stream || requester.version < DEFAULT_VERSION)
     {
-        if (user.find(sub) != std::string::npos)
+        std::string list = readPage(page.query, after, pageSize, cursor);
+        std::cout << "Sending account page\n";
+        return {Network::LIST_PAGE, list, cursor};
+    }
+
+    std::cout << "Streaming account list\n";
+    uint64_t serial;
+    EventLoop *loop = owningLoop(requester.socket, serial);
+    if (loop == nullptr)
+    {
+        // A connection's own thread may block in its sends.
+        while (true)
         {
-            result += user + "\n";
+            std::string list = readPage(page.query, after, pageSize, cursor);
+            if (cursor.empty())
+            {
+                return {Network::LIST_PAGE, list, ""};
+            }
+            if (Network::sendReply(requester, {Network::LIST_PAGE, list, cursor}) < 0)
+            {
+                return {Network::NO_RETURN};
+            }
         }
     }
 
-    std::cout << "Sending account list\n";
-    return {Network::LIST, result};
+    // The first page answers the request, and every page that follows is
+    // read once the loop gets to its task.
+    std::string list = readPage(page.query, after, pageSize, cursor);
+    if (!cursor.empty())
+    {
+        postNextPage(std::make_shared<PageStream>(PageStream{
+            loop, requester.socket, serial, requester.version, requester.requestId,
+            page.query, after, pageSize
+        }));
+    }
+    return {Network::LIST_PAGE, list, cursor};
 }
 
-Network::Message Server::deleteAccount(Network::Message requester)
+std::string Server::readPage(std::string_view query, std::string &after, size_t pageSize,
+                             std::string &cursorOut)
 {
-    std::unique_lock lock(userListLock);
-    std::string user = requester.data;
+    // Takes one user more to tell whether another page follows.
+    std::vector<std::string> names = users.listAfter(after, query, pageSize + 1);
+    bool more = names.size() > pageSize;
+    if (more)
+    {
+        names.pop_back();
+        after = names.back();
+    }
+    cursorOut = more ? encodeCursor(after) : "";
 
-    if (userList.find(user) == userList.end())
+    std::string list;
+    for (const std::string &user : names)
     {
-        return {Network::ERROR, "User does not exist"};
+        list += user + "\n";
     }
+    return list;
+}
 
-    userList.erase(user);
-    messages_lock.erase(user);
+void Server::postNextPage(std::shared_ptr<PageStream> stream)
+{
+    // Posted tasks wait while the connection is paused, so a slow reader
+    // only ever has the pages it is sent queued.
+    stream->loop->post(stream->socket, stream->version, [this, stream]()
+    {
+        if (!connectionOpen(stream->socket, stream->serial))
+        {
+            return Network::Message{Network::NO_RETURN};
+        }
+        std::string cursor;
+        std::string list = readPage(stream->query, stream->after, stream->pageSize, cursor);
+        if (!cursor.empty())
+        {
+            postNextPage(stream);
+        }
+        return Network::Message{Network::LIST_PAGE, list, cursor, "", stream->requestId};
+    });
+}
+
+Network::Message Server::deleteAccount(const Network::MessageView &requester)
+{
+    std::string user(requester.data);
+
+    uint64_t sequence;
+    {
+        auto gate = changing();
+        std::unique_lock userGuard(userLock(user));
+        if (!users.erase(user))
+        {
+            return {Network::ERROR, "User does not exist"};
+        }
+        sequence = logChange({WriteAheadLog::DELETE, user});
+        mailboxes.erase(user);
+    }
+    {
+        std::unique_lock subscribersGuard(subscribersLock);
+        auto subscription = subscribers.find(user);
+        if (subscription != subscribers.end())
+        {
+            subscribedUsers.erase(subscription->second.socket);
+            subscribers.erase(subscription);
+        }
+    }
 
     std::cout << "Deleting account: " << user << "\n";
-    return {Network::DELETE, user};
+    return replyWhenDurable(requester, sequence, {Network::DELETE, user});
+}
+
+Network::Message Server::sendMessage(const Network::MessageView &message)
+{
+    if (message.chunk)
+    {
+        return receiveChunk(message);
+    }
+
+    // Copied straight from the receive buffer into the mailbox.
+    return deliver(message);
 }
 
-Network::Message Server::sendMessage(Network::Message message)
+Network::Message Server::deliver(const Network::MessageView &message)
 {
-    std::unique_lock lock(messages_lock[message.receiver]);
-    messages[message.receiver].push(message);
+    uint32_t sender;
+    Network::Message refused = internSender(message.sender, sender);
+    if (refused.operation == Network::ERROR)
+    {
+        return refused;
+    }
 
-    std::cout << "Enqueing message from " << message.sender << " to " << message.receiver << "\n";
+    std::string receiver(message.receiver);
+    // Logged before it is queued, so no record of its delivery can precede it.
+    // The receiver may get it before it is durable; the sender only hears
+    // back once it is.
+    uint64_t sequence;
+    {
+        auto gate = changing();
+        std::unique_lock receiverGuard(userLock(receiver));
+        if (!users.contains(receiver))
+        {
+            return {Network::ERROR, "Receiver does not exist"};
+        }
+        std::cout << "Enqueing message from " << message.sender << " to " << receiver << "\n";
+        sequence = logChange({WriteAheadLog::ENQUEUE, receiver, message.sender, message.data});
+        Epoch::Guard guard;
+        mailboxes.get(receiver).push(sender, message.data, sequence);
+    }
+    checkMailboxBudget();
+
+    pushMessages(receiver);
+    return replyWhenDurable(message, sequence, {Network::OK});
+}
+
+Network::Message Server::internSender(std::string_view sender, uint32_t &idOut)
+{
+    // Names are interned for good, so only accounts may send. That bounds
+    // the names kept to the accounts ever created.
+    if (!users.contains(sender))
+    {
+        return {Network::ERROR, "Sender does not exist"};
+    }
+    idOut = Usernames::intern(sender);
+    if (idOut == Usernames::NO_ID)
+    {
+        return {Network::ERROR, "Too many senders"};
+    }
     return {Network::OK};
 }
 
-Network::Message Server::requestMessages(Network::Message message)
+Network::Message Server::receiveChunk(const Network::MessageView &chunk)
 {
-    std::string username = message.data;
-    std::string result;
+    std::unique_lock lock(partialMessagesLock);
+    PartialMessages &partials = partialMessages[chunk.socket];
+    auto forget = [&]()
+    {
+        if (partials.messages.empty())
+        {
+            partialMessages.erase(chunk.socket);
+        }
+    };
+
+    auto partial = partials.messages.find(chunk.requestId);
+    if (partial == partials.messages.end())
+    {
+        if (chunk.data.empty())
+        {
+            // The end of a message that was refused, or never started.
+            forget();
+            return {Network::ERROR, "Message not started"};
+        }
+        // A refused message is kept as an empty `ERROR` until its last
+        // chunk, so none of its chunks can start a message once the
+        // connection is back within the limits. These count toward the
+        // limit as well, and a peer that opens twice as many is cut off.
+        size_t bytes = chunk.sender.size() + chunk.receiver.size();
+        const char *refusal = partials.messages.size() >= MAX_PARTIAL_MESSAGES
+                                  ? "Too many streamed messages"
+                              : partials.bytes + bytes > maxMessageLength
+                                  ? "Message too long"
+                                  : nullptr;
+        if (refusal != nullptr)
+        {
+            if (partials.messages.size() >= 2 * MAX_PARTIAL_MESSAGES)
+            {
+                shutdown(chunk.socket, SHUT_RDWR);
+                return {Network::NO_RETURN};
+            }
+            partials.messages.emplace(chunk.requestId, Network::Message{Network::ERROR});
+            return {Network::ERROR, refusal};
+        }
+        // The first chunk starts the message with its sender and receiver.
+        partials.bytes += bytes;
+        partial = partials.messages.emplace(chunk.requestId, Network::Message{
+            Network::SEND, "", std::string(chunk.sender), std::string(chunk.receiver)
+        }).first;
+    }
+
+    Network::Message &message = partial->second;
+    size_t held = message.data.size() + message.sender.size() + message.receiver.size();
+    if (chunk.data.size() > 0)
+    {
+        if (message.operation == Network::ERROR)
+        {
+            // Already refused; drop the rest.
+            return {Network::NO_RETURN};
+        }
+        if (partials.bytes + chunk.data.size() > maxMessageLength)
+        {
+            partials.bytes -= held;
+            message.operation = Network::ERROR;
+            std::string().swap(message.data);
+            std::string().swap(message.sender);
+            std::string().swap(message.receiver);
+            return {Network::ERROR, "Message too long"};
+        }
+        partials.bytes += chunk.data.size();
+        message.data += chunk.data;
+        return {Network::NO_RETURN};
+    }
+
+    // The empty chunk ends the message.
+    Network::Message complete = std::move(message);
+    partials.bytes -= held;
+    partials.messages.erase(partial);
+    forget();
+    lock.unlock();
+
+    if (complete.operation == Network::ERROR)
+    {
+        // Answered when it was refused.
+        return {Network::NO_RETURN};
+    }
+    return deliver({Network::SEND, complete.data, complete.sender, complete.receiver,
+                    chunk.requestId, chunk.socket, chunk.version});
+}
+
+Network::Message Server::sendBatch(const Network::MessageView &batch)
+{
+    std::vector<Network::BatchEntry> entries;
+    if (Network::decodeBatch(batch.data, entries) < 0)
+    {
+        return {Network::ERROR, "Malformed batch"};
+    }
+    uint32_t sender;
+    Network::Message refused = internSender(batch.sender, sender);
+    if (refused.operation == Network::ERROR)
+    {
+        return refused;
+    }
+
+    std::string status(entries.size(), (char)Network::OK);
+    std::unordered_map<std::string, std::vector<size_t>> byReceiver;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        byReceiver[entries[i].receiver].push_back(i);
+    }
+
+    // The whole batch waits for one commit.
+    uint64_t last = 0;
+    {
+        auto gate = changing();
+        for (auto it = byReceiver.begin(); it != byReceiver.end();)
+        {
+            auto &[receiver, indices] = *it;
+            std::unique_lock receiverGuard(userLock(receiver));
+            if (!users.contains(receiver))
+            {
+                for (size_t i : indices)
+                {
+                    status[i] = (char)Network::ERROR;
+                }
+                it = byReceiver.erase(it);
+                continue;
+            }
+            Epoch::Guard guard;
+            Mailbox &mailbox = mailboxes.get(receiver);
+            for (size_t i : indices)
+            {
+                uint64_t sequence = logChange({WriteAheadLog::ENQUEUE, receiver, batch.sender,
+                                               entries[i].data});
+                mailbox.push(sender, entries[i].data, sequence);
+                last = std::max(last, sequence);
+            }
+            ++it;
+        }
+    }
+
+    checkMailboxBudget();
+
+    std::cout << "Enqueing " << entries.size() << " messages from " << batch.sender << "\n";
+    for (auto &[receiver, indices] : byReceiver)
+    {
+        pushMessages(receiver);
+    }
+    return replyWhenDurable(batch, last, {Network::OK, status});
+}
+
+Network::Message Server::requestMessages(const Network::MessageView &message)
+{
+    std::string username(message.data);
 
     if (username.size() <= 0 || username[0] == '\0')
     {
         return {Network::SEND, ""};;
     }
 
-    std::unique_lock lock(messages_lock[username]);
-    while (!messages[username].empty())
+    bool more;
+    return takeMessages(username, more);
+}
+
+Network::Message Server::takeMessages(const std::string &username, bool &moreOut)
+{
+    std::string result;
+    moreOut = false;
+
+    auto gate = changing();
+    Epoch::Guard guard;
+    Mailbox *mailbox = mailboxes.find(username);
+    if (mailbox == nullptr)
+    {
+        return {Network::SEND, ""};
+    }
+    // Bounded, so a large backlog is neither read back from its spill file
+    // nor sent at once. Only what goes into this reply is logged as
+    // delivered.
+    WriteAheadLog::Record delivered{WriteAheadLog::DEQUEUE, username};
+    mailbox->drain([&result, &username, &delivered](uint64_t sequence, std::string_view sender,
+                                                   std::string_view data)
     {
-        Network::Message msg = messages[username].front();
         std::cout << "Delivering message to " << username << "\n";
-        messages[username].pop();
-        result += msg.sender + ": " + msg.data + "\n";
+        result.append(sender).append(": ").append(data) += '\n';
+        delivered.sequences.push_back(sequence);
+    }, MAX_DELIVERY_BYTES);
+    moreOut = mailbox->size() > 0;
+
+    // Not waited for: if the server stops before the record is durable, the
+    // messages are delivered again rather than lost.
+    if (log && !delivered.sequences.empty())
+    {
+        log->append(delivered);
     }
 
     return {Network::SEND, result};
 }
 
+Network::Message Server::subscribe(const Network::MessageView &subscriber)
+{
+    std::string user(subscriber.data);
+    if (!users.contains(user))
+    {
+        return {Network::ERROR, "User does not exist"};
+    }
+
+    {
+        std::unique_lock lock(subscribersLock);
+        // A connection follows one user at a time.
+        auto previous = subscribedUsers.find(subscriber.socket);
+        if (previous != subscribedUsers.end())
+        {
+            subscribers.erase(previous->second);
+        }
+        auto loop = connectionLoops.find(subscriber.socket);
+        subscribers[user] = {
+            subscriber.socket,
+            subscriber.version,
+            loop != connectionLoops.end() ? loop->second.loop : nullptr
+        };
+        subscribedUsers[subscriber.socket] = user;
+    }
+
+    std::cout << "Subscribing " << user << "\n";
+    // Hand over what arrived while the user was offline. What does not fit
+    // into the reply is pushed after it.
+    bool more;
+    Network::Message waiting = takeMessages(user, more);
+    if (more)
+    {
+        pushMessages(user);
+    }
+    return waiting;
+}
+
+Network::Message Server::refusedOperation(const Network::MessageView &reply)
+{
+    // Pings are all the server sends unasked that a client may lack a route
+    // for. Answering would start a loop with the client's `Endpoint`.
+    uint64_t serial;
+    EventLoop *loop = owningLoop(reply.socket, serial);
+    if (loop != nullptr)
+    {
+        // This runs on the loop that owns the connection.
+        loop->stopPinging(reply.socket);
+        return {Network::NO_RETURN};
+    }
+
+    std::unique_lock lock(threadConnectionsLock);
+    auto connection = threadConnections.find(reply.socket);
+    if (connection != threadConnections.end())
+    {
+        connection->second.answersPings = false;
+    }
+    return {Network::NO_RETURN};
+}
+
+void Server::pushMessages(const std::string &user)
+{
+    std::unique_lock lock(subscribersLock);
+    auto subscription = subscribers.find(user);
+    if (subscription == subscribers.end())
+    {
+        return;
+    }
+    Subscription target = subscription->second;
+
+    if (target.loop == nullptr)
+    {
+        // Thread-per-connection: wake the subscriber's thread to send. The
+        // eventfd is closed with the connection, under the same lock.
+        std::unique_lock threadsLock(threadConnectionsLock);
+        auto connection = threadConnections.find(target.socket);
+        if (connection != threadConnections.end() && connection->second.wakeFd >= 0)
+        {
+            uint64_t one = 1;
+            write(connection->second.wakeFd, &one, sizeof(one));
+        }
+        return;
+    }
+
+    // The loop owning the connection does the sending. The mailbox is only
+    // drained once it runs the task, so messages stay queued if the user
+    // disconnects first, and pushes that find it already empty send nothing.
+    target.loop->post(target.socket, target.version, [this, user, target]()
+    {
+        {
+            std::unique_lock lock(subscribersLock);
+            auto subscription = subscribers.find(user);
+            if (subscription == subscribers.end() ||
+                subscription->second.socket != target.socket)
+            {
+                return Network::Message{Network::NO_RETURN};
+            }
+        }
+        // One reply per task, so a large backlog goes out over several turns
+        // of the loop and waits while the connection is paused.
+        bool more;
+        Network::Message mail = takeMessages(user, more);
+        if (more)
+        {
+            pushMessages(user);
+        }
+        if (mail.data.empty())
+        {
+            return Network::Message{Network::NO_RETURN};
+        }
+        return mail;
+    });
+}
+
+void Server::connectionClosed(int socket)
+{
+    {
+        std::unique_lock lock(partialMessagesLock);
+        partialMessages.erase(socket);
+    }
+
+    std::unique_lock lock(subscribersLock);
+    connectionLoops.erase(socket);
+    auto user = subscribedUsers.find(socket);
+    if (user != subscribedUsers.end())
+    {
+        subscribers.erase(user->second);
+        subscribedUsers.erase(user);
+    }
+}
+
 int Server::acceptClient()
 {
-    int clientSocket;
-    struct sockaddr_in address;
-    size_t addressLength;
+    return acceptClient(0);
+}
 
-    addressLength = sizeof(address);
-    clientSocket = accept(serverFd, (struct sockaddr *)&address,
-                          (socklen_t *)&addressLength);
+int Server::acceptClient(size_t acceptor)
+{
+    Acceptor &from = *acceptors[acceptor];
+    int clientSocket = accept(from.socket, nullptr, nullptr);
     if (clientSocket < 0)
     {
-        perror("accept()");
+        // The socket was shut down by `stopServer()`.
+        if (serverRunning)
+        {
+            perror("accept()");
+        }
         return clientSocket;
     }
 
+    from.accepted++;
+    return addConnection(clientSocket, from);
+}
+
+void Server::serve()
+{
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < acceptors.size(); i++)
+    {
+        threads.emplace_back([this, i]()
+        {
+            while (serverRunning)
+            {
+                if (acceptClient(i) < 0 && serverRunning)
+                {
+                    std::cerr << "Failed client connection" << std::endl;
+                }
+            }
+        });
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+std::vector<Server::AcceptorStats> Server::getAcceptorStats()
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+    std::vector<AcceptorStats> stats;
+    for (auto &acceptor : acceptors)
+    {
+        uint64_t accepted = acceptor->accepted;
+        stats.push_back({accepted, accepted / elapsed.count()});
+    }
+    return stats;
+}
+
+int Server::connectLoopback()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("socketpair()");
+        return -1;
+    }
+
+    if (addConnection(fds[0], *acceptors[0]) < 0)
+    {
+        close(fds[1]);
+        return -1;
+    }
+    return fds[1];
+}
+
+int Server::addConnection(int clientSocket, Acceptor &acceptor)
+{
+    if (mode != THREAD_PER_CONNECTION)
+    {
+        // With fewer loops than acceptors, acceptors share loops instead.
+        size_t shards = acceptors.size();
+        size_t index = acceptor.index % loops.size();
+        if (loops.size() > shards)
+        {
+            size_t shardLoops = (loops.size() - acceptor.index + shards - 1) / shards;
+            index = acceptor.index + shards * (acceptor.nextLoop++ % shardLoops);
+        }
+        EventLoop &loop = *loops[index];
+        {
+            std::unique_lock lock(subscribersLock);
+            connectionLoops[clientSocket] = {&loop, nextConnectionSerial++};
+        }
+        if (loop.addConnection(clientSocket) < 0)
+        {
+            perror("addConnection()");
+            connectionClosed(clientSocket);
+            close(clientSocket);
+            return -1;
+        }
+        return 0;
+    }
+
     std::thread socketThread(&Server::processClient, this, clientSocket);
     socketThread.detach();
 
@@ -173,16 +1321,197 @@ int Server::acceptClient()
 
 int Server::processClient(int socket)
 {
+    // Reads never block, so pushes and pings go out while a frame is only
+    // partly received. Sends still wait for the socket to become writable.
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        perror("fcntl()");
+        close(socket);
+        return -1;
+    }
+
+    ThreadConnection *connection;
+    {
+        std::unique_lock lock(threadConnectionsLock);
+        uint64_t now = TimerWheel::now();
+        connection = &threadConnections[socket];
+        connection->lastActive = now;
+        connection->lastPing = now;
+        connection->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (connection->wakeFd < 0)
+        {
+            perror("eventfd()");
+            threadConnections.erase(socket);
+            lock.unlock();
+            network.getTransport().forget(socket);
+            close(socket);
+            return -1;
+        }
+        uint64_t deadline;
+        if (idlePolicy.enabled() &&
+            idlePolicy.check(now, now, now, deadline) == IdlePolicy::WAIT &&
+            deadline != UINT64_MAX)
+        {
+            idleTimers.schedule(socket, deadline);
+            reaperWake.notify_one();
+        }
+    }
+
+    FrameDecoder decoder;
+    Arena arena;
     while (serverRunning)
     {
-        int err = network.receiveOperation(socket);
-        if (err < 0)
+        // Wait for either request bytes or a push or ping.
+        struct pollfd fds[2] = {{socket, POLLIN, 0}, {connection->wakeFd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
         {
             break;
         }
+        uint64_t count;
+        if ((fds[1].revents & POLLIN) && read(connection->wakeFd, &count, sizeof(count)) > 0)
+        {
+            if (connection->pingDue.exchange(false) && sendPing(socket) < 0)
+            {
+                idleEvictions++;
+                break;
+            }
+            if (deliverPushes(socket) < 0)
+            {
+                break;
+            }
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            continue;
+        }
+        // Only complete frames are dispatched. The rest of a frame is waited
+        // for in `poll()` with everything else.
+        int err = decoder.readFrom(network.getTransport(), socket);
+        if (err < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            continue;
+        }
+        if (err <= 0 || network.dispatchBuffered(socket, decoder, arena) < 0)
+        {
+            break;
+        }
+        connection->lastActive.store(TimerWheel::now(), std::memory_order_relaxed);
     }
 
+    // Once forgotten the socket can no longer be shut down by the reaper or
+    // `stopServer()`, so its number is safe to reuse.
+    {
+        std::unique_lock lock(threadConnectionsLock);
+        idleTimers.cancel(socket);
+        close(connection->wakeFd);
+        threadConnections.erase(socket);
+    }
+    network.getTransport().forget(socket);
+    connectionClosed(socket);
     close(socket);
 
     return 0;
 }
+
+int Server::deliverPushes(int socket)
+{
+    std::string user;
+    uint32_t version;
+    {
+        std::unique_lock lock(subscribersLock);
+        auto subscribed = subscribedUsers.find(socket);
+        if (subscribed == subscribedUsers.end())
+        {
+            return 0;
+        }
+        user = subscribed->second;
+        version = subscribers[user].version;
+    }
+
+    // Sent a reply at a time, so only one is ever held.
+    bool more = true;
+    while (more)
+    {
+        Network::Message mail = takeMessages(user, more);
+        if (mail.data.empty())
+        {
+            return 0;
+        }
+        Network::OutputBuffer output;
+        network.queueMessage(output, mail, version);
+        if (network.flush(socket, output) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int Server::sendPing(int socket)
+{
+    // Never block on a peer that stopped reading: a ping that does not fit
+    // into the socket buffer evicts it.
+    Network::OutputBuffer output;
+    network.queueMessage(output, {Network::PING}, MIN_VERSION);
+    ssize_t sent = send(socket, output.bytes.data(), output.bytes.size(),
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+    return sent == (ssize_t)output.bytes.size() ? 0 : -1;
+}
+
+void Server::reapIdle()
+{
+    std::unique_lock lock(threadConnectionsLock);
+    while (serverRunning)
+    {
+        int timeout = idleTimers.timeoutMillis(TimerWheel::now());
+        if (timeout < 0)
+        {
+            reaperWake.wait(lock);
+        }
+        else
+        {
+            reaperWake.wait_for(lock, std::chrono::milliseconds(timeout));
+        }
+
+        uint64_t now = TimerWheel::now();
+        idleTimers.advance(now, [this, now](uint64_t socket)
+        {
+            auto it = threadConnections.find(socket);
+            if (it == threadConnections.end())
+            {
+                return;
+            }
+            ThreadConnection &connection = it->second;
+
+            IdlePolicy policy = idlePolicy;
+            if (!connection.answersPings)
+            {
+                policy.heartbeatMillis = 0;
+            }
+            uint64_t deadline;
+            IdlePolicy::Action action = policy.check(connection.lastActive,
+                                                     connection.lastPing, now, deadline);
+            if (action == IdlePolicy::PING)
+            {
+                // Sent by the connection's thread, between its replies.
+                connection.lastPing = now;
+                connection.pingDue = true;
+                uint64_t one = 1;
+                write(connection.wakeFd, &one, sizeof(one));
+                action = IdlePolicy::WAIT;
+            }
+            if (action == IdlePolicy::EVICT)
+            {
+                // The client's thread sees the shutdown and closes the socket.
+                idleEvictions++;
+                shutdown(socket, SHUT_RDWR);
+                return;
+            }
+            if (deadline != UINT64_MAX)
+            {
+                idleTimers.schedule(socket, deadline);
+            }
+        });
+    }
+}
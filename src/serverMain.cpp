@@ -1,30 +1,153 @@
 #include "server.hpp"
 #include <iostream>
 #include <string>
+#include <vector>
+
+/**
+ * Sets the option in `options` named by `flag`, given as `--name=value`.
+ *
+ * @return  -1 if the flag or its value is not known.
+*/
+static int parseFlag(const std::string &flag, Server::Options &options)
+{
+    size_t equals = flag.find('=');
+    if (flag.compare(0, 2, "--") != 0 || equals == std::string::npos)
+    {
+        return -1;
+    }
+    std::string name = flag.substr(2, equals - 2);
+    std::string value = flag.substr(equals + 1);
+
+    if (name == "durability")
+    {
+        if (value == "none")
+        {
+            options.durability = WriteAheadLog::NONE;
+        }
+        else if (value == "batched")
+        {
+            options.durability = WriteAheadLog::BATCHED;
+        }
+        else if (value == "sync")
+        {
+            options.durability = WriteAheadLog::PER_OPERATION;
+        }
+        else
+        {
+            return -1;
+        }
+        return 0;
+    }
+    if (name == "data")
+    {
+        options.dataDirectory = value;
+        return 0;
+    }
+    if (name == "spill")
+    {
+        options.spillDirectory = value;
+        return 0;
+    }
+
+    uint64_t number;
+    try
+    {
+        size_t used;
+        number = std::stoull(value, &used);
+        if (used != value.size())
+        {
+            return -1;
+        }
+    }
+    catch (const std::exception &)
+    {
+        return -1;
+    }
+    if (name == "commit-window")
+    {
+        options.commitWindowMicros = number;
+    }
+    else if (name == "snapshot-interval")
+    {
+        options.snapshotIntervalMillis = number;
+    }
+    else if (name == "mailbox-budget")
+    {
+        options.mailboxBudgetBytes = number;
+    }
+    else if (name == "idle-timeout")
+    {
+        options.idleTimeoutMillis = number;
+    }
+    else if (name == "heartbeat")
+    {
+        options.heartbeatMillis = number;
+    }
+    else if (name == "backlog")
+    {
+        options.backlog = (int)number;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
 
 /**
  * Starts the server and accepts clients.
 */
 int main(int argc, char const *argv[])
 {
-	if (argc < 2)
+    // Flags may go anywhere; the rest are positional.
+    Server::Options options;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        if (argument.compare(0, 2, "--") != 0)
+        {
+            positional.push_back(argument);
+        }
+        else if (parseFlag(argument, options) < 0)
+        {
+            std::cerr << "Unknown option " << argument << std::endl;
+            return -1;
+        }
+    }
+
+	if (positional.empty())
 	{
-		std::cerr << "Usage: server [PORT]" << std::endl;
+		std::cerr << "Usage: server [PORT|SOCKET_PATH] [threads|epoll|uring] [ACCEPTORS] "
+                     "[--data=DIR] [--durability=none|batched|sync] [--commit-window=MICROS] "
+                     "[--snapshot-interval=MILLIS] [--mailbox-budget=BYTES] [--spill=DIR] "
+                     "[--idle-timeout=MILLIS] [--heartbeat=MILLIS] [--backlog=N]" << std::endl;
 		return -1;
 	}
 
-	int port = std::stoi(argv[1]);
-
-    Server server(port);
+    // Anything that is not a port number is a Unix domain socket path.
+    std::string where = positional[0];
+    Address address = where.find_first_not_of("0123456789") == std::string::npos
+                          ? Address::tcp("0.0.0.0", std::stoi(where))
+                          : Address::unixSocket(where);
 
-    while (true)
+    // Thread-per-connection remains the default so both modes can be compared
+    // under the same load.
+    if (positional.size() >= 2 && positional[1] == "epoll")
     {
-        int err = server.acceptClient();
-        if (err < 0)
-        {
-            std::cerr << "Failed client connection" << std::endl;
-        }
+        options.mode = Server::EVENT_LOOP;
+    }
+    else if (positional.size() >= 2 && positional[1] == "uring")
+    {
+        options.mode = Server::URING_LOOP;
     }
+    if (positional.size() >= 3)
+    {
+        options.acceptors = std::stoi(positional[2]);
+    }
+
+    Server server(address, options);
+    server.serve();
 
     return 0;
 }
@@ -0,0 +1,587 @@
+#include <algorithm>
+#include <cstddef>
+#include <tuple>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checksum.hpp"
+#include "snapshot.hpp"
+
+// Buffered bytes that make the writer write them out.
+#define WRITE_BUFFER_LENGTH (1 << 20)
+
+namespace
+{
+
+const char MAGIC[8] = {'C', 'H', 'A', 'T', 'S', 'N', 'P', '2'};
+
+struct Header
+{
+    char magic[8];
+    uint64_t sequence;
+    uint64_t fileLength;
+    uint64_t userCount;
+    uint64_t usersOffset;
+    uint64_t userIndexOffset;
+    uint64_t mailboxCount;
+    uint64_t messageCount;
+    uint64_t tableOffset;
+    // A power of two.
+    uint64_t tableSlots;
+    uint64_t mailboxesOffset;
+    // CRC-32 of the users, the table and the index, checked on open, and of
+    // the header up to here.
+    uint32_t usersChecksum;
+    uint32_t tableChecksum;
+    uint32_t indexChecksum;
+    uint32_t headerChecksum;
+};
+
+/**
+ * A mailbox table slot. Offset 0 marks an empty slot, since the header is
+ * there. A mailbox's checksum is only checked once it is read, so mailboxes
+ * that are never used are never paged in.
+*/
+struct Slot
+{
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t count;
+    uint64_t length;
+    uint64_t checksum;
+};
+
+/**
+ * FNV-1a, which unlike `std::hash` is the same in every build that reads the
+ * file.
+*/
+uint64_t hashOf(std::string_view name)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : name)
+    {
+        hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+template <typename T>
+T read(const char *at)
+{
+    T value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+const Header &headerOf(const char *base)
+{
+    return *(const Header *)base;
+}
+
+}
+
+Snapshot::Writer::Writer(const std::string &path, uint64_t sequence)
+    : path(path), temporaryPath(path + ".tmp"), failed(false), committed(false),
+      offset(sizeof(Header)), sequence(sequence), userCount(0), messageCount(0),
+      mailboxesOffset(0), running(0), usersChecksum(0)
+{
+    fd = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror("create snapshot");
+        failed = true;
+    }
+    // Room for the header, written last.
+    buffer.assign(sizeof(Header), '\0');
+}
+
+Snapshot::Writer::~Writer()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (!committed)
+    {
+        unlink(temporaryPath.c_str());
+    }
+}
+
+void Snapshot::Writer::emit(const void *bytes, size_t length)
+{
+    running = crc32((const char *)bytes, length, running);
+    buffer.append((const char *)bytes, length);
+    offset += length;
+    if (buffer.size() >= WRITE_BUFFER_LENGTH)
+    {
+        flush();
+    }
+}
+
+int Snapshot::Writer::flush()
+{
+    size_t written = 0;
+    while (!failed && written < buffer.size())
+    {
+        ssize_t n = write(fd, buffer.data() + written, buffer.size() - written);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("write snapshot");
+            failed = true;
+        }
+        written += std::max<ssize_t>(n, 0);
+    }
+    buffer.clear();
+    return failed ? -1 : 0;
+}
+
+void Snapshot::Writer::addUser(std::string_view user)
+{
+    if (userCount % USER_CHUNK == 0)
+    {
+        userIndex.push_back(offset);
+    }
+    uint32_t length = user.size();
+    emit(&length, sizeof(length));
+    emit(user.data(), user.size());
+    userCount++;
+}
+
+void Snapshot::Writer::endSection()
+{
+    if (mailboxesOffset == 0)
+    {
+        mailboxesOffset = offset;
+        usersChecksum = running;
+    }
+    else if (!mailboxes.empty())
+    {
+        mailboxes.back().length = offset - mailboxes.back().offset;
+        mailboxes.back().checksum = running;
+    }
+    running = 0;
+}
+
+void Snapshot::Writer::beginMailbox(std::string_view user)
+{
+    endSection();
+    mailboxes.push_back({hashOf(user), offset, 0, 0, 0});
+    uint32_t length = user.size();
+    emit(&length, sizeof(length));
+    emit(user.data(), user.size());
+}
+
+void Snapshot::Writer::addMessage(uint64_t sequence, std::string_view sender,
+                                  std::string_view data)
+{
+    mailboxes.back().count++;
+    messageCount++;
+    uint32_t lengths[2] = {(uint32_t)sender.size(), (uint32_t)data.size()};
+    emit(&sequence, sizeof(sequence));
+    emit(lengths, sizeof(lengths));
+    emit(sender.data(), sender.size());
+    emit(data.data(), data.size());
+}
+
+int Snapshot::Writer::commit()
+{
+    Header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.sequence = sequence;
+    header.userCount = userCount;
+    header.usersOffset = sizeof(Header);
+    header.mailboxCount = mailboxes.size();
+    header.messageCount = messageCount;
+
+    // At most half full, so probes stay short.
+    header.tableSlots = 1;
+    while (header.tableSlots < 2 * mailboxes.size())
+    {
+        header.tableSlots <<= 1;
+    }
+    // Ends the last mailbox, or the users if there is none.
+    endSection();
+    header.mailboxesOffset = mailboxesOffset;
+    header.usersChecksum = usersChecksum;
+    std::vector<Slot> table(header.tableSlots, Slot{0, 0, 0, 0, 0});
+    for (const Entry &mailbox : mailboxes)
+    {
+        uint64_t slot = mailbox.hash & (header.tableSlots - 1);
+        while (table[slot].offset != 0)
+        {
+            slot = (slot + 1) & (header.tableSlots - 1);
+        }
+        table[slot] = {mailbox.hash, mailbox.offset, mailbox.count, mailbox.length,
+                       mailbox.checksum};
+    }
+    std::vector<Entry>().swap(mailboxes);
+
+    // The table and index are read in place, so align them.
+    char padding[8] = {};
+    emit(padding, (8 - offset % 8) % 8);
+    header.tableOffset = offset;
+    running = 0;
+    emit(table.data(), table.size() * sizeof(Slot));
+    header.tableChecksum = running;
+    header.userIndexOffset = offset;
+    running = 0;
+    emit(userIndex.data(), userIndex.size() * sizeof(uint64_t));
+    header.indexChecksum = running;
+    header.fileLength = offset;
+    header.headerChecksum = crc32((const char *)&header, offsetof(Header, headerChecksum));
+
+    if (flush() < 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        fdatasync(fd) < 0)
+    {
+        if (!failed)
+        {
+            perror("write snapshot");
+        }
+        return -1;
+    }
+    close(fd);
+    fd = -1;
+    if (rename(temporaryPath.c_str(), path.c_str()) < 0)
+    {
+        perror("rename snapshot");
+        return -1;
+    }
+    committed = true;
+
+    // Make the rename itself durable.
+    std::string directory = path.substr(0, path.find_last_of('/') + 1) + ".";
+    int parent = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parent >= 0)
+    {
+        fsync(parent);
+        close(parent);
+    }
+    return 0;
+}
+
+std::unique_ptr<Snapshot> Snapshot::open(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(Header))
+    {
+        close(fd);
+        return nullptr;
+    }
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        perror("mmap snapshot");
+        return nullptr;
+    }
+
+    std::unique_ptr<Snapshot> snapshot(new Snapshot());
+    snapshot->base = (const char *)mapping;
+    snapshot->length = info.st_size;
+    if (!snapshot->valid())
+    {
+        fprintf(stderr, "Snapshot %s is corrupt\n", path.c_str());
+        return nullptr;
+    }
+    snapshot->taken = std::make_unique<std::atomic<bool>[]>(headerOf(snapshot->base).tableSlots);
+    return snapshot;
+}
+
+bool Snapshot::valid() const
+{
+    const Header &header = headerOf(base);
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        crc32(base, offsetof(Header, headerChecksum)) != header.headerChecksum ||
+        header.fileLength != length)
+    {
+        return false;
+    }
+
+    // Sections follow each other in order, the table and index aligned, the
+    // table with at least one empty slot to end its probes.
+    uint64_t chunks = header.userCount / USER_CHUNK + (header.userCount % USER_CHUNK != 0);
+    if (header.usersOffset != sizeof(Header) ||
+        header.mailboxesOffset < header.usersOffset ||
+        header.tableOffset < header.mailboxesOffset ||
+        header.userIndexOffset < header.tableOffset ||
+        header.fileLength < header.userIndexOffset ||
+        header.tableOffset % 8 != 0 || header.userIndexOffset % 8 != 0 ||
+        header.tableSlots == 0 || (header.tableSlots & (header.tableSlots - 1)) != 0 ||
+        header.tableSlots != (header.userIndexOffset - header.tableOffset) / sizeof(Slot) ||
+        (header.userIndexOffset - header.tableOffset) % sizeof(Slot) != 0 ||
+        header.mailboxCount >= header.tableSlots ||
+        chunks != (header.fileLength - header.userIndexOffset) / sizeof(uint64_t) ||
+        (header.fileLength - header.userIndexOffset) % sizeof(uint64_t) != 0)
+    {
+        return false;
+    }
+    if (crc32(base + header.usersOffset, header.mailboxesOffset - header.usersOffset) !=
+            header.usersChecksum ||
+        crc32(base + header.tableOffset, header.userIndexOffset - header.tableOffset) !=
+            header.tableChecksum ||
+        crc32(base + header.userIndexOffset, header.fileLength - header.userIndexOffset) !=
+            header.indexChecksum)
+    {
+        return false;
+    }
+
+    // Every name lies within the users, and the index points at every
+    // `USER_CHUNK`th of them. Users are read on start anyway.
+    const char *index = base + header.userIndexOffset;
+    uint64_t at = header.usersOffset;
+    for (uint64_t i = 0; i < header.userCount; i++)
+    {
+        if ((i % USER_CHUNK == 0 && read<uint64_t>(index + i / USER_CHUNK * sizeof(uint64_t)) != at) ||
+            header.mailboxesOffset - at < sizeof(uint32_t) ||
+            header.mailboxesOffset - at - sizeof(uint32_t) < read<uint32_t>(base + at))
+        {
+            return false;
+        }
+        at += sizeof(uint32_t) + read<uint32_t>(base + at);
+    }
+    if (at != header.mailboxesOffset)
+    {
+        return false;
+    }
+
+    // Every mailbox lies within the mailboxes. Their contents are checked
+    // when they are read.
+    const Slot *table = (const Slot *)(base + header.tableOffset);
+    uint64_t mailboxes = 0;
+    uint64_t messages = 0;
+    for (uint64_t slot = 0; slot < header.tableSlots; slot++)
+    {
+        if (table[slot].offset == 0)
+        {
+            continue;
+        }
+        if (table[slot].offset < header.mailboxesOffset ||
+            table[slot].offset > header.tableOffset ||
+            table[slot].length > header.tableOffset - table[slot].offset ||
+            table[slot].length < sizeof(uint32_t))
+        {
+            return false;
+        }
+        mailboxes++;
+        messages += table[slot].count;
+    }
+    return mailboxes == header.mailboxCount && messages == header.messageCount;
+}
+
+Snapshot::~Snapshot()
+{
+    munmap((void *)base, length);
+}
+
+uint64_t Snapshot::getSequence() const
+{
+    return headerOf(base).sequence;
+}
+
+uint64_t Snapshot::getUserCount() const
+{
+    return headerOf(base).userCount;
+}
+
+uint64_t Snapshot::getMailboxCount() const
+{
+    return headerOf(base).mailboxCount;
+}
+
+uint64_t Snapshot::getMessageCount() const
+{
+    return headerOf(base).messageCount;
+}
+
+void Snapshot::forEachUser(int threads, const std::function<void(std::string_view user)> &visit)
+{
+    const Header &header = headerOf(base);
+    const char *index = base + header.userIndexOffset;
+    uint64_t chunks = (header.userCount + USER_CHUNK - 1) / USER_CHUNK;
+
+    auto visitChunks = [&](uint64_t first)
+    {
+        for (uint64_t chunk = first; chunk < chunks; chunk += threads)
+        {
+            const char *at = base + read<uint64_t>(index + chunk * sizeof(uint64_t));
+            uint64_t count = header.userCount - chunk * USER_CHUNK;
+            if (count > USER_CHUNK)
+            {
+                count = USER_CHUNK;
+            }
+            for (uint64_t i = 0; i < count; i++)
+            {
+                uint32_t length = read<uint32_t>(at);
+                visit(std::string_view(at + sizeof(length), length));
+                at += sizeof(length) + length;
+            }
+        }
+    };
+
+    threads = std::max(1, (int)std::min<uint64_t>(threads, chunks));
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++)
+    {
+        workers.emplace_back(visitChunks, t);
+    }
+    visitChunks(0);
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+int64_t Snapshot::slotOf(std::string_view user) const
+{
+    const Header &header = headerOf(base);
+    const Slot *table = (const Slot *)(base + header.tableOffset);
+    uint64_t hash = hashOf(user);
+    uint64_t mask = header.tableSlots - 1;
+    for (uint64_t slot = hash & mask; table[slot].offset != 0; slot = (slot + 1) & mask)
+    {
+        if (table[slot].hash != hash)
+        {
+            continue;
+        }
+        const char *name = base + table[slot].offset;
+        uint32_t nameLength = read<uint32_t>(name);
+        if (nameLength <= table[slot].length - sizeof(uint32_t) &&
+            std::string_view(name + sizeof(uint32_t), nameLength) == user)
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+bool Snapshot::visitMailbox(int64_t slot,
+                            const std::function<void(uint64_t sequence, std::string_view sender,
+                                                     std::string_view data)> &visit) const
+{
+    const Slot &entry = ((const Slot *)(base + headerOf(base).tableOffset))[slot];
+    const char *start = base + entry.offset;
+    const char *end = start + entry.length;
+    uint32_t nameLength = read<uint32_t>(start);
+    std::string_view name(start + sizeof(uint32_t),
+                          std::min<uint64_t>(nameLength, entry.length - sizeof(uint32_t)));
+
+    // Every message is checked to lie within the mailbox before any is
+    // passed on, so a damaged mailbox is dropped whole.
+    bool intact = crc32(start, entry.length) == entry.checksum &&
+                  nameLength <= entry.length - sizeof(uint32_t);
+    const char *at = start + sizeof(uint32_t) + name.size();
+    for (uint64_t i = 0; intact && i < entry.count; i++)
+    {
+        if (end - at < 16)
+        {
+            intact = false;
+            break;
+        }
+        uint64_t lengths = (uint64_t)read<uint32_t>(at + 8) + read<uint32_t>(at + 12);
+        at += 16;
+        if ((uint64_t)(end - at) < lengths)
+        {
+            intact = false;
+            break;
+        }
+        at += lengths;
+    }
+    if (!intact || at != end)
+    {
+        fprintf(stderr, "Snapshot mailbox of %.*s is corrupt\n", (int)name.size(), name.data());
+        return false;
+    }
+
+    at = start + sizeof(uint32_t) + nameLength;
+    for (uint64_t i = 0; i < entry.count; i++)
+    {
+        uint64_t sequence = read<uint64_t>(at);
+        uint32_t senderLength = read<uint32_t>(at + 8);
+        uint32_t dataLength = read<uint32_t>(at + 12);
+        at += 16;
+        visit(sequence, std::string_view(at, senderLength),
+              std::string_view(at + senderLength, dataLength));
+        at += senderLength + dataLength;
+    }
+    return true;
+}
+
+bool Snapshot::contains(const std::string &user)
+{
+    int64_t slot = slotOf(user);
+    return slot >= 0 && !taken[slot].load();
+}
+
+void Snapshot::load(const std::string &user, Mailbox *mailbox)
+{
+    take(user, [mailbox](uint64_t sequence, std::string_view sender, std::string_view data)
+    {
+        if (mailbox != nullptr && mailbox->push(sender, data, sequence) < 0)
+        {
+            fprintf(stderr, "No ID left for sender %.*s\n", (int)sender.size(), sender.data());
+        }
+    });
+}
+
+bool Snapshot::take(std::string_view user,
+                    const std::function<void(uint64_t sequence, std::string_view sender,
+                                             std::string_view data)> &visit)
+{
+    int64_t slot = slotOf(user);
+    if (slot < 0 || taken[slot].exchange(true))
+    {
+        return false;
+    }
+    return visitMailbox(slot, visit);
+}
+
+std::vector<bool> Snapshot::copyTo(Writer &writer)
+{
+    const Header &header = headerOf(base);
+    const Slot *table = (const Slot *)(base + header.tableOffset);
+    std::vector<bool> added(header.tableSlots, false);
+    for (uint64_t slot = 0; slot < header.tableSlots; slot++)
+    {
+        if (table[slot].offset == 0 || taken[slot].load())
+        {
+            continue;
+        }
+        // Read whole before it is started in `writer`, since it may be
+        // damaged.
+        std::vector<std::tuple<uint64_t, std::string_view, std::string_view>> messages;
+        if (!visitMailbox(slot, [&messages](uint64_t sequence, std::string_view sender,
+                                            std::string_view data)
+        {
+            messages.emplace_back(sequence, sender, data);
+        }))
+        {
+            continue;
+        }
+        const char *name = base + table[slot].offset;
+        writer.beginMailbox(std::string_view(name + sizeof(uint32_t), read<uint32_t>(name)));
+        for (auto &[sequence, sender, data] : messages)
+        {
+            writer.addMessage(sequence, sender, data);
+        }
+        added[slot] = true;
+    }
+    return added;
+}
+
+bool Snapshot::copied(const std::vector<bool> &added, std::string_view user) const
+{
+    int64_t slot = slotOf(user);
+    return slot >= 0 && added[slot];
+}
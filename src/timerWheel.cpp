@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <chrono>
+
+#include "timerWheel.hpp"
+
+TimerWheel::TimerWheel(uint64_t tickMillis) : TimerWheel(tickMillis, now())
+{
+}
+
+TimerWheel::TimerWheel(uint64_t tickMillis, uint64_t start)
+    : tickMillis(std::max(tickMillis, (uint64_t)1)),
+      nextTick(start / this->tickMillis)
+{
+    slots.fill(NONE);
+}
+
+uint64_t TimerWheel::now()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TimerWheel::schedule(uint64_t id, uint64_t deadline)
+{
+    auto [it, inserted] = timers.try_emplace(id);
+    if (!inserted)
+    {
+        unlink(it->second);
+    }
+    // Round up so the timer never fires before its deadline.
+    it->second.tick = deadline / tickMillis + (deadline % tickMillis != 0);
+    place(id, it->second);
+}
+
+void TimerWheel::cancel(uint64_t id)
+{
+    auto it = timers.find(id);
+    if (it == timers.end())
+    {
+        return;
+    }
+    unlink(it->second);
+    timers.erase(it);
+}
+
+void TimerWheel::advance(uint64_t now, const std::function<void(uint64_t id)> &expired)
+{
+    uint64_t target = now / tickMillis;
+    while (nextTick <= target)
+    {
+        if (timers.empty())
+        {
+            nextTick = target + 1;
+            return;
+        }
+
+        uint64_t tick = nextTick;
+        // Entering a new span of a level: move its timers one level down.
+        // Spans of higher levels start first, as in an odometer.
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--)
+        {
+            uint64_t span = tick >> (WHEEL_SLOT_BITS * level);
+            if ((tick & ((1ull << (WHEEL_SLOT_BITS * level)) - 1)) != 0)
+            {
+                continue;
+            }
+            uint64_t id = takeSlot(level * WHEEL_SLOTS + (span & (WHEEL_SLOTS - 1)));
+            while (id != NONE)
+            {
+                Timer &timer = timers[id];
+                uint64_t next = timer.next;
+                place(id, timer);
+                id = next;
+            }
+        }
+
+        // The due timers are detached first: `expired` may cancel or move
+        // any of them, and timers it schedules for a passed deadline go to
+        // the next tick rather than the slot being fired.
+        uint64_t id = takeSlot(tick & (WHEEL_SLOTS - 1));
+        nextTick++;
+        firing.clear();
+        while (id != NONE)
+        {
+            Timer &timer = timers[id];
+            firing.push_back(id);
+            id = timer.next;
+            timer.slot = DETACHED;
+        }
+        for (uint64_t due : firing)
+        {
+            auto it = timers.find(due);
+            if (it == timers.end() || it->second.slot != DETACHED)
+            {
+                continue;
+            }
+            timers.erase(it);
+            expired(due);
+        }
+    }
+}
+
+int TimerWheel::timeoutMillis(uint64_t now) const
+{
+    if (timers.empty())
+    {
+        return -1;
+    }
+
+    // The next timer due on level 0, or else the start of the next span,
+    // which may cascade timers down.
+    uint64_t tick = nextTick;
+    while ((tick & (WHEEL_SLOTS - 1)) != 0 && slots[tick & (WHEEL_SLOTS - 1)] == NONE)
+    {
+        tick++;
+    }
+
+    uint64_t due = tick * tickMillis;
+    return due <= now ? 0 : (int)std::min(due - now, (uint64_t)INT32_MAX);
+}
+
+void TimerWheel::place(uint64_t id, Timer &timer)
+{
+    uint64_t tick = std::max(timer.tick, nextTick);
+    uint64_t delta = tick - nextTick;
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ull << (WHEEL_SLOT_BITS * (level + 1))))
+    {
+        level++;
+    }
+    // Past the range of the top level: wait in the last slot it covers.
+    uint64_t range = 1ull << (WHEEL_SLOT_BITS * WHEEL_LEVELS);
+    if (delta >= range)
+    {
+        tick = nextTick + range - 1;
+    }
+
+    timer.slot = level * WHEEL_SLOTS +
+                 ((tick >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1));
+    timer.prev = NONE;
+    timer.next = slots[timer.slot];
+    if (timer.next != NONE)
+    {
+        timers[timer.next].prev = id;
+    }
+    slots[timer.slot] = id;
+}
+
+void TimerWheel::unlink(Timer &timer)
+{
+    if (timer.slot == DETACHED)
+    {
+        return;
+    }
+    if (timer.prev != NONE)
+    {
+        timers[timer.prev].next = timer.next;
+    }
+    else
+    {
+        slots[timer.slot] = timer.next;
+    }
+    if (timer.next != NONE)
+    {
+        timers[timer.next].prev = timer.prev;
+    }
+}
+
+uint64_t TimerWheel::takeSlot(uint32_t slot)
+{
+    uint64_t id = slots[slot];
+    slots[slot] = NONE;
+    return id;
+}
+
+IdlePolicy::Action IdlePolicy::check(uint64_t lastActive, uint64_t lastPing,
+                                     uint64_t now, uint64_t &deadlineOut) const
+{
+    if (idleMillis > 0 && now >= lastActive + idleMillis)
+    {
+        return EVICT;
+    }
+
+    Action action = WAIT;
+    uint64_t deadline = idleMillis > 0 ? lastActive + idleMillis : UINT64_MAX;
+    if (heartbeatMillis > 0)
+    {
+        uint64_t ping = std::max(lastActive, lastPing) + heartbeatMillis;
+        if (now >= ping)
+        {
+            action = PING;
+            ping = now + heartbeatMillis;
+        }
+        deadline = std::min(deadline, ping);
+    }
+    deadlineOut = deadline;
+    return action;
+}
@@ -0,0 +1,277 @@
+#include <algorithm>
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "transport.hpp"
+
+SocketTransport::SocketTransport(bool queueing) : queueing(queueing)
+{
+}
+
+int SocketTransport::send(int socket, const struct iovec *iov, int count)
+{
+    uint32_t calls = 0;
+    return sendAll(socket, iov, count, 0, calls);
+}
+
+int SocketTransport::sendZeroCopy(int socket, const struct iovec *iov, int count,
+                                  std::vector<std::shared_ptr<std::string>> hold)
+{
+    std::unique_lock lock(zeroCopyLock);
+    ZeroCopyState &state = zeroCopy[socket];
+
+    if (!state.enabled && !state.unsupported)
+    {
+        // Only TCP and UDP sockets support zero-copy sends.
+        int enable = 1;
+        state.enabled = setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &enable,
+                                   sizeof(int)) == 0;
+        state.unsupported = !state.enabled;
+        syscalls++;
+    }
+    if (state.unsupported)
+    {
+        lock.unlock();
+        return send(socket, iov, count);
+    }
+
+    reapZeroCopy(socket, state);
+
+    uint32_t calls = 0;
+    int err = sendAll(socket, iov, count, MSG_ZEROCOPY, calls);
+    state.nextId += calls;
+    if (calls > 0)
+    {
+        state.held.emplace_back(state.nextId, std::move(hold));
+    }
+    return err;
+}
+
+int SocketTransport::receive(int socket, const struct iovec *iov, int count)
+{
+    while (true)
+    {
+        ssize_t err = readv(socket, iov, count);
+        syscalls++;
+        if (err < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return err;
+    }
+}
+
+void SocketTransport::reapCompletions(int socket)
+{
+    std::unique_lock lock(zeroCopyLock);
+    auto it = zeroCopy.find(socket);
+    if (it != zeroCopy.end() && it->second.enabled)
+    {
+        reapZeroCopy(socket, it->second);
+    }
+}
+
+void SocketTransport::forget(int socket)
+{
+    {
+        std::unique_lock lock(zeroCopyLock);
+        zeroCopy.erase(socket);
+    }
+    outbound.erase(socket);
+}
+
+size_t SocketTransport::queued(int socket)
+{
+    auto it = outbound.find(socket);
+    return it == outbound.end() ? 0 : it->second.bytes.size() - it->second.offset;
+}
+
+int SocketTransport::drain(int socket)
+{
+    auto it = outbound.find(socket);
+    if (it == outbound.end())
+    {
+        return 0;
+    }
+
+    Outbound &queue = it->second;
+    while (queue.offset < queue.bytes.size())
+    {
+        ssize_t err = ::send(socket, queue.bytes.data() + queue.offset,
+                             queue.bytes.size() - queue.offset, MSG_DONTWAIT);
+        syscalls++;
+        if (err < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return err;
+        }
+        queue.offset += err;
+    }
+
+    size_t left = queue.bytes.size() - queue.offset;
+    if (left == 0)
+    {
+        outbound.erase(it);
+    }
+    else if (queue.offset > left)
+    {
+        // Drop the written prefix once it outweighs what is left.
+        queue.bytes.erase(0, queue.offset);
+        queue.offset = 0;
+    }
+    return left;
+}
+
+int SocketTransport::sendAll(int socket, const struct iovec *iov, int count,
+                             int flags, uint32_t &calls)
+{
+    // Keep whole frames together when several threads send on one socket.
+    std::unique_lock lock(sendLocks[socket % SEND_LOCK_STRIPES]);
+    std::vector<struct iovec> remaining(iov, iov + count);
+    size_t index = 0;
+    size_t sent = 0;
+
+    // Queue the remaining buffers, and everything sent after them.
+    auto enqueue = [&]()
+    {
+        Outbound &queue = outbound[socket];
+        for (; index < remaining.size(); index++)
+        {
+            queue.bytes.append((const char *)remaining[index].iov_base,
+                               remaining[index].iov_len);
+            sent += remaining[index].iov_len;
+        }
+        return sent;
+    };
+    if (queueing && queued(socket) > 0)
+    {
+        return enqueue();
+    }
+
+    while (true)
+    {
+        while (index < remaining.size() && remaining[index].iov_len == 0)
+        {
+            index++;
+        }
+        if (index == remaining.size())
+        {
+            break;
+        }
+
+        struct msghdr message = {};
+        message.msg_iov = &remaining[index];
+        message.msg_iovlen = std::min(remaining.size() - index, (size_t)IOV_MAX);
+
+        ssize_t err = sendmsg(socket, &message, flags);
+        syscalls++;
+        if (err < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // Sockets owned by an event loop are non-blocking, so queue what
+            // is left or wait for the socket to become writable again.
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && queueing)
+            {
+                return enqueue();
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                struct pollfd pfd = {socket, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                syscalls++;
+                continue;
+            }
+            // The kernel ran out of memory to pin pages; copy instead.
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+            {
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            return err;
+        }
+
+        if (flags & MSG_ZEROCOPY)
+        {
+            calls++;
+        }
+        sent += err;
+
+        // Skip past whatever was written.
+        size_t written = err;
+        while (written > 0)
+        {
+            if (written >= remaining[index].iov_len)
+            {
+                written -= remaining[index].iov_len;
+                index++;
+            }
+            else
+            {
+                remaining[index].iov_base = (char *)remaining[index].iov_base + written;
+                remaining[index].iov_len -= written;
+                written = 0;
+            }
+        }
+    }
+
+    return sent;
+}
+
+void SocketTransport::reapZeroCopy(int socket, ZeroCopyState &state)
+{
+    while (true)
+    {
+        char control[128];
+        struct msghdr message = {};
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        int err = recvmsg(socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT);
+        syscalls++;
+        if (err < 0)
+        {
+            break;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr;
+             cmsg = CMSG_NXTHDR(&message, cmsg))
+        {
+            bool recvErr = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                           (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
+            if (!recvErr)
+            {
+                continue;
+            }
+            struct sock_extended_err *notification =
+                (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (notification->ee_errno == 0 &&
+                notification->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+            {
+                // [ee_info, ee_data] is the range of finished sends.
+                state.completed = std::max(state.completed, notification->ee_data + 1);
+            }
+        }
+    }
+
+    while (!state.held.empty() && state.held.front().first <= state.completed)
+    {
+        state.held.pop_front();
+    }
+}
@@ -0,0 +1,532 @@
+#include <algorithm>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "transport.hpp"
+
+// Registered send buffers. One is held by each in-flight write, so this bounds
+// the number of connections with a write outstanding at once.
+#define SEND_SLOTS 64
+#define SEND_SLOT_SIZE 65536
+
+// Provided buffers for multishot receives. Must be a power of two.
+#define RECEIVE_BUFFERS 256
+#define RECEIVE_BUFFER_SIZE 16384
+#define BUFFER_GROUP 0
+
+UringTransport::UringTransport(unsigned entries)
+    : sqPending(0), sendArena(nullptr), bufferRing(nullptr),
+      receiveArena(nullptr), bufferRingTail(0), nextGeneration(0),
+      wakeupFd(-1), wakeupArmed(false), syncResult(0), syncDone(false)
+{
+    struct io_uring_params params = {};
+    ringFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ringFd < 0)
+    {
+        return;
+    }
+
+    // Map the submission and completion rings, which share one mapping on
+    // kernels that support it.
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+    {
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    cqRing = singleMmap ? sqRing :
+             mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, ringFd,
+                                       IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(ringFd);
+        ringFd = -1;
+        return;
+    }
+
+    char *sq = (char *)sqRing;
+    sqHead = (unsigned *)(sq + params.sq_off.head);
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = (char *)cqRing;
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Register the send buffers so the kernel does not have to map them for
+    // every write.
+    sendArena = (char *)mmap(nullptr, SEND_SLOTS * SEND_SLOT_SIZE,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct iovec slots[SEND_SLOTS];
+    for (int i = 0; i < SEND_SLOTS; i++)
+    {
+        slots[i].iov_base = sendArena + i * SEND_SLOT_SIZE;
+        slots[i].iov_len = SEND_SLOT_SIZE;
+        freeSendSlots.push_back(SEND_SLOTS - 1 - i);
+    }
+    if (sendArena == MAP_FAILED ||
+        syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS,
+                slots, SEND_SLOTS) < 0)
+    {
+        close(ringFd);
+        ringFd = -1;
+        return;
+    }
+
+    // Set up the provided buffer ring that multishot receives pick from.
+    bufferRing = (struct io_uring_buf_ring *)mmap(
+        nullptr, RECEIVE_BUFFERS * sizeof(struct io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    receiveArena = (char *)mmap(nullptr, RECEIVE_BUFFERS * RECEIVE_BUFFER_SIZE,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct io_uring_buf_reg reg = {};
+    reg.ring_addr = (uint64_t)bufferRing;
+    reg.ring_entries = RECEIVE_BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+    if (bufferRing == MAP_FAILED || receiveArena == MAP_FAILED ||
+        syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0)
+    {
+        close(ringFd);
+        ringFd = -1;
+        return;
+    }
+    for (uint16_t i = 0; i < RECEIVE_BUFFERS; i++)
+    {
+        recycleBuffer(i);
+    }
+}
+
+UringTransport::~UringTransport()
+{
+    if (ringFd >= 0)
+    {
+        close(ringFd);
+        munmap(sqes, sqesSize);
+        if (cqRing != sqRing)
+        {
+            munmap(cqRing, cqRingSize);
+        }
+        munmap(sqRing, sqRingSize);
+    }
+    if (sendArena && sendArena != MAP_FAILED)
+    {
+        munmap(sendArena, SEND_SLOTS * SEND_SLOT_SIZE);
+    }
+    if (bufferRing && bufferRing != MAP_FAILED)
+    {
+        munmap(bufferRing, RECEIVE_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    if (receiveArena && receiveArena != MAP_FAILED)
+    {
+        munmap(receiveArena, RECEIVE_BUFFERS * RECEIVE_BUFFER_SIZE);
+    }
+}
+
+int UringTransport::send(int socket, const struct iovec *iov, int count)
+{
+    // Everything is copied into the connection's pending bytes and batched.
+    Connection &connection = connections[socket];
+    if (connection.pending.empty() && connection.writeSlot < 0)
+    {
+        dirtySockets.push_back(socket);
+    }
+
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        connection.pending.append((const char *)iov[i].iov_base, iov[i].iov_len);
+        length += iov[i].iov_len;
+    }
+    return length;
+}
+
+int UringTransport::receive(int socket, const struct iovec *iov, int count)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = socket;
+    sqe->addr = (uint64_t)iov;
+    sqe->len = count;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = encode(SYNC_RECV, socket);
+
+    syncDone = false;
+    while (!syncDone)
+    {
+        // Completions for watched sockets are still delivered to whichever
+        // handler the owning loop last waited with.
+        int err = wait(handler);
+        if (err < 0 && errno != EINTR)
+        {
+            return err;
+        }
+    }
+
+    if (syncResult < 0)
+    {
+        errno = -syncResult;
+        return -1;
+    }
+    return syncResult;
+}
+
+int UringTransport::flush()
+{
+    submitDirty();
+
+    if (sqPending == 0)
+    {
+        return 0;
+    }
+    return enter(sqPending, 0);
+}
+
+void UringTransport::watch(int socket)
+{
+    Connection &connection = connections[socket];
+    connection.generation = nextGeneration++ & 0xFFFFFF;
+    connection.watched = true;
+    armReceive(socket);
+}
+
+void UringTransport::unwatch(int socket)
+{
+    connections.erase(socket);
+}
+
+void UringTransport::pauseReceive(int socket)
+{
+    auto it = connections.find(socket);
+    if (it == connections.end() || !it->second.watched || it->second.paused)
+    {
+        return;
+    }
+    it->second.paused = true;
+    if (it->second.receiving)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = encode(RECV, socket);
+        sqe->user_data = encode(CANCEL, socket);
+    }
+}
+
+void UringTransport::resumeReceive(int socket)
+{
+    auto it = connections.find(socket);
+    if (it == connections.end() || !it->second.watched || !it->second.paused)
+    {
+        return;
+    }
+    it->second.paused = false;
+    if (!it->second.receiving)
+    {
+        armReceive(socket);
+    }
+}
+
+size_t UringTransport::queued(int socket)
+{
+    auto it = connections.find(socket);
+    if (it == connections.end())
+    {
+        return 0;
+    }
+    size_t writing = it->second.writeSlot >= 0
+                         ? it->second.writeLength - it->second.writeOffset : 0;
+    return it->second.pending.size() + writing;
+}
+
+void UringTransport::watchWakeup(int fd)
+{
+    wakeupFd = fd;
+    if (wakeupArmed)
+    {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = encode(WAKEUP, fd);
+    wakeupArmed = true;
+}
+
+int UringTransport::wait(const ReceiveHandler &onReceive, int timeoutMillis)
+{
+    handler = onReceive;
+
+    if (timeoutMillis >= 0)
+    {
+        // Completes after the timeout or along with the first other
+        // completion, whichever comes first, so it never outlives the wait.
+        timeout.tv_sec = timeoutMillis / 1000;
+        timeout.tv_nsec = (timeoutMillis % 1000) * 1000000L;
+        struct io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uint64_t)&timeout;
+        sqe->len = 1;
+        sqe->off = 1;
+        sqe->user_data = encode(TIMEOUT, 0);
+    }
+
+    // Queue writes for everything sent since the last wait so they share the
+    // submission with the wait itself.
+    submitDirty();
+
+    int err = enter(sqPending, 1);
+    if (err < 0)
+    {
+        return err;
+    }
+
+    int reaped = 0;
+    unsigned head = *cqHead;
+    while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe cqe = cqes[head & *cqMask];
+        head++;
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        reaped++;
+
+        RequestKind kind = (RequestKind)(cqe.user_data >> 56);
+        uint32_t tag = (cqe.user_data >> 32) & 0xFFFFFF;
+        int socket = (int)(uint32_t)cqe.user_data;
+        auto it = connections.find(socket);
+
+        if (kind == WAKEUP)
+        {
+            uint64_t value;
+            read(wakeupFd, &value, sizeof(value));
+            syscalls++;
+            wakeupArmed = false;
+            watchWakeup(wakeupFd);
+        }
+        else if (kind == SYNC_RECV)
+        {
+            syncResult = cqe.res;
+            syncDone = true;
+        }
+        else if (kind == WRITE)
+        {
+            // For writes the tag is the registered buffer in use.
+            int slot = tag;
+            bool current = it != connections.end() && it->second.writeSlot == slot;
+            if (current && cqe.res > 0 &&
+                it->second.writeOffset + cqe.res < it->second.writeLength)
+            {
+                // Short write; send the rest from the same buffer.
+                it->second.writeOffset += cqe.res;
+                submitWrite(socket);
+                continue;
+            }
+
+            freeSendSlots.push_back(slot);
+            if (current)
+            {
+                it->second.writeSlot = -1;
+                if (cqe.res < 0)
+                {
+                    // The receive side reports the disconnect.
+                    it->second.pending.clear();
+                }
+                else if (!it->second.pending.empty())
+                {
+                    submitWrite(socket);
+                }
+            }
+        }
+        else if (kind == RECV)
+        {
+            bool current = it != connections.end() && it->second.watched &&
+                           it->second.generation == tag;
+            if (cqe.flags & IORING_CQE_F_BUFFER)
+            {
+                uint16_t bufferId = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (current && cqe.res > 0 && onReceive)
+                {
+                    onReceive(socket, receiveArena + bufferId * RECEIVE_BUFFER_SIZE,
+                              cqe.res);
+                }
+                recycleBuffer(bufferId);
+            }
+            // The handler may have unwatched the socket.
+            it = connections.find(socket);
+            if (!current || it == connections.end() || !it->second.watched)
+            {
+                continue;
+            }
+
+            Connection &connection = it->second;
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+            {
+                connection.receiving = false;
+            }
+            if (cqe.res == -ECANCELED)
+            {
+                // Cancelled by `pauseReceive()`, not a failed connection. The
+                // receive may have been resumed in the meantime.
+                if (!connection.paused && !connection.receiving)
+                {
+                    armReceive(socket);
+                }
+                continue;
+            }
+            if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS))
+            {
+                if (onReceive)
+                {
+                    onReceive(socket, nullptr, cqe.res);
+                }
+            }
+            else if (!connection.receiving && !connection.paused)
+            {
+                // The kernel ended the multishot (for example when it ran out
+                // of provided buffers), so arm a new one.
+                armReceive(socket);
+            }
+        }
+    }
+
+    return reaped;
+}
+
+void UringTransport::submitDirty()
+{
+    std::vector<int> sockets;
+    sockets.swap(dirtySockets);
+    for (int socket : sockets)
+    {
+        auto it = connections.find(socket);
+        if (it != connections.end() && it->second.writeSlot < 0 &&
+            !it->second.pending.empty())
+        {
+            submitWrite(socket);
+        }
+    }
+}
+
+struct io_uring_sqe *UringTransport::getSqe()
+{
+    unsigned tail = *sqTail;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > *sqMask)
+    {
+        // Submission queue is full; hand what we have to the kernel first.
+        enter(sqPending, 0);
+    }
+
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    sqPending++;
+    return sqe;
+}
+
+int UringTransport::enter(unsigned toSubmit, unsigned minComplete)
+{
+    unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int submitted = syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+                            flags, nullptr, 0);
+    syscalls++;
+    if (submitted < 0)
+    {
+        return submitted;
+    }
+    sqPending -= std::min((unsigned)submitted, sqPending);
+    return submitted;
+}
+
+void UringTransport::armReceive(int socket)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = encode(RECV, socket);
+    connections[socket].receiving = true;
+}
+
+void UringTransport::submitWrite(int socket)
+{
+    Connection &connection = connections[socket];
+
+    if (connection.writeSlot < 0)
+    {
+        if (freeSendSlots.empty())
+        {
+            // Retried on the next flush once a write completes.
+            dirtySockets.push_back(socket);
+            return;
+        }
+        connection.writeSlot = freeSendSlots.back();
+        freeSendSlots.pop_back();
+        connection.writeOffset = 0;
+        connection.writeLength = std::min(connection.pending.size(),
+                                          (size_t)SEND_SLOT_SIZE);
+        memcpy(sendArena + connection.writeSlot * SEND_SLOT_SIZE,
+               connection.pending.data(), connection.writeLength);
+        connection.pending.erase(0, connection.writeLength);
+    }
+
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = socket;
+    sqe->addr = (uint64_t)(sendArena + connection.writeSlot * SEND_SLOT_SIZE +
+                           connection.writeOffset);
+    sqe->len = connection.writeLength - connection.writeOffset;
+    sqe->off = (uint64_t)-1;
+    sqe->buf_index = connection.writeSlot;
+    sqe->user_data = ((uint64_t)WRITE << 56) |
+                     ((uint64_t)connection.writeSlot << 32) | (uint32_t)socket;
+}
+
+void UringTransport::recycleBuffer(uint16_t bufferId)
+{
+    // Index the ring directly: in C++ the header's flexible array member is not
+    // at offset 0 as the kernel expects.
+    struct io_uring_buf *buffer =
+        (struct io_uring_buf *)bufferRing + (bufferRingTail & (RECEIVE_BUFFERS - 1));
+    buffer->addr = (uint64_t)(receiveArena + bufferId * RECEIVE_BUFFER_SIZE);
+    buffer->len = RECEIVE_BUFFER_SIZE;
+    buffer->bid = bufferId;
+    bufferRingTail++;
+    __atomic_store_n(&bufferRing->tail, bufferRingTail, __ATOMIC_RELEASE);
+}
+
+uint64_t UringTransport::encode(RequestKind kind, int socket)
+{
+    uint32_t generation = 0;
+    auto it = connections.find(socket);
+    if (it != connections.end())
+    {
+        generation = it->second.generation;
+    }
+    return ((uint64_t)kind << 56) | ((uint64_t)generation << 32) |
+           (uint32_t)socket;
+}
@@ -0,0 +1,281 @@
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <queue>
+
+#include "userRegistry.hpp"
+
+UserRegistry::UserRegistry(size_t shards)
+{
+    size_t count = 1;
+    while (count < shards)
+    {
+        count <<= 1;
+    }
+    mask = count - 1;
+    this->shards = std::make_unique<Shard[]>(count);
+}
+
+UserRegistry::Shard &UserRegistry::shardOf(const std::string &user)
+{
+    // The set hashes the name again to pick a bucket; mixing the high bits in
+    // keeps shard and bucket choice from following the same low bits.
+    size_t hash = std::hash<std::string>()(user);
+    return shards[(hash ^ (hash >> 32)) & mask];
+}
+
+std::vector<uint32_t> UserRegistry::trigramsOf(std::string_view name)
+{
+    std::vector<uint32_t> trigrams;
+    for (size_t i = 0; i + 3 <= name.size(); i++)
+    {
+        trigrams.push_back((uint32_t)(uint8_t)name[i] << 16 |
+                           (uint32_t)(uint8_t)name[i + 1] << 8 |
+                           (uint32_t)(uint8_t)name[i + 2]);
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+    return trigrams;
+}
+
+bool UserRegistry::insert(const std::string &user)
+{
+    Shard &shard = shardOf(user);
+    std::unique_lock lock(shard.lock);
+    auto [it, inserted] = shard.users.insert(user);
+    if (inserted)
+    {
+        for (uint32_t trigram : trigramsOf(user))
+        {
+            shard.trigrams[trigram].insert(&*it);
+        }
+        shard.ordered.insert(*it);
+    }
+    return inserted;
+}
+
+bool UserRegistry::erase(const std::string &user)
+{
+    Shard &shard = shardOf(user);
+    std::unique_lock lock(shard.lock);
+    auto it = shard.users.find(user);
+    if (it == shard.users.end())
+    {
+        return false;
+    }
+    for (uint32_t trigram : trigramsOf(user))
+    {
+        auto posting = shard.trigrams.find(trigram);
+        posting->second.erase(&*it);
+        if (posting->second.empty())
+        {
+            shard.trigrams.erase(posting);
+        }
+    }
+    shard.ordered.erase(*it);
+    shard.users.erase(it);
+    return true;
+}
+
+bool UserRegistry::contains(std::string_view user)
+{
+    // Sets of strings are only searched by view from C++20 on, so the name is
+    // copied into a buffer the thread keeps rather than a new string.
+    thread_local std::string key;
+    key.assign(user);
+    Shard &shard = shardOf(key);
+    std::shared_lock lock(shard.lock);
+    return shard.users.find(key) != shard.users.end();
+}
+
+void UserRegistry::forEach(const std::function<void(const std::string &user)> &visit)
+{
+    for (size_t i = 0; i <= mask; i++)
+    {
+        std::shared_lock lock(shards[i].lock);
+        for (const std::string &user : shards[i].users)
+        {
+            visit(user);
+        }
+    }
+}
+
+void UserRegistry::search(std::string_view query,
+                          const std::function<void(const std::string &user)> &visit)
+{
+    if (query.size() < 3)
+    {
+        forEach([&visit, query](const std::string &user)
+        {
+            if (user.find(query) != std::string::npos)
+            {
+                visit(user);
+            }
+        });
+        return;
+    }
+
+    for (size_t i = 0; i <= mask; i++)
+    {
+        std::shared_lock lock(shards[i].lock);
+        searchShard(shards[i], query, visit);
+    }
+}
+
+bool UserRegistry::postingsOf(Shard &shard, std::string_view query, Postings &postingsOut)
+{
+    postingsOut.clear();
+    for (uint32_t trigram : trigramsOf(query))
+    {
+        auto posting = shard.trigrams.find(trigram);
+        if (posting == shard.trigrams.end())
+        {
+            // No user of this shard has the trigram, so none can match.
+            return false;
+        }
+        postingsOut.push_back(&posting->second);
+    }
+
+    // Probing the shortest lists first drops most candidates early.
+    std::sort(postingsOut.begin(), postingsOut.end(), [](auto *a, auto *b)
+    {
+        return a->size() < b->size();
+    });
+    return true;
+}
+
+bool UserRegistry::matches(const Postings &postings, size_t first, const std::string *user,
+                           std::string_view query)
+{
+    for (size_t p = first; p < postings.size(); p++)
+    {
+        if (postings[p]->count(user) == 0)
+        {
+            return false;
+        }
+    }
+    // Sharing every trigram does not put them in the query's order.
+    return user->find(query) != std::string::npos;
+}
+
+void UserRegistry::searchShard(Shard &shard, std::string_view query,
+                               const std::function<void(const std::string &user)> &visit)
+{
+    Postings postings;
+    if (!postingsOf(shard, query, postings))
+    {
+        return;
+    }
+
+    // Walk the shortest list and probe the others.
+    for (const std::string *user : *postings[0])
+    {
+        if (matches(postings, 1, user, query))
+        {
+            visit(*user);
+        }
+    }
+}
+
+std::vector<std::string> UserRegistry::listAfter(std::string_view after,
+                                                 std::string_view query, size_t limit)
+{
+    // The next match of every shard, smallest first. A shard's following
+    // match is only looked for once its current one is taken.
+    using Candidate = std::pair<std::string, size_t>;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> next;
+    std::vector<std::string> users;
+    if (limit == 0)
+    {
+        return users;
+    }
+    for (size_t i = 0; i <= mask; i++)
+    {
+        std::string user;
+        if (nextMatch(i, after, query, user))
+        {
+            next.emplace(std::move(user), i);
+        }
+    }
+
+    while (!next.empty())
+    {
+        auto [user, index] = next.top();
+        next.pop();
+        users.push_back(std::move(user));
+        if (users.size() == limit)
+        {
+            break;
+        }
+        if (nextMatch(index, users.back(), query, user))
+        {
+            next.emplace(std::move(user), index);
+        }
+    }
+    return users;
+}
+
+bool UserRegistry::nextMatch(size_t index, std::string_view after, std::string_view query,
+                             std::string &userOut)
+{
+    Shard &shard = shards[index];
+    std::shared_lock lock(shard.lock);
+    if (query.size() < 3)
+    {
+        return nextInOrder(shard, after, query, userOut);
+    }
+
+    Postings postings;
+    if (!postingsOf(shard, query, postings))
+    {
+        return false;
+    }
+
+    // With `n` users in the shortest list, about one in `size() / n` users
+    // in order is a candidate, so reading the whole list costs less than the
+    // walk to the next one when `n * n < size()`.
+    const auto &shortest = *postings[0];
+    if (shortest.size() * shortest.size() >= shard.ordered.size())
+    {
+        return nextInOrder(shard, after, query, userOut);
+    }
+    const std::string *next = nullptr;
+    for (const std::string *user : shortest)
+    {
+        if (*user > after && (next == nullptr || *user < *next) &&
+            matches(postings, 1, user, query))
+        {
+            next = user;
+        }
+    }
+    if (next != nullptr)
+    {
+        userOut = *next;
+    }
+    return next != nullptr;
+}
+
+bool UserRegistry::nextInOrder(Shard &shard, std::string_view after, std::string_view query,
+                               std::string &userOut)
+{
+    for (auto it = shard.ordered.upper_bound(after); it != shard.ordered.end(); ++it)
+    {
+        if (it->find(query) != std::string_view::npos)
+        {
+            userOut = *it;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t UserRegistry::size()
+{
+    size_t total = 0;
+    for (size_t i = 0; i <= mask; i++)
+    {
+        std::shared_lock lock(shards[i].lock);
+        total += shards[i].users.size();
+    }
+    return total;
+}
@@ -0,0 +1,542 @@
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "checksum.hpp"
+#include "writeAheadLog.hpp"
+
+// Length and checksum in front of every record body.
+#define FRAME_HEADER_LENGTH 8
+// Sequence number and type at the start of every record body.
+#define BODY_HEADER_LENGTH 9
+
+static void putFixed(std::string &out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        out += (char)(value >> (8 * i));
+    }
+}
+
+static uint64_t getFixed(const char *in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)(uint8_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+/**
+ * Path of the segment in `directory` whose first record is `start`. The
+ * number is zero-padded so that names sort like their numbers.
+*/
+static std::string segmentPath(const std::string &directory, uint64_t start)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "wal-%020llu.log", (unsigned long long)start);
+    return directory + "/" + name;
+}
+
+/**
+ * Reads the segment open as `fd` from its start, a chunk at a time, and passes
+ * every intact record to `visit`. Only a chunk, or a record longer than one,
+ * is held at once.
+ *
+ * @return  Offset just past the last intact record.
+*/
+static uint64_t readSegment(int fd, const std::function<void(WriteAheadLog::Record &record)> &visit)
+{
+    std::string buffer;
+    // Where the next record starts, in `buffer` and in the file.
+    size_t start = 0;
+    uint64_t offset = 0;
+    bool ended = false;
+    char chunk[1 << 16];
+    while (true)
+    {
+        WriteAheadLog::Record record;
+        int64_t length = WriteAheadLog::decode(std::string_view(buffer).substr(start), record);
+        if (length > 0)
+        {
+            visit(record);
+            start += length;
+            offset += length;
+            continue;
+        }
+        if (length < 0 || ended)
+        {
+            return offset;
+        }
+
+        buffer.erase(0, start);
+        start = 0;
+        ssize_t bytes = pread(fd, chunk, sizeof(chunk), offset + buffer.size());
+        if (bytes < 0)
+        {
+            perror("read write-ahead log segment");
+            exit(1);
+        }
+        ended = bytes == 0;
+        buffer.append(chunk, bytes);
+    }
+}
+
+WriteAheadLog::WriteAheadLog(const std::string &directory, Durability durability,
+                             uint64_t commitWindowMicros,
+                             const std::function<void(Record &record)> &replay)
+    : directory(directory), fd(-1), durability(durability),
+      commitWindowMicros(commitWindowMicros), nextSequence(1), durableSequence(0),
+      flushing(false), closing(false), stats{}
+{
+    DIR *listing = opendir(directory.c_str());
+    if (listing == nullptr)
+    {
+        perror("open write-ahead log");
+        exit(1);
+    }
+    while (dirent *entry = readdir(listing))
+    {
+        unsigned long long start;
+        int length = 0;
+        if (sscanf(entry->d_name, "wal-%20llu.log%n", &start, &length) == 1 &&
+            entry->d_name[length] == '\0')
+        {
+            segments.push_back(start);
+        }
+    }
+    closedir(listing);
+    std::sort(segments.begin(), segments.end());
+
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        int segment = open(segmentPath(directory, segments[i]).c_str(), O_RDWR | O_CLOEXEC);
+        if (segment < 0)
+        {
+            perror("open write-ahead log segment");
+            exit(1);
+        }
+        // An empty segment still numbers the records that follow.
+        nextSequence = std::max(nextSequence, segments[i]);
+        uint64_t offset = readSegment(segment, [this, &replay](Record &record)
+        {
+            nextSequence = record.sequence + 1;
+            if (replay)
+            {
+                replay(record);
+            }
+        });
+
+        if (i + 1 < segments.size())
+        {
+            close(segment);
+            continue;
+        }
+        // Drop a record the last run did not finish writing, so new records
+        // follow the last intact one.
+        struct stat status;
+        if (fstat(segment, &status) < 0 ||
+            ((uint64_t)status.st_size > offset && ftruncate(segment, offset) < 0))
+        {
+            perror("truncate write-ahead log");
+            exit(1);
+        }
+        if (lseek(segment, offset, SEEK_SET) < 0)
+        {
+            perror("seek write-ahead log");
+            exit(1);
+        }
+        fd = segment;
+    }
+    durableSequence = nextSequence - 1;
+
+    if (fd < 0)
+    {
+        openSegment();
+    }
+    if (durability != PER_OPERATION)
+    {
+        flusher = std::thread(&WriteAheadLog::flushLoop, this);
+    }
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+    {
+        std::unique_lock guard(lock);
+        closing = true;
+    }
+    appended.notify_all();
+    if (flusher.joinable())
+    {
+        flusher.join();
+    }
+    close(fd);
+}
+
+void WriteAheadLog::replay(const std::function<void(Record &record)> &visit)
+{
+    for (uint64_t start : segments)
+    {
+        int segment = open(segmentPath(directory, start).c_str(), O_RDONLY | O_CLOEXEC);
+        if (segment < 0)
+        {
+            perror("open write-ahead log segment");
+            exit(1);
+        }
+        readSegment(segment, visit);
+        close(segment);
+    }
+}
+
+uint64_t WriteAheadLog::append(Record &record)
+{
+    std::unique_lock guard(lock);
+    record.sequence = nextSequence++;
+    size_t start = pending.size();
+    encode(record, pending);
+    stats.records++;
+    stats.bytes += pending.size() - start;
+
+    if (durability == PER_OPERATION)
+    {
+        if (writeAll(pending) < 0 || fdatasync(fd) < 0)
+        {
+            perror("sync write-ahead log");
+            exit(1);
+        }
+        pending.clear();
+        stats.syncs++;
+        durableSequence = record.sequence;
+    }
+    else if (start == 0)
+    {
+        appended.notify_one();
+    }
+    return record.sequence;
+}
+
+void WriteAheadLog::commit(uint64_t sequence)
+{
+    if (durability != BATCHED)
+    {
+        return;
+    }
+    std::unique_lock guard(lock);
+    committed.wait(guard, [this, sequence]()
+    {
+        return durableSequence >= sequence;
+    });
+}
+
+bool WriteAheadLog::whenDurable(uint64_t sequence, std::function<void()> callback)
+{
+    if (durability != BATCHED)
+    {
+        return false;
+    }
+    std::unique_lock guard(lock);
+    if (durableSequence >= sequence)
+    {
+        return false;
+    }
+    completions.emplace_back(sequence, std::move(callback));
+    return true;
+}
+
+void WriteAheadLog::completeDurable()
+{
+    std::vector<std::pair<uint64_t, std::function<void()>>> done;
+    {
+        std::unique_lock guard(lock);
+        auto durable = std::partition(completions.begin(), completions.end(),
+                                      [this](const auto &completion)
+        {
+            return completion.first > durableSequence;
+        });
+        done.assign(std::make_move_iterator(durable),
+                    std::make_move_iterator(completions.end()));
+        completions.erase(durable, completions.end());
+    }
+    std::sort(done.begin(), done.end(), [](const auto &a, const auto &b)
+    {
+        return a.first < b.first;
+    });
+    for (auto &[sequence, callback] : done)
+    {
+        callback();
+    }
+}
+
+uint64_t WriteAheadLog::rotate()
+{
+    std::unique_lock guard(lock);
+    committed.wait(guard, [this]()
+    {
+        return !flushing;
+    });
+    if (!pending.empty())
+    {
+        if (writeAll(pending) < 0 || (durability != NONE && fdatasync(fd) < 0))
+        {
+            perror("sync write-ahead log");
+            exit(1);
+        }
+        pending.clear();
+        if (durability != NONE)
+        {
+            stats.syncs++;
+        }
+    }
+    durableSequence = nextSequence - 1;
+    committed.notify_all();
+
+    // An empty segment can take the records that follow as it is.
+    if (segments.back() != nextSequence)
+    {
+        close(fd);
+        openSegment();
+    }
+    uint64_t last = nextSequence - 1;
+    guard.unlock();
+    completeDurable();
+    return last;
+}
+
+void WriteAheadLog::removeSegmentsThrough(uint64_t sequence)
+{
+    std::vector<std::string> removed;
+    {
+        std::unique_lock guard(lock);
+        // A segment ends where the next one starts.
+        size_t count = 0;
+        while (count + 1 < segments.size() && segments[count + 1] - 1 <= sequence)
+        {
+            removed.push_back(segmentPath(directory, segments[count]));
+            count++;
+        }
+        segments.erase(segments.begin(), segments.begin() + count);
+    }
+    for (const std::string &path : removed)
+    {
+        unlink(path.c_str());
+    }
+}
+
+WriteAheadLog::Stats WriteAheadLog::getStats()
+{
+    std::unique_lock guard(lock);
+    return stats;
+}
+
+void WriteAheadLog::flushLoop()
+{
+    std::string batch;
+    std::unique_lock guard(lock);
+    while (true)
+    {
+        appended.wait(guard, [this]()
+        {
+            return !pending.empty() || closing;
+        });
+        if (pending.empty())
+        {
+            return;
+        }
+        if (commitWindowMicros > 0 && !closing)
+        {
+            appended.wait_for(guard, std::chrono::microseconds(commitWindowMicros), [this]()
+            {
+                return closing;
+            });
+        }
+
+        // Records appended from here on form the next batch, gathering while
+        // this one syncs.
+        batch.swap(pending);
+        uint64_t last = nextSequence - 1;
+        flushing = true;
+        guard.unlock();
+
+        if (writeAll(batch) < 0 || (durability == BATCHED && fdatasync(fd) < 0))
+        {
+            perror("sync write-ahead log");
+            exit(1);
+        }
+        batch.clear();
+
+        guard.lock();
+        if (durability == BATCHED)
+        {
+            stats.syncs++;
+        }
+        flushing = false;
+        durableSequence = std::max(durableSequence, last);
+        committed.notify_all();
+        if (!completions.empty())
+        {
+            guard.unlock();
+            completeDurable();
+            guard.lock();
+        }
+    }
+}
+
+void WriteAheadLog::openSegment()
+{
+    fd = open(segmentPath(directory, nextSequence).c_str(),
+              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror("create write-ahead log segment");
+        exit(1);
+    }
+    segments.push_back(nextSequence);
+
+    // The new name must be as durable as the records written to it.
+    if (durability != NONE)
+    {
+        int parent = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (parent >= 0)
+        {
+            fsync(parent);
+            close(parent);
+        }
+    }
+}
+
+int WriteAheadLog::writeAll(const std::string &bytes)
+{
+    size_t written = 0;
+    while (written < bytes.size())
+    {
+        ssize_t n = write(fd, bytes.data() + written, bytes.size() - written);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+void WriteAheadLog::encode(const Record &record, std::string &out)
+{
+    size_t frame = out.size();
+    out.append(FRAME_HEADER_LENGTH, '\0');
+
+    putFixed(out, record.sequence, 8);
+    out += (char)record.type;
+    if (record.type == DEQUEUE)
+    {
+        putFixed(out, record.user.size(), 4);
+        out += record.user;
+        putFixed(out, record.sequences.size(), 4);
+        for (uint64_t sequence : record.sequences)
+        {
+            putFixed(out, sequence, 8);
+        }
+    }
+    else
+    {
+        for (std::string_view field : {record.user, record.sender, record.data})
+        {
+            putFixed(out, field.size(), 4);
+            out += field;
+        }
+    }
+
+    size_t bodyLength = out.size() - frame - FRAME_HEADER_LENGTH;
+    uint32_t checksum = crc32(out.data() + frame + FRAME_HEADER_LENGTH, bodyLength);
+    for (int i = 0; i < 4; i++)
+    {
+        out[frame + i] = (char)(bodyLength >> (8 * i));
+        out[frame + 4 + i] = (char)(checksum >> (8 * i));
+    }
+}
+
+int64_t WriteAheadLog::decode(std::string_view data, Record &recordOut)
+{
+    if (data.size() < FRAME_HEADER_LENGTH)
+    {
+        return 0;
+    }
+    uint64_t bodyLength = getFixed(data.data(), 4);
+    uint32_t checksum = getFixed(data.data() + 4, 4);
+    if (data.size() - FRAME_HEADER_LENGTH < bodyLength)
+    {
+        return 0;
+    }
+    std::string_view body = data.substr(FRAME_HEADER_LENGTH, bodyLength);
+    if (body.size() < BODY_HEADER_LENGTH || crc32(body.data(), body.size()) != checksum)
+    {
+        return -1;
+    }
+
+    recordOut.sequence = getFixed(body.data(), 8);
+    recordOut.type = (RecordType)body[8];
+    size_t position = BODY_HEADER_LENGTH;
+    auto getString = [&body, &position](std::string_view &field)
+    {
+        if (body.size() - position < 4)
+        {
+            return false;
+        }
+        uint64_t length = getFixed(body.data() + position, 4);
+        position += 4;
+        if (body.size() - position < length)
+        {
+            return false;
+        }
+        field = body.substr(position, length);
+        position += length;
+        return true;
+    };
+
+    switch (recordOut.type)
+    {
+    case CREATE:
+    case DELETE:
+    case ENQUEUE:
+        if (!getString(recordOut.user) || !getString(recordOut.sender) ||
+            !getString(recordOut.data))
+        {
+            return -1;
+        }
+        break;
+    case DEQUEUE:
+    {
+        if (!getString(recordOut.user) || body.size() - position < 4)
+        {
+            return -1;
+        }
+        uint64_t count = getFixed(body.data() + position, 4);
+        position += 4;
+        if ((body.size() - position) / 8 < count)
+        {
+            return -1;
+        }
+        for (uint64_t i = 0; i < count; i++, position += 8)
+        {
+            recordOut.sequences.push_back(getFixed(body.data() + position, 8));
+        }
+        break;
+    }
+    default:
+        return -1;
+    }
+    return FRAME_HEADER_LENGTH + bodyLength;
+}
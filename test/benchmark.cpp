@@ -0,0 +1,836 @@
+#include "server.hpp"
+#include "client.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define BENCHMARK_PORT 1200
+#define BENCHMARK_SOCKET_PATH "/tmp/chat-benchmark.sock"
+
+// Number of heap allocations made by the process, counted by the global
+// `operator new` below.
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *memory = malloc(size);
+    if (memory == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t size) noexcept
+{
+    free(memory);
+}
+
+/**
+ * Measures the receive path alone: `frames` `SEND` frames are parsed out of a
+ * receive buffer and dispatched to `Server::sendMessage()`, which stores them
+ * in a mailbox. Reports heap allocations and time per frame.
+*/
+int benchmarkDispatch(int frames)
+{
+    std::cout.setstate(std::ios::failbit);
+    Server server(BENCHMARK_PORT);
+
+    Endpoint<Server> network(&server);
+    server.createAccount({Network::CREATE, "notification-service"});
+
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+    // Field lengths past the small-string buffer, as in real traffic.
+    Network::OutputBuffer frame;
+    network.queueMessage(frame, {Network::SEND, "your order has shipped and arrives tomorrow",
+                                 "notification-service", "subscriber-000042"});
+    const int framesPerRead = 64;
+    std::string burst;
+    for (int i = 0; i < framesPerRead; i++)
+    {
+        burst += frame.bytes;
+    }
+    FrameDecoder decoder(burst.size() * 2);
+    Arena arena;
+    char replies[65536];
+
+    uint64_t allocationsBefore = allocations;
+    auto start = std::chrono::steady_clock::now();
+    int dispatched = 0;
+    while (dispatched < frames)
+    {
+        decoder.append(burst.data(), burst.size());
+        dispatched += network.dispatchBuffered(fds[0], decoder, arena);
+        while (recv(fds[1], replies, sizeof(replies), MSG_DONTWAIT) > 0)
+        {
+        }
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::cerr << "frames:            " << dispatched << "\n"
+              << "allocations/frame: " << (double)(allocations - allocationsBefore) / dispatched << "\n"
+              << "ns/frame:          " << seconds * 1e9 / dispatched << "\n"
+              << "pool hit rate:     " << server.getPoolStats().hitRate() << std::endl;
+    server.stopServer();
+    return 0;
+}
+
+/**
+ * Round-trip benchmark for the server's connection modes. Each client sends
+ * `messages` chat messages, keeping up to `depth` requests in flight (1 waits
+ * for every `OK` before sending the next). With `batch` above 1 every request
+ * is a `SEND_BATCH` of that many messages. Clients reach the server over TCP,
+ * a Unix domain socket, or an in-process socket pair (`loopback`), which
+ * leaves the protocol and handler cost without the TCP stack.
+ * Reports throughput, latency percentiles and server-side syscalls per message
+ * so the transports can be compared under the same load.
+*/
+/**
+ * Opens `connections` connections as fast as `ACCEPTORS` acceptor threads take
+ * them, closing each right away, and reports how the kernel spread them across
+ * the acceptors' `SO_REUSEPORT` sockets.
+*/
+int benchmarkConnect(int acceptors, int connections)
+{
+    std::cout.setstate(std::ios::failbit);
+    Server::Options options;
+    options.mode = Server::EVENT_LOOP;
+    options.acceptors = acceptors;
+    Server server(BENCHMARK_PORT, options);
+    std::thread serving([&server]()
+    {
+        server.serve();
+    });
+
+    Address address = Address::tcp("127.0.0.1", BENCHMARK_PORT);
+    auto start = std::chrono::steady_clock::now();
+    int refused = 0;
+    for (int i = 0; i < connections; i++)
+    {
+        int socket = connectTo(address);
+        if (socket < 0)
+        {
+            refused++;
+            continue;
+        }
+        close(socket);
+    }
+
+    // Connections are counted once accepted, which may trail connect().
+    uint64_t accepted = 0;
+    std::vector<Server::AcceptorStats> stats;
+    while (accepted < (uint64_t)(connections - refused))
+    {
+        stats = server.getAcceptorStats();
+        accepted = 0;
+        for (auto &acceptor : stats)
+        {
+            accepted += acceptor.accepted;
+        }
+        std::this_thread::yield();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    server.stopServer();
+    serving.join();
+
+    std::cerr << "connections:       " << connections << "\n"
+              << "refused:           " << refused << "\n"
+              << "accepts/s:         " << (uint64_t)(accepted / elapsed.count()) << "\n";
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        std::cerr << "acceptor " << i << ":        " << stats[i].accepted << " accepted, "
+                  << (uint64_t)stats[i].acceptsPerSecond << "/s\n";
+    }
+    return 0;
+}
+
+/**
+ * The account registry as it was before sharding: one set behind one
+ * exclusive lock. Kept as the baseline of `benchmarkRegistry()`.
+*/
+struct SingleLockRegistry
+{
+    std::unordered_set<std::string> users;
+    std::mutex lock;
+
+    bool insert(const std::string &user)
+    {
+        std::unique_lock guard(lock);
+        return users.insert(user).second;
+    }
+
+    bool erase(const std::string &user)
+    {
+        std::unique_lock guard(lock);
+        return users.erase(user) > 0;
+    }
+
+    bool contains(const std::string &user)
+    {
+        std::unique_lock guard(lock);
+        return users.find(user) != users.end();
+    }
+
+    void forEach(const std::function<void(const std::string &user)> &visit)
+    {
+        std::unique_lock guard(lock);
+        for (const std::string &user : users)
+        {
+            visit(user);
+        }
+    }
+};
+
+/**
+ * Runs `operations` registry operations on each of `threads` threads against
+ * `registry`, which starts with 10000 users: mostly lookups, as made by every
+ * `SEND_BATCH` and `SUBSCRIBE`, then account churn, and a `LIST` scan every
+ * 1000 operations.
+ *
+ * @return  Operations per second across all threads.
+*/
+template <typename Registry>
+double runRegistry(Registry &registry, int threads, int operations)
+{
+    for (int i = 0; i < 10000; i++)
+    {
+        registry.insert("user" + std::to_string(i));
+    }
+
+    std::atomic<bool> go{false};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&registry, &go, t, operations]()
+        {
+            while (!go)
+            {
+                std::this_thread::yield();
+            }
+            uint32_t seed = t + 1;
+            size_t matches = 0;
+            for (int i = 0; i < operations; i++)
+            {
+                seed = seed * 1103515245 + 12345;
+                std::string user = "user" + std::to_string((seed >> 8) % 10000);
+                std::string churned = "churn" + std::to_string(t) + "-" + std::to_string(i % 64);
+                if (i % 1000 == 999)
+                {
+                    registry.forEach([&matches](const std::string &name)
+                    {
+                        matches += name.find("99") != std::string::npos;
+                    });
+                }
+                else if (i % 10 < 8)
+                {
+                    matches += registry.contains(user);
+                }
+                else if (i % 10 == 8)
+                {
+                    registry.insert(churned);
+                }
+                else
+                {
+                    registry.erase(churned);
+                }
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return (double)threads * operations / elapsed.count();
+}
+
+/**
+ * Compares the sharded `UserRegistry` with the single-lock registry it
+ * replaced under the same mix of operations from `threads` threads.
+*/
+int benchmarkRegistry(int threads, int operations)
+{
+    SingleLockRegistry single;
+    double singleRate = runRegistry(single, threads, operations);
+    UserRegistry sharded;
+    double shardedRate = runRegistry(sharded, threads, operations);
+
+    std::cerr << "threads:           " << threads << "\n"
+              << "cores:             " << std::thread::hardware_concurrency() << "\n"
+              << "single lock:       " << (uint64_t)singleRate << " ops/s\n"
+              << "sharded (" << sharded.shardCount() << "):      "
+              << (uint64_t)shardedRate << " ops/s\n"
+              << "speedup:           " << shardedRate / singleRate << std::endl;
+    return 0;
+}
+
+/**
+ * Registers `users` accounts and times `queries` substring searches of three
+ * to five characters, through the trigram index and by scanning every user as
+ * `listAccounts()` did before it.
+*/
+int benchmarkSearch(int users, int queries)
+{
+    UserRegistry registry;
+    std::vector<std::string> names;
+    uint32_t seed = 1;
+    auto next = [&seed]()
+    {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 8;
+    };
+    for (int i = 0; i < users; i++)
+    {
+        // Lowercase names of 8 to 16 letters
+        std::string name(8 + next() % 9, 'a');
+        for (char &c : name)
+        {
+            c = 'a' + next() % 26;
+        }
+        names.push_back(name);
+        registry.insert(name);
+    }
+
+    std::vector<std::string> searches;
+    for (int i = 0; i < queries; i++)
+    {
+        const std::string &name = names[next() % names.size()];
+        size_t length = 3 + next() % 3;
+        searches.push_back(name.substr(next() % (name.size() - length + 1), length));
+    }
+
+    size_t indexed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const std::string &query : searches)
+    {
+        registry.search(query, [&indexed](const std::string &user)
+        {
+            indexed++;
+        });
+    }
+    std::chrono::duration<double, std::micro> indexTime = std::chrono::steady_clock::now() - start;
+
+    size_t scanned = 0;
+    start = std::chrono::steady_clock::now();
+    for (const std::string &query : searches)
+    {
+        registry.forEach([&scanned, &query](const std::string &user)
+        {
+            scanned += user.find(query) != std::string::npos;
+        });
+    }
+    std::chrono::duration<double, std::micro> scanTime = std::chrono::steady_clock::now() - start;
+
+    std::cerr << "users:             " << users << "\n"
+              << "queries:           " << queries << "\n"
+              << "matches/query:     " << (double)indexed / queries
+              << (indexed == scanned ? "" : " (MISMATCH)") << "\n"
+              << "trigram index:     " << indexTime.count() / queries << " us/query\n"
+              << "linear scan:       " << scanTime.count() / queries << " us/query\n"
+              << "speedup:           " << scanTime.count() / indexTime.count() << std::endl;
+    return indexed == scanned ? 0 : 1;
+}
+
+/**
+ * Appends and commits `operations` 64-byte messages from `threads` threads
+ * under each durability policy of `WriteAheadLog`.
+*/
+int benchmarkLog(int threads, int operations)
+{
+    char directory[] = "/tmp/chat-benchmark-XXXXXX";
+    if (mkdtemp(directory) == nullptr)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string payload(64, 'x');
+
+    std::cerr << "threads:           " << threads << "\n"
+              << "operations:        " << operations << "\n";
+    const char *names[] = {"none", "batched", "per-operation"};
+    for (auto durability : {WriteAheadLog::NONE, WriteAheadLog::BATCHED,
+                            WriteAheadLog::PER_OPERATION})
+    {
+        std::string segment = std::string(directory) + "/wal-00000000000000000001.log";
+        unlink(segment.c_str());
+        WriteAheadLog log(directory, durability);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> writers;
+        for (int t = 0; t < threads; t++)
+        {
+            writers.emplace_back([&log, &payload, t, threads, operations]()
+            {
+                for (int i = t; i < operations; i += threads)
+                {
+                    WriteAheadLog::Record record{WriteAheadLog::ENQUEUE, "receiver",
+                                                 "sender", payload};
+                    log.commit(log.append(record));
+                }
+            });
+        }
+        for (std::thread &writer : writers)
+        {
+            writer.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        WriteAheadLog::Stats stats = log.getStats();
+
+        std::string label = std::string(names[durability]) + ":";
+        label.resize(19, ' ');
+        std::cerr << label << (uint64_t)(operations / elapsed.count()) << " ops/s, "
+                  << stats.syncs << " syncs";
+        if (stats.syncs > 0)
+        {
+            std::cerr << " (" << (double)stats.records / stats.syncs << " records/sync)";
+        }
+        std::cerr << "\n";
+    }
+
+    unlink((std::string(directory) + "/wal-00000000000000000001.log").c_str());
+    rmdir(directory);
+    return 0;
+}
+
+/**
+ * Starts a server from a snapshot of `users` accounts holding `messages`
+ * 32-byte messages, and from a log of the same changes, and compares how
+ * long each takes.
+*/
+int benchmarkRecovery(int users, int messages)
+{
+    char directory[] = "/tmp/chat-benchmark-XXXXXX";
+    if (mkdtemp(directory) == nullptr)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string snapshotPath = std::string(directory) + "/snapshot";
+    std::string segmentPath = std::string(directory) + "/wal-00000000000000000001.log";
+    std::string payload(32, 'x');
+    auto nameOf = [](int i)
+    {
+        return "user" + std::to_string(i);
+    };
+
+    // Messages are spread evenly over the first tenth of the accounts.
+    int receivers = std::max(1, users / 10);
+    auto start = std::chrono::steady_clock::now();
+    {
+        Snapshot::Writer writer(snapshotPath, 0);
+        for (int i = 0; i < users; i++)
+        {
+            writer.addUser(nameOf(i));
+        }
+        uint64_t sequence = 1;
+        for (int r = 0; r < receivers; r++)
+        {
+            writer.beginMailbox(nameOf(r));
+            for (int m = r; m < messages; m += receivers)
+            {
+                writer.addMessage(sequence++, nameOf((r + 1) % users), payload);
+            }
+        }
+        if (writer.commit() < 0)
+        {
+            return 1;
+        }
+    }
+    std::chrono::duration<double> writeTime = std::chrono::steady_clock::now() - start;
+
+    // Keep the server's logging out of the measurement.
+    std::cout.setstate(std::ios::failbit);
+    Server::Options options;
+    options.dataDirectory = directory;
+    options.durability = WriteAheadLog::NONE;
+
+    start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> snapshotStart, firstRead;
+    {
+        Server server(Address::tcp("127.0.0.1", BENCHMARK_PORT), options);
+        snapshotStart = std::chrono::steady_clock::now() - start;
+        auto before = std::chrono::steady_clock::now();
+        std::string reply = server.requestMessages({Network::REQUEST, nameOf(0)}).data;
+        size_t count = std::count(reply.begin(), reply.end(), '\n');
+        firstRead = std::chrono::steady_clock::now() - before;
+        if (count != (size_t)(messages + receivers - 1) / receivers)
+        {
+            std::cerr << "snapshot restored " << count << " messages for " << nameOf(0)
+                      << std::endl;
+            return 1;
+        }
+        server.stopServer();
+    }
+    unlink(snapshotPath.c_str());
+    unlink(segmentPath.c_str());
+
+    {
+        WriteAheadLog log(directory, WriteAheadLog::NONE);
+        for (int i = 0; i < users; i++)
+        {
+            std::string user = nameOf(i);
+            WriteAheadLog::Record record{WriteAheadLog::CREATE, user};
+            log.append(record);
+        }
+        for (int m = 0; m < messages; m++)
+        {
+            std::string receiver = nameOf(m % receivers);
+            std::string sender = nameOf((m % receivers + 1) % users);
+            WriteAheadLog::Record record{WriteAheadLog::ENQUEUE, receiver, sender, payload};
+            log.append(record);
+        }
+    }
+    start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> logStart;
+    {
+        Server server(Address::tcp("127.0.0.1", BENCHMARK_PORT), options);
+        logStart = std::chrono::steady_clock::now() - start;
+        server.stopServer();
+    }
+    unlink(segmentPath.c_str());
+    rmdir(directory);
+
+    std::cerr << "users:             " << users << "\n"
+              << "messages:          " << messages << " in " << receivers << " mailboxes\n"
+              << "snapshot write:    " << writeTime.count() << " s\n"
+              << "snapshot start:    " << snapshotStart.count() << " s\n"
+              << "first mailbox:     " << firstRead.count() * 1000 << " ms\n"
+              << "log replay start:  " << logStart.count() << " s\n"
+              << "speedup:           " << logStart.count() / snapshotStart.count() << std::endl;
+    return 0;
+}
+
+/**
+ * Resident memory of the process in bytes.
+*/
+static uint64_t residentBytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Queues `messages` messages of 1 to `maxPayload` bytes from 10000 senders
+ * over 10000 mailboxes, first in `Mailbox`es and then as `Network::Message`s
+ * in a `std::deque` per receiver, and compares the memory each takes.
+*/
+int benchmarkStore(int messages, int maxPayload)
+{
+    const int users = 10000;
+    std::vector<std::string> names;
+    for (int i = 0; i < users; i++)
+    {
+        names.push_back("user" + std::to_string(100000 + i));
+    }
+    std::string payload(maxPayload, 'x');
+    auto lengthOf = [maxPayload](int i)
+    {
+        return 1 + (uint32_t)(i * 2654435761u) % maxPayload;
+    };
+
+    // Slabs are kept once carved, so the records are measured first.
+    uint64_t before = residentBytes();
+    double mailboxBytes;
+    uint64_t slabBefore = RecordSlab::getSlabBytes();
+    {
+        MailboxDirectory directory;
+        Epoch::Guard guard;
+        for (int i = 0; i < messages; i++)
+        {
+            std::string_view data = std::string_view(payload).substr(0, lengthOf(i));
+            directory.get(names[i % users]).push(names[(i / users) % users], data, i + 1);
+        }
+        mailboxBytes = (double)(residentBytes() - before) / messages;
+    }
+
+    before = residentBytes();
+    double dequeBytes;
+    {
+        std::vector<std::deque<Network::Message>> queues(users);
+        for (int i = 0; i < messages; i++)
+        {
+            queues[i % users].push_back({Network::SEND, payload.substr(0, lengthOf(i)),
+                                         names[(i / users) % users], names[i % users]});
+        }
+        dequeBytes = (double)(residentBytes() - before) / messages;
+    }
+
+    std::cerr << "messages:          " << messages << " of 1-" << maxPayload << " bytes\n"
+              << "Message deque:     " << dequeBytes << " bytes/message\n"
+              << "Mailbox records:   " << mailboxBytes << " bytes/message ("
+              << (double)(RecordSlab::getSlabBytes() - slabBefore) / messages
+              << " in slabs)\n"
+              << "reduction:         " << dequeBytes / mailboxBytes << "x" << std::endl;
+    return 0;
+}
+
+/**
+ * Queues `messages` 128-byte messages for 1000 offline users on a server
+ * keeping `budgetMegabytes` of them in memory, then delivers them all, and
+ * reports how far memory grew and how fast spilled mail is read back.
+*/
+int benchmarkSpill(int messages, int budgetMegabytes)
+{
+    const int users = 1000;
+    // Keep the server's per-message logging out of the measurement.
+    std::cout.setstate(std::ios::failbit);
+    Server::Options options;
+    options.mailboxBudgetBytes = (uint64_t)budgetMegabytes << 20;
+    Server server(Address::tcp("127.0.0.1", BENCHMARK_PORT), options);
+
+    server.createAccount({Network::CREATE, "sender"});
+    std::string payload(128, 'x');
+    uint64_t before = residentBytes();
+    uint64_t peakQueued = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; i++)
+    {
+        std::string receiver = "user" + std::to_string(i % users);
+        server.sendMessage({Network::SEND, payload, "sender", receiver});
+        peakQueued = std::max(peakQueued, server.getQueuedBytes());
+    }
+    std::chrono::duration<double> queueTime = std::chrono::steady_clock::now() - start;
+    uint64_t grown = residentBytes() - before;
+
+    start = std::chrono::steady_clock::now();
+    size_t delivered = 0;
+    for (int u = 0; u < users; u++)
+    {
+        std::string reply = server.requestMessages({Network::REQUEST,
+                                                    "user" + std::to_string(u)}).data;
+        delivered += std::count(reply.begin(), reply.end(), '\n');
+    }
+    std::chrono::duration<double> drainTime = std::chrono::steady_clock::now() - start;
+    server.stopServer();
+
+    std::cerr << "messages:          " << messages << " for " << users << " users\n"
+              << "budget:            " << budgetMegabytes << " MB\n"
+              << "queued:            " << (uint64_t)(messages / queueTime.count())
+              << " msg/s, peak " << (peakQueued >> 20) << " MB in memory\n"
+              << "resident growth:   " << (grown >> 20) << " MB\n"
+              << "delivered:         " << delivered << " at "
+              << (uint64_t)(delivered / drainTime.count()) << " msg/s" << std::endl;
+    return delivered == (size_t)messages ? 0 : 1;
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: benchmark [threads|epoll|uring] [CLIENTS] [MESSAGES] [DEPTH] [BATCH]"
+                  << " [tcp|unix|loopback]\n"
+                  << "       benchmark dispatch [FRAMES]\n"
+                  << "       benchmark connect [ACCEPTORS] [CONNECTIONS]\n"
+                  << "       benchmark registry [THREADS] [OPERATIONS]\n"
+                  << "       benchmark search [USERS] [QUERIES]\n"
+                  << "       benchmark log [THREADS] [OPERATIONS]\n"
+                  << "       benchmark recovery [USERS] [MESSAGES]\n"
+                  << "       benchmark store [MESSAGES] [MAXPAYLOAD]\n"
+                  << "       benchmark spill [MESSAGES] [BUDGETMB]" << std::endl;
+        return -1;
+    }
+
+    if (std::string(argv[1]) == "dispatch")
+    {
+        return benchmarkDispatch(argc >= 3 ? std::stoi(argv[2]) : 100000);
+    }
+    if (std::string(argv[1]) == "connect")
+    {
+        return benchmarkConnect(argc >= 3 ? std::stoi(argv[2]) : 4,
+                                argc >= 4 ? std::stoi(argv[3]) : 10000);
+    }
+
+    if (std::string(argv[1]) == "registry")
+    {
+        return benchmarkRegistry(argc >= 3 ? std::stoi(argv[2]) : 8,
+                                 argc >= 4 ? std::stoi(argv[3]) : 200000);
+    }
+
+    if (std::string(argv[1]) == "search")
+    {
+        return benchmarkSearch(argc >= 3 ? std::stoi(argv[2]) : 1000000,
+                               argc >= 4 ? std::stoi(argv[3]) : 20);
+    }
+
+    if (std::string(argv[1]) == "log")
+    {
+        return benchmarkLog(argc >= 3 ? std::stoi(argv[2]) : 8,
+                            argc >= 4 ? std::stoi(argv[3]) : 20000);
+    }
+
+    if (std::string(argv[1]) == "recovery")
+    {
+        return benchmarkRecovery(argc >= 3 ? std::stoi(argv[2]) : 1000000,
+                                 argc >= 4 ? std::stoi(argv[3]) : 4000000);
+    }
+
+    if (std::string(argv[1]) == "store")
+    {
+        return benchmarkStore(argc >= 3 ? std::stoi(argv[2]) : 2000000,
+                              argc >= 4 ? std::stoi(argv[3]) : 128);
+    }
+
+    if (std::string(argv[1]) == "spill")
+    {
+        return benchmarkSpill(argc >= 3 ? std::stoi(argv[2]) : 2000000,
+                              argc >= 4 ? std::stoi(argv[3]) : 16);
+    }
+
+    std::string modeName = argv[1];
+    int clients = argc >= 3 ? std::stoi(argv[2]) : 8;
+    int messages = argc >= 4 ? std::stoi(argv[3]) : 2000;
+    int depth = std::max(1, argc >= 5 ? std::stoi(argv[4]) : 1);
+    int batch = std::max(1, argc >= 6 ? std::stoi(argv[5]) : 1);
+    std::string transportName = argc >= 7 ? argv[6] : "tcp";
+
+    Server::Options options;
+    if (modeName == "epoll")
+    {
+        options.mode = Server::EVENT_LOOP;
+    }
+    else if (modeName == "uring")
+    {
+        options.mode = Server::URING_LOOP;
+    }
+
+    // Keep the server's per-message logging out of the measurement.
+    std::cout.setstate(std::ios::failbit);
+
+    Address address = transportName == "unix"
+                          ? Address::unixSocket(BENCHMARK_SOCKET_PATH)
+                          : Address::tcp("127.0.0.1", BENCHMARK_PORT);
+    Server server(address, options);
+    std::vector<std::unique_ptr<Client>> connections;
+    if (transportName == "loopback")
+    {
+        for (int i = 0; i < clients; i++)
+        {
+            connections.push_back(std::make_unique<Client>(server.connectLoopback()));
+        }
+    }
+    else
+    {
+        std::thread acceptor([&server, clients]()
+        {
+            for (int i = 0; i < clients; i++)
+            {
+                server.acceptClient();
+            }
+        });
+        for (int i = 0; i < clients; i++)
+        {
+            connections.push_back(std::make_unique<Client>(address));
+        }
+        acceptor.join();
+    }
+    for (int i = 0; i < clients; i++)
+    {
+        connections[i]->createAccount("bench" + std::to_string(i));
+    }
+
+    std::vector<std::vector<double>> latencies(clients);
+    uint64_t syscallsBefore = server.getSyscalls();
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < clients; i++)
+    {
+        workers.emplace_back([&, i]()
+        {
+            std::string user = "bench" + std::to_string(i);
+            Network::Message request = {Network::SEND, "hello", user, user};
+            if (batch > 1)
+            {
+                std::vector<Network::BatchEntry> entries(batch, {user, "hello"});
+                request = {Network::SEND_BATCH, "", user};
+                Network::encodeBatch(entries, request.data);
+            }
+            std::deque<std::pair<std::chrono::steady_clock::time_point,
+                                 std::future<std::string>>> inFlight;
+            for (int j = 0; j < messages || !inFlight.empty(); j += batch)
+            {
+                if (j < messages)
+                {
+                    inFlight.emplace_back(std::chrono::steady_clock::now(),
+                                          connections[i]->sendRequest(request));
+                }
+                if ((int)inFlight.size() < depth && j < messages)
+                {
+                    continue;
+                }
+                inFlight.front().second.get();
+                auto received = std::chrono::steady_clock::now();
+                latencies[i].push_back(std::chrono::duration<double, std::micro>(
+                    received - inFlight.front().first).count());
+                inFlight.pop_front();
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    uint64_t syscalls = server.getSyscalls() - syscallsBefore;
+
+    std::vector<double> all;
+    for (auto &clientLatencies : latencies)
+    {
+        all.insert(all.end(), clientLatencies.begin(), clientLatencies.end());
+    }
+    std::sort(all.begin(), all.end());
+    size_t total = all.size() * batch;
+
+    std::cerr << "mode:              " << modeName << " over " << transportName << "\n"
+              << "pipeline depth:    " << depth << "\n"
+              << "batch size:        " << batch << "\n"
+              << "messages:          " << total << "\n"
+              << "throughput:        " << (uint64_t)(total / seconds) << " msg/s\n"
+              << "p50 latency:       " << all[all.size() / 2] << " us\n"
+              << "p99 latency:       " << all[all.size() * 99 / 100] << " us\n"
+              << "syscalls/message:  " << (double)syscalls / total << "\n"
+              << "compression ratio: " << server.getCompressionStats().ratio() << " ("
+              << server.getCompressionStats().compressNanoseconds / 1000000.0
+              << " ms CPU)\n"
+              << "pool hit rate:     " << server.getPoolStats().hitRate() << "\n"
+              << "arena bytes/conn:  " << server.getPoolStats().bytesPerConnection() << "\n"
+              << "peak queued bytes: " << server.getOutboundStats().peakQueuedBytes << " ("
+              << server.getOutboundStats().pauses << " pauses)" << std::endl;
+
+    for (auto &client : connections)
+    {
+        client->stopClient();
+    }
+    server.stopServer();
+    return 0;
+}
@@ -1,8 +1,25 @@
 #include "server.hpp"
 #include "client.hpp"
+#include "checksum.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <random>
 #include <string>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <thread>
+#include <unordered_set>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #define PADDED_LENGTH 50
 
@@ -76,6 +93,14 @@ void testServer(Server &server, Client &client)
          "the quick brown fox jumps over the lazy dog", "abcdef", "123abcdef456"}) ==
          (Network::Message){Network::OK, "", "", ""},
          "sendMessage long");
+    test(server.sendMessage({Network::SEND, "hi", "nobody", "abcdef"}) ==
+         (Network::Message){Network::ERROR, "Sender does not exist", "", ""},
+         "sendMessage unknown sender");
+    test(server.sendMessage({Network::SEND, "hi", "abcdef", "nobody"}) ==
+         (Network::Message){Network::ERROR, "Receiver does not exist", "", ""},
+         "sendMessage unknown receiver");
+    test(server.sendBatch({Network::SEND_BATCH, "", "nobody"}).operation == Network::ERROR,
+         "sendBatch unknown sender");
 
     // Test `requestMessages`
     test(server.requestMessages({Network::REQUEST, ""}) ==
@@ -91,6 +116,199 @@ void testServer(Server &server, Client &client)
     test(server.requestMessages({Network::REQUEST, "123abcdef456"}) ==
          (Network::Message){Network::SEND, "", "", ""},
          "requestMessages all read");
+
+    // Test the streamed messages one connection may send at once
+    auto chunk = [&server](std::string data, uint64_t requestId)
+    {
+        return server.sendMessage({Network::SEND, data, "abcdef", "123abcdef456",
+                                   requestId, 1000, 0, true}).operation;
+    };
+    bool started = true;
+    for (uint64_t i = 0; i < MAX_PARTIAL_MESSAGES; i++)
+    {
+        started = started && chunk("part" + std::to_string(i), i) == Network::NO_RETURN;
+    }
+    test(started, "sendMessage streams started");
+    test(chunk("extra", 100) == Network::ERROR && chunk("more", 100) == Network::NO_RETURN,
+         "sendMessage too many streams");
+    test(chunk("", 0) == Network::OK && chunk("", 100) == Network::NO_RETURN,
+         "sendMessage refused stream ended");
+    test(chunk("next", 101) == Network::NO_RETURN, "sendMessage stream slot freed");
+    // The rest of a refused message is dropped even once a slot is free.
+    test(chunk("early", 102) == Network::ERROR && chunk("", 1) == Network::OK &&
+         chunk("late", 102) == Network::NO_RETURN && chunk("", 102) == Network::NO_RETURN,
+         "sendMessage refused stream stays refused");
+    for (uint64_t i = 2; i < MAX_PARTIAL_MESSAGES; i++)
+    {
+        chunk("", i);
+    }
+    chunk("", 101);
+    std::string parts;
+    for (uint64_t i = 0; i < MAX_PARTIAL_MESSAGES; i++)
+    {
+        parts += "abcdef: part" + std::to_string(i) + "\n";
+    }
+    test(server.requestMessages({Network::REQUEST, "123abcdef456"}).data ==
+         parts + "abcdef: next\n",
+         "sendMessage streams delivered");
+
+    // Test `sendBatch`
+    std::string batch;
+    Network::encodeBatch({{"abcdef", "one"}, {"nobody", "two"},
+                          {"123abcdef456", "three"}, {"abcdef", "four"}}, batch);
+    std::string status = {Network::OK, Network::ERROR, Network::OK, Network::OK};
+    test(server.sendBatch({Network::SEND_BATCH, batch, "abcdef"}) ==
+         (Network::Message){Network::OK, status, "", ""},
+         "sendBatch statuses");
+    test(server.requestMessages({Network::REQUEST, "abcdef"}) ==
+         (Network::Message){Network::SEND, "abcdef: one\nabcdef: four\n", "", ""},
+         "sendBatch grouped in order");
+    test(server.requestMessages({Network::REQUEST, "123abcdef456"}) ==
+         (Network::Message){Network::SEND, "abcdef: three\n", "", ""},
+         "sendBatch other recipient");
+    test(server.sendBatch({Network::SEND_BATCH, batch.substr(0, batch.size() - 1),
+                           "abcdef"}).operation == Network::ERROR,
+         "sendBatch malformed");
+    test(server.sendBatch({Network::SEND_BATCH, "", "abcdef"}) ==
+         (Network::Message){Network::OK, "", "", ""},
+         "sendBatch empty");
+
+    // Test that a deletion racing sends leaves no mailbox behind
+    std::atomic<bool> racing = true;
+    std::thread sends([&server, &racing]()
+    {
+        std::string racerBatch;
+        Network::encodeBatch({{"racer", "batched"}}, racerBatch);
+        while (racing)
+        {
+            server.sendMessage({Network::SEND, "hi", "abcdef", "racer"});
+            server.sendBatch({Network::SEND_BATCH, racerBatch, "abcdef"});
+        }
+    });
+    for (int i = 0; i < 2000; i++)
+    {
+        server.createAccount({Network::CREATE, "racer"});
+        server.deleteAccount({Network::DELETE, "racer"});
+    }
+    racing = false;
+    sends.join();
+    server.createAccount({Network::CREATE, "racer"});
+    test(server.requestMessages({Network::REQUEST, "racer"}) ==
+         (Network::Message){Network::SEND, "", "", ""},
+         "deleteAccount racing sends");
+    server.deleteAccount({Network::DELETE, "racer"});
+}
+
+/**
+ * Subscribes `client` as its current user and checks that backlogged messages
+ * are returned and new ones are pushed.
+*/
+void testSubscribe(Server &server, Client &client, std::string label)
+{
+    std::string user = client.getCurrentUser();
+    server.createAccount({Network::CREATE, "bot"});
+    server.sendMessage({Network::SEND, "early", "bot", user});
+    test(client.subscribe() == "bot: early\n", "subscribe backlog " + label);
+
+    // A backlog too large for one reply follows in pushes
+    client.deleteAccount(user);
+    client.createAccount(user);
+    std::string large(100 << 10, 'l');
+    for (int i = 0; i < 12; i++)
+    {
+        server.sendMessage({Network::SEND, large, "bot", user});
+    }
+    size_t expected = 12 * (large.size() + 6);
+    auto pushedBytes = std::make_shared<std::atomic<size_t>>(0);
+    client.setMessageHandler([pushedBytes](std::string messages)
+    {
+        *pushedBytes += messages.size();
+    });
+    size_t replied = client.subscribe().size();
+    for (int i = 0; i < 500 && replied + *pushedBytes < expected; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    test(replied < expected && replied + *pushedBytes == expected,
+         "subscribe large backlog " + label);
+
+    auto pushed = std::make_shared<std::promise<std::string>>();
+    std::future<std::string> received = pushed->get_future();
+    auto once = std::make_shared<std::atomic<bool>>(false);
+    client.setMessageHandler([pushed, once](std::string messages)
+    {
+        if (!once->exchange(true))
+        {
+            pushed->set_value(messages);
+        }
+    });
+    client.sendMessage({Network::SEND, "pushed", "bot", user});
+    test(received.wait_for(std::chrono::seconds(5)) == std::future_status::ready &&
+         received.get() == "bot: pushed\n",
+         "subscribe push " + label);
+    test(client.requestMessages() == "", "subscribe nothing queued " + label);
+    client.setMessageHandler(nullptr);
+    server.deleteAccount({Network::DELETE, "bot"});
+}
+
+void testListPages(Server &server, Client &client, std::string label)
+{
+    std::string all;
+    for (int i = 0; i < 25; i++)
+    {
+        std::string name = std::string("page") + (char)('a' + i);
+        client.createAccount(name);
+        all += name + "\n";
+    }
+
+    // Test `getAccountPage` in order and up to the last page
+    std::string cursor;
+    std::string first = client.getAccountPage("page", 10, cursor);
+    test(first == all.substr(0, 60) && !cursor.empty(), "getAccountPage first " + label);
+
+    // Users added or removed behind the cursor do not shift later pages
+    client.createAccount("pageaa");
+    client.deleteAccount("pagea");
+    std::string second = client.getAccountPage("page", 10, cursor);
+    test(second == all.substr(60, 60) && !cursor.empty(), "getAccountPage stable " + label);
+    client.createAccount("pageza");
+    std::string third = client.getAccountPage("page", 10, cursor);
+    test(third == all.substr(120) + "pageza\n" && cursor.empty(),
+         "getAccountPage last " + label);
+    client.deleteAccount("pageza");
+    client.createAccount("pagea");
+    client.deleteAccount("pageaa");
+
+    // Test `listAccounts`, page by page and streamed
+    for (bool stream : {false, true})
+    {
+        std::string listed;
+        int pages = 0;
+        std::string result = client.listAccounts("page", 7, [&](std::string_view users)
+        {
+            listed += users;
+            pages++;
+        }, stream);
+        std::string mode = stream ? " streamed " : " paged ";
+        test(result == "" && listed == all && pages == 4, "listAccounts" + mode + label);
+    }
+    int pages = 0;
+    test(client.listAccounts("nobody", 7, [&pages](std::string_view users)
+    {
+        pages++;
+    }, true) == "" && pages == 1, "listAccounts empty " + label);
+
+    test(server.listPage({Network::LIST_PAGE, "\xff"}).operation == Network::ERROR,
+         "listPage malformed " + label);
+    std::string forged;
+    Network::encodeListPage({"page", "pagej", 10, false}, forged);
+    test(server.listPage({Network::LIST_PAGE, forged}).operation == Network::ERROR,
+         "listPage malformed cursor " + label);
+
+    for (int i = 0; i < 25; i++)
+    {
+        client.deleteAccount(std::string("page") + (char)('a' + i));
+    }
 }
 
 void testClient(Server &server, Client &client)
@@ -123,11 +341,11 @@ void testClient(Server &server, Client &client)
     // Test `getAccountList`
     test(client.getAccountList("user123") == "user123\n",
          "getAccountList substring one");
-    test(client.getAccountList("user") == "user123\nuser\n",
+    test(client.getAccountList("user") == "user\nuser123\n",
          "getAccountList substring both");
     test(client.getAccountList("123user") == "",
          "getAccountList substring none");
-    test(client.getAccountList("") == "user123\nuser\n123abcdef456\nabcdef\n",
+    test(client.getAccountList("") == "123abcdef456\nabcdef\nuser\nuser123\n",
          "getAccountList all");
 
     // Test `getClientUserList`
@@ -212,6 +430,1705 @@ void testClient(Server &server, Client &client)
     test(client.sendMessage({Network::SEND,
          "the quick brown fox jumps over the lazy dog", "user123", "user"}) == "",
          "sendMessage long");
+    test(server.sendMessage({Network::SEND, "hi", "nobody", "abcdef"}) ==
+         (Network::Message){Network::ERROR, "Sender does not exist", "", ""},
+         "sendMessage unknown sender");
+    test(server.sendBatch({Network::SEND_BATCH, "", "nobody"}).operation == Network::ERROR,
+         "sendBatch unknown sender");
+
+    // Test `subscribe`
+    client.setCurrentUser("abcdef");
+    testSubscribe(server, client, "threads");
+    client.setCurrentUser("");
+
+    testListPages(server, client, "threads");
+}
+
+/**
+ * Reads whatever is currently queued on `socket` into a string.
+*/
+std::string drainSocket(int socket)
+{
+    char buffer[4096];
+    std::string drained;
+    ssize_t n;
+    while ((n = recv(socket, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+    {
+        drained.append(buffer, n);
+    }
+    return drained;
+}
+
+void testFrameDecoder()
+{
+    FrameDecoder decoder(8);
+
+    // Test `append` and `peek` across the end of the ring
+    decoder.append("abcdef", 6);
+    decoder.consume(4);
+    decoder.append("ghij", 4);
+    test(decoder.size() == 6 && std::string(decoder.peek(0, 6), 6) == "efghij",
+         "peek wrapped");
+
+    // Test growing past the initial capacity
+    decoder.append("klmnopqrst", 10);
+    test(decoder.size() == 16 &&
+         std::string(decoder.peek(0, 16), 16) == "efghijklmnopqrst",
+         "append grows");
+
+    // Test `readFrom`
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    SocketTransport transport;
+    decoder.consume(16);
+    write(fds[1], "uvwxyz", 6);
+    test(decoder.readFrom(transport, fds[0]) == 6 &&
+         std::string(decoder.peek(0, 6), 6) == "uvwxyz",
+         "readFrom");
+    close(fds[1]);
+    test(decoder.readFrom(transport, fds[0]) == 0, "readFrom disconnect");
+    close(fds[0]);
+}
+
+/**
+ * Compresses and decompresses `data`, returning whether it survived intact.
+*/
+bool roundTrip(const std::string &data)
+{
+    std::string compressed;
+    std::string restored;
+    LzCodec::compress(data.data(), data.size(), compressed);
+    return LzCodec::decompress(compressed.data(), compressed.size(), data.size(),
+                               restored) == 0 && restored == data;
+}
+
+void testCompression()
+{
+    std::string repeated;
+    std::string mixed;
+    for (int i = 0; i < 1000; i++)
+    {
+        repeated += "user" + std::to_string(i % 10) + "\n";
+        mixed += (char)(i * 7919 % 251);
+    }
+
+    // Test `compress` and `decompress`
+    test(roundTrip(""), "compression empty");
+    test(roundTrip("abc"), "compression short");
+    test(roundTrip(std::string(5000, 'a')), "compression overlapping match");
+    test(roundTrip(repeated), "compression repeated");
+    test(roundTrip(mixed), "compression incompressible");
+
+    std::string compressed;
+    LzCodec::compress(repeated.data(), repeated.size(), compressed);
+    test(compressed.size() < repeated.size() / 10, "compression ratio");
+
+    std::string restored;
+    test(LzCodec::decompress(compressed.data(), compressed.size() / 2,
+                             repeated.size(), restored) < 0,
+         "decompress truncated");
+    test(LzCodec::decompress(compressed.data(), compressed.size(),
+                             repeated.size() - 1, restored) < 0,
+         "decompress wrong length");
+    std::string badOffset = {(char)0x10, 'a', (char)0x05, (char)0x00};
+    test(LzCodec::decompress(badOffset.data(), badOffset.size(), 5, restored) < 0,
+         "decompress bad offset");
+}
+
+void testBufferPool()
+{
+    BufferPool pool;
+    PoolStats &stats = BufferPool::getStats();
+
+    // Test `acquire` and `release`
+    uint64_t misses = stats.misses;
+    std::string buffer = pool.acquire(1000);
+    test(buffer.empty() && buffer.capacity() >= 1000 && stats.misses == misses + 1,
+         "acquire miss");
+    const char *storage = buffer.data();
+    buffer = "payload";
+    pool.release(std::move(buffer));
+    uint64_t hits = stats.hits;
+    std::string reused = pool.acquire(600);
+    test(reused.empty() && reused.data() == storage && stats.hits == hits + 1,
+         "acquire reuses buffer");
+    test(pool.acquire(2000).data() != storage, "acquire larger class");
+    pool.release(std::move(reused));
+
+    // Test `Arena`
+    uint64_t pooled = stats.pooledBytes;
+    {
+        Arena arena;
+        std::string &first = arena.acquire(100);
+        first = "first";
+        std::string &second = arena.acquire(5000);
+        test(first == "first" && second.capacity() >= 5000 &&
+             arena.getPeakBytes() >= 5100,
+             "arena acquire");
+        arena.reset();
+        test(stats.pooledBytes >= pooled + arena.getPeakBytes(),
+             "arena reset returns buffers");
+        arena.acquire(5000);
+        test(arena.getPeakBytes() < 10200, "arena reuses after reset");
+    }
+    test(stats.hitRate() > 0 && stats.hitRate() <= 1, "pool hit rate");
+}
+
+void testTimerWheel()
+{
+    const uint64_t tick = 10;
+    TimerWheel wheel(tick, 0);
+    test(wheel.timeoutMillis(0) == -1, "timeoutMillis empty");
+
+    // Test timers on every level against the time they are due, including
+    // one past the range of the top level
+    std::mt19937_64 random(7);
+    std::map<uint64_t, uint64_t> deadlines;
+    for (uint64_t id = 0; id < 2000; id++)
+    {
+        deadlines[id] = random() % (400000 * tick);
+    }
+    deadlines[2000] = ((1ull << 24) + 1000) * tick + 3;
+    for (auto &[id, deadline] : deadlines)
+    {
+        wheel.schedule(id, deadline);
+    }
+    // Moved and cancelled timers
+    deadlines[1] = 5 * tick;
+    wheel.schedule(1, deadlines[1]);
+    wheel.cancel(2);
+    deadlines.erase(2);
+    test(wheel.size() == deadlines.size(), "schedule size");
+    test(wheel.timeoutMillis(0) <= (int)(WHEEL_SLOTS * tick), "timeoutMillis pending");
+
+    bool onTime = true;
+    size_t fired = 0;
+    uint64_t now = 0;
+    while (wheel.size() > 0 && now < deadlines[2000] + 2 * tick)
+    {
+        uint64_t previous = now;
+        now += 1 + random() % (now < 400000 * tick ? 5000 : 5000000);
+        wheel.advance(now, [&](uint64_t id)
+        {
+            // Fires in the first advance past its deadline's tick.
+            uint64_t due = (deadlines[id] + tick - 1) / tick * tick;
+            onTime = onTime && due <= now && (due > previous || previous == 0);
+            fired++;
+        });
+    }
+    test(onTime, "advance on time");
+    test(fired == deadlines.size() && wheel.size() == 0, "advance fires all");
+
+    // Test timers scheduled while firing
+    int rescheduled = 0;
+    wheel.schedule(1, now);
+    wheel.advance(now + tick, [&](uint64_t id)
+    {
+        if (rescheduled++ == 0)
+        {
+            wheel.schedule(id, 0);
+        }
+    });
+    test(rescheduled == 1 && wheel.size() == 1, "schedule while firing");
+    wheel.advance(now + 2 * tick, [&](uint64_t id)
+    {
+        rescheduled++;
+    });
+    test(rescheduled == 2 && wheel.size() == 0, "fire rescheduled");
+
+    // Test the idle policy
+    IdlePolicy policy = {1000, 300};
+    uint64_t deadline;
+    test(policy.check(0, 0, 100, deadline) == IdlePolicy::WAIT && deadline == 300,
+         "IdlePolicy wait");
+    test(policy.check(0, 0, 300, deadline) == IdlePolicy::PING && deadline == 600,
+         "IdlePolicy ping");
+    test(policy.check(500, 300, 700, deadline) == IdlePolicy::WAIT && deadline == 800,
+         "IdlePolicy active again");
+    test(policy.check(0, 900, 1000, deadline) == IdlePolicy::EVICT, "IdlePolicy evict");
+}
+
+void testQueueingTransport()
+{
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    int sendBuffer = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    SocketTransport transport(true);
+
+    // Whatever does not fit into the socket is queued instead of waited for
+    std::string first(1 << 20, 'a');
+    std::string second(1000, 'b');
+    struct iovec iov = {first.data(), first.size()};
+    test(transport.send(fds[0], &iov, 1) == (int)first.size(), "queueing send");
+    test(transport.queued(fds[0]) > 0, "queueing queued");
+
+    // Later sends queue behind it to keep the stream in order
+    size_t queued = transport.queued(fds[0]);
+    iov = {second.data(), second.size()};
+    transport.send(fds[0], &iov, 1);
+    test(transport.queued(fds[0]) == queued + second.size(), "queueing keeps order");
+
+    std::string received = drainSocket(fds[1]);
+    for (int i = 0; i < 10000 && transport.queued(fds[0]) > 0; i++)
+    {
+        test(transport.drain(fds[0]) >= 0, "queueing drain");
+        received += drainSocket(fds[1]);
+    }
+    received += drainSocket(fds[1]);
+    test(transport.queued(fds[0]) == 0, "queueing drained");
+    test(received == first + second, "queueing contents");
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void testUserRegistry()
+{
+    UserRegistry registry(5);
+    test(registry.shardCount() == 8, "UserRegistry shard count");
+
+    // Test point operations
+    test(registry.insert("alice") && registry.insert("bob"), "UserRegistry insert");
+    test(!registry.insert("alice"), "UserRegistry insert existing");
+    test(registry.contains("alice") && !registry.contains("carol"), "UserRegistry contains");
+    test(registry.erase("alice") && !registry.erase("alice"), "UserRegistry erase");
+    test(!registry.contains("alice") && registry.size() == 1, "UserRegistry size");
+
+    // Test concurrent writers to every shard and a scan running alongside
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; t++)
+    {
+        writers.emplace_back([&registry, t]()
+        {
+            for (int i = 0; i < 1000; i++)
+            {
+                registry.insert(std::to_string(t) + "-" + std::to_string(i));
+            }
+            for (int i = 0; i < 1000; i += 2)
+            {
+                registry.erase(std::to_string(t) + "-" + std::to_string(i));
+            }
+        });
+    }
+    size_t scanned = 0;
+    registry.forEach([&scanned](const std::string &user)
+    {
+        scanned++;
+    });
+    for (std::thread &writer : writers)
+    {
+        writer.join();
+    }
+    test(scanned >= 1 && scanned <= 4001, "UserRegistry forEach while writing");
+    test(registry.size() == 2001, "UserRegistry concurrent writers");
+
+    std::map<std::string, int> seen;
+    registry.forEach([&seen](const std::string &user)
+    {
+        seen[user]++;
+    });
+    bool once = std::all_of(seen.begin(), seen.end(), [](auto &user)
+    {
+        return user.second == 1;
+    });
+    test(once && seen.size() == 2001 && seen.count("bob") && seen.count("3-999") &&
+         !seen.count("3-998"),
+         "UserRegistry forEach visits each user once");
+
+    // Test `search` against a scan, through the index and the short fallback
+    UserRegistry names(4);
+    std::vector<std::string> users = {"ab", "abc", "abcabc", "xabcx", "aaaa", "bca", "cab"};
+    for (const std::string &user : users)
+    {
+        names.insert(user);
+    }
+    auto search = [&names](std::string_view query)
+    {
+        std::vector<std::string> found;
+        names.search(query, [&found](const std::string &user)
+        {
+            found.push_back(user);
+        });
+        std::sort(found.begin(), found.end());
+        return found;
+    };
+    bool matchesScan = true;
+    for (std::string query : {"", "a", "ab", "abc", "bca", "cabc", "aaa", "aaaa", "aaaaa",
+                              "xab", "zzz", "abcx"})
+    {
+        std::vector<std::string> expected;
+        for (const std::string &user : users)
+        {
+            if (user.find(query) != std::string::npos)
+            {
+                expected.push_back(user);
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+        matchesScan = matchesScan && search(query) == expected;
+    }
+    test(matchesScan, "UserRegistry search matches scan");
+
+    // Trigrams that appear in a different order are no match
+    test(search("bcab") == std::vector<std::string>{"abcabc"}, "UserRegistry search verifies");
+
+    // Deleted users leave the index
+    names.erase("abcabc");
+    names.erase("xabcx");
+    test(search("abc") == std::vector<std::string>{"abc"}, "UserRegistry search after erase");
+    names.insert("xabcx");
+    test(search("abcx") == std::vector<std::string>{"xabcx"}, "UserRegistry search reinsert");
+
+    // Test `listAfter` merging the shards in order from a name onwards
+    test(names.listAfter("", "", 3) == std::vector<std::string>{"aaaa", "ab", "abc"},
+         "UserRegistry listAfter first");
+    test(names.listAfter("abc", "", 10) == std::vector<std::string>{"bca", "cab", "xabcx"},
+         "UserRegistry listAfter cursor");
+    test(names.listAfter("a", "ab", 10) == std::vector<std::string>{"ab", "abc", "cab", "xabcx"},
+         "UserRegistry listAfter query");
+    test(names.listAfter("xabcx", "", 10).empty(), "UserRegistry listAfter end");
+
+    // Rare trigrams are paged through their posting lists, common ones in
+    // order, with the same result
+    UserRegistry many(2);
+    for (int i = 0; i < 2000; i++)
+    {
+        many.insert("user" + std::to_string(i) + (i % 500 == 7 ? "xyz" : ""));
+    }
+    test(many.listAfter("", "7xyz", 10) ==
+             std::vector<std::string>{"user1007xyz", "user1507xyz", "user507xyz", "user7xyz"},
+         "UserRegistry listAfter rare query");
+    test(many.listAfter("user1507xyz", "7xyz", 2) ==
+             std::vector<std::string>{"user507xyz", "user7xyz"},
+         "UserRegistry listAfter rare cursor");
+    test(many.listAfter("user1998", "ser1", 3) == std::vector<std::string>{"user1999"},
+         "UserRegistry listAfter common query");
+}
+
+void testMailbox()
+{
+    // Test order and count with several producers and one reader
+    Mailbox mailbox;
+    const int producers = 4, perProducer = 5000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < producers; t++)
+    {
+        threads.emplace_back([&mailbox, t]()
+        {
+            for (int i = 0; i < perProducer; i++)
+            {
+                mailbox.push(std::to_string(t), std::to_string(i));
+            }
+        });
+    }
+    std::vector<int> next(producers, 0);
+    bool ordered = true;
+    int received = 0;
+    auto visit = [&](uint64_t, std::string_view sender, std::string_view data)
+    {
+        int t = std::stoi(std::string(sender));
+        ordered = ordered && std::stoi(std::string(data)) == next[t]++;
+        received++;
+    };
+    while (received < producers * perProducer)
+    {
+        mailbox.drain(visit);
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    test(ordered && received == producers * perProducer && mailbox.size() == 0,
+         "Mailbox keeps each producer's order");
+
+    // Test that concurrent readers never see a message twice
+    Mailbox shared;
+    std::atomic<bool> done(false);
+    std::atomic<int> drained(0);
+    std::vector<std::atomic<int>> seen(20000);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; r++)
+    {
+        readers.emplace_back([&]()
+        {
+            auto count = [&](uint64_t, std::string_view, std::string_view data)
+            {
+                seen[std::stoi(std::string(data))]++;
+                drained++;
+            };
+            while (!done)
+            {
+                shared.drain(count);
+            }
+            shared.drain(count);
+        });
+    }
+    for (int i = 0; i < 20000; i++)
+    {
+        shared.push("", std::to_string(i));
+    }
+    done = true;
+    for (std::thread &reader : readers)
+    {
+        reader.join();
+    }
+    bool once = std::all_of(seen.begin(), seen.end(), [](std::atomic<int> &n)
+    {
+        return n == 1;
+    });
+    test(once && drained == 20000, "Mailbox concurrent drains deliver once");
+
+    // Test payloads on both sides of the inline limit
+    Mailbox sizes;
+    std::vector<std::string> payloads = {"", "short", std::string(232, 'i'),
+                                         std::string(233, 'o'), std::string(1 << 20, 'l')};
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        sizes.push("sender" + std::to_string(i), payloads[i], i + 1);
+    }
+    std::vector<std::string> peeked, delivered;
+    bool intact = true;
+    sizes.peek([&](uint64_t sequence, std::string_view sender, std::string_view data)
+    {
+        peeked.emplace_back(data);
+        intact = intact && sender == "sender" + std::to_string(sequence - 1);
+    });
+    sizes.drain([&](uint64_t, std::string_view, std::string_view data)
+    {
+        delivered.emplace_back(data);
+    });
+    test(intact && peeked == payloads && delivered == payloads, "Mailbox inline and long payloads");
+
+    // Test spilling to disk and reading back in order
+    char spillDirectory[] = "/tmp/chat-spill-XXXXXX";
+    mkdtemp(spillDirectory);
+    std::string spillPath = std::string(spillDirectory) + "/mailbox.spill";
+    auto queued = std::make_shared<std::atomic<uint64_t>>(0);
+    {
+        Mailbox spilled(queued);
+        spilled.push("a", "1", 1);
+        spilled.push("b", std::string(100000, '2'), 2);
+        uint64_t held = *queued;
+        bool freed = spilled.spill(spillPath) == (int64_t)held && *queued == 0;
+        spilled.push("c", "3", 3);
+        freed = freed && spilled.spill(spillPath) > 0 && spilled.memoryBytes() == 0;
+        spilled.push("d", "4", 4);
+        std::string peeked, delivered;
+        auto collect = [](std::string &out)
+        {
+            return [&out](uint64_t sequence, std::string_view sender, std::string_view data)
+            {
+                out += std::to_string(sequence) + std::string(sender);
+                out += data.substr(0, 2);
+            };
+        };
+        spilled.peek(collect(peeked));
+        spilled.drain(collect(delivered));
+        test(freed && peeked == "1a12b223c34d4" && delivered == peeked &&
+             spilled.size() == 0 && access(spillPath.c_str(), F_OK) != 0,
+             "Mailbox spills and reads back in order");
+    }
+    test(*queued == 0, "Mailbox counts queued bytes");
+
+    // Test that a bounded drain leaves the rest queued, spilled or not
+    {
+        Mailbox bounded;
+        for (int i = 0; i < 8; i++)
+        {
+            bounded.push("s", std::string(100, 'a' + i), i + 1);
+            if (i == 3)
+            {
+                bounded.spill(spillPath);
+            }
+        }
+        std::string delivered;
+        auto collect = [&delivered](uint64_t, std::string_view, std::string_view data)
+        {
+            delivered += data[0];
+        };
+        std::vector<size_t> drained;
+        for (int i = 0; i < 3; i++)
+        {
+            drained.push_back(bounded.drain(collect, i < 2 ? 250 : UINT64_MAX));
+        }
+        test(drained == std::vector<size_t>{3, 3, 2} && delivered == "abcdefgh" &&
+             bounded.size() == 0 && access(spillPath.c_str(), F_OK) != 0,
+             "Mailbox bounded drain");
+    }
+
+    // Test that the least recently drained mailbox spills first
+    {
+        MailboxDirectory directory;
+        directory.setSpillDirectory(spillDirectory);
+        Epoch::Guard guard;
+        directory.get("cold").push("x", std::string(5000, 'c'));
+        directory.get("hot").drain([](uint64_t, std::string_view, std::string_view)
+        {
+        });
+        directory.get("hot").push("x", std::string(5000, 'h'));
+        directory.spillColdest(6000);
+        test(directory.find("cold")->memoryBytes() == 0 &&
+             directory.find("hot")->memoryBytes() > 0 && directory.getQueuedBytes() <= 6000,
+             "MailboxDirectory spills coldest first");
+    }
+
+    // Test that an erased mailbox is freed once the last guard leaves, with
+    // nothing retired after it
+    {
+        MailboxDirectory directory;
+        directory.setSpillDirectory(spillDirectory);
+        {
+            Epoch::Guard guard;
+            directory.get("gone").push("x", std::string(5000, 'g'));
+        }
+        directory.spillColdest(0);
+        auto spillFiles = [&spillDirectory]()
+        {
+            int files = 0;
+            DIR *listing = opendir(spillDirectory);
+            while (dirent *entry = readdir(listing))
+            {
+                files += entry->d_name[0] != '.';
+            }
+            closedir(listing);
+            return files;
+        };
+        std::promise<void> entered, release;
+        std::thread holder([&entered, &release]()
+        {
+            Epoch::Guard guard;
+            entered.set_value();
+            release.get_future().wait();
+        });
+        entered.get_future().wait();
+        {
+            Epoch::Guard guard;
+            directory.get("gone").push("x", "in memory");
+        }
+        directory.erase("gone");
+        bool kept = spillFiles() == 1;
+        test(directory.getQueuedBytes() == 0, "MailboxDirectory uncounts erased");
+        release.set_value();
+        holder.join();
+        test(kept && spillFiles() == 0, "Epoch frees erased mailbox");
+    }
+    test(rmdir(spillDirectory) == 0, "Mailbox removes spill files");
+
+    // Test the username table and record slab
+    uint32_t id = Usernames::intern("interned");
+    test(Usernames::intern(std::string("intern") + "ed") == id &&
+         Usernames::nameOf(id) == "interned" && Usernames::intern("other") != id,
+         "Usernames interns each name once");
+    void *record = RecordSlab::allocate(40);
+    RecordSlab::release(record, 40);
+    test(RecordSlab::allocate(36) == record, "RecordSlab reuses its class");
+    RecordSlab::release(record, 40);
+
+    // Test the directory
+    MailboxDirectory directory(3);
+    {
+        Epoch::Guard guard;
+        test(directory.find("alice") == nullptr, "MailboxDirectory find missing");
+        directory.get("alice").push("bob", "hi");
+        Mailbox *alice = directory.find("alice");
+        test(alice == &directory.get("alice") && alice->size() == 1, "MailboxDirectory get");
+    }
+    test(directory.erase("alice") && !directory.erase("alice") &&
+         directory.find("alice") == nullptr, "MailboxDirectory erase");
+
+    // Test that a retired object outlives a guard held by another thread
+    static std::atomic<int> freed;
+    freed = 0;
+    struct Tracked
+    {
+        ~Tracked()
+        {
+            freed++;
+        }
+    };
+    std::promise<void> entered, release;
+    std::thread holder([&entered, &release]()
+    {
+        Epoch::Guard guard;
+        entered.set_value();
+        release.get_future().wait();
+    });
+    entered.get_future().wait();
+    Epoch::retire(new Tracked());
+    for (int i = 0; i < 4; i++)
+    {
+        Epoch::collect();
+    }
+    bool kept = freed == 0;
+    release.set_value();
+    holder.join();
+    // Freed when the guard leaves, without another collection.
+    test(kept && freed == 1, "Epoch retire waits for guards");
+}
+
+void testNetwork(Server &server)
+{
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+    Endpoint<Server> network(&server);
+
+    // Encode two frames back to back as they would arrive on the wire.
+    network.sendMessage(fds[1], {Network::LIST, "abcdef"});
+    std::string first = drainSocket(fds[0]);
+    network.sendMessage(fds[1], {Network::LIST, "123"});
+    std::string frames = first + drainSocket(fds[0]);
+
+    // Test `dispatchBuffered`
+    FrameDecoder decoder(16);
+    decoder.append(frames.data(), 10);
+    test(network.dispatchBuffered(fds[0], decoder) == 0 && decoder.size() == 10,
+         "dispatchBuffered partial header");
+    decoder.append(frames.data() + 10, frames.size() - 11);
+    test(network.dispatchBuffered(fds[0], decoder) == 1 &&
+         decoder.size() == frames.size() - first.size() - 1,
+         "dispatchBuffered partial frame");
+    decoder.append(&frames.back(), 1);
+    test(network.dispatchBuffered(fds[0], decoder) == 1 && decoder.size() == 0,
+         "dispatchBuffered complete frame");
+    test(drainSocket(fds[1]).size() > 0, "dispatchBuffered replies");
+
+    // Test `receiveOperation` with many frames arriving in one read
+    write(fds[1], frames.data(), frames.size());
+    test(network.receiveOperation(fds[0], decoder) == 2 && decoder.size() == 0,
+         "receiveOperation multiple frames");
+    test(drainSocket(fds[1]).size() > 0, "receiveOperation replies");
+
+    // Test `MessageView::materialize`
+    std::string buffer = "senderreceiverdata";
+    Network::MessageView view = {Network::SEND, std::string_view(buffer).substr(14),
+                                 std::string_view(buffer).substr(0, 6),
+                                 std::string_view(buffer).substr(6, 8), 9};
+    Network::Message owned = view.materialize();
+    buffer.assign(buffer.size(), 'x');
+    test(owned == (Network::Message){Network::SEND, "data", "sender", "receiver"} &&
+         owned.requestId == 9,
+         "materialize copies fields");
+
+    // Test `queueMessage` and `flush`
+    Network::OutputBuffer output;
+    network.queueMessage(output, {Network::LIST, "abcdef"});
+    network.queueMessage(output, {Network::LIST, "123"});
+    uint64_t syscalls = network.getTransport().getSyscalls();
+    test(network.flush(fds[1], output) == (int)frames.size() && output.empty(),
+         "flush coalesced frames");
+    test(network.getTransport().getSyscalls() - syscalls == 1,
+         "flush single syscall");
+    test(drainSocket(fds[0]) == frames, "flush frame contents");
+
+    std::string garbage = "garbage that is not a valid frame header";
+    decoder.append(garbage.data(), garbage.size());
+    test(network.dispatchBuffered(fds[0], decoder) < 0,
+         "dispatchBuffered bad version");
+    drainSocket(fds[1]);
+    decoder.consume(decoder.size());
+
+    // Test that replies echo the request ID
+    Network::Message request = {Network::LIST, "abc"};
+    request.requestId = 42;
+    network.sendMessage(fds[1], request);
+    test(network.receiveOperation(fds[0], decoder) == 1, "receiveOperation request ID");
+    std::string reply = drainSocket(fds[1]);
+    uint32_t version = 0;
+    uint64_t requestId = 0;
+    if (reply.size() >= 40)
+    {
+        memcpy(&version, reply.data(), sizeof(version));
+        memcpy(&requestId, reply.data() + 32, sizeof(requestId));
+    }
+    test(version == DEFAULT_VERSION && requestId == 42, "reply request ID");
+
+    // Test that a version 1 frame, whose header has no request ID, gets a
+    // version 1 reply
+    uint32_t oldHeader[2] = {1, Network::LIST};
+    uint64_t oldLengths[3] = {0, 0, 3};
+    std::string oldFrame = std::string((char *)oldHeader, sizeof(oldHeader)) +
+                           std::string((char *)oldLengths, sizeof(oldLengths)) +
+                           "abc";
+    write(fds[1], oldFrame.data(), oldFrame.size());
+    test(network.receiveOperation(fds[0], decoder) == 1 && decoder.size() == 0,
+         "receiveOperation version 1");
+    reply = drainSocket(fds[1]);
+    version = 0;
+    uint64_t dataLength = 0;
+    if (reply.size() >= 32)
+    {
+        memcpy(&version, reply.data(), sizeof(version));
+        memcpy(&dataLength, reply.data() + 24, sizeof(dataLength));
+    }
+    test(version == 1 && reply.size() == 32 + dataLength, "reply version 1");
+
+    // Test the packed header
+    Network packed;
+    packed.setVersion(PACKED_VERSION);
+    request.requestId = 300;
+    packed.sendMessage(fds[1], request);
+    std::string packedFrame = drainSocket(fds[0]);
+    test(packedFrame.size() == 10 && packedFrame[0] == PACKED_VERSION,
+         "sendMessage packed header");
+    for (size_t i = 0; i + 1 < packedFrame.size(); i++)
+    {
+        decoder.append(&packedFrame[i], 1);
+        if (network.dispatchBuffered(fds[0], decoder) != 0)
+        {
+            break;
+        }
+    }
+    test(decoder.size() == packedFrame.size() - 1, "dispatchBuffered partial packed");
+    decoder.append(&packedFrame.back(), 1);
+    test(network.dispatchBuffered(fds[0], decoder) == 1 && decoder.size() == 0,
+         "dispatchBuffered packed");
+    reply = drainSocket(fds[1]);
+    test(reply.size() > 4 && reply[0] == PACKED_VERSION &&
+         (uint8_t)reply[2] == 0xac && (uint8_t)reply[3] == 0x02,
+         "reply packed request ID");
+
+    // Test version negotiation
+    packed.sendMessage(fds[1], {Network::HELLO, "1"});
+    test(network.receiveOperation(fds[0], decoder) == 1, "receiveOperation hello");
+    reply = drainSocket(fds[1]);
+    test(reply.size() > 0 && reply.back() == '1', "hello older version");
+
+    // Test operations the handler has no route for, including ones past the
+    // end of the dispatch table
+    for (uint32_t operation : {(uint32_t)Network::OK, (uint32_t)Network::MAX_OPCODES + 1})
+    {
+        network.sendMessage(fds[1], {(Network::OpCode)operation});
+        test(network.receiveOperation(fds[0], decoder) == 1, "receiveOperation unrouted");
+        reply = drainSocket(fds[1]);
+        uint32_t replyOperation = 0;
+        if (reply.size() >= 8)
+        {
+            memcpy(&replyOperation, reply.data() + 4, sizeof(replyOperation));
+        }
+        test(replyOperation == Network::UNSUPPORTED_OP, "reply unsupported operation");
+    }
+
+    // Test frame size limits, checked before the body arrives
+    uint32_t hugeHeader[2] = {DEFAULT_VERSION, Network::LIST};
+    uint64_t hugeLengths[4] = {0, 0, (uint64_t)1 << 40, 0};
+    decoder.append((char *)hugeHeader, sizeof(hugeHeader));
+    decoder.append((char *)hugeLengths, sizeof(hugeLengths));
+    test(network.dispatchBuffered(fds[0], decoder) < 0 &&
+         drainSocket(fds[1]).find("Frame too large.") != std::string::npos,
+         "dispatchBuffered frame too large");
+    decoder.consume(decoder.size());
+    uint64_t overflowLengths[4] = {~(uint64_t)0, 2, 0, 0};
+    decoder.append((char *)hugeHeader, sizeof(hugeHeader));
+    decoder.append((char *)overflowLengths, sizeof(overflowLengths));
+    test(network.dispatchBuffered(fds[0], decoder) < 0, "dispatchBuffered length overflow");
+    drainSocket(fds[1]);
+    decoder.consume(decoder.size());
+
+    network.setMaxFrameLength(Network::LIST, 4);
+    network.sendMessage(fds[1], {Network::LIST, "abcdef"});
+    test(network.receiveOperation(fds[0], decoder) < 0,
+         "receiveOperation per-operation limit");
+    drainSocket(fds[1]);
+    decoder.consume(decoder.size());
+    packed.sendMessage(fds[1], {Network::LIST, "abcdef"});
+    test(network.receiveOperation(fds[0], decoder) < 0, "receiveOperation packed too large");
+    reply = drainSocket(fds[1]);
+    test(reply.size() > 2 && reply[0] == PACKED_VERSION &&
+         (reply[1] & 0x1f) == Network::ERROR, "frame error in request version");
+    decoder.consume(decoder.size());
+    network.setMaxFrameLength(Network::LIST, DEFAULT_MAX_FRAME_LENGTH);
+
+    // Test streamed payloads, consumed one chunk at a time
+    std::string streamed(10000, 's');
+    FrameDecoder chunkDecoder(256);
+    server.createAccount({Network::CREATE, "streamer"});
+    server.createAccount({Network::CREATE, "stream"});
+    packed.sendChunked(fds[1], {Network::SEND, streamed, "streamer", "stream"}, 1000);
+    int dispatched = 0;
+    std::string chunks = drainSocket(fds[0]);
+    for (size_t i = 0; i < chunks.size(); i += 512)
+    {
+        chunkDecoder.append(chunks.data() + i, std::min((size_t)512, chunks.size() - i));
+        dispatched += network.dispatchBuffered(fds[0], chunkDecoder);
+    }
+    test(dispatched == 11 && chunkDecoder.capacity() <= 2048, "dispatchBuffered chunks");
+    reply = drainSocket(fds[1]);
+    test(reply.size() > 0 && (reply[1] & 0x1f) == Network::OK, "reply streamed once");
+    test(server.requestMessages({Network::REQUEST, "stream"}) ==
+         (Network::Message){Network::SEND, "streamer: " + streamed + "\n"},
+         "streamed message assembled");
+    server.deleteAccount({Network::DELETE, "streamer"});
+    server.deleteAccount({Network::DELETE, "stream"});
+
+    packed.sendChunked(fds[1], {Network::LIST, "abc"}, 1);
+    test(network.receiveOperation(fds[0], decoder) < 0,
+         "receiveOperation chunk not streamed");
+    drainSocket(fds[1]);
+    decoder.consume(decoder.size());
+
+    // Test compressed replies, only sent to requesters that accept them
+    std::string users;
+    for (int i = 0; i < 100; i++)
+    {
+        users += "compressed" + std::to_string(i) + "\n";
+        server.createAccount({Network::CREATE, "compressed" + std::to_string(i)});
+    }
+    network.setCompressionThreshold(64);
+    packed.sendMessage(fds[1], {Network::LIST, "compressed"});
+    network.receiveOperation(fds[0], decoder);
+    std::string compressedReply = drainSocket(fds[1]);
+    test(compressedReply.size() > 2 && (compressedReply[1] & 0x80) &&
+         compressedReply.size() < users.size() / 2,
+         "reply compressed");
+    test(network.getCompressionStats().framesCompressed == 1 &&
+         network.getCompressionStats().ratio() > 2,
+         "compression stats");
+
+    FrameDecoder replyDecoder;
+    replyDecoder.append(compressedReply.data(), compressedReply.size());
+    Endpoint<Server> receiver(&server);
+    test(receiver.dispatchBuffered(fds[0], replyDecoder) == 1 &&
+         receiver.getCompressionStats().framesDecompressed == 1,
+         "dispatchBuffered compressed");
+    drainSocket(fds[1]);
+
+    network.sendMessage(fds[1], {Network::LIST, "compressed"});
+    network.receiveOperation(fds[0], decoder);
+    test(drainSocket(fds[1]).size() > users.size(), "reply uncompressed version 2");
+
+    for (int i = 0; i < 100; i++)
+    {
+        server.deleteAccount({Network::DELETE, "compressed" + std::to_string(i)});
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void testEventLoop(Server::Mode mode, int port)
+{
+    Server::Options options;
+    options.mode = mode;
+    options.loopThreads = 2;
+    // Exercise zero-copy sends for the longer replies.
+    options.zeroCopyThreshold = 8;
+    options.compressionThreshold = 64;
+    // Messages longer than a frame must be streamed.
+    options.maxFrameLength = 128 * 1024;
+    options.maxMessageLength = 2 << 20;
+    Server server(port, options);
+    std::thread t([&server]()
+    {
+        test(server.acceptClient() == 0, "acceptClient event loop");
+    });
+
+    Client client("127.0.0.1", port);
+    t.join();
+
+    test(client.getProtocolVersion() == VERSION, "negotiated version event loop");
+    test(client.createAccount("loop") == "Created account loop",
+         "createAccount event loop");
+    test(client.createAccount("loop") == "User already exists",
+         "createAccount duplicate event loop");
+    test(client.getAccountList("loo") == "loop\n",
+         "getAccountList event loop");
+    testListPages(server, client, mode == Server::EVENT_LOOP ? "epoll" : "uring");
+    test(client.sendMessage({Network::SEND, "hi", "loop", "loop"}) == "",
+         "sendMessage event loop");
+    client.setCurrentUser("loop");
+    test(client.requestMessages() == "loop: hi\n",
+         "requestMessages event loop");
+
+    // Test pipelined requests
+    std::vector<std::future<std::string>> replies;
+    for (int i = 0; i < 50; i++)
+    {
+        replies.push_back(client.sendRequest({Network::SEND, "p", "loop", "loop"}));
+    }
+    bool allOk = true;
+    for (auto &reply : replies)
+    {
+        allOk = allOk && reply.get() == "";
+    }
+    test(allOk, "sendRequest pipelined");
+    std::string expected;
+    for (int i = 0; i < 50; i++)
+    {
+        expected += "loop: p\n";
+    }
+    test(client.requestMessages() == expected, "requestMessages pipelined");
+    test(server.getCompressionStats().framesCompressed > 0,
+         "requestMessages compressed");
+
+    // Test `sendBatch`
+    std::vector<Network::BatchEntry> entries = {{"loop", "a"}, {"ghost", "b"},
+                                                {"loop", "c"}};
+    test(client.sendBatch("loop", entries) ==
+         std::vector<Network::OpCode>{Network::OK, Network::ERROR, Network::OK},
+         "sendBatch event loop");
+    test(client.requestMessages() == "loop: a\nloop: c\n", "sendBatch delivered");
+
+    // Test messages streamed in chunks
+    std::string large;
+    for (int i = 0; large.size() < (1 << 20); i++)
+    {
+        large += std::to_string(i) + " ";
+    }
+    test(client.sendMessage({Network::SEND, large, "loop", "loop"}) == "",
+         "sendMessage streamed");
+    test(client.requestMessages() == "loop: " + large + "\n",
+         "requestMessages streamed");
+    test(client.sendMessage({Network::SEND, large + large, "loop", "loop"}) ==
+         "Message too long",
+         "sendMessage streamed too long");
+    test(client.getAccountList("loo") == "loop\n", "connection kept after streaming");
+
+    // Test concurrent callers each getting their own reply
+    std::vector<std::thread> callers;
+    std::atomic<bool> matched = true;
+    for (int i = 0; i < 4; i++)
+    {
+        callers.emplace_back([&client, &matched, i]()
+        {
+            std::string name = "caller" + std::to_string(i);
+            matched = matched && client.createAccount(name) == "Created account " + name;
+            for (int j = 0; j < 20; j++)
+            {
+                matched = matched && client.getAccountList(name) == name + "\n";
+            }
+        });
+    }
+    for (auto &caller : callers)
+    {
+        caller.join();
+    }
+    test(matched, "concurrent callers");
+
+    testSubscribe(server, client, "event loop");
+
+    test(client.deleteAccount("loop") == "Deleted account loop",
+         "deleteAccount event loop");
+
+    client.stopClient();
+    server.stopServer();
+}
+
+void testTransports(Server::Mode mode, std::string label)
+{
+    Server::Options options;
+    options.mode = mode;
+    std::string path = "/tmp/chat-test-" + label + ".sock";
+    {
+        Server server(Address::unixSocket(path), options);
+        std::thread t([&server]()
+        {
+            test(server.acceptClient() == 0, "acceptClient unix socket");
+        });
+
+        Client local(Address::unixSocket(path));
+        t.join();
+
+        test(access(path.c_str(), F_OK) == 0, "listen unix socket " + label);
+        test(local.createAccount("local") == "Created account local",
+             "createAccount unix socket " + label);
+
+        // Test a client connected without any listening socket
+        Client loopback(server.connectLoopback());
+        test(loopback.getProtocolVersion() == VERSION, "negotiated version loopback " + label);
+        test(loopback.getAccountList("loc") == "local\n", "getAccountList loopback " + label);
+        test(loopback.sendMessage({Network::SEND, "hi", "local", "local"}) == "",
+             "sendMessage loopback " + label);
+        local.setCurrentUser("local");
+        test(local.requestMessages() == "local: hi\n", "requestMessages unix socket " + label);
+        test(loopback.deleteAccount("local") == "Deleted account local",
+             "deleteAccount loopback " + label);
+
+        local.stopClient();
+        loopback.stopClient();
+        server.stopServer();
+    }
+    test(access(path.c_str(), F_OK) != 0, "unlink unix socket " + label);
+}
+
+/**
+ * Reads from `socket` until the server closes it, for at most two seconds.
+ *
+ * @return  Whether the server closed the connection.
+*/
+bool waitClosed(int socket, std::string &receivedOut)
+{
+    struct timeval timeout = {2, 0};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char buffer[4096];
+    ssize_t n;
+    // With a receive timeout set, interrupted reads are not restarted.
+    while ((n = recv(socket, buffer, sizeof(buffer), 0)) > 0 || (n < 0 && errno == EINTR))
+    {
+        receivedOut.append(buffer, std::max(n, (ssize_t)0));
+    }
+    return n == 0;
+}
+
+void testIdle(Server::Mode mode, int port, std::string label)
+{
+    Server::Options options;
+    options.mode = mode;
+    options.loopThreads = 1;
+    options.idleTimeoutMillis = 300;
+    options.heartbeatMillis = 50;
+    Server server(port, options);
+    std::thread acceptor([&server]()
+    {
+        server.serve();
+    });
+
+    // A client answers every ping, a bare socket never does
+    Client client("127.0.0.1", port);
+    int silent = connectTo(Address::tcp("127.0.0.1", port));
+    auto start = std::chrono::steady_clock::now();
+    std::string pings;
+    test(waitClosed(silent, pings), "evict idle " + label);
+    std::chrono::duration<double, std::milli> waited = std::chrono::steady_clock::now() - start;
+    test(waited.count() >= 250, "evict not early " + label);
+    test(pings.size() > 0, "ping idle " + label);
+    test(server.getIdleEvictions() == 1, "getIdleEvictions " + label);
+    close(silent);
+
+    // A frame that is only partly received must not hold up pings
+    int partial = connectTo(Address::tcp("127.0.0.1", port));
+    send(partial, "\x01", 1, 0);
+    pings.clear();
+    test(waitClosed(partial, pings) && pings.size() > 0, "ping partial frame " + label);
+    close(partial);
+
+    // A version 1 peer without heartbeats answers pings with UNSUPPORTED_OP,
+    // which must neither be answered nor keep it from being evicted
+    int old = connectTo(Address::tcp("127.0.0.1", port));
+    Endpoint<Server> encoder(&server);
+    Network::OutputBuffer unsupported;
+    encoder.queueMessage(unsupported, {Network::UNSUPPORTED_OP}, MIN_VERSION);
+    struct timeval timeout = {2, 0};
+    setsockopt(old, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string received;
+    size_t frames = 0;
+    char buffer[4096];
+    ssize_t n;
+    while (frames < 100 &&
+           ((n = recv(old, buffer, sizeof(buffer), 0)) > 0 || (n < 0 && errno == EINTR)))
+    {
+        // Pings and anything answering ours are version 1 headers alone.
+        received.append(buffer, std::max(n, (ssize_t)0));
+        for (; received.size() >= unsupported.bytes.size();
+             received.erase(0, unsupported.bytes.size()))
+        {
+            frames++;
+            send(old, unsupported.bytes.data(), unsupported.bytes.size(), MSG_NOSIGNAL);
+        }
+    }
+    test(n == 0 && frames >= 1 && frames <= 2, "no ping loop with version 1 " + label);
+    close(old);
+
+    test(client.getAccountList("") == "", "heartbeat keeps client " + label);
+
+    // Stopping must end the reads blocked on the client's connection
+    server.stopServer();
+    acceptor.join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    test(client.getAccountList("") == "Connection closed", "stopServer closes " + label);
+    client.stopClient();
+}
+
+void testAcceptors(int port)
+{
+    Server::Options options;
+    options.mode = Server::EVENT_LOOP;
+    options.loopThreads = 4;
+    options.acceptors = 2;
+    options.backlog = 64;
+    Server server(port, options);
+    std::thread acceptors([&server]()
+    {
+        server.serve();
+    });
+
+    std::vector<std::unique_ptr<Client>> clients;
+    bool allServed = true;
+    for (int i = 0; i < 8; i++)
+    {
+        clients.push_back(std::make_unique<Client>("127.0.0.1", port));
+        allServed = allServed && clients.back()->getAccountList("") == "";
+    }
+    test(allServed, "serve SO_REUSEPORT");
+
+    std::vector<Server::AcceptorStats> stats = server.getAcceptorStats();
+    test(stats.size() == 2, "getAcceptorStats size");
+    test(stats[0].accepted + stats[1].accepted == 8, "getAcceptorStats accepted");
+    test(stats[0].acceptsPerSecond + stats[1].acceptsPerSecond > 0,
+         "getAcceptorStats rate");
+
+    for (auto &client : clients)
+    {
+        client->stopClient();
+    }
+    // Stopping must wake both acceptors blocked in accept().
+    server.stopServer();
+    acceptors.join();
+    test(true, "stopServer interrupts serve");
+}
+
+void testBackpressure(Server::Mode mode, int port, std::string label)
+{
+    Server::Options options;
+    options.mode = mode;
+    options.loopThreads = 1;
+    options.compressionThreshold = 0;
+    options.outboundHighWater = 64 << 10;
+    options.outboundLowWater = 16 << 10;
+    Server server(port, options);
+    std::thread acceptor([&server]()
+    {
+        server.serve();
+    });
+
+    // Every listing is about 50kB
+    Client client("127.0.0.1", port);
+    for (int i = 0; i < 50; i++)
+    {
+        client.createAccount(std::to_string(i) + std::string(1000, 'x'));
+    }
+
+    // A peer that pipelines requests without reading the replies
+    int slow = connectTo(Address::tcp("127.0.0.1", port));
+    Endpoint<Server> network(&server);
+    Network::OutputBuffer requests;
+    network.queueMessage(requests, {Network::LIST, ""}, MIN_VERSION);
+    std::string request = requests.bytes;
+    write(slow, request.data(), request.size());
+    std::string reply;
+    while (reply.size() < 50 * 1000)
+    {
+        reply += drainSocket(slow);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    reply += drainSocket(slow);
+
+    int pipelined = 400;
+    std::string batch;
+    for (int i = 0; i < pipelined; i++)
+    {
+        batch += request;
+    }
+    write(slow, batch.data(), batch.size());
+    for (int i = 0; i < 200 && server.getOutboundStats().pauses == 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    OutboundStats stats = server.getOutboundStats();
+    test(stats.pauses > 0 && stats.pausedConnections == 1, "pause slow reader " + label);
+    test(stats.peakQueuedBytes > options.outboundHighWater, "peakQueuedBytes " + label);
+    test(client.getAccountList("none") == "", "serve others while paused " + label);
+
+    // Reading catches up and resumes the connection
+    struct timeval timeout = {2, 0};
+    setsockopt(slow, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    size_t expected = reply.size() * pipelined;
+    size_t received = 0;
+    char buffer[1 << 16];
+    ssize_t n;
+    while (received < expected &&
+           ((n = recv(slow, buffer, sizeof(buffer), 0)) > 0 || (n < 0 && errno == EINTR)))
+    {
+        received += std::max(n, (ssize_t)0);
+    }
+    test(received == expected, "deliver every reply " + label);
+    // The loop may not have seen its last writes complete yet
+    for (int i = 0; i < 100 && server.getOutboundStats().queuedBytes > 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    stats = server.getOutboundStats();
+    test(stats.pausedConnections == 0 && stats.queuedBytes == 0, "resume slow reader " + label);
+
+    // A streamed list stops at the high-water mark instead of queueing every
+    // page. Pages are about 30kB, and the list outgrows the socket buffers.
+    for (int i = 0; i < 8000; i++)
+    {
+        client.createAccount("s" + std::to_string(i) + std::string(3000, 'y'));
+    }
+    std::string stream;
+    Network::encodeListPage({"yyy", "", 10, true}, stream);
+    requests = {};
+    network.queueMessage(requests, {Network::LIST_PAGE, stream}, DEFAULT_VERSION);
+    write(slow, requests.bytes.data(), requests.bytes.size());
+    for (int i = 0; i < 200 && server.getOutboundStats().pausedConnections == 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    stats = server.getOutboundStats();
+    test(stats.pausedConnections == 1 &&
+         stats.queuedBytes < options.outboundHighWater + (64 << 10),
+         "stream stops while paused " + label);
+    received = 0;
+    while ((n = recv(slow, buffer, sizeof(buffer), 0)) > 0 || (n < 0 && errno == EINTR))
+    {
+        received += std::max(n, (ssize_t)0);
+    }
+    test(received > 8000 * 3000, "stream resumes " + label);
+    close(slow);
+
+    client.stopClient();
+    server.stopServer();
+    acceptor.join();
+}
+
+/**
+ * Number of files in `directory`.
+*/
+int countFiles(const std::string &directory)
+{
+    int count = 0;
+    DIR *listing = opendir(directory.c_str());
+    while (dirent *entry = readdir(listing))
+    {
+        count += entry->d_name[0] != '.';
+    }
+    closedir(listing);
+    return count;
+}
+
+/**
+ * Deletes the files in `directory`, then the directory.
+*/
+void removeDirectory(const std::string &directory)
+{
+    DIR *listing = opendir(directory.c_str());
+    while (dirent *entry = readdir(listing))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            unlink((directory + "/" + entry->d_name).c_str());
+        }
+    }
+    closedir(listing);
+    rmdir(directory.c_str());
+}
+
+void testWriteAheadLog()
+{
+    // Test the record encoding
+    std::string encoded;
+    WriteAheadLog::Record enqueue{WriteAheadLog::ENQUEUE, "bob", "alice", "hi"};
+    enqueue.sequence = 7;
+    WriteAheadLog::Record dequeue{WriteAheadLog::DEQUEUE, "bob"};
+    dequeue.sequences = {7, 9};
+    WriteAheadLog::encode(enqueue, encoded);
+    size_t first = encoded.size();
+    WriteAheadLog::encode(dequeue, encoded);
+    WriteAheadLog::Record decoded;
+    test(WriteAheadLog::decode(encoded, decoded) == (int64_t)first &&
+         decoded.type == WriteAheadLog::ENQUEUE && decoded.sequence == 7 &&
+         decoded.user == "bob" && decoded.sender == "alice" && decoded.data == "hi",
+         "WriteAheadLog enqueue round trip");
+    WriteAheadLog::Record decodedDequeue;
+    test(WriteAheadLog::decode(std::string_view(encoded).substr(first), decodedDequeue) ==
+         (int64_t)(encoded.size() - first) &&
+         decodedDequeue.sequences == std::vector<uint64_t>{7, 9},
+         "WriteAheadLog dequeue round trip");
+    test(WriteAheadLog::decode(std::string_view(encoded).substr(0, first - 1), decoded) == 0,
+         "WriteAheadLog torn record");
+    std::string corrupt = encoded.substr(0, first);
+    corrupt[first - 1] ^= 1;
+    test(WriteAheadLog::decode(corrupt, decoded) == -1, "WriteAheadLog checksum");
+
+    char directory[] = "/tmp/chat-wal-XXXXXX";
+    test(mkdtemp(directory) != nullptr, "WriteAheadLog temporary directory");
+
+    // Test that concurrent commits share syncs
+    {
+        WriteAheadLog log(directory, WriteAheadLog::BATCHED, 200);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; t++)
+        {
+            threads.emplace_back([&log, t]()
+            {
+                std::string user = "user" + std::to_string(t);
+                for (int i = 0; i < 50; i++)
+                {
+                    WriteAheadLog::Record record{WriteAheadLog::CREATE, user};
+                    log.commit(log.append(record));
+                }
+            });
+        }
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+        WriteAheadLog::Stats stats = log.getStats();
+        test(stats.records == 400 && stats.syncs > 0 && stats.syncs < stats.records,
+             "WriteAheadLog group commit");
+    }
+
+    // Test that completions run in order once their batch is durable
+    std::vector<uint64_t> completed;
+    bool deferred = true, immediate = false;
+    {
+        WriteAheadLog log(directory, WriteAheadLog::BATCHED, 20000);
+        uint64_t sequence = 0;
+        for (int i = 0; i < 10; i++)
+        {
+            WriteAheadLog::Record record{WriteAheadLog::CREATE, "waiting"};
+            sequence = log.append(record);
+            // Only the flusher calls back, and it is joined below.
+            deferred = deferred && log.whenDurable(sequence, [&completed, sequence]()
+            {
+                completed.push_back(sequence);
+            });
+        }
+        log.commit(sequence);
+        immediate = !log.whenDurable(sequence, []() {});
+    }
+    test(deferred && immediate && completed.size() == 10 &&
+         std::is_sorted(completed.begin(), completed.end()),
+         "WriteAheadLog whenDurable");
+
+    // Test replay, and that a torn tail is dropped
+    std::string segment = std::string(directory) + "/wal-00000000000000000001.log";
+    int fd = open(segment.c_str(), O_WRONLY | O_APPEND);
+    write(fd, encoded.data(), first - 3);
+    close(fd);
+    uint64_t replayed = 0, last = 0;
+    bool ascending = true;
+    {
+        WriteAheadLog log(directory, WriteAheadLog::PER_OPERATION, 0,
+                          [&](WriteAheadLog::Record &record)
+        {
+            ascending = ascending && record.sequence == last + 1;
+            last = record.sequence;
+            replayed++;
+        });
+        WriteAheadLog::Record record{WriteAheadLog::DELETE, "user0"};
+        test(replayed == 410 && ascending && log.append(record) == 411 &&
+             log.getStats().syncs == 1,
+             "WriteAheadLog replay");
+    }
+    replayed = 0;
+    {
+        WriteAheadLog log(directory, WriteAheadLog::NONE, 0, [&](WriteAheadLog::Record &record)
+        {
+            replayed++;
+        });
+    }
+    test(replayed == 411, "WriteAheadLog appends after torn tail");
+
+    // Test that rotated segments are removed once covered
+    {
+        WriteAheadLog log(directory, WriteAheadLog::BATCHED);
+        uint64_t cut = log.rotate();
+        WriteAheadLog::Record record{WriteAheadLog::CREATE, "late"};
+        log.commit(log.append(record));
+        log.removeSegmentsThrough(cut);
+        test(cut == 411 && countFiles(directory) == 1, "WriteAheadLog rotate");
+    }
+    replayed = 0;
+    {
+        WriteAheadLog log(directory, WriteAheadLog::NONE, 0, [&](WriteAheadLog::Record &record)
+        {
+            replayed++;
+            last = record.sequence;
+        });
+        WriteAheadLog::Record record{WriteAheadLog::CREATE, "later"};
+        test(log.append(record) == 413, "WriteAheadLog numbering continues");
+    }
+    test(replayed == 1 && last == 412, "WriteAheadLog removes covered segments");
+
+    removeDirectory(directory);
+}
+
+void testSnapshot()
+{
+    char directory[] = "/tmp/chat-snapshot-XXXXXX";
+    mkdtemp(directory);
+    std::string path = std::string(directory) + "/snapshot";
+    test(Snapshot::open(path) == nullptr, "Snapshot missing");
+
+    {
+        Snapshot::Writer writer(path, 42);
+        for (int i = 0; i < 10000; i++)
+        {
+            writer.addUser("user" + std::to_string(i));
+        }
+        writer.beginMailbox("alice");
+        writer.addMessage(3, "bob", "hi");
+        writer.addMessage(5, "carol", "");
+        writer.beginMailbox("bob");
+        writer.addMessage(4, "alice", "hey");
+        writer.beginMailbox("dave");
+        writer.addMessage(6, "alice", "later");
+        test(writer.commit() == 0, "Snapshot commit");
+    }
+    std::unique_ptr<Snapshot> snapshot = Snapshot::open(path);
+    test(snapshot && snapshot->getSequence() == 42 && snapshot->getUserCount() == 10000 &&
+         snapshot->getMailboxCount() == 3 && snapshot->getMessageCount() == 4,
+         "Snapshot header");
+
+    // Test that users are split across threads without loss
+    std::mutex seenLock;
+    std::unordered_set<std::string> seen;
+    snapshot->forEachUser(3, [&](std::string_view user)
+    {
+        std::unique_lock lock(seenLock);
+        seen.insert(std::string(user));
+    });
+    test(seen.size() == 10000 && seen.count("user0") && seen.count("user9999"),
+         "Snapshot users across threads");
+
+    // Test that each mailbox is handed over once
+    std::string taken;
+    auto collect = [&taken](uint64_t sequence, std::string_view sender, std::string_view data)
+    {
+        taken += std::to_string(sequence) + " " + std::string(sender) + ": " +
+                 std::string(data) + "\n";
+    };
+    test(snapshot->contains("alice") && !snapshot->contains("erin"), "Snapshot contains");
+    test(snapshot->take("alice", collect) && taken == "3 bob: hi\n5 carol: \n" &&
+         !snapshot->contains("alice") && !snapshot->take("alice", collect),
+         "Snapshot take once");
+
+    // Test mailboxes filled from the snapshot on first use
+    MailboxDirectory mailboxes;
+    mailboxes.setSource(snapshot.get());
+    {
+        Epoch::Guard guard;
+        Mailbox *bob = mailboxes.find("bob");
+        test(bob != nullptr && bob->size() == 1 && mailboxes.find("erin") == nullptr,
+             "Snapshot fills mailboxes");
+    }
+
+    // Test copying what was not handed over into a new snapshot
+    Snapshot::Writer next(path, 43);
+    std::vector<bool> copied = snapshot->copyTo(next);
+    test(snapshot->copied(copied, "dave") && !snapshot->copied(copied, "bob") &&
+         !snapshot->copied(copied, "alice"),
+         "Snapshot copies untouched mailboxes");
+    test(next.commit() == 0, "Snapshot replaced");
+    std::unique_ptr<Snapshot> replaced = Snapshot::open(path);
+    taken.clear();
+    test(replaced && replaced->getSequence() == 43 && replaced->getMessageCount() == 1 &&
+         replaced->take("dave", collect) && taken == "6 alice: later\n",
+         "Snapshot reads replacement");
+
+    // Test that damage is found, in the sections checked on open and in a
+    // mailbox once it is read
+    {
+        Snapshot::Writer writer(path, 44);
+        writer.addUser("zed");
+        writer.beginMailbox("zed");
+        writer.addMessage(7, "bob", "yo");
+        writer.commit();
+    }
+    std::string intact;
+    {
+        std::ifstream file(path, std::ios::binary);
+        intact.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    auto damaged = [&path, &intact](size_t at, std::string bytes)
+    {
+        std::string copy = intact;
+        copy.replace(at, bytes.size(), bytes);
+        std::ofstream(path, std::ios::binary | std::ios::trunc) << copy;
+        return Snapshot::open(path);
+    };
+    // The header is 104 bytes, the user follows it, then the mailbox, whose
+    // last byte is at 138.
+    test(damaged(0, "") != nullptr && damaged(108, "Z") == nullptr, "Snapshot users checksum");
+    std::unique_ptr<Snapshot> bitten = damaged(138, "!");
+    test(bitten && !bitten->take("zed", collect), "Snapshot damaged mailbox");
+    std::string header = intact.substr(0, 104);
+    uint64_t slots = 3;
+    memcpy(&header[72], &slots, sizeof(slots));
+    uint32_t checksum = crc32(header.data(), 100);
+    memcpy(&header[100], &checksum, sizeof(checksum));
+    test(damaged(0, header) == nullptr, "Snapshot table size");
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << intact;
+
+    // Test that a cut-short file is refused
+    truncate(path.c_str(), 100);
+    test(Snapshot::open(path) == nullptr, "Snapshot truncated");
+
+    removeDirectory(directory);
+}
+
+void testRecovery(int port)
+{
+    char directory[] = "/tmp/chat-data-XXXXXX";
+    mkdtemp(directory);
+    Server::Options options;
+    options.dataDirectory = directory;
+
+    {
+        Server server(port, options);
+        server.createAccount({Network::CREATE, "alice"});
+        server.createAccount({Network::CREATE, "bob"});
+        server.createAccount({Network::CREATE, "carol"});
+        server.sendMessage({Network::SEND, "read", "alice", "bob"});
+        server.requestMessages({Network::REQUEST, "bob"});
+        server.sendMessage({Network::SEND, "unread", "alice", "bob"});
+        std::string batch;
+        Network::encodeBatch({{"bob", "batched"}, {"carol", "gone"}}, batch);
+        server.sendBatch({Network::SEND_BATCH, batch, "alice"});
+        server.deleteAccount({Network::DELETE, "carol"});
+        // Records longer than the chunks the log is read in, and a mailbox
+        // that outlived its account
+        std::string large(200000, 'l');
+        server.createAccount({Network::CREATE, "frank"});
+        server.sendMessage({Network::SEND, "stale", "alice", "frank"});
+        server.deleteAccount({Network::DELETE, "frank"});
+        server.createAccount({Network::CREATE, "frank"});
+        server.sendMessage({Network::SEND, large, "alice", "frank"});
+        server.stopServer();
+    }
+
+    {
+        Server server(port, options);
+        test(server.listAccounts({Network::LIST, ""}) ==
+             (Network::Message){Network::LIST, "alice\nbob\nfrank\n", "", ""},
+             "recovery restores accounts");
+        test(server.requestMessages({Network::REQUEST, "frank"}) ==
+             (Network::Message){Network::SEND, "alice: " + std::string(200000, 'l') + "\n",
+                                "", ""},
+             "recovery reads large records");
+        server.deleteAccount({Network::DELETE, "frank"});
+        test(server.requestMessages({Network::REQUEST, "bob"}) ==
+             (Network::Message){Network::SEND, "alice: unread\nalice: batched\n", "", ""},
+             "recovery restores undelivered messages");
+        test(server.requestMessages({Network::REQUEST, "carol"}) ==
+             (Network::Message){Network::SEND, "", "", ""},
+             "recovery drops deleted mailboxes");
+
+        // Changes on both sides of a snapshot
+        server.createAccount({Network::CREATE, "erin"});
+        server.sendMessage({Network::SEND, "lazy", "alice", "erin"});
+        server.sendMessage({Network::SEND, "before", "alice", "bob"});
+        test(server.snapshot() == 0 && countFiles(directory) == 2, "snapshot removes old log");
+        server.sendMessage({Network::SEND, "after", "alice", "bob"});
+        server.createAccount({Network::CREATE, "dave"});
+        server.stopServer();
+    }
+
+    {
+        Server server(port, options);
+        test(server.listAccounts({Network::LIST, ""}) ==
+             (Network::Message){Network::LIST, "alice\nbob\ndave\nerin\n", "", ""},
+             "snapshot restores accounts");
+        // Leaves erin's mailbox in the snapshot for the next one to copy.
+        test(server.snapshot() == 0, "snapshot from snapshot");
+        test(server.requestMessages({Network::REQUEST, "bob"}) ==
+             (Network::Message){Network::SEND, "alice: before\nalice: after\n", "", ""},
+             "snapshot and log tail merge");
+        server.stopServer();
+    }
+
+    Server server(port, options);
+    test(server.requestMessages({Network::REQUEST, "bob"}) ==
+         (Network::Message){Network::SEND, "", "", ""},
+         "snapshot tail keeps deliveries");
+    test(server.requestMessages({Network::REQUEST, "erin"}) ==
+         (Network::Message){Network::SEND, "alice: lazy\n", "", ""},
+         "snapshot keeps untouched mailboxes");
+    server.stopServer();
+
+    removeDirectory(directory);
+}
+
+void testGroupCommit(int port)
+{
+    char directory[] = "/tmp/chat-commit-XXXXXX";
+    mkdtemp(directory);
+    Server::Options options;
+    options.mode = Server::EVENT_LOOP;
+    options.loopThreads = 1;
+    options.dataDirectory = directory;
+    options.commitWindowMicros = 20000;
+    Server server(port, options);
+    std::thread t([&server]()
+    {
+        server.acceptClient();
+    });
+    Client client("127.0.0.1", port);
+    t.join();
+    client.createAccount("durable");
+
+    // Pipelined changes join one group commit instead of syncing in turn on
+    // the loop thread.
+    uint64_t syncs = server.getLogStats().syncs;
+    std::vector<std::future<std::string>> replies;
+    for (int i = 0; i < 20; i++)
+    {
+        replies.push_back(client.sendRequest({Network::SEND, "p", "durable", "durable"}));
+    }
+    bool allOk = true;
+    for (auto &reply : replies)
+    {
+        allOk = allOk && reply.get() == "";
+    }
+    test(allOk && server.getLogStats().syncs - syncs < 10, "pipelined changes share commits");
+
+    client.stopClient();
+    server.stopServer();
+    removeDirectory(directory);
+}
+
+void testSpill(int port)
+{
+    char directory[] = "/tmp/chat-spill-XXXXXX";
+    mkdtemp(directory);
+    std::string leftover = std::string(directory) + "/mailbox-7.spill";
+    close(open(leftover.c_str(), O_CREAT | O_WRONLY, 0600));
+
+    Server::Options options;
+    options.mailboxBudgetBytes = 64 << 10;
+    options.spillDirectory = directory;
+    Server server(port, options);
+    test(access(leftover.c_str(), F_OK) != 0, "spill directory emptied on start");
+
+    server.createAccount({Network::CREATE, "offline"});
+    server.createAccount({Network::CREATE, "sender"});
+    std::string expected;
+    for (int i = 0; i < 2000; i++)
+    {
+        std::string data = std::to_string(i) + std::string(200, 'x');
+        server.sendMessage({Network::SEND, data, "sender", "offline"});
+        expected += "sender: " + data + "\n";
+    }
+    bool bounded = false;
+    for (int i = 0; i < 200 && !bounded; i++)
+    {
+        bounded = server.getQueuedBytes() <= options.mailboxBudgetBytes;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    test(bounded && countFiles(directory) == 1, "spill keeps mailboxes in budget");
+    test(server.requestMessages({Network::REQUEST, "offline"}).data == expected,
+         "spilled messages delivered in order");
+    test(server.getQueuedBytes() == 0 && countFiles(directory) == 0,
+         "delivered spill file removed");
+
+    // Test that a backlog larger than one reply is handed over in parts
+    std::string large(100 << 10, 'l');
+    for (int i = 0; i < 12; i++)
+    {
+        server.sendMessage({Network::SEND, large, "sender", "offline"});
+    }
+    size_t first = server.requestMessages({Network::REQUEST, "offline"}).data.size();
+    size_t second = server.requestMessages({Network::REQUEST, "offline"}).data.size();
+    size_t entry = large.size() + 9;
+    test(first == 11 * entry && second == entry, "deliver backlog in bounded parts");
+
+    server.stopServer();
+    removeDirectory(directory);
 }
 
 int main()
@@ -227,12 +2144,51 @@ int main()
     Client client("127.0.0.1", 1111);
     t.join();
 
+    test(client.getProtocolVersion() == VERSION, "negotiated version");
+
     std::cerr << "\nRUNNING SERVER TESTS..." << std::endl;
     testServer(server, client);
 
     std::cerr << "\nRUNNING CLIENT TESTS..." << std::endl;
     testClient(server, client);
 
+    std::cerr << "\nRUNNING NETWORK TESTS..." << std::endl;
+    testFrameDecoder();
+    testCompression();
+    testBufferPool();
+    testTimerWheel();
+    testQueueingTransport();
+    testUserRegistry();
+    testMailbox();
+    testNetwork(server);
+
+    std::cerr << "\nRUNNING EVENT LOOP TESTS..." << std::endl;
+    testEventLoop(Server::EVENT_LOOP, 1112);
+
+    std::cerr << "\nRUNNING URING LOOP TESTS..." << std::endl;
+    testEventLoop(Server::URING_LOOP, 1113);
+
+    std::cerr << "\nRUNNING TRANSPORT TESTS..." << std::endl;
+    testTransports(Server::THREAD_PER_CONNECTION, "threads");
+    testTransports(Server::EVENT_LOOP, "epoll");
+    testAcceptors(1114);
+
+    std::cerr << "\nRUNNING IDLE TESTS..." << std::endl;
+    testIdle(Server::THREAD_PER_CONNECTION, 1115, "threads");
+    testIdle(Server::EVENT_LOOP, 1116, "epoll");
+    testIdle(Server::URING_LOOP, 1117, "uring");
+
+    std::cerr << "\nRUNNING BACKPRESSURE TESTS..." << std::endl;
+    testBackpressure(Server::EVENT_LOOP, 1118, "epoll");
+    testBackpressure(Server::URING_LOOP, 1119, "uring");
+
+    std::cerr << "\nRUNNING DURABILITY TESTS..." << std::endl;
+    testWriteAheadLog();
+    testSnapshot();
+    testRecovery(1120);
+    testSpill(1121);
+    testGroupCommit(1122);
+
     client.stopClient();
 
     std::cerr << "\nRUNNING FINAL TESTS..." << std::endl;